@@ -0,0 +1,41 @@
+#!/bin/sh
+# Runs the load generator against the server once per I/O backend and transport, and prints games/sec,
+# latency and server-side syscalls per game for each, e.g.
+#   ./bench.sh                  # defaults
+#   CONNECTIONS=50 GAMES=100 ./bench.sh
+#   BACKENDS=blocking TRANSPORTS="tcp unix" ./bench.sh
+#   PROTOCOL=compact ./bench.sh   # one-round-trip login and line based commands
+PORT=${PORT:-23400}
+CONNECTIONS=${CONNECTIONS:-20}
+GAMES=${GAMES:-50}
+BACKENDS=${BACKENDS:-"blocking uring"}
+TRANSPORTS=${TRANSPORTS:-"tcp unix"}
+SOCKET_PATH=${SOCKET_PATH:-/tmp/hangman-bench.sock}
+PROTOCOL=${PROTOCOL:-legacy}
+
+make -s hangman || exit 1
+
+for backend in $BACKENDS; do
+for transport in $TRANSPORTS; do
+    serverLog=$(mktemp)
+    ./server -q -b "$backend" -u "$SOCKET_PATH" -w "$CONNECTIONS" -W "$CONNECTIONS" "$PORT" > "$serverLog" 2>&1 &
+    serverPid=$!
+    sleep 0.5
+
+    echo "== $backend over $transport"
+    if [ "$transport" = unix ]; then
+        target="-u $SOCKET_PATH"
+    else
+        target="127.0.0.1 $PORT"
+    fi
+    ./loadgen -m "$PROTOCOL" -c "$CONNECTIONS" -g "$GAMES" $target | grep -E 'games_per_second|round_trip_us|failed'
+
+    # The server dumps its stats on the way out
+    kill -INT "$serverPid"
+    wait "$serverPid"
+    grep -E '^io\.' "$serverLog"
+    rm -f "$serverLog"
+
+    PORT=$((PORT + 1))
+done
+done
@@ -0,0 +1,53 @@
+#ifndef HANGMAN_BOARD_EXPORT_H
+#define HANGMAN_BOARD_EXPORT_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+//--------------------------------------------------------------------------------------------
+// Leaderboard exports, written by the server (-x) and read by boardview or anything else on the same machine
+//--------------------------------------------------------------------------------------------
+// The file is a board_export_header_t followed by maxRows board_export_row_t, best player first. The server maps
+// it once and rewrites it in place whenever the leaderboard's changed, at most ten times a second.
+// Readers map it read only and never need a system call or a lock to take a snapshot. Everything is in the
+// server's byte order, and the file never changes size while the server has it.
+//
+// The rows are guarded by a sequence lock. The server makes sequence odd, rewrites everything after it, then makes
+// it even again. To read a consistent snapshot:
+//
+//   1. Load sequence with acquire ordering. If it's odd the server's part way through, so start again.
+//   2. Copy out the fields and rows wanted, taking no more than maxRows rows whatever numRows says.
+//   3. Issue an acquire fence and load sequence again. If it's changed, throw the copy away and start again.
+//
+// Once closed is set the server has exited and nothing will change again. A server that's restarted with the
+// same path writes a new file over the old name, so readers that want to carry on should open it again.
+#define BOARD_EXPORT_MAGIC "HANGBRD1"
+#define BOARD_EXPORT_MAGIC_LENGTH 8
+#define BOARD_EXPORT_NAME_LENGTH 32 // Including the '\0', longer usernames are cut short
+
+typedef struct BoardExportHeaderStruct
+{
+    char magic[BOARD_EXPORT_MAGIC_LENGTH];
+    uint32_t headerSize;      // Where the rows start
+    uint32_t rowSize;
+    uint32_t maxRows;         // Room for every user the server knows about
+    uint32_t serverPid;
+    _Atomic uint64_t sequence;
+
+    // Everything from here on is only meaningful in a snapshot
+    uint64_t version;         // The leaderboard version the rows are from, as sent in reply to BOARD. -P worker
+                              // processes share one version, so it's the same whichever of them wrote the
+                              // snapshot. It starts again from 0 when the server restarts.
+    uint64_t publishedAtMs;   // Wall clock time of the snapshot, in milliseconds since the epoch
+    uint32_t numRows;
+    uint32_t closed;
+} board_export_header_t;
+
+typedef struct BoardExportRowStruct
+{
+    char username[BOARD_EXPORT_NAME_LENGTH];
+    uint32_t gamesWon;
+    uint32_t gamesPlayed;
+} board_export_row_t;
+
+#endif
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "board_export.h"
+
+//--------------------------------------------------------------------------------------------
+// Global variables
+//--------------------------------------------------------------------------------------------
+int followIntervalMs = 0;     // Keep printing the leaderboard whenever it changes, checking this often
+int maxRowsWanted = -1;       // Only print the top rows, -1 for all of them
+long long numBenchmarkReads = 0;
+
+board_export_header_t *header = NULL;
+size_t mappedSize;
+board_export_row_t *exportRows;
+
+// One consistent copy of the export
+typedef struct SnapshotStruct
+{
+    uint64_t version;
+    uint64_t publishedAtMs;
+    uint32_t numRows;
+    uint32_t closed;
+    board_export_row_t *rows;
+} snapshot_t;
+
+//--------------------------------------------------------------------------------------------
+// Time related
+//--------------------------------------------------------------------------------------------
+long long now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+long long wall_clock_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//--------------------------------------------------------------------------------------------
+// Reading the export related
+//--------------------------------------------------------------------------------------------
+void open_export(char *fileName)
+{
+    int fileDescriptor = open(fileName, O_RDONLY);
+    struct stat status;
+    if (fileDescriptor == -1 || fstat(fileDescriptor, &status) == -1)
+    {
+        perror(fileName);
+        exit(1);
+    }
+    mappedSize = status.st_size;
+    if (mappedSize < sizeof(board_export_header_t))
+    {
+        fprintf(stderr, "%s isn't a leaderboard export\n", fileName);
+        exit(1);
+    }
+
+    // Nothing after this needs the file descriptor, or any other system call, to read the leaderboard
+    header = mmap(NULL, mappedSize, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+    close(fileDescriptor);
+    if (header == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    if (memcmp(header->magic, BOARD_EXPORT_MAGIC, BOARD_EXPORT_MAGIC_LENGTH) != 0 || header->headerSize < sizeof(board_export_header_t)
+        || header->rowSize != sizeof(board_export_row_t) || header->headerSize + (size_t)header->maxRows * header->rowSize > mappedSize)
+    {
+        fprintf(stderr, "%s isn't a leaderboard export this version of boardview understands\n", fileName);
+        exit(1);
+    }
+    exportRows = (board_export_row_t *)((char *)header + header->headerSize);
+}
+
+long long take_snapshot(snapshot_t *snapshot)
+{
+    // Copy until the sequence says nobody was writing, see board_export.h. Returns how many copies had to be thrown away.
+    long long numRetries = 0;
+    for (;; numRetries++)
+    {
+        uint64_t sequence = atomic_load_explicit(&header->sequence, memory_order_acquire);
+        if (sequence & 1)
+            continue;
+
+        snapshot->version = header->version;
+        snapshot->publishedAtMs = header->publishedAtMs;
+        snapshot->closed = header->closed;
+        snapshot->numRows = header->numRows;
+        if (snapshot->numRows > header->maxRows)
+            snapshot->numRows = header->maxRows; // Torn, and about to be thrown away
+        if (maxRowsWanted >= 0 && snapshot->numRows > (uint32_t)maxRowsWanted)
+            snapshot->numRows = maxRowsWanted;
+        memcpy(snapshot->rows, exportRows, snapshot->numRows * sizeof(board_export_row_t));
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&header->sequence, memory_order_relaxed) == sequence)
+            return numRetries;
+    }
+}
+
+void print_snapshot(snapshot_t *snapshot)
+{
+    // The same rows BOARD sends, best first
+    printf("BOARD %u %llu\n", snapshot->numRows, (unsigned long long)snapshot->version);
+    for (uint32_t i = 0; i < snapshot->numRows; i++)
+    {
+        board_export_row_t *row = &snapshot->rows[i];
+        printf("%.*s|%u|%u\n", BOARD_EXPORT_NAME_LENGTH, row->username, row->gamesWon, row->gamesPlayed);
+    }
+    printf("published_ms_ago %lld\n", wall_clock_ms() - (long long)snapshot->publishedAtMs);
+    if (snapshot->closed)
+        printf("closed\n");
+    fflush(stdout);
+}
+
+void run_benchmark(snapshot_t *snapshot)
+{
+    // Take snapshots back to back, e.g. while a load generator keeps the server busy, to see what they cost
+    long long numRetries = 0;
+    long long startedAtUs = now_us();
+    for (long long i = 0; i < numBenchmarkReads; i++)
+        numRetries += take_snapshot(snapshot);
+    long long elapsedUs = now_us() - startedAtUs;
+
+    printf("snapshots %lld\n", numBenchmarkReads);
+    printf("snapshots_per_second %.1f\n", elapsedUs > 0 ? numBenchmarkReads * 1000000.0 / elapsedUs : 0.0);
+    printf("ns_per_snapshot %.1f\n", numBenchmarkReads > 0 ? elapsedUs * 1000.0 / numBenchmarkReads : 0.0);
+    printf("retries %lld\n", numRetries);
+    printf("rows %u\n", snapshot->numRows);
+}
+
+void follow(snapshot_t *snapshot)
+{
+    // Print every version we see until the server exits. Versions that come and go between checks are skipped.
+    uint64_t lastVersion = 0;
+    bool printedAny = false;
+    for (;;)
+    {
+        take_snapshot(snapshot);
+        if (!printedAny || snapshot->version != lastVersion || snapshot->closed)
+        {
+            print_snapshot(snapshot);
+            lastVersion = snapshot->version;
+            printedAny = true;
+        }
+        if (snapshot->closed)
+            return;
+        usleep(followIntervalMs * 1000);
+    }
+}
+
+//--------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------
+void print_usage()
+{
+    fprintf(stderr, "usage: boardview [options] export\n");
+    fprintf(stderr, "  -f <ms>    keep printing the leaderboard whenever it changes, checking this often, until the server exits\n");
+    fprintf(stderr, "  -n <rows>  only print the top rows\n");
+    fprintf(stderr, "  -b <num>   take this many snapshots as fast as possible and report how long they took\n");
+}
+
+int main(int argc, char **argv)
+{
+    int option;
+    while ((option = getopt(argc, argv, "f:n:b:")) != -1)
+    {
+        switch (option)
+        {
+            case 'f': followIntervalMs = atoi(optarg); break;
+            case 'n': maxRowsWanted = atoi(optarg); break;
+            case 'b': numBenchmarkReads = atoll(optarg); break;
+            default:
+                print_usage();
+                exit(1);
+        }
+    }
+    if (argc - optind != 1 || followIntervalMs < 0 || numBenchmarkReads < 0)
+    {
+        print_usage();
+        exit(1);
+    }
+
+    open_export(argv[optind]);
+    snapshot_t snapshot;
+    snapshot.rows = malloc((header->maxRows > 0 ? header->maxRows : 1) * sizeof(board_export_row_t));
+    if (snapshot.rows == NULL)
+    {
+        fprintf(stderr, "Out of memory (rows).\n");
+        exit(1);
+    }
+
+    if (numBenchmarkReads > 0)
+    {
+        run_benchmark(&snapshot);
+    }
+    else if (followIntervalMs > 0)
+    {
+        follow(&snapshot);
+    }
+    else
+    {
+        take_snapshot(&snapshot);
+        print_snapshot(&snapshot);
+    }
+
+    free(snapshot.rows);
+    munmap(header, mappedSize);
+    return 0;
+}
@@ -1,8 +1,10 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -10,9 +12,15 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "engine.h"
+#include "protocol.h"
+#include "solver.h"
+
 #define MAX_MESSAGE_LENGTH 1000
 
 //--------------------------------------------------------------------------------------------
@@ -21,6 +29,57 @@
 int serverFileDescriptor;
 char messageBuffer[MAX_MESSAGE_LENGTH];
 char* currentUser;
+char* currentPassword;
+// Our copy of the leaderboard, so we only need to ask for what's changed since we last looked
+typedef struct LeaderboardRowStruct
+{
+    char username[MAX_LINE_LENGTH];
+    int gamesWon;
+    int totalGames;
+} leaderboard_row_t;
+leaderboard_row_t *cachedRows = NULL;
+int numCachedRows = 0;
+unsigned long cachedVersion = 0;
+bool haveCachedLeaderboard = false;
+
+char sessionToken[SESSION_TOKEN_LENGTH + 1]; // For picking the game back up if the connection drops
+bool connectionLost = false;
+
+// Where the server is, so we can reconnect
+char *serverAddress;
+int serverPort;
+bool useUnixSocket = false;
+
+// Lines from the server, along with how much of the legacy greeting still needs skipping over
+char lineBuffer[2 * MAX_LINE_LENGTH];
+int lineStart = 0;
+int lineEnd = 0;
+int greetingBytesLeft = sizeof(LOGIN_PROMPT) - 1;
+
+// Auto-play, where the solver picks the guesses from what's in the dictionary
+hangman_word_t *autoPlayWords = NULL;
+int numAutoPlayWords = 0;
+hangman_solver_t *solver = NULL;
+solver_scratch_t *solverScratch = NULL;
+solver_method_t solverMethod = SOLVER_FREQUENCY;
+
+// Batch mode, where a script's commands are sent without waiting for each reply and the replies come out as JSON lines
+bool batchMode = false;
+typedef struct BatchStepStruct
+{
+    char line[MAX_LINE_LENGTH];   // The protocol line to send, including the '\n'
+    char shown[MAX_LINE_LENGTH];  // What gets printed for it, i.e. without the password
+    int numReplies;               // PLAY can start several games, each with its own STATE
+    long long sentAtUs;
+} batch_step_t;
+batch_step_t *batchSteps = NULL;
+int numBatchSteps = 0;
+int numBatchStepsSent = 0;
+int numBatchStepsAnswered = 0;
+int batchDepth = 0;               // Most commands waiting on replies at once, 0 for no limit
+bool batchFinished = false;
+pthread_mutex_t batchMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t batchCondition = PTHREAD_COND_INITIALIZER;
 
 //--------------------------------------------------------------------------------------------
 // Functions related to making sure we exit gracefully
@@ -34,6 +93,11 @@ void perform_clean_exit(int exitCode)
 
     // Free dynamically allocated memory
     free(currentUser);
+    free(currentPassword);
+    free(cachedRows);
+    hangman_solver_scratch_free(solverScratch);
+    hangman_solver_free(solver);
+    hangman_free_words(autoPlayWords, numAutoPlayWords);
 
     exit(exitCode);
 }
@@ -52,53 +116,189 @@ void exit_handler(int signum)
 //--------------------------------------------------------------------------------------------
 char* get_user_input()
 {
-    scanf("%s", messageBuffer);
+    // Bounded to the buffer, and the end of piped input ends the program rather than repeating the last answer forever
+    if (scanf("%999s", messageBuffer) != 1)
+        perform_clean_exit(0);
     return messageBuffer;    
 }
 
 void send_server_message(int serverFileDescriptor, char* message)
 {
     int messageLength = strlen(message);
-    int sendResult = send(serverFileDescriptor, message, messageLength, 0);
+    int sendResult = send(serverFileDescriptor, message, messageLength, MSG_NOSIGNAL);
     if (sendResult == -1)
     {
         fprintf(stderr, "Error sending message.\n");
     }
 }
 
-char* receive_server_message(int serverFileDescriptor)
+char* receive_server_line(int serverFileDescriptor)
 {
-    int numBytes = recv(serverFileDescriptor, messageBuffer, MAX_MESSAGE_LENGTH, 0);
-    if (numBytes == -1) 
+    // Returns the next line from the server without its '\n'. The server always starts with the legacy
+    // username prompt, which we don't need as we've already sent our login, so it gets skipped over.
+    while (true)
     {
-        fprintf(stderr, "Error sending message.\n");
-        return NULL;
+        if (greetingBytesLeft > 0 && lineEnd > lineStart)
+        {
+            int numSkipped = lineEnd - lineStart < greetingBytesLeft ? lineEnd - lineStart : greetingBytesLeft;
+            lineStart += numSkipped;
+            greetingBytesLeft -= numSkipped;
+        }
+
+        char *lineEndPosition = memchr(lineBuffer + lineStart, '\n', lineEnd - lineStart);
+        if (greetingBytesLeft == 0 && lineEndPosition != NULL)
+        {
+            char *line = lineBuffer + lineStart;
+            *lineEndPosition = '\0';
+            lineStart = lineEndPosition + 1 - lineBuffer;
+            return line;
+        }
+
+        // Make room for the rest of the line
+        int partialLength = lineEnd - lineStart;
+        if (partialLength >= MAX_LINE_LENGTH)
+        {
+            fprintf(stderr, "Server sent a line that's too long.\n");
+            return NULL;
+        }
+        memmove(lineBuffer, lineBuffer + lineStart, partialLength);
+        lineStart = 0;
+        lineEnd = partialLength;
+
+        int numBytes = recv(serverFileDescriptor, lineBuffer + lineEnd, sizeof(lineBuffer) - lineEnd, 0);
+        if (numBytes == -1)
+        {
+            fprintf(stderr, "Error receiving message.\n");
+            connectionLost = true;
+            return NULL;
+        }
+        else if (numBytes == 0)
+        {
+            fprintf(stderr, "Server has closed connection whilst client tried receiving message.\n");
+            connectionLost = true;
+            return NULL;
+        }
+        lineEnd += numBytes;
     }
-    else if (numBytes == 0)
+}
+
+char* receive_server_reply(int serverFileDescriptor, char *expectedReply)
+{
+    // Returns what comes after the expected reply keyword, or NULL if the server sent something else (e.g. ERR)
+    char *line = receive_server_line(serverFileDescriptor);
+    if (line == NULL)
+        return NULL;
+
+    int keywordLength = strlen(expectedReply);
+    if (strncmp(line, expectedReply, keywordLength) != 0 || (line[keywordLength] != ' ' && line[keywordLength] != '\0'))
     {
-        fprintf(stderr, "Server has closed connection whilst client tried receiving message.\n");
+        fprintf(stderr, "\nServer replied: %s\n", line);
         return NULL;
     }
 
-    // Trim the message to its correct size
-    messageBuffer[numBytes] = '\0';
-    return messageBuffer;
+    return line[keywordLength] == ' ' ? line + keywordLength + 1 : line + keywordLength;
 }
 
 //--------------------------------------------------------------------------------------------
 // Leaderboard related
 //--------------------------------------------------------------------------------------------
-bool display_leaderboard(int serverFileDescriptor)
+bool store_leaderboard_row(char *row)
+{
+    // Add a "username|games won|games played" row to the cached leaderboard, replacing the user's old row if there is one
+    char *username = strtok(row, "|");
+    char *gamesWon = strtok(NULL, "|");
+    char *totalGames = strtok(NULL, "|");
+    if (username == NULL || gamesWon == NULL || totalGames == NULL)
+        return false;
+
+    leaderboard_row_t *cachedRow = NULL;
+    for (int i = 0; i < numCachedRows && cachedRow == NULL; i++)
+    {
+        if (strcmp(cachedRows[i].username, username) == 0)
+            cachedRow = &cachedRows[i];
+    }
+    if (cachedRow == NULL)
+    {
+        leaderboard_row_t *grownRows = realloc(cachedRows, (numCachedRows + 1) * sizeof(leaderboard_row_t));
+        if (grownRows == NULL)
+        {
+            fprintf(stderr, "\nERROR: out of memory\n");
+            perform_clean_exit(1);
+        }
+        cachedRows = grownRows;
+        cachedRow = &cachedRows[numCachedRows++];
+        snprintf(cachedRow->username, sizeof(cachedRow->username), "%s", username);
+    }
+
+    cachedRow->gamesWon = atoi(gamesWon);
+    cachedRow->totalGames = atoi(totalGames);
+    return true;
+}
+
+int compare_leaderboard_rows(const void *first, const void *second)
 {
-    char* receivedMessage;
+    // Same order as the server keeps them in: games won, then percentage won, then alphabetical
+    const leaderboard_row_t *row1 = first;
+    const leaderboard_row_t *row2 = second;
+    if (row1->gamesWon != row2->gamesWon)
+        return row1->gamesWon < row2->gamesWon ? -1 : 1;
+
+    double percentageWon1 = (double)row1->gamesWon / row1->totalGames;
+    double percentageWon2 = (double)row2->gamesWon / row2->totalGames;
+    if (percentageWon1 != percentageWon2)
+        return percentageWon1 < percentageWon2 ? -1 : 1;
+
+    return strcmp(row1->username, row2->username);
+}
 
-    // First receive the number of items in the leaderboard
-    receivedMessage = receive_server_message(serverFileDescriptor);
+bool receive_leaderboard(int serverFileDescriptor)
+{
+    // The reply is either the whole leaderboard, just the rows that changed since our copy, or nothing at all if our
+    // copy is still up to date
+    char *receivedMessage = receive_server_line(serverFileDescriptor);
     if (receivedMessage == NULL) return false;
-    send_server_message(serverFileDescriptor, "Y");    
-    int numLeaderboardItems = atoi(receivedMessage);
 
-    if (numLeaderboardItems == 0)
+    int numRows;
+    char *keyword = strtok(receivedMessage, " ");
+    if (keyword != NULL && strcmp(keyword, REPLY_BOARD) == 0)
+    {
+        numCachedRows = 0;
+        numRows = atoi(strtok(NULL, " "));
+        cachedVersion = strtoul(strtok(NULL, " "), NULL, 10);
+    }
+    else if (keyword != NULL && strcmp(keyword, REPLY_DELTA) == 0)
+    {
+        strtok(NULL, " "); // The version it's changes since, which is ours
+        cachedVersion = strtoul(strtok(NULL, " "), NULL, 10);
+        numRows = atoi(strtok(NULL, " "));
+    }
+    else if (keyword != NULL && strcmp(keyword, REPLY_NOT_MODIFIED) == 0)
+    {
+        numRows = 0;
+    }
+    else
+    {
+        fprintf(stderr, "\nServer replied: %s\n", receivedMessage);
+        return false;
+    }
+
+    for (int i = 0; i < numRows; i++)
+    {
+        receivedMessage = receive_server_line(serverFileDescriptor);
+        if (receivedMessage == NULL || !store_leaderboard_row(receivedMessage)) return false;
+    }
+    haveCachedLeaderboard = true;
+    qsort(cachedRows, numCachedRows, sizeof(leaderboard_row_t), compare_leaderboard_rows);
+
+    return true;
+}
+
+bool display_leaderboard(int serverFileDescriptor)
+{
+    if (!receive_leaderboard(serverFileDescriptor))
+        return false;
+
+    if (numCachedRows == 0)
     {
         printf("\n");
         printf("====================================================================\n");
@@ -109,33 +309,20 @@ bool display_leaderboard(int serverFileDescriptor)
     }
     else
     {
-        // Now receive each item individually
-        for (int i = 0; i < numLeaderboardItems; i++)
+        for (int i = 0; i < numCachedRows; i++)
         {
             printf("\n");
             printf("====================================================================\n");
             printf("\n");
 
-            // Receive all details for the single leaderboard item in one go and split it up for simplicity
-            receivedMessage = receive_server_message(serverFileDescriptor);
-            if (receivedMessage == NULL) return false;
-            send_server_message(serverFileDescriptor, "Y");  
-            char *username = strtok(receivedMessage, "|");
-            int gamesWon = atoi(strtok(NULL, "|"));
-            int totalGames = atoi(strtok(NULL, "|"));
-
-            printf("Player - %s\n", username);        
-            printf("Number of games won - %d\n", gamesWon);        
-            printf("Number of games played - %d\n", totalGames);        
+            printf("Player - %s\n", cachedRows[i].username);        
+            printf("Number of games won - %d\n", cachedRows[i].gamesWon);        
+            printf("Number of games played - %d\n", cachedRows[i].totalGames);        
             
             printf("\n");
             printf("====================================================================\n");
         }
     }
-    
-    // Check the server is ready to continue to the main menu
-    receivedMessage = receive_server_message(serverFileDescriptor);
-    if (receivedMessage == NULL) return false;
 
     return true;
 }
@@ -143,17 +330,12 @@ bool display_leaderboard(int serverFileDescriptor)
 //--------------------------------------------------------------------------------------------
 // Running the actual game related
 //--------------------------------------------------------------------------------------------
-bool authenticate_user(int serverFileDescriptor)
+void read_credentials()
 {
+    // The username and password are sent along with the first menu selection, so nothing goes to the server yet
     printf("You are required to logon with your Username and Password\n");
-    
-    char* message;
-
-    message = receive_server_message(serverFileDescriptor);
-    if (message == NULL) return false;
-    printf("%s", message);
 
-    // Read the username and send to server
+    printf("%s", LOGIN_PROMPT);
     char* username = get_user_input();    
     currentUser = malloc(strlen(username) + 1);
     if (!currentUser)
@@ -163,52 +345,125 @@ bool authenticate_user(int serverFileDescriptor)
         perform_clean_exit(1);
     }
     strcpy(currentUser, username);
-    send_server_message(serverFileDescriptor, username);
 
-    // Check if username was correct
-    message = receive_server_message(serverFileDescriptor);
-    if (message == NULL) return false;
-    if (strcmp("false", message) == 0) 
+    printf("%s", PASSWORD_PROMPT);
+    char* password = get_user_input();
+    currentPassword = malloc(strlen(password) + 1);
+    if (!currentPassword)
     {
-        fprintf(stderr, "\nYou entered an incorrect username - disconnecting\n");
-        return false;
+        fprintf(stderr, "\nERROR: out of memory\n");
+        perform_clean_exit(1);
     }
-    printf("%s", message);
-    
-    // Read the username and send to server
-    char* password = get_user_input();
-    send_server_message(serverFileDescriptor, password);
+    strcpy(currentPassword, password);
+}
+
+bool send_command(int serverFileDescriptor, char *command, char *argument)
+{
+    char line[MAX_LINE_LENGTH];
+    int lineLength;
+    if (argument != NULL)
+        lineLength = snprintf(line, sizeof(line), "%s %s\n", command, argument);
+    else
+        lineLength = snprintf(line, sizeof(line), "%s\n", command);
+    if (lineLength >= (int)sizeof(line))
+        return false;
+
+    send_server_message(serverFileDescriptor, line);
+    return true;
+}
+
+int connect_to_server();
+
+bool resume_session(int serverFileDescriptor)
+{
+    // Reconnect and pick up where we left off with the session token, without logging in again.
+    // The new connection takes over the old one's file descriptor so nothing else needs to know.
+    if (sessionToken[0] == '\0')
+        return false;
 
-    // Check if password was correct
-    message = receive_server_message(serverFileDescriptor);
-    if (message == NULL) return false;
-    if (strcmp("false", message) == 0) 
+    printf("\nConnection lost, resuming...\n");
+    int newFileDescriptor = connect_to_server();
+    dup2(newFileDescriptor, serverFileDescriptor);
+    close(newFileDescriptor);
+    lineStart = 0;
+    lineEnd = 0;
+    greetingBytesLeft = sizeof(LOGIN_PROMPT) - 1;
+    connectionLost = false;
+
+    if (!send_command(serverFileDescriptor, COMMAND_RESUME, sessionToken))
+        return false;
+    char *token = receive_server_reply(serverFileDescriptor, REPLY_OK);
+    if (token == NULL)
     {
-        fprintf(stderr, "\nYou entered an incorrect username - disconnecting\n");
+        sessionToken[0] = '\0';
         return false;
     }
-
+    snprintf(sessionToken, sizeof(sessionToken), "%s", token);
     return true;
 }
 
+bool send_user_guess(int serverFileDescriptor, bool *expectResults)
+{
+    // Keep asking until the guess is one the server will take, since it answers anything else with ERR and no new state
+    char *guess;
+    while (true)
+    {
+        printf("\nEnter your guess (or several letters to guess them in order): ");
+        guess = get_user_input();
+        int numLetters = strlen(guess);
+        bool allLetters = true;
+        for (int i = 0; i < numLetters; i++)
+            allLetters = allLetters && isalpha((unsigned char)guess[i]);
+        if (allLetters && numLetters <= MAX_NUM_GUESSES)
+            break;
+        printf("\nGuesses can only be letters, at most %d at a time\n", MAX_NUM_GUESSES);
+    }
+
+    *expectResults = strlen(guess) > 1;
+    return send_command(serverFileDescriptor, COMMAND_GUESS, guess);
+}
+
 bool play_hangman(int serverFileDescriptor)
 {
     bool gameFinished = false;
     char* message;
     char* gameFinishedMessage;
+    bool expectResults = false;
 
     while (!gameFinished)
     {   
         printf("\n--------------------------------------------------------------------\n");
+
+        // Several letters at once get a hit or miss for each one before the new state
+        if (expectResults)
+        {
+            message = receive_server_reply(serverFileDescriptor, REPLY_RESULTS);
+            expectResults = false;
+            if (message == NULL && !connectionLost)
+            {
+                // The guess was turned down, so there's no new state coming. Ask for another one.
+                if (!send_user_guess(serverFileDescriptor, &expectResults)) return false;
+                continue;
+            }
+            if (message != NULL && (message = strchr(message, ' ')) != NULL)
+                printf("\nHits (+) and misses (-): %s\n", message + 1);
+        }
         
         // Receive currently made guesses from server, remaining number of guesses, and the current word from the server
         // They're all joined together as one message for simplicity so we need to separate them with strtok()
-        message = receive_server_message(serverFileDescriptor);
+        message = receive_server_reply(serverFileDescriptor, REPLY_STATE);
+        if (message == NULL && connectionLost && resume_session(serverFileDescriptor))
+            message = receive_server_reply(serverFileDescriptor, REPLY_STATE);
         if (message == NULL) return false;    
-        char *guessedLetters = strtok(message, "|");
+
+        // We only play one game at a time, so the game ID in front can be skipped over
+        message = strchr(message, ' ');
+        if (message == NULL) return false;
+        char *guessedLetters = strtok(message + 1, "|");
         char *numGuessesString = strtok(NULL, "|");
         char *clientWord = strtok(NULL, "|");
         char *gameStatusIndicator = strtok(NULL, "|");
+        if (gameStatusIndicator == NULL) return false;
         
         // Print out the info we received
         printf("\nGuessed letters: %s\n", guessedLetters);
@@ -228,12 +483,24 @@ bool play_hangman(int serverFileDescriptor)
             gameFinishedMessage = "\nBad luck %s! You have run out of guesses. The hangman got you!\n";
             gameFinished = true;
         }
+        else if (solver != NULL)
+        {
+            // Let the solver guess, and show how it got there
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            int numCandidates = hangman_solver_filter(solver, solverScratch, clientWord, guessedLetters);
+            char guess[2] = {hangman_solver_next_guess(solverScratch, solverMethod), '\0'};
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            const char *category = hangman_solver_category(solverScratch);
+            printf("\n%d word%s still fit%s%s, guessing %s (%ld us)\n", numCandidates, numCandidates == 1 ? "" : "s",
+                   category != NULL ? ", all " : "", category != NULL ? category : "", guess,
+                   (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+            if (guess[0] == '\0' || !send_command(serverFileDescriptor, COMMAND_GUESS, guess)) return false;
+        }
         else
         {
             // Get the next guess from the user
-            printf("\nEnter your guess: ");
-            message = get_user_input();        
-            send_server_message(serverFileDescriptor, message);    
+            if (!send_user_guess(serverFileDescriptor, &expectResults)) return false;
         }
     }
 
@@ -253,12 +520,12 @@ bool main_menu(int serverFileDescriptor)
     printf("Welcome to the Online Hangman Gaming System\n\n");
     printf("====================================================================\n\n\n");
 
-    if (!authenticate_user(serverFileDescriptor))
-        return false;
+    read_credentials();
 
     printf("\n\n--------------------------------------------------------------------\n\n");
     printf("\nWelcome to the Hangman Gaming System\n");
 
+    bool loggedIn = false;
     bool quitMenu = false;
     while (!quitMenu)
     {
@@ -283,8 +550,30 @@ bool main_menu(int serverFileDescriptor)
                 printf("\nIncorrect Selection\nPlease ");
         }
 
-        // Send the server the selectction and begin playing the corresponding action
-        send_server_message(serverFileDescriptor, selectionString);
+        char *command = selection == '1' ? COMMAND_PLAY : selection == '2' ? COMMAND_BOARD : COMMAND_QUIT;
+        if (!loggedIn)
+        {
+            // The first selection rides along with the login, so it only costs the one round trip
+            char credentials[MAX_LINE_LENGTH];
+            snprintf(credentials, sizeof(credentials), "%s %s %s", currentUser, currentPassword, command);
+            if (!send_command(serverFileDescriptor, COMMAND_LOGIN, credentials)) return false;
+            char *token = receive_server_reply(serverFileDescriptor, REPLY_OK);
+            if (token == NULL)
+            {
+                fprintf(stderr, "\nYou entered an incorrect username or password - disconnecting\n");
+                return false;
+            }
+            snprintf(sessionToken, sizeof(sessionToken), "%s", token);
+            loggedIn = true;
+        }
+        else
+        {
+            char since[MAX_LINE_LENGTH];
+            snprintf(since, sizeof(since), BOARD_SINCE " %lu", cachedVersion);
+            bool onlyChanges = selection == '2' && haveCachedLeaderboard;
+            send_command(serverFileDescriptor, command, onlyChanges ? since : NULL);
+        }
+
         switch(selection) 
         {
             case '1':
@@ -294,6 +583,8 @@ bool main_menu(int serverFileDescriptor)
                 quitMenu = !display_leaderboard(serverFileDescriptor);
                 break;
             case '3':
+                // Wait for the goodbye so the server isn't cut off mid-reply, but we're quitting either way
+                receive_server_reply(serverFileDescriptor, REPLY_BYE);
                 quitMenu = true;
                 break;
             default: 
@@ -307,30 +598,277 @@ bool main_menu(int serverFileDescriptor)
 }
 
 //--------------------------------------------------------------------------------------------
-// main
+// Batch mode related
 //--------------------------------------------------------------------------------------------
-int main(int argc, char **argv)
+long long now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+bool add_batch_step(char *verb, char *argument)
 {
-    // Check we got an IP and port number input
-    if (argc != 3)
+    // Turns a script line into the protocol line for it. The menu's numbers work as well as the words.
+    batch_step_t *step = &batchSteps[numBatchSteps];
+    char *command = NULL;
+    step->numReplies = 1;
+    if (strcasecmp(verb, "login") == 0)
+    {
+        char username[MAX_LINE_LENGTH];
+        if (argument == NULL || sscanf(argument, "%s", username) != 1)
+            return false;
+        if (snprintf(step->shown, sizeof(step->shown), COMMAND_LOGIN " %s ***", username) >= (int)sizeof(step->shown))
+            return false;
+        return snprintf(step->line, sizeof(step->line), COMMAND_LOGIN " %s\n", argument) < (int)sizeof(step->line);
+    }
+    else if (strcasecmp(verb, "play") == 0 || strcmp(verb, "1") == 0)
     {
-        fprintf(stderr, "usage: Client IP and port\n");
+        command = COMMAND_PLAY;
+        if (argument != NULL)
+            step->numReplies = atoi(argument) > 0 ? atoi(argument) : 1;
+    }
+    else if (strcasecmp(verb, "guess") == 0)
+        command = COMMAND_GUESS;
+    else if (strcasecmp(verb, "word") == 0)
+        command = COMMAND_WORD;
+    else if (strcasecmp(verb, "board") == 0 || strcmp(verb, "2") == 0)
+    {
+        command = COMMAND_BOARD;
+        for (char *character = argument; character != NULL && *character != '\0'; character++)
+            *character = toupper(*character);
+    }
+    else if (strcasecmp(verb, "quit") == 0 || strcmp(verb, "3") == 0)
+        command = COMMAND_QUIT;
+    else
+        return false;
+
+    if (argument != NULL)
+        snprintf(step->shown, sizeof(step->shown), "%s %s", command, argument);
+    else
+        snprintf(step->shown, sizeof(step->shown), "%s", command);
+    return snprintf(step->line, sizeof(step->line), "%s\n", step->shown) < (int)sizeof(step->line);
+}
+
+void read_batch_script(char *fileName)
+{
+    // One step per line: login <username> <password>, play [count], guess [game ID] <letters>,
+    // word [game ID] <object type> <object name>, board [since <version>|top|hour|day|week] or quit.
+    // Blank lines and lines starting with '#' are skipped.
+    FILE *script = strcmp(fileName, "-") == 0 ? stdin : fopen(fileName, "r");
+    if (script == NULL)
+    {
+        perror(fileName);
         exit(1);
     }
 
-    // Get port number and IP from command line arguments
-    char *ipAddress = argv[1];
-    int port = atoi(argv[2]);
-    if (port == 0)
+    int stepsAllocated = 0;
+    char line[MAX_LINE_LENGTH];
+    for (int lineNumber = 1; fgets(line, sizeof(line), script) != NULL; lineNumber++)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *verb = line + strspn(line, " \t");
+        if (*verb == '\0' || *verb == '#')
+            continue;
+        char *argument = verb + strcspn(verb, " \t");
+        if (*argument != '\0')
+        {
+            *argument++ = '\0';
+            argument += strspn(argument, " \t");
+        }
+
+        if (numBatchSteps == stepsAllocated)
+        {
+            stepsAllocated = stepsAllocated > 0 ? stepsAllocated * 2 : 64;
+            batchSteps = realloc(batchSteps, stepsAllocated * sizeof(batch_step_t));
+            if (batchSteps == NULL)
+            {
+                fprintf(stderr, "\nERROR: out of memory\n");
+                exit(1);
+            }
+        }
+        if (!add_batch_step(verb, *argument != '\0' ? argument : NULL))
+        {
+            fprintf(stderr, "Can't make sense of line %d of the script: %s\n", lineNumber, verb);
+            exit(1);
+        }
+        numBatchSteps++;
+    }
+
+    if (script != stdin)
+        fclose(script);
+}
+
+void *send_batch_steps(void *data)
+{
+    // Sends as many steps as the depth allows in one go, so a whole script can go out in a single write
+    (void)data;
+    char *buffer = malloc(MAX_LINE_LENGTH * (batchDepth > 0 ? batchDepth : numBatchSteps));
+    if (buffer == NULL)
     {
-        fprintf(stderr, "Please specify a valid port number\n");
+        fprintf(stderr, "\nERROR: out of memory\n");
         exit(1);
     }
 
-    // Set exit_handler() to trigger when a SIGINT signal is received (i.e. when Ctrl+C is pressed)
-    if (signal(SIGINT, exit_handler) == SIG_ERR)
-        printf("\nCan't catch SIGINT\n");
+    pthread_mutex_lock(&batchMutex);
+    while (numBatchStepsSent < numBatchSteps && !batchFinished)
+    {
+        if (batchDepth > 0 && numBatchStepsSent - numBatchStepsAnswered >= batchDepth)
+        {
+            pthread_cond_wait(&batchCondition, &batchMutex);
+            continue;
+        }
+
+        int firstStep = numBatchStepsSent;
+        int lastStep = batchDepth > 0 ? numBatchStepsAnswered + batchDepth : numBatchSteps;
+        if (lastStep > numBatchSteps)
+            lastStep = numBatchSteps;
+        int length = 0;
+        long long sentAtUs = now_us();
+        for (int i = firstStep; i < lastStep; i++)
+        {
+            batchSteps[i].sentAtUs = sentAtUs;
+            int lineLength = strlen(batchSteps[i].line);
+            memcpy(buffer + length, batchSteps[i].line, lineLength);
+            length += lineLength;
+        }
+        numBatchStepsSent = lastStep;
+        pthread_cond_broadcast(&batchCondition);
+        pthread_mutex_unlock(&batchMutex);
+
+        for (int sent = 0; sent < length; )
+        {
+            int numBytes = send(serverFileDescriptor, buffer + sent, length - sent, MSG_NOSIGNAL);
+            if (numBytes <= 0)
+            {
+                // The reader will find out the connection's gone too
+                free(buffer);
+                return NULL;
+            }
+            sent += numBytes;
+        }
+        pthread_mutex_lock(&batchMutex);
+    }
+    pthread_mutex_unlock(&batchMutex);
+
+    free(buffer);
+    return NULL;
+}
 
+void print_json_string(const char *string)
+{
+    putchar('"');
+    for (const char *character = string; *character != '\0'; character++)
+    {
+        if (*character == '"' || *character == '\\')
+            printf("\\%c", *character);
+        else if ((unsigned char)*character < ' ')
+            printf("\\u%04x", *character);
+        else
+            putchar(*character);
+    }
+    putchar('"');
+}
+
+int count_reply_rows(char *line)
+{
+    // How many lines follow a reply's first line
+    int numRows = 0;
+    if (strncmp(line, REPLY_RESULTS " ", strlen(REPLY_RESULTS) + 1) == 0)
+        return 1; // The STATE
+    else if (sscanf(line, REPLY_BOARD " %d", &numRows) == 1 || sscanf(line, REPLY_TOP " %d", &numRows) == 1 ||
+             sscanf(line, REPLY_WINDOW " %*s %d", &numRows) == 1 || sscanf(line, REPLY_DELTA " %*u %*u %d", &numRows) == 1)
+        return numRows;
+    return 0;
+}
+
+bool receive_batch_reply(batch_step_t *step, int stepNumber, long long startUs)
+{
+    // Prints the step along with everything the server sent back for it. Returns false if the connection's gone.
+    printf("{\"step\":%d,\"command\":", stepNumber);
+    print_json_string(step->shown);
+    printf(",\"reply\":[");
+
+    bool ok = true;
+    bool first = true;
+    for (int reply = 0; reply < step->numReplies && ok; reply++)
+    {
+        int numLines = 1;
+        for (int i = 0; i < numLines; i++)
+        {
+            char *line = receive_server_line(serverFileDescriptor);
+            if (line == NULL)
+            {
+                printf("],\"ok\":false,\"error\":\"connection closed\"}\n");
+                return false;
+            }
+            if (i == 0)
+                numLines += count_reply_rows(line);
+            if (strncmp(line, REPLY_ERROR, strlen(REPLY_ERROR)) == 0)
+                ok = false;
+
+            printf("%s", first ? "" : ",");
+            print_json_string(line);
+            first = false;
+        }
+    }
+
+    long long doneUs = now_us();
+    printf("],\"ok\":%s,\"sent_us\":%lld,\"us\":%lld}\n", ok ? "true" : "false", step->sentAtUs - startUs, doneUs - step->sentAtUs);
+    return true;
+}
+
+bool run_batch()
+{
+    // The protocol answers commands in order, so the sender never needs to wait for a reply before sending the next one
+    long long startUs = now_us();
+    pthread_t senderThread;
+    if (pthread_create(&senderThread, NULL, send_batch_steps, NULL) != 0)
+    {
+        perror("pthread_create");
+        return false;
+    }
+
+    int numErrors = 0;
+    int stepNumber;
+    for (stepNumber = 0; stepNumber < numBatchSteps; stepNumber++)
+    {
+        pthread_mutex_lock(&batchMutex);
+        while (numBatchStepsSent <= stepNumber)
+            pthread_cond_wait(&batchCondition, &batchMutex);
+        pthread_mutex_unlock(&batchMutex);
+
+        bool connected = receive_batch_reply(&batchSteps[stepNumber], stepNumber + 1, startUs);
+
+        pthread_mutex_lock(&batchMutex);
+        numBatchStepsAnswered++;
+        pthread_cond_broadcast(&batchCondition);
+        pthread_mutex_unlock(&batchMutex);
+        if (!connected)
+        {
+            numErrors++;
+            break;
+        }
+        fflush(stdout);
+    }
+
+    pthread_mutex_lock(&batchMutex);
+    batchFinished = true;
+    pthread_cond_broadcast(&batchCondition);
+    pthread_mutex_unlock(&batchMutex);
+    shutdown(serverFileDescriptor, SHUT_RDWR);
+    pthread_join(senderThread, NULL);
+
+    printf("{\"summary\":true,\"steps\":%d,\"answered\":%d,\"seconds\":%.6f}\n", numBatchSteps, numBatchStepsAnswered - numErrors,
+           (now_us() - startUs) / 1000000.0);
+    return stepNumber == numBatchSteps;
+}
+
+//--------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------
+int connect_to_tcp_server(char *ipAddress, int port)
+{
     // Get the host info
     struct hostent *hostEntity = gethostbyname(ipAddress);
     if (hostEntity == NULL)
@@ -342,8 +880,8 @@ int main(int argc, char **argv)
     }
 
     // Create a socket for connecting to the server
-    serverFileDescriptor = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverFileDescriptor == -1)
+    int fileDescriptor = socket(AF_INET, SOCK_STREAM, 0);
+    if (fileDescriptor == -1)
     {
         perror("socket");
         exit(1);
@@ -357,14 +895,134 @@ int main(int argc, char **argv)
     bzero(&(serverAddressInfo.sin_zero), 8); // zero the rest of the struct
 
     // Connect to the server
-    int connectResult = connect(serverFileDescriptor, (struct sockaddr *)&serverAddressInfo, sizeof(struct sockaddr));
+    int connectResult = connect(fileDescriptor, (struct sockaddr *)&serverAddressInfo, sizeof(struct sockaddr));
     if (connectResult == -1)
     {
         perror("connect");
         exit(1);
     }
 
-    printf("Connected to server %s:%d\n", inet_ntoa(serverAddressInfo.sin_addr), port);
+    if (!batchMode)
+        printf("Connected to server %s:%d\n", inet_ntoa(serverAddressInfo.sin_addr), port);
+    return fileDescriptor;
+}
+
+int connect_to_unix_server(char *path)
+{
+    // For when the server is on the same machine and listening on a UNIX domain socket
+    struct sockaddr_un serverAddressInfo;
+    memset(&serverAddressInfo, 0, sizeof(serverAddressInfo));
+    serverAddressInfo.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(serverAddressInfo.sun_path))
+    {
+        fprintf(stderr, "Socket path is too long\n");
+        exit(1);
+    }
+    strcpy(serverAddressInfo.sun_path, path);
+
+    int fileDescriptor = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fileDescriptor == -1)
+    {
+        perror("socket");
+        exit(1);
+    }
+
+    if (connect(fileDescriptor, (struct sockaddr *)&serverAddressInfo, sizeof(serverAddressInfo)) == -1)
+    {
+        perror("connect");
+        exit(1);
+    }
+
+    if (!batchMode)
+        printf("Connected to server at %s\n", path);
+    return fileDescriptor;
+}
+
+int connect_to_server()
+{
+    if (useUnixSocket)
+        return connect_to_unix_server(serverAddress);
+    return connect_to_tcp_server(serverAddress, serverPort);
+}
+
+void load_solver(char *wordsFileName)
+{
+    // Auto-play needs the same dictionary as the server to be any good
+    autoPlayWords = hangman_read_words(wordsFileName, &numAutoPlayWords);
+    if (autoPlayWords == NULL)
+        exit(1);
+    solver = hangman_solver_create(autoPlayWords, numAutoPlayWords);
+    solverScratch = solver != NULL ? hangman_solver_scratch_create(solver) : NULL;
+    if (solverScratch == NULL)
+    {
+        fprintf(stderr, "\nERROR: out of memory\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    // Check we got an IP and port number, or a UNIX socket path, as input, optionally with a dictionary to auto-play
+    // with or a script to run
+    int option;
+    char *wordsFileName = NULL;
+    char *scriptFileName = NULL;
+    while ((option = getopt(argc, argv, "u:a:eb:d:")) != -1)
+    {
+        switch (option)
+        {
+            case 'u':
+                useUnixSocket = true;
+                serverAddress = optarg;
+                break;
+            case 'a': wordsFileName = optarg; break;
+            case 'e': solverMethod = SOLVER_ENTROPY; break;
+            case 'b': scriptFileName = optarg; break;
+            case 'd': batchDepth = atoi(optarg); break;
+            default: argc = -1; break;
+        }
+    }
+    if (argc - optind != (useUnixSocket ? 0 : 2))
+    {
+        fprintf(stderr, "usage: Client [options] IP and port, or Client [options] -u socket path\n");
+        fprintf(stderr, "  -a <file>    auto-play, with the solver picking guesses from the words in the file\n");
+        fprintf(stderr, "  -e           have the solver pick the most informative letter rather than the most likely one\n");
+        fprintf(stderr, "  -b <script>  run a script (- for stdin) and print the replies as JSON lines\n");
+        fprintf(stderr, "  -d <num>     with -b, the most commands waiting on replies at once (default no limit)\n");
+        exit(1);
+    }
+    if (wordsFileName != NULL)
+        load_solver(wordsFileName);
+    if (scriptFileName != NULL)
+    {
+        batchMode = true;
+        read_batch_script(scriptFileName);
+    }
+
+    // Set exit_handler() to trigger when a SIGINT signal is received (i.e. when Ctrl+C is pressed)
+    if (signal(SIGINT, exit_handler) == SIG_ERR)
+        printf("\nCan't catch SIGINT\n");
+
+    if (!useUnixSocket)
+    {
+        // Get port number and IP from command line arguments
+        serverAddress = argv[optind];
+        serverPort = atoi(argv[optind + 1]);
+        if (serverPort == 0)
+        {
+            fprintf(stderr, "Please specify a valid port number\n");
+            exit(1);
+        }
+    }
+    serverFileDescriptor = connect_to_server();
+
+    if (batchMode)
+    {
+        bool finished = run_batch();
+        close(serverFileDescriptor);
+        free(batchSteps);
+        return finished ? 0 : 1;
+    }
 
     bool gameResult = main_menu(serverFileDescriptor);
     if (!gameResult)
@@ -374,6 +1032,11 @@ int main(int argc, char **argv)
     
     close(serverFileDescriptor);
     free(currentUser);
+    free(currentPassword);
+    free(cachedRows);
+    hangman_solver_scratch_free(solverScratch);
+    hangman_solver_free(solver);
+    hangman_free_words(autoPlayWords, numAutoPlayWords);
 
     return 0;
 }
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+
+//--------------------------------------------------------------------------------------------
+// Reading the dictionary related
+//--------------------------------------------------------------------------------------------
+void hangman_free_words(hangman_word_t *words, int numWords)
+{
+    if (words == NULL)
+        return;
+    for (int i = 0; i < numWords; i++)
+    {
+        free(words[i].objectName);
+        free(words[i].objectType);
+    }
+    free(words);
+}
+
+char *copy_string(const char *string)
+{
+    char *copy = malloc(strlen(string) + 1);
+    if (copy != NULL)
+        strcpy(copy, string);
+    return copy;
+}
+
+hangman_word_t *hangman_read_words(const char *fileName, int *numWords)
+{
+    FILE *fp = fopen(fileName, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Error opening file (%s).\n", fileName);
+        return NULL;
+    }
+
+    int wordsAllocated = 256;
+    hangman_word_t *words = malloc(wordsAllocated * sizeof(hangman_word_t));
+    char line[MAX_WORD_LENGTH + 3]; // Room for the line ending, and to notice lines that are too long
+    *numWords = 0;
+    while (words != NULL && fgets(line, sizeof(line), fp) != NULL)
+    {
+        // Get rid of CR or LF at end of line, and skip blank lines
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+
+        // Splits the given string when it sees a comma so that we get the objectName and objectType separated
+        char *objectName = strtok(line, ",");
+        char *objectType = strtok(NULL, ",");
+        if (objectName == NULL || objectType == NULL || strlen(objectType) + 1 + strlen(objectName) > MAX_WORD_LENGTH)
+        {
+            fprintf(stderr, "Can't play the word on line %d of %s.\n", *numWords + 1, fileName);
+            hangman_free_words(words, *numWords);
+            fclose(fp);
+            return NULL;
+        }
+
+        if (*numWords == wordsAllocated)
+        {
+            wordsAllocated *= 2;
+            hangman_word_t *grown = realloc(words, wordsAllocated * sizeof(hangman_word_t));
+            if (grown == NULL)
+                break;
+            words = grown;
+        }
+        words[*numWords].objectName = copy_string(objectName);
+        words[*numWords].objectType = copy_string(objectType);
+        (*numWords)++;
+        if (words[*numWords - 1].objectName == NULL || words[*numWords - 1].objectType == NULL)
+            break;
+    }
+
+    // Running out of memory part way through is as good as not being able to read the file
+    bool failed = !feof(fp) || words == NULL;
+    fclose(fp);
+    if (failed)
+    {
+        fprintf(stderr, "Out of memory (hangmanWords).\n");
+        hangman_free_words(words, *numWords);
+        return NULL;
+    }
+
+    return words;
+}
+
+//--------------------------------------------------------------------------------------------
+// Playing the game related
+//--------------------------------------------------------------------------------------------
+int hangman_pick_word(unsigned long long randomNumber, int numWords)
+{
+    return (int)(randomNumber % numWords);
+}
+
+int hangman_num_guesses(int wordLength)
+{
+    // The number of characters in both words plus nine, up to 26
+    if (wordLength + GUESSES_OVER_LENGTH > MAX_NUM_GUESSES)
+        return MAX_NUM_GUESSES;
+    return wordLength + GUESSES_OVER_LENGTH;
+}
+
+void hangman_start_game(hangman_game_t *game, hangman_word_t *word)
+{
+    // Combine to get a single string with both objectType and objectName separated by a space
+    int typeLength = strlen(word->objectType);
+    game->wordLength = typeLength + 1 + strlen(word->objectName);
+    strcpy(game->hangmanWord, word->objectType);
+    game->hangmanWord[typeLength] = ' ';
+    strcpy(game->hangmanWord + typeLength + 1, word->objectName);
+
+    // The word the player sees starts off as underscores and a single space
+    memset(game->clientWord, '_', game->wordLength);
+    game->clientWord[typeLength] = ' ';
+    game->clientWord[game->wordLength] = '\0';
+
+    memset(game->guessedLetters, 0, sizeof(game->guessedLetters));
+    game->guessedLetters[0] = ' ';
+    game->numGuessesMade = 0;
+    game->numGuessesLeft = hangman_num_guesses(game->wordLength);
+    game->won = false;
+}
+
+char hangman_game_status(hangman_game_t *game)
+{
+    if (game->won)
+        return 'W'; // Won
+    else if (game->numGuessesLeft == 0)
+        return 'L'; // Lost
+    else
+        return 'O'; // Ongoing
+}
+
+bool hangman_guess_letter(hangman_game_t *game, char guess)
+{
+    // Returns whether the letter is in the word
+    bool hit = false;
+    game->guessedLetters[game->numGuessesMade] = guess;
+    game->guessedLetters[game->numGuessesMade + 1] = '\0';
+    game->numGuessesMade++;
+    game->numGuessesLeft--;
+
+    // Update the clientWord and check if they've won the game
+    game->won = true;
+    for (int j = 0; j < game->wordLength; j++)
+    {
+        // Check if the current character in the array is the same as the guess character
+        if (game->hangmanWord[j] == guess)
+        {
+            // Change the client hangman word to have the guessed character in the same position as the original word
+            game->clientWord[j] = guess;
+            hit = true;
+        }
+        else if (game->clientWord[j] == '_')
+        {
+            // Make the winning boolean false if there is still any underscores found in the client word
+            game->won = false;
+        }
+    }
+
+    return hit;
+}
+
+int hangman_guess_letters(hangman_game_t *game, char *letters, char *results)
+{
+    // Apply a batch of letters in order, each costing a guess just as if they'd been sent one at a time, stopping as
+    // soon as the game is over. results gets '+' for a letter in the word, '-' for a miss and '.' for letters that
+    // weren't needed. Returns how many were applied.
+    int numLetters = strlen(letters);
+    int numApplied = 0;
+    for (int i = 0; i < numLetters; i++)
+    {
+        if (hangman_game_status(game) == 'O')
+        {
+            results[i] = hangman_guess_letter(game, letters[i]) ? '+' : '-';
+            numApplied++;
+        }
+        else
+        {
+            results[i] = '.';
+        }
+    }
+    results[numLetters] = '\0';
+
+    return numApplied;
+}
+
+bool hangman_guess_word(hangman_game_t *game, char *word)
+{
+    // Guessing the whole word costs a single guess, shown as a '*' in the guessed letters. Returns whether it was right.
+    game->guessedLetters[game->numGuessesMade] = WORD_GUESS_MARKER;
+    game->guessedLetters[game->numGuessesMade + 1] = '\0';
+    game->numGuessesMade++;
+    game->numGuessesLeft--;
+
+    if (strcmp(game->hangmanWord, word) != 0)
+        return false;
+
+    strcpy(game->clientWord, game->hangmanWord);
+    game->won = true;
+    return true;
+}
@@ -0,0 +1,54 @@
+#ifndef HANGMAN_ENGINE_H
+#define HANGMAN_ENGINE_H
+
+#include <stdbool.h>
+
+//--------------------------------------------------------------------------------------------
+// The rules of hangman
+//--------------------------------------------------------------------------------------------
+// No sockets, threads, globals or allocation once a game's started, so the server and simulate play by exactly
+// the same rules and a game can be played millions of times a second.
+//
+// A word is an object type and an object name, e.g. "food" and "apple", played as "food apple". The player gets
+// the word's length plus GUESSES_OVER_LENGTH guesses, up to MAX_NUM_GUESSES. Each letter or whole word guessed
+// costs one guess, whether it's right or not. The game's won once every letter's been revealed, and lost once
+// the guesses run out.
+#define MAX_NUM_GUESSES 26
+#define GUESSES_OVER_LENGTH 9
+#define MAX_WORD_LENGTH 100                          // Object type, space and object name
+#define WORD_GUESS_MARKER '*'                        // Stands in for a full word guess in a game's guessed letters
+
+// Define a struct to represent a word to be guessed in Hangman
+typedef struct hangmanWordStruct
+{
+    char *objectName;
+    char *objectType;
+} hangman_word_t;
+
+// Define a struct to hold the state of one game
+typedef struct HangmanGameStruct
+{
+    char hangmanWord[MAX_WORD_LENGTH + 1];       // objectType and objectName separated by a space
+    char clientWord[MAX_WORD_LENGTH + 1];        // What the player gets to see, with underscores for letters not guessed yet
+    int wordLength;
+    char guessedLetters[MAX_NUM_GUESSES + 1];    // +1 for the '\0'
+    int numGuessesMade;
+    int numGuessesLeft;
+    bool won;
+} hangman_game_t;
+
+// Reads "objectName,objectType" lines. Returns NULL if the file can't be read, or a word is too long to play.
+hangman_word_t *hangman_read_words(const char *fileName, int *numWords);
+void hangman_free_words(hangman_word_t *words, int numWords);
+
+// Which word a random number picks
+int hangman_pick_word(unsigned long long randomNumber, int numWords);
+int hangman_num_guesses(int wordLength);
+
+void hangman_start_game(hangman_game_t *game, hangman_word_t *word);
+char hangman_game_status(hangman_game_t *game); // 'O' ongoing, 'W' won or 'L' lost
+bool hangman_guess_letter(hangman_game_t *game, char guess);
+int hangman_guess_letters(hangman_game_t *game, char *letters, char *results);
+bool hangman_guess_word(hangman_game_t *game, char *word);
+
+#endif
@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+//--------------------------------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------------------------------
+#define MAX_MESSAGE_LENGTH 1000
+#define DEFAULT_CONNECTIONS 10
+#define DEFAULT_GAMES 20
+#define GUESS_ORDER "etaoinshrdlucmfwypvbgkjqxz" // Rough English letter frequency, good enough to finish games
+
+//--------------------------------------------------------------------------------------------
+// Global variables
+//--------------------------------------------------------------------------------------------
+char *hostName;
+int port;
+char *unixSocketPath = NULL; // Connect over a UNIX domain socket instead of TCP when set
+int numConnections = DEFAULT_CONNECTIONS;
+int gamesPerConnection = DEFAULT_GAMES;
+char *username = "Maolin";
+char *password = "111111";
+bool compactProtocol = false; // Log in and play with the line based protocol instead of the interactive one
+int gamesAtOnce = 1;          // Games each compact connection plays at the same time
+int lettersPerGuess = 1;      // Letters sent in each compact GUESS
+
+// Buffered lines from the server, for the compact protocol
+typedef struct LineReaderStruct
+{
+    char buffer[2 * MAX_LINE_LENGTH];
+    int start;
+    int end;
+    int skipBytes; // The legacy greeting, which compact clients don't wait for
+} line_reader_t;
+
+// Define a struct to hold what each connection's thread measured
+typedef struct ConnectionResultStruct
+{
+    pthread_t thread;
+    int connectionId;
+    bool failed;
+    int gamesPlayed;
+    int gamesWon;
+    long long *roundTripsUs; // Time from sending each guess to receiving the new game state
+    int numRoundTrips;
+    int roundTripsAllocated;
+} connection_result_t;
+
+//--------------------------------------------------------------------------------------------
+// Time related
+//--------------------------------------------------------------------------------------------
+long long now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+//--------------------------------------------------------------------------------------------
+// Sending/Receiving messages related
+//--------------------------------------------------------------------------------------------
+bool send_message(int fileDescriptor, char *message)
+{
+    int messageLength = strlen(message);
+    return send(fileDescriptor, message, messageLength, MSG_NOSIGNAL) == messageLength;
+}
+
+char *receive_message(int fileDescriptor, char *buffer)
+{
+    int numBytes = recv(fileDescriptor, buffer, MAX_MESSAGE_LENGTH - 1, 0);
+    if (numBytes <= 0)
+        return NULL;
+
+    buffer[numBytes] = '\0';
+    return buffer;
+}
+
+char *receive_line(int fileDescriptor, line_reader_t *reader)
+{
+    while (true)
+    {
+        int numSkipped = reader->end - reader->start < reader->skipBytes ? reader->end - reader->start : reader->skipBytes;
+        reader->start += numSkipped;
+        reader->skipBytes -= numSkipped;
+
+        char *lineEnd = memchr(reader->buffer + reader->start, '\n', reader->end - reader->start);
+        if (reader->skipBytes == 0 && lineEnd != NULL)
+        {
+            char *line = reader->buffer + reader->start;
+            *lineEnd = '\0';
+            reader->start = lineEnd + 1 - reader->buffer;
+            return line;
+        }
+
+        int partialLength = reader->end - reader->start;
+        if (partialLength >= MAX_LINE_LENGTH)
+            return NULL;
+        memmove(reader->buffer, reader->buffer + reader->start, partialLength);
+        reader->start = 0;
+        reader->end = partialLength;
+
+        int numBytes = recv(fileDescriptor, reader->buffer + reader->end, sizeof(reader->buffer) - reader->end, 0);
+        if (numBytes <= 0)
+            return NULL;
+        reader->end += numBytes;
+    }
+}
+
+int connect_to_unix_server()
+{
+    struct sockaddr_un serverAddressInfo;
+    memset(&serverAddressInfo, 0, sizeof(serverAddressInfo));
+    serverAddressInfo.sun_family = AF_UNIX;
+    strncpy(serverAddressInfo.sun_path, unixSocketPath, sizeof(serverAddressInfo.sun_path) - 1);
+
+    int fileDescriptor = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fileDescriptor == -1)
+        return -1;
+    if (connect(fileDescriptor, (struct sockaddr *)&serverAddressInfo, sizeof(serverAddressInfo)) == -1)
+    {
+        close(fileDescriptor);
+        return -1;
+    }
+
+    return fileDescriptor;
+}
+
+int connect_to_server()
+{
+    if (unixSocketPath != NULL)
+        return connect_to_unix_server();
+
+    struct hostent *hostEntity = gethostbyname(hostName);
+    if (hostEntity == NULL)
+        return -1;
+
+    int fileDescriptor = socket(AF_INET, SOCK_STREAM, 0);
+    if (fileDescriptor == -1)
+        return -1;
+
+    struct sockaddr_in serverAddressInfo;
+    memset(&serverAddressInfo, 0, sizeof(serverAddressInfo));
+    serverAddressInfo.sin_family = AF_INET;
+    serverAddressInfo.sin_port = htons(port);
+    serverAddressInfo.sin_addr = *((struct in_addr *)hostEntity->h_addr_list[0]);
+    if (connect(fileDescriptor, (struct sockaddr *)&serverAddressInfo, sizeof(serverAddressInfo)) == -1)
+    {
+        close(fileDescriptor);
+        return -1;
+    }
+
+    return fileDescriptor;
+}
+
+//--------------------------------------------------------------------------------------------
+// Playing games related
+//--------------------------------------------------------------------------------------------
+void record_round_trip(connection_result_t *result, long long roundTripUs)
+{
+    if (result->numRoundTrips == result->roundTripsAllocated)
+    {
+        result->roundTripsAllocated = result->roundTripsAllocated == 0 ? 256 : result->roundTripsAllocated * 2;
+        result->roundTripsUs = realloc(result->roundTripsUs, result->roundTripsAllocated * sizeof(long long));
+        if (result->roundTripsUs == NULL)
+        {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(1);
+        }
+    }
+    result->roundTripsUs[result->numRoundTrips++] = roundTripUs;
+}
+
+bool play_game(int fileDescriptor, char *buffer, connection_result_t *result)
+{
+    // Same exchange as the interactive client: the selection, then a game state for every guess until it's over
+    if (!send_message(fileDescriptor, "1"))
+        return false;
+
+    int guessNum = 0;
+    long long sentAtUs = 0;
+    while (true)
+    {
+        char *message = receive_message(fileDescriptor, buffer);
+        if (message == NULL)
+            return false;
+        if (sentAtUs != 0)
+            record_round_trip(result, now_us() - sentAtUs);
+
+        // The status is the last field of "guessed|guesses left|word|status"
+        char *gameStatusIndicator = strrchr(message, '|');
+        if (gameStatusIndicator == NULL)
+            return false;
+        if (gameStatusIndicator[1] != 'O')
+        {
+            result->gamesPlayed++;
+            if (gameStatusIndicator[1] == 'W')
+                result->gamesWon++;
+            return true;
+        }
+
+        char guess[2] = {GUESS_ORDER[guessNum++ % 26], '\0'};
+        sentAtUs = now_us();
+        if (!send_message(fileDescriptor, guess))
+            return false;
+    }
+}
+
+bool run_legacy_session(int fileDescriptor, connection_result_t *result)
+{
+    char buffer[MAX_MESSAGE_LENGTH];
+
+    // Username prompt, username, password prompt, password, result
+    if (receive_message(fileDescriptor, buffer) == NULL || !send_message(fileDescriptor, username))
+        return false;
+    if (receive_message(fileDescriptor, buffer) == NULL || !send_message(fileDescriptor, password))
+        return false;
+    if (receive_message(fileDescriptor, buffer) == NULL || strcmp(buffer, "true") != 0)
+        return false;
+
+    for (int i = 0; i < gamesPerConnection; i++)
+    {
+        if (!play_game(fileDescriptor, buffer, result))
+            return false;
+    }
+
+    return send_message(fileDescriptor, "3");
+}
+
+bool run_compact_session(int fileDescriptor, connection_result_t *result)
+{
+    // Log in and start the first games in one go without waiting for the prompt. After that, every round sends the
+    // next guess for each game still going (and PLAY for any that finished) in one write, then reads all the replies.
+    line_reader_t *reader = calloc(1, sizeof(line_reader_t));
+    int *guessNums = calloc(gamesPerConnection + 1, sizeof(int)); // Indexed by game ID, which counts up from 1
+    char *batch = malloc(gamesAtOnce * MAX_LINE_LENGTH);
+    if (reader == NULL || guessNums == NULL || batch == NULL)
+    {
+        free(reader);
+        free(guessNums);
+        free(batch);
+        return false;
+    }
+    reader->skipBytes = sizeof(LOGIN_PROMPT) - 1;
+
+    int numStarted = gamesAtOnce < gamesPerConnection ? gamesAtOnce : gamesPerConnection;
+    snprintf(batch, MAX_LINE_LENGTH, COMMAND_LOGIN " %s %s " COMMAND_PLAY " %d\n", username, password, numStarted);
+    bool succeeded = send_message(fileDescriptor, batch);
+    char *line = succeeded ? receive_line(fileDescriptor, reader) : NULL;
+    succeeded = line != NULL && strncmp(line, REPLY_OK, strlen(REPLY_OK)) == 0; // Followed by the session token
+
+    int numBatched = 0;
+    int numInBatch = 0;
+    int numOutstanding = numStarted;
+    long long sentAtUs = 0;
+    while (succeeded && numOutstanding > 0)
+    {
+        // Each reply is "STATE <game ID> guessed|guesses left|word|status", after "RESULTS ..." for several letters
+        line = receive_line(fileDescriptor, reader);
+        if (line != NULL && strncmp(line, REPLY_RESULTS " ", strlen(REPLY_RESULTS) + 1) == 0)
+            continue;
+        if (line == NULL || strncmp(line, REPLY_STATE " ", strlen(REPLY_STATE) + 1) != 0)
+        {
+            succeeded = false;
+            break;
+        }
+        int gameId = atoi(line + strlen(REPLY_STATE) + 1);
+        char *gameStatusIndicator = strrchr(line, '|');
+        if (gameId <= 0 || gameId > gamesPerConnection || gameStatusIndicator == NULL)
+        {
+            succeeded = false;
+            break;
+        }
+
+        if (gameStatusIndicator[1] != 'O')
+        {
+            result->gamesPlayed++;
+            if (gameStatusIndicator[1] == 'W')
+                result->gamesWon++;
+            if (numStarted < gamesPerConnection)
+            {
+                numBatched += sprintf(batch + numBatched, COMMAND_PLAY "\n");
+                numInBatch++;
+                numStarted++;
+            }
+        }
+        else
+        {
+            numBatched += sprintf(batch + numBatched, COMMAND_GUESS " %d ", gameId);
+            for (int i = 0; i < lettersPerGuess; i++)
+                batch[numBatched++] = GUESS_ORDER[guessNums[gameId]++ % 26];
+            batch[numBatched++] = '\n';
+            batch[numBatched] = '\0';
+            numInBatch++;
+        }
+
+        // Once every reply from the last round is in, send the next round
+        if (--numOutstanding == 0 && numBatched > 0)
+        {
+            long long nowUs = now_us();
+            if (sentAtUs != 0)
+                record_round_trip(result, nowUs - sentAtUs);
+            sentAtUs = nowUs;
+
+            succeeded = send_message(fileDescriptor, batch);
+            numOutstanding = numInBatch;
+            numBatched = 0;
+            numInBatch = 0;
+        }
+    }
+
+    if (succeeded)
+        succeeded = send_message(fileDescriptor, COMMAND_QUIT "\n");
+    free(reader);
+    free(guessNums);
+    free(batch);
+    return succeeded;
+}
+
+void *run_connection(void *data)
+{
+    connection_result_t *result = data;
+
+    int fileDescriptor = connect_to_server();
+    if (fileDescriptor == -1)
+    {
+        perror("connect");
+        result->failed = true;
+        return NULL;
+    }
+
+    if (compactProtocol)
+        result->failed = !run_compact_session(fileDescriptor, result);
+    else
+        result->failed = !run_legacy_session(fileDescriptor, result);
+    close(fileDescriptor);
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------------
+// Reporting related
+//--------------------------------------------------------------------------------------------
+int compare_long_longs(const void *first, const void *second)
+{
+    long long a = *(const long long *)first;
+    long long b = *(const long long *)second;
+    return (a > b) - (a < b);
+}
+
+long long percentile(long long *sortedValues, int numValues, double fraction)
+{
+    if (numValues == 0)
+        return 0;
+    int index = (int)(fraction * (numValues - 1));
+    return sortedValues[index];
+}
+
+void report_results(connection_result_t *results, double elapsedSeconds)
+{
+    int numFailed = 0;
+    int totalGames = 0;
+    int totalWon = 0;
+    int totalRoundTrips = 0;
+    for (int i = 0; i < numConnections; i++)
+    {
+        numFailed += results[i].failed ? 1 : 0;
+        totalGames += results[i].gamesPlayed;
+        totalWon += results[i].gamesWon;
+        totalRoundTrips += results[i].numRoundTrips;
+    }
+
+    // Merge everyone's round trips so we can get percentiles across the whole run
+    long long *allRoundTrips = malloc((totalRoundTrips + 1) * sizeof(long long));
+    int numMerged = 0;
+    for (int i = 0; i < numConnections; i++)
+    {
+        memcpy(allRoundTrips + numMerged, results[i].roundTripsUs, results[i].numRoundTrips * sizeof(long long));
+        numMerged += results[i].numRoundTrips;
+    }
+    qsort(allRoundTrips, totalRoundTrips, sizeof(long long), compare_long_longs);
+
+    printf("connections %d\n", numConnections);
+    printf("failed_connections %d\n", numFailed);
+    printf("games %d\n", totalGames);
+    printf("games_won %d\n", totalWon);
+    printf("seconds %.3f\n", elapsedSeconds);
+    printf("games_per_second %.1f\n", elapsedSeconds > 0 ? totalGames / elapsedSeconds : 0.0);
+    printf("round_trip_us.p50 %lld\n", percentile(allRoundTrips, totalRoundTrips, 0.50));
+    printf("round_trip_us.p90 %lld\n", percentile(allRoundTrips, totalRoundTrips, 0.90));
+    printf("round_trip_us.p99 %lld\n", percentile(allRoundTrips, totalRoundTrips, 0.99));
+    printf("round_trip_us.max %lld\n", percentile(allRoundTrips, totalRoundTrips, 1.0));
+
+    free(allRoundTrips);
+}
+
+//--------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------
+void print_usage()
+{
+    fprintf(stderr, "usage: loadgen [options] host port\n");
+    fprintf(stderr, "       loadgen [options] -u socket path\n");
+    fprintf(stderr, "  -c <num>   number of concurrent connections (default %d)\n", DEFAULT_CONNECTIONS);
+    fprintf(stderr, "  -g <num>   games to play on each connection (default %d)\n", DEFAULT_GAMES);
+    fprintf(stderr, "  -U <name>  username to log in with (default %s)\n", username);
+    fprintf(stderr, "  -P <pass>  password to log in with (default %s)\n", password);
+    fprintf(stderr, "  -u <path>  connect over the server's UNIX domain socket instead of TCP\n");
+    fprintf(stderr, "  -G <num>   with -m compact, games to play at the same time on each connection (default 1)\n");
+    fprintf(stderr, "  -L <num>   with -m compact, letters to send in each guess (default 1)\n");
+    fprintf(stderr, "  -m <mode>  legacy (interactive prompts) or compact (line protocol) (default legacy)\n");
+}
+
+int main(int argc, char **argv)
+{
+    int option;
+    while ((option = getopt(argc, argv, "c:g:G:L:U:P:u:m:")) != -1)
+    {
+        switch (option)
+        {
+            case 'c': numConnections = atoi(optarg); break;
+            case 'g': gamesPerConnection = atoi(optarg); break;
+            case 'G': gamesAtOnce = atoi(optarg); break;
+            case 'L': lettersPerGuess = atoi(optarg); break;
+            case 'U': username = optarg; break;
+            case 'P': password = optarg; break;
+            case 'u': unixSocketPath = optarg; break;
+            case 'm':
+                if (strcmp(optarg, "compact") == 0)
+                    compactProtocol = true;
+                else if (strcmp(optarg, "legacy") != 0)
+                {
+                    print_usage();
+                    exit(1);
+                }
+                break;
+            default:
+                print_usage();
+                exit(1);
+        }
+    }
+
+    int numPositional = unixSocketPath != NULL ? 0 : 2;
+    if (argc - optind != numPositional || numConnections <= 0 || gamesPerConnection <= 0
+        || gamesAtOnce <= 0 || gamesAtOnce > MAX_GAMES_PER_CONNECTION || lettersPerGuess <= 0 || lettersPerGuess > 26)
+    {
+        print_usage();
+        exit(1);
+    }
+    if (unixSocketPath == NULL)
+    {
+        hostName = argv[optind];
+        port = atoi(argv[optind + 1]);
+        if (port <= 0)
+        {
+            fprintf(stderr, "Please specify a valid port number\n");
+            exit(1);
+        }
+    }
+
+    connection_result_t *results = calloc(numConnections, sizeof(connection_result_t));
+    if (results == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(1);
+    }
+
+    // Start every connection at once and time how long it takes them all to finish
+    long long startUs = now_us();
+    for (int i = 0; i < numConnections; i++)
+    {
+        results[i].connectionId = i;
+        if (pthread_create(&results[i].thread, NULL, run_connection, &results[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < numConnections; i++)
+        pthread_join(results[i].thread, NULL);
+    double elapsedSeconds = (now_us() - startUs) / 1000000.0;
+
+    report_results(results, elapsedSeconds);
+
+    for (int i = 0; i < numConnections; i++)
+        free(results[i].roundTripsUs);
+    free(results);
+    return 0;
+}
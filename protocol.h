@@ -0,0 +1,94 @@
+#ifndef HANGMAN_PROTOCOL_H
+#define HANGMAN_PROTOCOL_H
+
+//--------------------------------------------------------------------------------------------
+// Things the server and its clients need to agree on
+//--------------------------------------------------------------------------------------------
+// Every connection starts with the server sending LOGIN_PROMPT.
+//
+// Legacy clients answer it interactively: username, PASSWORD_PROMPT, password, "true"/"false", then
+// menu selections and single letter guesses, one unframed message per round trip.
+//
+// Compact clients don't wait for the prompt. Straight after connecting they send a LOGIN line and skip
+// over the prompt when it arrives. From then on every message in both directions is a single line ending
+// in '\n', so clients can send several commands without waiting for each reply:
+//
+//   LOGIN <username> <password> [action]           ->  OK <session token>, or ERR and the connection is closed.
+//                                                      If an action (any command below) was given its reply follows the OK.
+//   RESUME <session token>                         ->  OK <new session token>, followed by STATE for every game that was
+//                                                      in progress, or ERR if the session has expired. Sent instead of
+//                                                      LOGIN after a dropped connection. Each token works once.
+//   PLAY [count]                                   ->  STATE <game ID> <guessed letters>|<guesses left>|<word>|<O/W/L>
+//                                                      for each new game. A connection can have MAX_GAMES_PER_CONNECTION
+//                                                      games going at once.
+//   GUESS [game ID] <letters>                      ->  STATE <game ID> ... Without a game ID the guess goes to the game
+//                                                      started most recently. Several letters are guessed in order until
+//                                                      the game is over, and the STATE is preceded by
+//                                                      RESULTS <game ID> <'+' hit, '-' miss or '.' not needed, per letter>
+//   WORD [game ID] <object type> <object name>     ->  RESULTS <game ID> <+ or ->, then STATE. Costs a single guess.
+//   BOARD                                          ->  BOARD <rows> <version>, then <username>|<games won>|<games played>
+//                                                      per row. The version goes up with every change, and is
+//                                                      the same whichever of a server's worker processes is asked.
+//   BOARD SINCE <version>                          ->  NOTMODIFIED <version> if nothing's changed, otherwise
+//                                                      DELTA <since> <version> <rows> and a row for each user whose
+//                                                      results have changed. Rows are never removed.
+//   BOARD TOP                                      ->  TOP <rows>, then a row per player as for BOARD, best first. Only the
+//                                                      best few players are sent (10 unless the server's been told otherwise).
+//   BOARD HOUR|DAY|WEEK                            ->  WINDOW <name> <rows>, then <username>|<games won>|<games played>
+//                                                      for the best WINDOW_TOP_K players over the last hour, day or week.
+//                                                      Summaries are rebuilt about once a second.
+//   EXPORT CSV|JSON                                ->  EXPORT <format> <version> <bytes>, then exactly that many bytes holding
+//                                                      every row of the leaderboard, best first, with games won, games
+//                                                      played and percentage won. CSV has a header row, JSON is an array.
+//   QUIT                                           ->  BYE
+//
+// Spectators and dashboards send these instead of LOGIN, and don't need an account (BOARD and EXPORT work here too):
+//
+//   SUBSCRIBE [version]                            ->  NOTMODIFIED or DELTA as for BOARD SINCE (everything by default),
+//                                                      then a DELTA is pushed after every change. Subscribers that fall
+//                                                      too far behind are disconnected rather than miss a change.
+//   LIVE                                           ->  LIVE <rows>, then <live ID>|<username> per game being played
+//   WATCH <live ID>                                ->  OK, then FRAME <live ID> <guessed letters>|<guesses left>|<word>|<O/W/L>
+//                                                      every time the game changes. The connection is closed after the
+//                                                      game ends. Spectators that fall behind skip straight to newer frames.
+//
+// Replies come back in the same order as the commands, so a client can keep guesses for all its games in flight at once.
+// Anything the server can't make sense of is answered with ERR <reason>.
+// A server limiting how fast one address can connect or send may answer a new connection with ERR instead of the
+// prompt, or a command with ERR, and then close the connection. A compact client's session can still be resumed.
+#define LOGIN_PROMPT "\nPlease enter your username: "
+#define PASSWORD_PROMPT "Please enter your password: "
+#define MAX_LINE_LENGTH 1024
+#define SESSION_TOKEN_LENGTH 32 // Hex digits
+#define MAX_GAMES_PER_CONNECTION 64
+#define WINDOW_TOP_K 10
+
+#define COMMAND_LOGIN "LOGIN"
+#define COMMAND_RESUME "RESUME"
+#define COMMAND_PLAY "PLAY"
+#define COMMAND_GUESS "GUESS"
+#define COMMAND_WORD "WORD"
+#define COMMAND_BOARD "BOARD"
+#define BOARD_SINCE "SINCE"
+#define BOARD_TOP "TOP"
+#define COMMAND_SUBSCRIBE "SUBSCRIBE"
+#define COMMAND_QUIT "QUIT"
+#define COMMAND_LIVE "LIVE"
+#define COMMAND_WATCH "WATCH"
+#define COMMAND_EXPORT "EXPORT"
+
+#define REPLY_OK "OK"
+#define REPLY_ERROR "ERR"
+#define REPLY_STATE "STATE"
+#define REPLY_RESULTS "RESULTS"
+#define REPLY_BOARD "BOARD"
+#define REPLY_NOT_MODIFIED "NOTMODIFIED"
+#define REPLY_DELTA "DELTA"
+#define REPLY_BYE "BYE"
+#define REPLY_LIVE "LIVE"
+#define REPLY_FRAME "FRAME"
+#define REPLY_WINDOW "WINDOW"
+#define REPLY_TOP "TOP"
+#define REPLY_EXPORT "EXPORT"
+
+#endif
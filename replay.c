@@ -0,0 +1,574 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+//--------------------------------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------------------------------
+#define RECEIVE_BUFFER_LENGTH 65536
+#define STALL_TIMEOUT_US 5000000LL // Give up waiting on a reply that's never coming after this long
+#define MAX_POLL_WAIT_MS 100
+
+//--------------------------------------------------------------------------------------------
+// Global variables
+//--------------------------------------------------------------------------------------------
+char *hostName;
+int port;
+char *unixSocketPath = NULL; // Connect over a UNIX domain socket instead of TCP when set
+double speed = 1.0;          // 2 replays twice as fast as it was captured, 0 as fast as the server replies
+bool strictOrder = false;    // Replay every event in the order it was captured, across all connections
+char *dumpFileName = NULL;   // Where to write everything the server sent, to compare runs
+
+// One captured event, with the data that came with it
+typedef struct ReplayRecordStruct
+{
+    trace_record_t header;
+    char *data;
+    int nextInConnection; // The connection's next record, or -1
+} replay_record_t;
+replay_record_t *records = NULL;
+int numRecords = 0;
+
+// Define a struct to hold what's going on with each captured connection
+typedef struct ReplayConnectionStruct
+{
+    int fileDescriptor;               // -1 before it's opened and after it's closed
+    bool serverClosed;                // The server hung up on us
+    int nextRecord;                   // The next of this connection's records to replay, or -1 once they're all done
+    unsigned long long bytesReceived;
+    unsigned long long awaitingBytes; // A reply's complete once this much has come back
+    long long sentAtUs;               // When the message being replied to went out, 0 if we aren't waiting on one
+    char *received;                   // Everything the server sent, when dumping
+    size_t receivedAllocated;
+} replay_connection_t;
+replay_connection_t *connections = NULL;
+int numConnections = 0;
+unsigned long firstConnection = 0;
+
+// What we measured
+long long *replyTimesUs = NULL;
+int numReplies = 0;
+int repliesAllocated = 0;
+int numMessages = 0;
+int numClosedEarly = 0;
+int numStalls = 0;
+int numConnectFailures = 0;
+
+//--------------------------------------------------------------------------------------------
+// Time related
+//--------------------------------------------------------------------------------------------
+long long now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+//--------------------------------------------------------------------------------------------
+// Custom malloc and realloc functions to ensure we handle errors properly
+//--------------------------------------------------------------------------------------------
+void *custom_realloc(void *pointer, size_t size)
+{
+    void *allocatedPointer = realloc(pointer, size);
+    if (allocatedPointer == NULL && size > 0)
+    {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(1);
+    }
+    return allocatedPointer;
+}
+
+//--------------------------------------------------------------------------------------------
+// Reading the capture related
+//--------------------------------------------------------------------------------------------
+void read_trace(char *fileName)
+{
+    FILE *fp = fopen(fileName, "rb");
+    if (fp == NULL)
+    {
+        perror(fileName);
+        exit(1);
+    }
+
+    char magic[TRACE_MAGIC_LENGTH];
+    if (fread(magic, TRACE_MAGIC_LENGTH, 1, fp) != 1 || memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LENGTH) != 0)
+    {
+        fprintf(stderr, "%s isn't a hangman capture\n", fileName);
+        exit(1);
+    }
+
+    // A capture cut short by the server being killed just ends part way through a record, so stop at the last whole one
+    int recordsAllocated = 0;
+    trace_record_t header;
+    while (fread(&header, sizeof(header), 1, fp) == 1)
+    {
+        char *data = NULL;
+        if (header.length > 0)
+        {
+            data = custom_realloc(NULL, header.length);
+            if (fread(data, header.length, 1, fp) != 1)
+            {
+                free(data);
+                break;
+            }
+        }
+
+        if (numRecords == recordsAllocated)
+        {
+            recordsAllocated = recordsAllocated == 0 ? 1024 : recordsAllocated * 2;
+            records = custom_realloc(records, recordsAllocated * sizeof(replay_record_t));
+        }
+        records[numRecords].header = header;
+        records[numRecords].data = data;
+        records[numRecords].nextInConnection = -1;
+        numRecords++;
+    }
+    fclose(fp);
+
+    if (numRecords == 0)
+    {
+        fprintf(stderr, "%s has nothing to replay\n", fileName);
+        exit(1);
+    }
+
+    // Captures can start part way through a server's life, so connection numbers don't have to start at 1
+    unsigned long lastConnection = records[0].header.connection;
+    firstConnection = records[0].header.connection;
+    for (int i = 0; i < numRecords; i++)
+    {
+        if (records[i].header.connection < firstConnection)
+            firstConnection = records[i].header.connection;
+        if (records[i].header.connection > lastConnection)
+            lastConnection = records[i].header.connection;
+    }
+    numConnections = lastConnection - firstConnection + 1;
+    connections = custom_realloc(NULL, numConnections * sizeof(replay_connection_t));
+    memset(connections, 0, numConnections * sizeof(replay_connection_t));
+    for (int i = 0; i < numConnections; i++)
+    {
+        connections[i].fileDescriptor = -1;
+        connections[i].nextRecord = -1;
+    }
+
+    // Chain each connection's records together, going backwards so each chain starts at its first record
+    for (int i = numRecords - 1; i >= 0; i--)
+    {
+        replay_connection_t *connection = &connections[records[i].header.connection - firstConnection];
+        records[i].nextInConnection = connection->nextRecord;
+        connection->nextRecord = i;
+    }
+}
+
+//--------------------------------------------------------------------------------------------
+// Connecting related
+//--------------------------------------------------------------------------------------------
+int connect_to_unix_server()
+{
+    struct sockaddr_un serverAddressInfo;
+    memset(&serverAddressInfo, 0, sizeof(serverAddressInfo));
+    serverAddressInfo.sun_family = AF_UNIX;
+    strncpy(serverAddressInfo.sun_path, unixSocketPath, sizeof(serverAddressInfo.sun_path) - 1);
+
+    int fileDescriptor = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fileDescriptor == -1)
+        return -1;
+    if (connect(fileDescriptor, (struct sockaddr *)&serverAddressInfo, sizeof(serverAddressInfo)) == -1)
+    {
+        close(fileDescriptor);
+        return -1;
+    }
+
+    return fileDescriptor;
+}
+
+int connect_to_server()
+{
+    if (unixSocketPath != NULL)
+        return connect_to_unix_server();
+
+    struct hostent *hostEntity = gethostbyname(hostName);
+    if (hostEntity == NULL)
+        return -1;
+
+    int fileDescriptor = socket(AF_INET, SOCK_STREAM, 0);
+    if (fileDescriptor == -1)
+        return -1;
+
+    struct sockaddr_in serverAddressInfo;
+    memset(&serverAddressInfo, 0, sizeof(serverAddressInfo));
+    serverAddressInfo.sin_family = AF_INET;
+    serverAddressInfo.sin_port = htons(port);
+    serverAddressInfo.sin_addr = *((struct in_addr *)hostEntity->h_addr_list[0]);
+    if (connect(fileDescriptor, (struct sockaddr *)&serverAddressInfo, sizeof(serverAddressInfo)) == -1)
+    {
+        close(fileDescriptor);
+        return -1;
+    }
+
+    return fileDescriptor;
+}
+
+//--------------------------------------------------------------------------------------------
+// Replaying related
+//--------------------------------------------------------------------------------------------
+void record_reply_time(long long replyTimeUs)
+{
+    if (numReplies == repliesAllocated)
+    {
+        repliesAllocated = repliesAllocated == 0 ? 1024 : repliesAllocated * 2;
+        replyTimesUs = custom_realloc(replyTimesUs, repliesAllocated * sizeof(long long));
+    }
+    replyTimesUs[numReplies++] = replyTimeUs;
+}
+
+replay_connection_t *connection_of(replay_record_t *record)
+{
+    return &connections[record->header.connection - firstConnection];
+}
+
+bool is_record_due(replay_record_t *record, long long startUs, long long nowUs, bool ignoreReplies)
+{
+    // A record can go once its time has come (scaled by the speed) and the server has sent everything it had
+    // by then, which is what the captured client would have been reacting to
+    if (speed > 0 && startUs + (long long)(record->header.timeUs / speed) > nowUs)
+        return false;
+    replay_connection_t *connection = connection_of(record);
+    return ignoreReplies || connection->serverClosed || connection->bytesReceived >= record->header.bytesSent;
+}
+
+bool is_connection_caught_up(replay_connection_t *connection)
+{
+    // Whether the connection has had every reply it's going to get before its next record
+    if (connection->fileDescriptor == -1 || connection->nextRecord == -1)
+        return true;
+    return connection->bytesReceived >= records[connection->nextRecord].header.bytesSent;
+}
+
+void close_connection(replay_connection_t *connection)
+{
+    if (connection->fileDescriptor != -1)
+        close(connection->fileDescriptor);
+    connection->fileDescriptor = -1;
+}
+
+void replay_record(int recordIndex, long long nowUs)
+{
+    replay_record_t *record = &records[recordIndex];
+    replay_connection_t *connection = connection_of(record);
+    connection->nextRecord = record->nextInConnection;
+
+    if (record->header.event == TRACE_OPENED)
+    {
+        connection->fileDescriptor = connect_to_server();
+        if (connection->fileDescriptor == -1)
+        {
+            numConnectFailures++;
+            connection->serverClosed = true;
+        }
+    }
+    else if (record->header.event == TRACE_RECEIVED)
+    {
+        if (connection->fileDescriptor == -1)
+        {
+            if (!connection->serverClosed)
+                numClosedEarly++;
+            return;
+        }
+
+        // Send the bytes exactly as the server received them. A short send just means the socket buffer's full.
+        size_t numSent = 0;
+        while (numSent < record->header.length)
+        {
+            ssize_t result = send(connection->fileDescriptor, record->data + numSent, record->header.length - numSent, MSG_NOSIGNAL);
+            if (result == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                numClosedEarly++;
+                close_connection(connection);
+                connection->serverClosed = true;
+                return;
+            }
+            numSent += result;
+        }
+        numMessages++;
+
+        // Time how long until the server's sent as much as it had by the connection's next event
+        if (record->nextInConnection != -1 && records[record->nextInConnection].header.bytesSent > connection->bytesReceived)
+        {
+            if (connection->sentAtUs == 0)
+                connection->sentAtUs = nowUs;
+            connection->awaitingBytes = records[record->nextInConnection].header.bytesSent;
+        }
+    }
+    else if (record->header.event == TRACE_CLOSED)
+    {
+        close_connection(connection);
+    }
+}
+
+void receive_from_connection(replay_connection_t *connection, long long nowUs)
+{
+    char buffer[RECEIVE_BUFFER_LENGTH];
+    ssize_t numBytes = recv(connection->fileDescriptor, buffer, sizeof(buffer), 0);
+    if (numBytes <= 0)
+    {
+        if (numBytes == -1 && errno == EINTR)
+            return;
+        close_connection(connection);
+        connection->serverClosed = true;
+        return;
+    }
+
+    if (dumpFileName != NULL)
+    {
+        if (connection->bytesReceived + numBytes > connection->receivedAllocated)
+        {
+            connection->receivedAllocated = 2 * (connection->bytesReceived + numBytes);
+            connection->received = custom_realloc(connection->received, connection->receivedAllocated);
+        }
+        memcpy(connection->received + connection->bytesReceived, buffer, numBytes);
+    }
+    connection->bytesReceived += numBytes;
+
+    if (connection->sentAtUs != 0 && connection->bytesReceived >= connection->awaitingBytes)
+    {
+        record_reply_time(nowUs - connection->sentAtUs);
+        connection->sentAtUs = 0;
+    }
+}
+
+int find_next_due_record(long long startUs, long long nowUs, int strictCursor, bool ignoreReplies)
+{
+    // With strict ordering only the next record in the capture can go, and only once every other connection has
+    // caught up, so everything reaches the server in the order it was captured. Otherwise each connection goes at its own pace.
+    if (strictOrder)
+    {
+        if (strictCursor >= numRecords || !is_record_due(&records[strictCursor], startUs, nowUs, ignoreReplies))
+            return -1;
+        for (int i = 0; i < numConnections && !ignoreReplies; i++)
+        {
+            if (&connections[i] != connection_of(&records[strictCursor]) && !connections[i].serverClosed && !is_connection_caught_up(&connections[i]))
+                return -1;
+        }
+        return strictCursor;
+    }
+
+    for (int i = 0; i < numConnections; i++)
+    {
+        int recordIndex = connections[i].nextRecord;
+        if (recordIndex != -1 && is_record_due(&records[recordIndex], startUs, nowUs, ignoreReplies))
+            return recordIndex;
+    }
+    return -1;
+}
+
+long long replay()
+{
+    struct pollfd *pollfileDescriptors = custom_realloc(NULL, numConnections * sizeof(struct pollfd));
+    replay_connection_t **polledConnections = custom_realloc(NULL, numConnections * sizeof(replay_connection_t *));
+    int numReplayed = 0;
+    int strictCursor = 0;
+    long long startUs = now_us();
+    long long lastProgressUs = startUs;
+    while (numReplayed < numRecords)
+    {
+        // Replay everything that's due. If we've been stuck waiting on replies for too long, stop waiting.
+        long long nowUs = now_us();
+        bool stalled = nowUs - lastProgressUs > STALL_TIMEOUT_US;
+        int recordIndex;
+        while ((recordIndex = find_next_due_record(startUs, nowUs, strictCursor, stalled)) != -1)
+        {
+            replay_record(recordIndex, nowUs);
+            numReplayed++;
+            lastProgressUs = nowUs;
+            if (stalled)
+            {
+                numStalls++;
+                stalled = false;
+            }
+            if (strictOrder)
+                strictCursor++;
+        }
+
+        // Wait for the server, but not past when the next record's due
+        int numPolled = 0;
+        for (int i = 0; i < numConnections; i++)
+        {
+            if (connections[i].fileDescriptor == -1)
+                continue;
+            pollfileDescriptors[numPolled].fd = connections[i].fileDescriptor;
+            pollfileDescriptors[numPolled].events = POLLIN;
+            polledConnections[numPolled++] = &connections[i];
+        }
+        int waitMs = MAX_POLL_WAIT_MS;
+        if (speed > 0 && numReplayed < numRecords)
+        {
+            long long nextDueUs = LLONG_MAX;
+            for (int i = 0; i < numConnections; i++)
+            {
+                int nextIndex = strictOrder ? strictCursor : connections[i].nextRecord;
+                if (nextIndex != -1 && nextIndex < numRecords)
+                {
+                    long long dueUs = startUs + (long long)(records[nextIndex].header.timeUs / speed);
+                    if (dueUs < nextDueUs)
+                        nextDueUs = dueUs;
+                }
+            }
+            long long untilDueMs = (nextDueUs - now_us() + 999) / 1000;
+            if (untilDueMs < waitMs)
+                waitMs = untilDueMs > 0 ? untilDueMs : 0;
+        }
+
+        if (poll(pollfileDescriptors, numPolled, waitMs) > 0)
+        {
+            nowUs = now_us();
+            for (int i = 0; i < numPolled; i++)
+            {
+                if (pollfileDescriptors[i].revents & (POLLIN | POLLHUP | POLLERR))
+                {
+                    receive_from_connection(polledConnections[i], nowUs);
+                    lastProgressUs = nowUs;
+                }
+            }
+        }
+    }
+    long long elapsedUs = now_us() - startUs;
+
+    // Anything left open was handed to spectator mode, which never gets a close
+    for (int i = 0; i < numConnections; i++)
+        close_connection(&connections[i]);
+    free(pollfileDescriptors);
+    free(polledConnections);
+    return elapsedUs;
+}
+
+//--------------------------------------------------------------------------------------------
+// Reporting related
+//--------------------------------------------------------------------------------------------
+int compare_long_longs(const void *first, const void *second)
+{
+    long long a = *(const long long *)first;
+    long long b = *(const long long *)second;
+    return (a > b) - (a < b);
+}
+
+long long percentile(long long *sortedValues, int numValues, double fraction)
+{
+    if (numValues == 0)
+        return 0;
+    int index = (int)(fraction * (numValues - 1));
+    return sortedValues[index];
+}
+
+void report_results(long long elapsedUs)
+{
+    qsort(replyTimesUs, numReplies, sizeof(long long), compare_long_longs);
+
+    printf("connections %d\n", numConnections);
+    printf("connect_failures %d\n", numConnectFailures);
+    printf("messages %d\n", numMessages);
+    printf("closed_early %d\n", numClosedEarly);
+    printf("stalls %d\n", numStalls);
+    printf("seconds %.3f\n", elapsedUs / 1000000.0);
+    printf("replies %d\n", numReplies);
+    printf("reply_us.p50 %lld\n", percentile(replyTimesUs, numReplies, 0.50));
+    printf("reply_us.p90 %lld\n", percentile(replyTimesUs, numReplies, 0.90));
+    printf("reply_us.p99 %lld\n", percentile(replyTimesUs, numReplies, 0.99));
+    printf("reply_us.max %lld\n", percentile(replyTimesUs, numReplies, 1.0));
+}
+
+void write_dump()
+{
+    // Everything each connection got back, in connection order, so two replays can be compared with cmp
+    FILE *fp = fopen(dumpFileName, "wb");
+    if (fp == NULL)
+    {
+        perror(dumpFileName);
+        return;
+    }
+    for (int i = 0; i < numConnections; i++)
+    {
+        fprintf(fp, "== connection %lu %llu\n", firstConnection + i, connections[i].bytesReceived);
+        fwrite(connections[i].received, 1, connections[i].bytesReceived, fp);
+        fputc('\n', fp);
+    }
+    fclose(fp);
+}
+
+//--------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------
+void print_usage()
+{
+    fprintf(stderr, "usage: replay [options] capture host port\n");
+    fprintf(stderr, "       replay [options] -u socket path capture\n");
+    fprintf(stderr, "  -s <speed> how much faster than it was captured to replay, 0 for as fast as the server replies (default 1)\n");
+    fprintf(stderr, "  -S         replay events in exactly the order they were captured, across all connections\n");
+    fprintf(stderr, "  -o <file>  write everything the server sent to this file, to compare runs\n");
+    fprintf(stderr, "  -u <path>  connect over the server's UNIX domain socket instead of TCP\n");
+}
+
+int main(int argc, char **argv)
+{
+    int option;
+    while ((option = getopt(argc, argv, "s:So:u:")) != -1)
+    {
+        switch (option)
+        {
+            case 's': speed = atof(optarg); break;
+            case 'S': strictOrder = true; break;
+            case 'o': dumpFileName = optarg; break;
+            case 'u': unixSocketPath = optarg; break;
+            default:
+                print_usage();
+                exit(1);
+        }
+    }
+
+    int numPositional = unixSocketPath != NULL ? 1 : 3;
+    if (argc - optind != numPositional || speed < 0)
+    {
+        print_usage();
+        exit(1);
+    }
+    if (unixSocketPath == NULL)
+    {
+        hostName = argv[optind + 1];
+        port = atoi(argv[optind + 2]);
+        if (port <= 0)
+        {
+            fprintf(stderr, "Please specify a valid port number\n");
+            exit(1);
+        }
+    }
+
+    read_trace(argv[optind]);
+    long long elapsedUs = replay();
+    report_results(elapsedUs);
+    if (dumpFileName != NULL)
+        write_dump();
+
+    for (int i = 0; i < numRecords; i++)
+        free(records[i].data);
+    for (int i = 0; i < numConnections; i++)
+        free(connections[i].received);
+    free(records);
+    free(connections);
+    free(replyTimesUs);
+    return 0;
+}
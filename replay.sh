@@ -0,0 +1,53 @@
+#!/bin/sh
+# Replays a capture against two server builds and prints their reply latencies side by side, and whether they
+# sent exactly the same bytes. Capture with the same seed for the replies to be comparable, e.g.
+#   ./server -r 42 -c capture.trc         # run some traffic through it, then Ctrl+C
+#   cp server server.old                  # ...rebuild...
+#   ./replay.sh capture.trc ./server.old ./server
+#   SPEED=0 STRICT=1 ./replay.sh capture.trc ./server.old ./server   # as fast as possible, in captured order
+if [ $# -ne 3 ]; then
+    echo "usage: $0 capture old-server new-server" >&2
+    exit 1
+fi
+CAPTURE=$1
+PORT=${PORT:-23450}
+SEED=${SEED:-42}
+SPEED=${SPEED:-1}
+STRICT=${STRICT:-0}
+WORKERS=${WORKERS:-10}
+
+make -s hangman || exit 1
+
+replayOptions="-s $SPEED"
+if [ "$STRICT" = 1 ]; then
+    replayOptions="$replayOptions -S"
+fi
+
+results=""
+dumps=""
+for server in "$2" "$3"; do
+    "$server" -q -r "$SEED" -w "$WORKERS" -W "$WORKERS" "$PORT" > /dev/null 2>&1 &
+    serverPid=$!
+    sleep 0.5
+
+    result=$(mktemp)
+    dump=$(mktemp)
+    ./replay $replayOptions -o "$dump" "$CAPTURE" 127.0.0.1 "$PORT" > "$result"
+    results="$results $result"
+    dumps="$dumps $dump"
+
+    kill -INT "$serverPid"
+    wait "$serverPid"
+    PORT=$((PORT + 1))
+done
+
+set -- $results
+echo "metric old new"
+paste -d' ' "$1" "$2" | awk '{ print $1, $2, $4 }' | grep -E 'reply_us|replies|stalls|closed_early|seconds'
+set -- $dumps
+if cmp -s "$1" "$2"; then
+    echo "replies identical"
+else
+    echo "replies differ"
+fi
+rm -f $results $dumps
@@ -2,39 +2,243 @@
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef HANGMAN_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#include "board_export.h"
+#include "engine.h"
+#include "protocol.h"
+#include "trace.h"
 
 //--------------------------------------------------------------------------------------------
 // Constants
 //--------------------------------------------------------------------------------------------
 #define DEFAULT_PORT 12345
-#define MAX_USERS 10
+#define DEFAULT_MIN_WORKERS 2
+#define DEFAULT_MAX_WORKERS 10
+#define DEFAULT_IDLE_TIMEOUT_MS 30000    // How long a surplus worker may sit idle before it retires
+#define DEFAULT_GROW_WAIT_MS 50          // How long a request may wait in the queue before the pool grows
+#define DEFAULT_STATS_INTERVAL_MS 5000
+#define DEFAULT_PRIORITY_AGING_MS 100    // How long a request waits to be treated as one class more urgent
+#define CLASSIFY_GRACE_MS 20             // How long a client has to send its first message before we assume it's legacy
+#define RECLASSIFY_PEEKS 4               // Unclassified requests that get another look each time a worker takes a request
+#define POOL_MANAGER_INTERVAL_MS 1000
+#define LISTEN_BACKLOG 128
 #define MAX_MESSAGE_LENGTH 100
-#define MAX_NUM_GUESSES 26
+#define URING_PENDING_SENDS 128                      // Reply segments the io_uring backend can hold back for the next receive
+#define MAX_OUTPUT_SEGMENTS 64                       // iovecs in an output buffer before it has to be flushed
+#define OUTPUT_SCRATCH_LENGTH 256                    // Room in an output buffer for formatted numbers and single characters
+#define MAX_OUTPUT_FRAMES 8                          // Frames an output buffer can hold on to until they've been sent
+#define MAX_EPOLL_EVENTS 16
+#define MAX_LISTENERS 2                              // TCP, plus optionally a UNIX domain socket
+#define MAX_ADDRESS_LENGTH 64
+#define SPAN_BUFFER_LENGTH 1024                      // Spans each thread holds on to before writing them out
+#define URING_WORKER_ENTRIES 8
+#define URING_ACCEPT_ENTRIES 64
+#define URING_NUM_BUFFERS 4                          // Provided receive buffers per worker ring
+#define URING_BUFFER_SIZE 1024
+#define LINE_BUFFER_LENGTH (2 * MAX_LINE_LENGTH)      // Buffered input for compact protocol connections
+#define URING_BUFFER_GROUP 0
+#define SPECTATOR_QUEUE_LENGTH 8                     // Frames a spectator can fall behind by before it starts skipping ahead
+#define SPECTATOR_STALL_TIMEOUT_MS 10000             // How long a spectator's socket can stay full before we give up on it
+#define SPECTATOR_CHECK_INTERVAL_MS 1000
+#define MAX_WINDOW_BUCKETS 24                        // Most buckets any leaderboard window is split into
+#define MAX_DETACHED_SESSIONS 256                    // Dropped connections we'll hold on to, oldest goes first when full
+#define DEFAULT_SESSION_LIFETIME_MS 120000           // How long a dropped connection's session can be resumed for
+#define DEFAULT_TOP_LEADERBOARD_SIZE 10              // Rows in the pre-encoded top of the leaderboard
+#define MIN_PROCESS_LIFETIME_MS 1000                 // Worker processes that die sooner than this are restarted after a pause
+#define SHARED_CHANGES_LENGTH 1024                   // Recent shared leaderboard versions a process can catch up on without checking every player
+#define ALL_PLAYERS_CHANGED -1
+#define BOARD_EXPORT_INTERVAL_MS 100                 // Most often the leaderboard export is rewritten
+#define HANDOFF_MESSAGE_LENGTH 65536                 // Biggest message between an older and newer server, a session with every game it can have
+#define HANDOFF_TIMEOUT_MS 5000                      // How long a newer server waits for the older one to hand over its listeners
+#define HANDOFF_CHECK_INTERVAL_MS 100                // How often a server that's handed over checks whether it's drained yet
+#define DEFAULT_DRAIN_TIMEOUT_MS 60000               // How long games get to finish after handing over to a newer server
+#define RATE_LIMIT_SLOTS 4096                        // Addresses the rate limiter keeps track of at once, a power of 2
+#define RATE_LIMIT_PROBES 8                          // Slots an address can be in, the least recently seen goes when they're all taken
+#define RATE_LIMIT_MILLI 1000                        // Buckets hold thousandths of a token, so slow rates still refill every millisecond
+#define NUM_LETTERS 26
+#define WORD_STATS_WRONG_LETTERS 5                   // Letters listed for each word in the word stats, most often guessed wrong first
+#define SEEN_WORD_BLOCKS 4                           // 64 bit blocks in each generation of a player's seen words filter
+#define SEEN_WORD_GENERATIONS 2
+#define SEEN_WORD_GENERATION_SIZE 32                 // Words that go into a generation before the older one is cleared
+#define SEEN_WORD_HASHES 3                           // Bits each word sets in a generation
+#define WORD_PICK_ATTEMPTS 8                         // Random words tried for one that suits the player before settling
+#define DIFFICULTY_MIN_GAMES 10                      // Games a player and a word each need before difficulty is matched
+#define DIFFICULTY_TOLERANCE 0.15                    // How far a word's win rate can be from the one the player needs
 #define NO_CONNECTION -1
 
 //--------------------------------------------------------------------------------------------
 // Global variables
 //--------------------------------------------------------------------------------------------
-int serverfileDescriptor;
-pthread_t threads[MAX_USERS];                                           // The thread pool
+int serverfileDescriptor;                                               // The TCP listening socket
+int listenerfileDescriptors[MAX_LISTENERS];                             // Every listening socket, TCP first
+int numListeners = 0;
+char *unixSocketPath = NULL;                                            // Where to listen for co-located clients, if anywhere
 pthread_mutex_t requestMutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;  // RECURSIVE mutex, since a handler thread might try to lock it twice consecutively.
 pthread_mutex_t screenMutex = PTHREAD_MUTEX_INITIALIZER;                // Mutex to stop multiple threads writing to the screen at once
-pthread_cond_t gotRequestThreadCond = PTHREAD_COND_INITIALIZER;         // Global condition variable
-char messageBuffers[MAX_USERS][MAX_MESSAGE_LENGTH];                     // Buffer for each thread
-int clientConnections[MAX_USERS];
-char *hangmanWordsInUse[MAX_USERS];
-char *clientWordsInUse[MAX_USERS];
+pthread_cond_t gotRequestThreadCond;                                    // Global condition variable, initialised in main() to use CLOCK_MONOTONIC
+pthread_cond_t poolManagerCond;                                         // Wakes the pool manager early, e.g. when requests start queueing
+volatile sig_atomic_t serverClosing = 0;                                // Set by the SIGINT handler, main() performs the actual shutdown
+volatile sig_atomic_t statsRequested = 0;                               // Set by the SIGUSR1 handler, the pool manager dumps the stats
+bool quietMode = false;                                                 // Skip the per-message logging, e.g. when benchmarking
+FILE *captureFile = NULL;                                               // Where to record what clients send, if anywhere
+pthread_mutex_t captureMutex = PTHREAD_MUTEX_INITIALIZER;               // Records go in one at a time, in time order
+long long captureStartUs;
+atomic_ulong connectionsAccepted;                                       // Bumped by the accepting thread, and for connections handed over to us
+bool seededWords = false;                                               // Pick words (and session tokens) from wordSeed, so replays repeat exactly
+unsigned long long wordSeed;
+FILE *spanTraceFile = NULL;                                             // Chrome trace of where the time goes, if asked for
+bool tracingSpans = false;
+pthread_mutex_t spanTraceMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Counters that are bumped from every thread without taking a lock
+atomic_ulong ioSyscalls;  // Every syscall made by the socket layer, to compare the I/O backends
+atomic_ulong gamesPlayed;
+
+// How every word and category has played, for tuning the words. The arrays run parallel to hangmanWords and the
+// categories, and are only ever bumped with relaxed atomics, so finishing a game doesn't take a lock.
+typedef struct WordStatsStruct
+{
+    atomic_uint plays;
+    atomic_uint wins;
+    atomic_uint guessesLeft;               // Summed over every game, won or lost
+    atomic_uint wrongLetters[NUM_LETTERS]; // Times each letter was guessed and wasn't in the word
+} word_stats_t;
+word_stats_t *wordStats = NULL;
+word_stats_t *categoryStats = NULL;
+bool wordStatsShared = false;           // Mapped so every worker process shares them, rather than allocated
+int *wordCategories;                    // Each word's category
+int *categoryFirstWords;                // The first word in each category, which is where its name comes from
+int numCategories = 0;
+char *wordStatsFileName = NULL;         // Where to write the word stats as CSV, if anywhere
+unsigned long wordStatsDumps = 0;
+
+// What each player's played lately, so they aren't given the same words over and over. Each player gets a fixed
+// size Bloom filter split into two generations: words go into the newer one, and once it's full the older one is
+// cleared to take its place. Kept parallel to the users array, and only touched with relaxed atomics, as the same
+// player can be playing on several connections at once.
+typedef struct PlayerWordsStruct
+{
+    _Atomic uint64_t seen[SEEN_WORD_GENERATIONS][SEEN_WORD_BLOCKS];
+    atomic_uint numSeen;                    // Words ever added, which says which generation is the newer one
+    atomic_uint gamesWon;                   // The player's record for matching difficulty, since this server started
+    atomic_uint gamesPlayed;
+} player_words_t;
+player_words_t *playerWords = NULL;
+bool playerWordsShared = false;
+bool freshWords = true;                 // Avoid the words a player's seen lately
+bool matchDifficulty = false;           // Pick words about as hard as the player needs
+atomic_ulong wordPicks;                 // Picks for a logged in player, the only ones that look at the filters
+atomic_ulong wordPickAttempts;
+atomic_ulong wordPicksUnmatched;        // Settled for a word that wasn't the right difficulty
+atomic_ulong wordPicksRepeated;         // Every word tried had been seen lately
+
+// Define the different ways the server can drive its sockets
+typedef enum IoBackendEnum
+{
+    IO_BACKEND_BLOCKING,     // One blocking accept()/send()/recv() per operation
+    IO_BACKEND_URING         // Multishot accept, linked send+recv submissions and provided receive buffers
+} io_backend_t;
+io_backend_t ioBackend = IO_BACKEND_BLOCKING;
+char *ioBackendNames[] = {"blocking", "uring"};
+
+// Define a struct to represent a game of Hangman in progress
+struct LiveGameStruct;
+
+typedef struct GameStruct
+{
+    bool active;
+    int gameId;                                  // How compact clients refer to the game, unique within the session
+    int wordIndex;                               // Index into hangmanWords
+    hangman_game_t state;                        // Everything the rules need, see engine.h
+    struct LiveGameStruct *live;                 // Where spectators watch the game from
+} game_t;
+
+// Define a struct to split the input on a compact protocol connection into lines
+typedef struct LineReaderStruct
+{
+    char buffer[LINE_BUFFER_LENGTH];
+    int start;                                   // Where the next unread line starts
+    int end;                                     // Where the received data ends
+} line_reader_t;
+
+// Define a struct to build up a reply out of pieces of existing data without copying it into a staging buffer.
+// Only small formatted values (numbers, single characters) get written into the buffer's own scratch space.
+// Define a struct to hold one encoded message, e.g. a game state for spectators or the top of the leaderboard,
+// which is shared by everyone it's sent to and freed by whoever drops the last reference
+typedef struct FrameStruct
+{
+    atomic_int refCount;
+    int length;
+    char data[];
+} frame_t;
+
+typedef struct OutputBufferStruct
+{
+    int clientfileDescriptor;
+    int threadId;
+    struct iovec segments[MAX_OUTPUT_SEGMENTS];
+    int numSegments;
+    char scratch[OUTPUT_SCRATCH_LENGTH];
+    int scratchUsed;
+    frame_t *frames[MAX_OUTPUT_FRAMES];     // Referenced by segments, so kept until they've been sent
+    int numFrames;
+    bool failed;                            // Set if a send failed since output_begin()
+} output_buffer_t;
+
+#ifdef HANGMAN_IO_URING
+// Define a struct to hold an io_uring instance that we've set up by hand, plus its provided buffer ring
+typedef struct UringStruct
+{
+    int ringFd;
+    unsigned sqEntries;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqeTail;                    // Tail including SQEs we've filled in but not published to the kernel yet
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    void *ringMemory;
+    size_t ringMemorySize;
+    size_t sqesSize;
+    struct io_uring_buf *bufferRing;     // NULL unless uring_setup_buffers() has been called
+    size_t bufferRingSize;
+    char *buffers;
+    unsigned bufferSize;
+    unsigned short bufferTail;
+} uring_t;
+#endif
 
 // Leaderboard critical section related stuff
 int leaderboardReadCount = 0;
@@ -42,12 +246,7 @@ pthread_mutex_t leaderboardReadCountMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t leaderboardReadMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t leaderboardWriteMutex = PTHREAD_MUTEX_INITIALIZER;
 
-// Define a struct to represent a word to be guessed in Hangman,and declare an Array to store them
-typedef struct hangmanWordStruct
-{
-    char *objectName;
-    char *objectType;
-} hangman_word_t;
+// Declare an Array to store the words to be guessed in Hangman
 hangman_word_t *hangmanWords; // Array of hangman_word_t structs
 int numWords;
 
@@ -59,19 +258,308 @@ typedef struct UserInfoStruct
 } user_info_t;
 user_info_t *users; // Array of user_info_t structs
 int numUsers;
-char *loggedInUsers[MAX_USERS];
+
+// Define a struct to represent a worker thread in the pool, and declare an Array to store them.
+// The array is sized to the maximum pool size at startup; slots are reused as workers retire and get respawned.
+typedef enum WorkerStateEnum
+{
+    WORKER_UNUSED,   // Slot is free
+    WORKER_STARTING, // Thread created but hasn't picked up work yet
+    WORKER_IDLE,     // Waiting for a request
+    WORKER_BUSY,     // Handling a client
+    WORKER_EXITED,   // Thread has finished and is waiting to be joined by the pool manager
+    NUM_WORKER_STATES
+} worker_state_t;
+
+typedef struct WorkerStruct
+{
+    pthread_t thread;
+    int threadId;                           // Index of this worker in the workers array
+    worker_state_t state;
+    long long idleSinceMs;                  // When the worker last became idle
+    char messageBuffer[MAX_MESSAGE_LENGTH]; // Buffer for receiving client messages
+    int clientConnection;                   // File descriptor of the client being handled, or NO_CONNECTION
+    char *loggedInUser;                     // Username of the client being handled, once authenticated
+    int loggedInUserIndex;                  // Where they are in the users array, or -1
+    output_buffer_t output;                 // For building replies to the client
+    line_reader_t lineReader;               // Buffered input when the client speaks the compact protocol
+    game_t games[MAX_GAMES_PER_CONNECTION]; // The games the client is playing. Legacy clients only ever use the first.
+    int numActiveGames;
+    int numFinishedGames;                   // Games that are over but still need their final state sent
+    int nextGameId;
+    int lastGameId;                         // The game a GUESS without a game ID goes to
+    bool connectionHandedOff;               // Someone else has taken over the client's socket, so don't close it
+    char sessionToken[SESSION_TOKEN_LENGTH + 1]; // Handed out at login so the client can resume after a dropped connection
+    struct AdoptedSessionStruct *adopted;   // The session of a connection handed over by an older server, until it's picked up
+    atomic_bool waitingBetweenGames;        // Waiting on a compact client with no games going, which a handover can interrupt
+    struct RateLimitSlotStruct *rateLimit;  // Where the client's address was in the rate limiter, checked against rateLimitSource before use
+    uint64_t rateLimitSource;               // The client's address as the rate limiter knows it, 0 if it isn't limited
+    unsigned long connectionNumber;
+    unsigned long long bytesSentToClient;   // Everything sent on this connection so far, for traffic captures
+    unsigned long long randomState;         // Where this connection's words come from with a seed
+#ifdef HANGMAN_IO_URING
+    uring_t *ring;                          // This worker's ring when using the io_uring backend, NULL otherwise
+    struct iovec pendingSends[URING_PENDING_SENDS]; // Replies waiting to be submitted along with the next receive.
+    int numPendingSends;                            // They point at the data where it is, nothing's copied.
+    struct msghdr pendingMessage;
+#endif
+} worker_t;
+worker_t *workers; // Array of worker_t structs
+
+// Define a struct to hold the pool's sizing policy and the metrics we expose about it.
+// Everything in here is protected by requestMutex.
+typedef struct WorkerPoolStruct
+{
+    int minWorkers;
+    int maxWorkers;
+    int idleTimeoutMs;
+    int growWaitMs;
+    int numLive;                                   // Workers that haven't exited yet
+    int numIdle;
+    int numBusy;
+    int peakLive;
+    bool shuttingDown;
+    bool managerRunning;
+    pthread_t managerThread;
+    unsigned long spawned;
+    unsigned long retired;
+    unsigned long growEvents;
+    unsigned long shrinkEvents;
+    unsigned long transitions[NUM_WORKER_STATES];  // How many times a worker has entered each state
+    unsigned long requestsHandled;
+    double queueWaitEwmaMs;
+    long long maxQueueWaitMs;
+} worker_pool_t;
+worker_pool_t pool = {
+    .minWorkers = DEFAULT_MIN_WORKERS,
+    .maxWorkers = DEFAULT_MAX_WORKERS,
+    .idleTimeoutMs = DEFAULT_IDLE_TIMEOUT_MS,
+    .growWaitMs = DEFAULT_GROW_WAIT_MS,
+};
+char *statsFileName = NULL;
+int statsIntervalMs = DEFAULT_STATS_INTERVAL_MS;
 
 // Define a struct to represent a client's request, and declare a linked list to store them
 typedef struct RequestStruct
 {
     int fileDescriptor;             // File descriptor of the client
-    struct sockaddr_in addressInfo; // Client's address info
+    struct sockaddr_storage addressInfo; // Client's address info, which may be AF_INET or AF_UNIX
     socklen_t addressSize;          // Client's address size
+    long long enqueuedAtMs;         // When the request was added to the queue
+    unsigned long connectionNumber; // Connections are numbered in the order they were accepted
+    int requestClass;               // Which queue it's waiting in
+    bool classified;                // Whether the class came from the client's first message, rather than a guess
+    struct AdoptedSessionStruct *adopted; // Handed over by an older server along with the connection, NULL for new connections
     struct RequestStruct *next;     // Pointer to the next request
 } request_t;
-request_t *requests = NULL;    // Head of the linked list of requests
-request_t *lastRequest = NULL; // Pointer to the tail of the linked list
-int numRequests = 0;
+
+// New connections are queued by how urgent they look from their first message, most urgent first:
+// players resuming games in progress, then logins that come with a menu action, plain logins, and
+// finally leaderboard reads and spectators. A request is treated as one class more urgent for every
+// priorityAgingMs it's been waiting, so nothing waits forever behind a steady stream of players.
+typedef enum
+{
+    REQUEST_IN_GAME,
+    REQUEST_MENU,
+    REQUEST_LOGIN,
+    REQUEST_EXPORT,
+    NUM_REQUEST_CLASSES
+} request_class_t;
+const char *requestClassNames[] = {"in_game", "menu", "login", "export"};
+
+// Everything in here is protected by requestMutex too
+typedef struct RequestQueueStruct
+{
+    request_t *head;                // Each class is its own linked list
+    request_t *tail;
+    int length;
+    unsigned long handled;
+    double waitEwmaMs;
+    long long maxWaitMs;
+} request_queue_t;
+request_queue_t requestQueues[NUM_REQUEST_CLASSES];
+int numRequests = 0;                // Across every class
+int priorityAgingMs = DEFAULT_PRIORITY_AGING_MS;
+unsigned long requestsAged = 0;     // Taken ahead of a more urgent class because they'd waited long enough
+
+// Define a struct to represent a spectator, whose socket is owned by the fan-out thread once it starts watching.
+// The queue is protected by spectatorMutex; the frame being sent is only touched by the fan-out thread.
+typedef struct SpectatorStruct
+{
+    int fileDescriptor;
+    struct LiveGameStruct *liveGame;            // The game being watched, NULL once it's over
+    frame_t *queuedFrames[SPECTATOR_QUEUE_LENGTH];
+    int firstQueuedFrame;
+    int numQueuedFrames;
+    bool gameOver;                              // Close the connection once everything queued has gone out
+    bool fellBehind;                            // Had to miss a frame that couldn't be skipped, so gets disconnected
+    frame_t *sendingFrame;
+    int bytesSent;                              // How much of sendingFrame has gone out
+    bool waitingToWrite;                        // Registered for EPOLLOUT because the socket was full
+    long long stalledSinceMs;
+    struct SpectatorStruct *nextInGame;
+    struct SpectatorStruct *next;               // In the list of every spectator
+} spectator_t;
+
+// Define a struct to represent a game that can be watched, and declare a linked list to store them.
+// Protected by spectatorMutex, apart from numSpectators which players check without it.
+typedef struct LiveGameStruct
+{
+    int liveId;
+    char *username;
+    atomic_int numSpectators;
+    spectator_t *spectators;
+    char latestState[MAX_NUM_GUESSES + MAX_WORD_LENGTH + 16]; // So new spectators don't have to wait for the next guess
+    bool deltas;                                // Frames are changes rather than whole states, so none can be skipped
+    struct LiveGameStruct *previous;
+    struct LiveGameStruct *next;
+} live_game_t;
+live_game_t *liveGames = NULL;
+int numLiveGames = 0;
+live_game_t leaderboardSubscribers = {.deltas = true}; // Not a game, but subscribers get leaderboard changes the same way
+int nextLiveId = 0;
+spectator_t *spectators = NULL;              // Only ever added to at the head, and only removed from by the fan-out thread
+pthread_mutex_t spectatorMutex = PTHREAD_MUTEX_INITIALIZER;
+int spectatorEpollfileDescriptor = -1;
+int spectatorWakefileDescriptor = -1;        // eventfd that tells the fan-out thread there are frames to send
+pthread_t spectatorThread;
+bool spectatorThreadRunning = false;
+volatile bool spectatorThreadStopping = false;
+unsigned long numSpectators = 0;
+atomic_ulong framesPublished;
+atomic_ulong framesSent;
+atomic_ulong framesSkipped;
+atomic_ulong spectatorsDropped;
+
+// Define a struct to represent a leaderboard covering only a recent window of time, e.g. the last day.
+// Results go into a ring of buckets, each covering a slice of the window, as well as into running totals for the
+// whole window. As a bucket falls out of the window its results are taken back off the totals and it's cleared
+// for reuse, so the totals always cover the window and nobody ever has to add the buckets up.
+// There's one more bucket than the window needs, so the one being cleared is never one being written to.
+// Counters are indexed by the user's position in the users array and are only ever touched atomically,
+// so writers never wait for a rotation. Rotations themselves are serialised by windowMutex.
+typedef struct WindowBucketStruct
+{
+    atomic_llong epoch;        // Which slice of time the bucket holds, i.e. time / bucket length
+    atomic_int *gamesWon;
+    atomic_int *gamesPlayed;
+} window_bucket_t;
+
+typedef struct LeaderboardWindowStruct
+{
+    char *name;
+    long long bucketMs;
+    int numBuckets;                                // Buckets the window covers, there's one spare on top
+    long long currentEpoch;                        // Newest bucket handed out, only changed under windowMutex
+    window_bucket_t buckets[MAX_WINDOW_BUCKETS + 1];
+    atomic_int *gamesWon;                          // Totals across the window
+    atomic_int *gamesPlayed;
+    atomic_bool changed;                           // Since the summary was last built
+    frame_t *summary;                              // Pre-encoded top WINDOW_TOP_K, replaced under windowMutex
+} leaderboard_window_t;
+leaderboard_window_t leaderboardWindows[] = {
+    {.name = "HOUR", .bucketMs = 5 * 60 * 1000LL, .numBuckets = 12},
+    {.name = "DAY", .bucketMs = 60 * 60 * 1000LL, .numBuckets = 24},
+    {.name = "WEEK", .bucketMs = 24 * 60 * 60 * 1000LL, .numBuckets = 7},
+};
+#define NUM_LEADERBOARD_WINDOWS (int)(sizeof(leaderboardWindows) / sizeof(leaderboardWindows[0]))
+pthread_mutex_t windowMutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned long windowRotations = 0;
+unsigned long windowSummariesBuilt = 0;
+
+// Define a struct to hold on to the session of a compact client whose connection dropped, so it can come back
+// to the same game with its token instead of logging in again. Protected by sessionMutex.
+typedef struct DetachedSessionStruct
+{
+    bool inUse;
+    char token[SESSION_TOKEN_LENGTH + 1];
+    char *username;           // Points at the username in the users array
+    int userIndex;
+    game_t *games;            // The games in progress when the connection dropped
+    int numGames;
+    int nextGameId;
+    int lastGameId;
+    long long detachedAtMs;
+} detached_session_t;
+detached_session_t detachedSessions[MAX_DETACHED_SESSIONS];
+pthread_mutex_t sessionMutex = PTHREAD_MUTEX_INITIALIZER;
+int sessionLifetimeMs = DEFAULT_SESSION_LIFETIME_MS;
+unsigned long sessionsDetached = 0;
+unsigned long sessionsResumed = 0;
+unsigned long sessionsExpired = 0;
+unsigned long sessionsEvicted = 0;
+
+// Zero-downtime restarts. A server started with -H listens on a UNIX socket at that path, and a newer server started
+// with the same -H connects to it. The older server hands over the leaderboard, its detached sessions and its
+// listening sockets, then each compact connection as soon as it's between games. Everything else gets until
+// drainTimeoutMs to finish before the older server exits.
+typedef enum HandoffStateEnum
+{
+    HANDOFF_NONE,
+    HANDOFF_SENDING,  // Results and detached sessions are forwarded to the newer server from here on
+    HANDOFF_DRAINING, // The newer server has the listeners, and compact connections follow once they're between games
+    HANDOFF_DONE
+} handoff_state_t;
+
+// Define a struct to hold the session that came with a connection an older server handed over
+typedef struct AdoptedSessionStruct
+{
+    char token[SESSION_TOKEN_LENGTH + 1];      // Empty if the client never got one
+    char *username;                            // Points at the username in the users array
+    int userIndex;
+    int nextGameId;
+    int lastGameId;
+    int numUnread;                             // What the client had sent that the older server hadn't got to yet
+    char unread[LINE_BUFFER_LENGTH];
+} adopted_session_t;
+
+char *handoffPath = NULL;
+int handoffListenerfileDescriptor = -1;
+int handoffInboundfileDescriptor = -1;        // From the server we took over from, until it's finished with us
+int handoffOutboundfileDescriptor = -1;       // To the server taking over from us
+atomic_int handoffState;
+pthread_mutex_t handoffMutex = PTHREAD_MUTEX_INITIALIZER; // Messages to the newer server go one at a time. Taken after the leaderboard and sessionMutex.
+pthread_t handoffThread;
+bool handoffThreadRunning = false;
+pthread_t mainThread;
+atomic_bool acceptingConnections;             // The main thread's still in accept_connections()
+int drainTimeoutMs = DEFAULT_DRAIN_TIMEOUT_MS;
+atomic_ulong handoffConnectionsSent;
+atomic_ulong handoffSessionsSent;
+atomic_ulong handoffResultsForwarded;
+atomic_ulong handoffConnectionsAdopted;
+atomic_ulong handoffSessionsAdopted;
+atomic_ulong handoffPlayersAdopted;
+
+// Per address rate limiting. Each address gets a token bucket for new connections and another for messages, plus a
+// count of how many of its connections the workers are busy with. The slots live in a fixed size open addressing
+// table that's read and updated with atomics alone, so checking a bucket is a CAS on a line nobody else is likely
+// to be touching. When every slot an address could go in is taken, the one seen least recently is reused.
+typedef struct RateLimitStruct
+{
+    int perSecond;                 // 0 for no limit
+    int burst;                     // Tokens a bucket holds when full
+} rate_limit_t;
+
+typedef struct RateLimitSlotStruct
+{
+    _Atomic uint64_t source;             // The address, 0 for an empty slot
+    _Atomic uint64_t connectionBucket;   // Thousandths of a token in the top 32 bits, when it was last topped up in the bottom 32
+    _Atomic uint64_t messageBucket;
+    _Atomic uint32_t lastSeenMs;
+    atomic_int openConnections;
+    atomic_bool throttled;               // Has been refused something since it got this slot
+} rate_limit_slot_t;
+
+rate_limit_slot_t *rateLimitSlots = NULL; // Only allocated if there's a limit to enforce
+bool rateLimitSlotsShared = false;        // Mapped so every worker process shares them, rather than allocated
+rate_limit_t connectionRateLimit;
+rate_limit_t messageRateLimit;
+int maxConnectionsPerSource = 0;          // 0 for no limit
+atomic_ulong rateLimitConnectionsRefused;
+atomic_ulong rateLimitMessagesRefused;
+atomic_ulong rateLimitSourcesThrottled;
+atomic_ulong rateLimitEvictions;
 
 // Define a struct to represent an item on the leaderboard, and declare a linked list to store them
 typedef struct LeaderboardItemStruct
@@ -80,10 +568,131 @@ typedef struct LeaderboardItemStruct
     int gamesWon;
     int totalGames;
     double percentageWon;
-    struct LeaderboardItemStruct *next;
+    unsigned long version;                      // The leaderboard's version when this item last changed
+    struct LeaderboardItemStruct *next;         // Towards the better players
+    struct LeaderboardItemStruct *previous;
+    struct LeaderboardItemStruct *newerChange;  // The items are also kept in order of when they last changed,
+    struct LeaderboardItemStruct *olderChange;  // so the changes since a version can be found without looking at the rest
 } leaderboard_item_t;
 leaderboard_item_t *leaderboardItems = NULL; // Head of the linked list of leaderboard items
+leaderboard_item_t *leaderboardTail = NULL;  // Best player, where the top of the leaderboard starts
 int numLeaderboardItems = 0;
+unsigned long leaderboardVersion = 0;        // Goes up by one with every change to the leaderboard
+leaderboard_item_t *newestChange = NULL;     // Head of the list of items in order of when they last changed
+int topLeaderboardSize = DEFAULT_TOP_LEADERBOARD_SIZE;
+frame_t *topLeaderboard = NULL;              // Pre-encoded top rows, best first. Replaced with the leaderboard write locked.
+unsigned long topLeaderboardRebuilds = 0;
+
+// With pre-forked worker processes, everyone's results are kept in shared memory and each process keeps its own
+// leaderboard (and the top rows, changes and windows built from it) in step with them. Counters are indexed like the
+// users array and only ever changed atomically with the mutex held, so a snapshot taken under the mutex always has
+// each player's wins and games from the same moment. The mutex is robust, so a process dying while it holds it
+// doesn't wedge everyone else.
+typedef struct SharedPlayerStruct
+{
+    atomic_int gamesWon;
+    atomic_int gamesPlayed;
+    atomic_ulong version;                    // The shared version when this player's results last changed
+} shared_player_t;
+
+typedef struct SharedLeaderboardStruct
+{
+    pthread_mutex_t mutex;                   // Process shared and robust
+    atomic_ulong version;                    // Goes up by one with every result from any process
+    atomic_ulong recoveries;                 // Times the mutex was taken over from a process that died holding it
+    int changes[SHARED_CHANGES_LENGTH];      // Whose result made each recent version, by version % SHARED_CHANGES_LENGTH
+    shared_player_t players[];
+} shared_leaderboard_t;
+shared_leaderboard_t *sharedLeaderboard = NULL;
+
+// Where the leaderboard is published for local readers, see board_export.h. Only the pool manager of a single
+// server, or of worker process 0, writes to it.
+char *boardExportPath = NULL;
+board_export_header_t *boardExport = NULL;
+size_t boardExportSize;
+unsigned long boardExportVersion = 0;  // The leaderboard version last written out
+long long nextBoardExportMs = 0;
+unsigned long boardExportWrites = 0;
+
+// Bulk exports of the whole leaderboard, for EXPORT. The latest snapshot in each format is kept in an unnamed
+// temporary file and sent again to anyone else who asks before the leaderboard next changes.
+typedef enum ExportFormatEnum
+{
+    EXPORT_CSV,
+    EXPORT_JSON,
+    NUM_EXPORT_FORMATS
+} export_format_t;
+const char *exportFormatNames[] = {"CSV", "JSON"};
+
+typedef struct ExportSnapshotStruct
+{
+    int fileDescriptor;
+    off_t size;
+    unsigned long version;       // The leaderboard version it was taken at
+    int numReferences;           // The cache's, plus one for each export sending it. Protected by exportMutex.
+} export_snapshot_t;
+export_snapshot_t *exportSnapshots[NUM_EXPORT_FORMATS];
+pthread_mutex_t exportMutex = PTHREAD_MUTEX_INITIALIZER; // Taken before the leaderboard lock
+unsigned long exportsServed = 0;
+unsigned long exportSnapshotsBuilt = 0;
+unsigned long exportSnapshotsReused = 0;
+atomic_ulong exportBytesSent;
+
+// A player's results as copied out of the shared leaderboard
+typedef struct SharedSnapshotStruct
+{
+    int userIndex;
+    int gamesWon;
+    int gamesPlayed;
+    unsigned long version;
+} shared_snapshot_t;
+size_t sharedLeaderboardSize = 0;
+atomic_ulong sharedVersionSeen;              // How much of the shared leaderboard this process has caught up with
+bool sharedLeaderboardSynced = false;        // Whether this process has caught up at least once, protected by the write lock
+
+// Pre-forked worker processes, each one running the whole thread pool on the shared listening sockets
+int numWorkerProcesses = 0;                  // 0 to serve everything from this process
+int workerProcessNumber = -1;                // Which one this is, -1 in the supervisor or without worker processes
+pid_t *workerProcesses = NULL;               // Only in the supervisor
+long long *workerProcessStartedAtMs = NULL;
+unsigned long workerProcessRestarts = 0;
+char *sharedTables = NULL;                   // Read only copy of the words and users that every worker process maps
+size_t sharedTablesSize = 0;
+
+//--------------------------------------------------------------------------------------------
+// Time related
+//--------------------------------------------------------------------------------------------
+long long now_ms()
+{
+    // Milliseconds on the monotonic clock, so wall clock changes don't mess with our timeouts
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long long wall_clock_ms()
+{
+    // For timestamps other processes will look at, where the monotonic clock means nothing
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long long now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+struct timespec deadline_at_ms(long long deadlineMs)
+{
+    // Convert a now_ms() style timestamp into a timespec for pthread_cond_timedwait()
+    struct timespec deadline;
+    deadline.tv_sec = deadlineMs / 1000;
+    deadline.tv_nsec = (deadlineMs % 1000) * 1000000;
+    return deadline;
+}
 
 //--------------------------------------------------------------------------------------------
 // Functions related to making sure we exit gracefully
@@ -91,72 +700,138 @@ int numLeaderboardItems = 0;
 void close_sockets()
 {
     printf("Closing sockets...\n");
-    close(serverfileDescriptor);
-
-    // Go through the open connections and close them
-    for (int i = 0; i < MAX_USERS; i++)
+    for (int i = 0; i < numListeners; i++)
+        close(listenerfileDescriptors[i]);
+    if (unixSocketPath != NULL)
+        unlink(unixSocketPath);
+    if (handoffListenerfileDescriptor != -1)
     {
-        if (clientConnections[i] != NO_CONNECTION)
-            close(clientConnections[i]);
+        // Once we've handed over, the path belongs to the newer server
+        close(handoffListenerfileDescriptor);
+        if (atomic_load(&handoffState) == HANDOFF_NONE)
+            unlink(handoffPath);
     }
 
     // Go through each unhandled request and close its connection
-    request_t *currentRequest = requests;
-    while (currentRequest != NULL)
+    for (int i = 0; i < NUM_REQUEST_CLASSES; i++)
     {
-        close(currentRequest->fileDescriptor);
-        currentRequest = requests->next;
+        for (request_t *currentRequest = requestQueues[i].head; currentRequest != NULL; currentRequest = currentRequest->next)
+            close(currentRequest->fileDescriptor);
     }
 }
 
-void cancel_threads()
+void stop_worker_pool()
 {
-    printf("Cancelling threads...\n");
+    // Nothing to stop if we never got as far as starting the pool
+    if (workers == NULL)
+        return;
+
+    printf("Stopping worker threads...\n");
 
-    // Wait on each thread to finish safely. 
-    // We've already set the serverClosing flag and closed sockets, so they should be wrapping up quickly
-    for (int i = 0; i < MAX_USERS; i++)
+    // Tell every worker to finish up. Workers blocked on a client get their connection shut down underneath them,
+    // which makes their recv() return and lets them unwind normally and free whatever they were using.
+    pthread_mutex_lock(&requestMutex);
+    pool.shuttingDown = true;
+    for (int i = 0; i < pool.maxWorkers; i++)
+    {
+        if (workers[i].clientConnection != NO_CONNECTION)
+            shutdown(workers[i].clientConnection, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&gotRequestThreadCond);
+    pthread_cond_signal(&poolManagerCond);
+    pthread_mutex_unlock(&requestMutex);
+
+    // The manager joins workers as they exit, so wait for it first, then join anything it didn't get to.
+    // If we've ended up here from one of the pool's own threads (e.g. out of memory) we can't join ourselves.
+    pthread_t self = pthread_self();
+    if (pool.managerRunning && !pthread_equal(pool.managerThread, self))
+        pthread_join(pool.managerThread, NULL);
+    for (int i = 0; i < pool.maxWorkers; i++)
     {
-        pthread_cancel(threads[i]);   
+        if (workers[i].state != WORKER_UNUSED && !pthread_equal(workers[i].thread, self))
+        {
+            pthread_join(workers[i].thread, NULL);
+            workers[i].state = WORKER_UNUSED;
+        }
     }
 }
 
+void free_detached_session(detached_session_t *session);
+void free_leaderboard_windows();
+void free_export_snapshots();
+void frame_retain(frame_t *frame);
+void frame_release(frame_t *frame);
+
 void free_memory()
 {
     printf("Freeing Memory...\n");
 
-    // Free all words stored in hangmanWords array, and free the array itself
-    for (int i = 0; i < numWords; i++)
+    // The words and users are either in the shared mapping or allocated one by one
+    if (sharedTables != NULL)
     {
-        free(hangmanWords[i].objectName);
-        free(hangmanWords[i].objectType);
+        munmap(sharedTables, sharedTablesSize);
     }
-    free(hangmanWords);
+    else
+    {
+        // Free all words stored in hangmanWords array, and free the array itself
+        hangman_free_words(hangmanWords, numWords);
 
-    // Free all users and passwords stored in users array, and free the array itself
-    for (int i = 0; i < numUsers; i++)
+        // Free all users and passwords stored in users array, and free the array itself
+        for (int i = 0; i < numUsers; i++)
+        {
+            free(users[i].username);
+            free(users[i].password);
+        }
+        free(users);
+    }
+    if (sharedLeaderboard != NULL)
+        munmap(sharedLeaderboard, sharedLeaderboardSize);
+    if (boardExport != NULL)
+        munmap(boardExport, boardExportSize);
+    if (wordStatsShared)
     {
-        free(users[i].username);
-        free(users[i].password);
+        munmap(wordStats, (numWords + numCategories) * sizeof(word_stats_t));
     }
-    free(users);
+    else
+    {
+        free(wordStats);
+        free(categoryStats);
+    }
+    free(wordCategories);
+    free(categoryFirstWords);
+    if (playerWordsShared)
+        munmap(playerWords, numUsers * sizeof(player_words_t));
+    else
+        free(playerWords);
+    if (rateLimitSlotsShared)
+        munmap(rateLimitSlots, RATE_LIMIT_SLOTS * sizeof(rate_limit_slot_t));
+    else
+        free(rateLimitSlots);
 
-    // Free up any memory allocated for current connections on threads that are in the process of being cancelled
-    for (int i = 0; i < MAX_USERS; i++)
+    // Free requests linked lists
+    for (int i = 0; i < NUM_REQUEST_CLASSES; i++)
     {
-        if (hangmanWordsInUse[i] != NULL) free(hangmanWordsInUse[i]);
-        if (clientWordsInUse[i] != NULL) free(clientWordsInUse[i]);
+        while (requestQueues[i].head != NULL)
+        {
+            request_t *temp = requestQueues[i].head->next;
+            free(requestQueues[i].head);
+            requestQueues[i].head = temp;
+        }
     }
 
-    // Free requests linked list
-    while (requests != NULL)
+    // Free the games of any sessions that were waiting to be resumed
+    for (int i = 0; i < MAX_DETACHED_SESSIONS; i++)
     {
-        request_t *temp = requests->next;
-        free(requests);
-        requests = temp;
+        if (detachedSessions[i].inUse)
+            free_detached_session(&detachedSessions[i]);
     }
 
+    free_leaderboard_windows();
+    free_export_snapshots();
+
     // Free leaderboard linked list
+    if (topLeaderboard != NULL)
+        frame_release(topLeaderboard);
     while (leaderboardItems != NULL)
     {
         leaderboard_item_t *temp = leaderboardItems->next;
@@ -165,25 +840,54 @@ void free_memory()
     }
 }
 
+void dump_stats(FILE *stream);
+void stop_spectator_fan_out();
+void close_span_trace();
+void sync_shared_leaderboard();
+void close_board_export();
+void stop_handoff_thread();
+void finish_handoff();
+void write_word_stats_file();
+bool forward_detached_session(detached_session_t *session);
+bool forward_result(char *username, bool gameWon);
+bool hand_off_connection(int clientfileDescriptor, int threadId);
+void output_sent(output_buffer_t *output);
+
 void perform_clean_exit(int exitCode)
 {
     printf("\n\nClosing Program...\n");
 
     // Do everything to try and exit as gracefully as possible
+    stop_handoff_thread();
+    stop_worker_pool();
+    finish_handoff();
+    stop_spectator_fan_out();
     close_sockets();
-    cancel_threads();
+    if (captureFile != NULL)
+        fclose(captureFile);
+    if (spanTraceFile != NULL)
+        close_span_trace();
+    if (boardExport != NULL && workerProcessNumber < 0)
+        close_board_export();
+    if (workerProcessNumber <= 0)
+        write_word_stats_file();
+    dump_stats(stdout);
     free_memory();
+    free(workers);
 
     exit(exitCode);
 }
 
 void exit_handler(int signum)
 {
-    // This is specifically to catch the SIGINT (CTRL+C) signal
-    if (signum != SIGINT) 
-        return; 
-
-    perform_clean_exit(0);
+    // SIGINT (CTRL+C) asks the server to shut down, which main() does once accept() is interrupted.
+    // SIGUSR1 asks for the current stats, which the pool manager prints on its next pass.
+    // Neither does the work here, since hardly anything is safe to call from inside a signal handler.
+    // SIGUSR2 does nothing at all, other than interrupt whatever the thread it's sent to is blocked on.
+    if (signum == SIGINT)
+        serverClosing = 1;
+    else if (signum == SIGUSR1)
+        statsRequested = 1;
 }
 
 //--------------------------------------------------------------------------------------------
@@ -246,6 +950,9 @@ void thread_fprintf(FILE *stream, int threadId, char *format, va_list args)
 
 void thread_printf(int threadId, char *format, ...)
 {
+    if (quietMode)
+        return;
+
     va_list args;
     va_start(args, format);
     thread_fprintf(stdout, threadId, format, args);
@@ -260,6 +967,17 @@ void thread_printf_error(int threadId, char *format, ...)
     va_end(args);
 }
 
+void format_client_address(struct sockaddr_storage *addressInfo, char *formattedAddress)
+{
+    // Fills formattedAddress (at least MAX_ADDRESS_LENGTH long) with something readable for log messages
+    if (addressInfo->ss_family == AF_INET)
+        inet_ntop(AF_INET, &((struct sockaddr_in *)addressInfo)->sin_addr, formattedAddress, MAX_ADDRESS_LENGTH);
+    else if (addressInfo->ss_family == AF_UNIX)
+        sprintf(formattedAddress, "local client on %.40s", unixSocketPath);
+    else
+        strcpy(formattedAddress, "unknown address");
+}
+
 //--------------------------------------------------------------------------------------------
 // Reading files related
 //--------------------------------------------------------------------------------------------
@@ -336,32 +1054,12 @@ char **read_text_file(char *fileName, int *numOfLines)
 
 void read_hangman_words()
 {
-    char **words = read_text_file("hangman_text.txt", &numWords);
-
-    hangmanWords = custom_calloc(numWords, sizeof(hangman_word_t));
-    if (hangmanWords == NULL)
-    {
-        fprintf(stderr, "Out of memory (hangmanWords).\n");
-        exit(1);
-    }
-
-    for (int i = 0; i < numWords; i++)
+    hangmanWords = hangman_read_words("hangman_text.txt", &numWords);
+    if (hangmanWords == NULL || numWords == 0)
     {
-        // Splits the given string when it sees a comma so that we get the objectName and objectType separated
-        char *objectName = strtok(words[i], ",");
-        char *objectType = strtok(NULL, ",");
-
-        // Dynamically allocate memory for the objectName and objectType fields and copy the values over
-        hangmanWords[i].objectName = custom_calloc(strlen(objectName) + 1, sizeof(char));
-        hangmanWords[i].objectType = custom_calloc(strlen(objectType) + 1, sizeof(char));
-        strcpy(hangmanWords[i].objectName, objectName);
-        strcpy(hangmanWords[i].objectType, objectType);
+        fprintf(stderr, "No words to play with.\n");
+        exit(2);
     }
-
-    // Don't need the directly read text file lines anymore
-    for (int i = 0; i < numWords; i++)
-        free(words[i]);
-    free(words);
 }
 
 void read_users()
@@ -404,622 +1102,5581 @@ void read_users()
 }
 
 //--------------------------------------------------------------------------------------------
-// Sending/Receiving messages related
+// io_uring related
 //--------------------------------------------------------------------------------------------
-void send_client_message(int clientfileDescriptor, char *message, int threadId)
+#ifdef HANGMAN_IO_URING
+// We talk to io_uring directly through its syscalls rather than pulling in liburing, since we only need a handful of
+// operations. The ring fields the kernel also touches are read and written with acquire/release ordering.
+bool uring_init(uring_t *ring, unsigned entries)
 {
-    int messageLength = strlen(message);
-    int sendResult = send(clientfileDescriptor, message, messageLength, 0);
-    if (sendResult == -1)
+    memset(ring, 0, sizeof(uring_t));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->ringFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->ringFd < 0)
+        return false;
+
+    // We rely on the submission and completion rings sharing one mapping, which every kernel with buffer rings supports
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
     {
-        thread_printf_error(threadId, "Error sending message.");
+        close(ring->ringFd);
+        return false;
+    }
+
+    size_t sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringMemorySize = sqRingSize > cqRingSize ? sqRingSize : cqRingSize;
+    ring->ringMemory = mmap(NULL, ring->ringMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_SQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_SQES);
+    if (ring->ringMemory == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        if (ring->ringMemory != MAP_FAILED) munmap(ring->ringMemory, ring->ringMemorySize);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqesSize);
+        close(ring->ringFd);
+        return false;
     }
+
+    char *ringMemory = ring->ringMemory;
+    ring->sqEntries = params.sq_entries;
+    ring->sqHead = (unsigned *)(ringMemory + params.sq_off.head);
+    ring->sqTail = (unsigned *)(ringMemory + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(ringMemory + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(ringMemory + params.sq_off.array);
+    ring->cqHead = (unsigned *)(ringMemory + params.cq_off.head);
+    ring->cqTail = (unsigned *)(ringMemory + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(ringMemory + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ringMemory + params.cq_off.cqes);
+    ring->sqeTail = *ring->sqTail;
+
+    // Each submission queue slot always points at the SQE with the same index, so we only need to fill this in once
+    for (unsigned i = 0; i < ring->sqEntries; i++)
+        ring->sqArray[i] = i;
+
+    return true;
 }
 
-char *receive_client_message(int clientfileDescriptor, int threadId)
+bool uring_setup_buffers(uring_t *ring, unsigned numBuffers, unsigned bufferSize)
 {
-    int numBytes = recv(clientfileDescriptor, messageBuffers[threadId], MAX_MESSAGE_LENGTH, 0);
-    if (numBytes == -1)
+    // Register a provided buffer ring, so receives pick a buffer when data actually arrives rather than us
+    // having to dedicate one to each receive up front. numBuffers must be a power of 2.
+    ring->bufferRingSize = numBuffers * sizeof(struct io_uring_buf);
+    ring->bufferRing = mmap(NULL, ring->bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufferRing == MAP_FAILED)
     {
-        thread_printf_error(threadId, "Error receiving message.");
-        return NULL;
+        ring->bufferRing = NULL;
+        return false;
     }
-    else if (numBytes == 0)
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (unsigned long)ring->bufferRing;
+    registration.ring_entries = numBuffers;
+    registration.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->ringFd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
     {
-        thread_printf_error(threadId, "Client has closed connection whilst server tried receiving message.");                
-        return NULL;
+        munmap(ring->bufferRing, ring->bufferRingSize);
+        ring->bufferRing = NULL;
+        return false;
     }
 
-    // Trim the message to its correct size
-    messageBuffers[threadId][numBytes] = '\0';
-    return messageBuffers[threadId];
-}
+    ring->buffers = custom_malloc(numBuffers * bufferSize);
+    ring->bufferSize = bufferSize;
+    for (unsigned i = 0; i < numBuffers; i++)
+    {
+        struct io_uring_buf *buffer = &ring->bufferRing[i];
+        buffer->addr = (unsigned long)(ring->buffers + i * bufferSize);
+        buffer->len = bufferSize;
+        buffer->bid = i;
+    }
 
-//--------------------------------------------------------------------------------------------
-// Leaderboard related
-//--------------------------------------------------------------------------------------------
-void read_lock()
-{
-    // Lock the read count so we don't have multiple readers accidentally screwing it up
-	pthread_mutex_lock(&leaderboardReadMutex);
-    pthread_mutex_lock(&leaderboardReadCountMutex);
-    leaderboardReadCount++;
-    
-    // If this is the only active reader, lock the leaderboard so we can't write to it
-	if (leaderboardReadCount == 1)
-        pthread_mutex_lock(&leaderboardWriteMutex);
-        
-    // Unlock the read count so other readers can come join the fun
-	pthread_mutex_unlock(&leaderboardReadCountMutex);
-	pthread_mutex_unlock(&leaderboardReadMutex);
+    // The ring's tail lives in the reserved field of the first entry
+    ring->bufferTail = numBuffers;
+    __atomic_store_n(&ring->bufferRing[0].resv, ring->bufferTail, __ATOMIC_RELEASE);
+    return true;
 }
 
-void read_unlock()
+void uring_recycle_buffer(uring_t *ring, unsigned short bufferId)
 {
-    // Lock the read count as we're messing with it again
-	pthread_mutex_lock(&leaderboardReadCountMutex);
-    leaderboardReadCount--;
-    
-    // If this is the last active reader, unlock the leaderboard so it can be written to again
-	if (leaderboardReadCount == 0)
-        pthread_mutex_unlock(&leaderboardWriteMutex);
-        
-    // We're finished with the read count
-	pthread_mutex_unlock(&leaderboardReadCountMutex);
+    // Hand a buffer back to the kernel once we've copied its data out
+    unsigned mask = ring->bufferRingSize / sizeof(struct io_uring_buf) - 1;
+    struct io_uring_buf *buffer = &ring->bufferRing[ring->bufferTail & mask];
+    char *bufferAddress = ring->buffers + bufferId * ring->bufferSize;
+    unsigned short ringTail = ring->bufferTail + 1;
+
+    // The tail shares slot 0's reserved field, so only fill in the fields that belong to the buffer
+    buffer->addr = (unsigned long)bufferAddress;
+    buffer->len = ring->bufferSize;
+    buffer->bid = bufferId;
+    ring->bufferTail = ringTail;
+    __atomic_store_n(&ring->bufferRing[0].resv, ring->bufferTail, __ATOMIC_RELEASE);
 }
 
-void write_lock()
+void uring_free(uring_t *ring)
 {
-    // Can only write if there are no readers reading and no other writers writing
-	pthread_mutex_lock(&leaderboardReadMutex);
-	pthread_mutex_lock(&leaderboardWriteMutex);
+    if (ring->bufferRing != NULL)
+    {
+        munmap(ring->bufferRing, ring->bufferRingSize);
+        free(ring->buffers);
+    }
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->ringMemory, ring->ringMemorySize);
+    close(ring->ringFd);
 }
 
-void write_unlock()
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
 {
-    // Let all other readers and writers have their fun once again
-	pthread_mutex_unlock(&leaderboardWriteMutex);
-	pthread_mutex_unlock(&leaderboardReadMutex);
+    // Returns the next free SQE, cleared out, or NULL if the submission queue is full
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (ring->sqeTail - head >= ring->sqEntries)
+        return NULL;
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqeTail & *ring->sqMask];
+    ring->sqeTail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
 }
 
-double get_percentage_won(leaderboard_item_t *item)
+int uring_submit_and_wait(uring_t *ring, unsigned waitFor)
 {
-    double gamesWon = (double)item->gamesWon;
-    double totalGames = (double)item->totalGames;
-    return gamesWon / totalGames;
+    // Publish everything we've filled in and wait for at least waitFor completions, all in one syscall
+    unsigned toSubmit = ring->sqeTail - *ring->sqTail;
+    __atomic_store_n(ring->sqTail, ring->sqeTail, __ATOMIC_RELEASE);
+
+    atomic_fetch_add_explicit(&ioSyscalls, 1, memory_order_relaxed);
+    return syscall(__NR_io_uring_enter, ring->ringFd, toSubmit, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
 }
 
-bool send_leaderboard(int clientfileDescriptor, int threadId)
+bool uring_next_completion(uring_t *ring, struct io_uring_cqe *completion)
 {
-    char messageToSend[MAX_MESSAGE_LENGTH];    
-    char* receivedMessage;
+    // Copies out the oldest completion and frees its slot. Returns false if there isn't one.
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        return false;
 
-    // Lock the leaderboard so no writers can write to it whilst we're reading and stuff
-    read_lock();
+    *completion = ring->cqes[head & *ring->cqMask];
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
 
-    // First send the number of items in the leaderboard
-    sprintf(messageToSend, "%d", numLeaderboardItems);
-    send_client_message(clientfileDescriptor, messageToSend, threadId);
-    receivedMessage = receive_client_message(clientfileDescriptor, threadId); // Verify that the client received the message
-    if (receivedMessage == NULL) 
+uring_t *create_worker_ring(int threadId)
+{
+    // Each worker gets its own small ring. If anything goes wrong this worker just uses the blocking path.
+    uring_t *ring = custom_malloc(sizeof(uring_t));
+    if (!uring_init(ring, URING_WORKER_ENTRIES))
     {
-        read_unlock();
-        return false;
+        free(ring);
+        thread_printf_error(threadId, "Couldn't create io_uring, using blocking sockets");
+        return NULL;
     }
-
-    // Now send each item individually
-    leaderboard_item_t *item = leaderboardItems;    
-    for (int i = 0; i < numLeaderboardItems; i++)
+    if (!uring_setup_buffers(ring, URING_NUM_BUFFERS, URING_BUFFER_SIZE))
     {
-        sprintf(messageToSend, "%s|%d|%d", item->username, item->gamesWon, item->totalGames);
-        send_client_message(clientfileDescriptor, messageToSend, threadId);
-        receivedMessage = receive_client_message(clientfileDescriptor, threadId); // Verify that the client received the message
-        if (receivedMessage == NULL) 
-        {
-            read_unlock();
-            return false;
-        }
-
-        item = item->next;
+        uring_free(ring);
+        free(ring);
+        thread_printf_error(threadId, "Couldn't register io_uring buffers, using blocking sockets");
+        return NULL;
     }
+    return ring;
+}
 
-    // Unlock the leaderboard
-    read_unlock();
+void destroy_worker_ring(worker_t *worker)
+{
+    if (worker->ring == NULL)
+        return;
 
-    // Indicate the server is ready to continue to the main menu
-    send_client_message(clientfileDescriptor, "Y", threadId);
+    uring_free(worker->ring);
+    free(worker->ring);
+    worker->ring = NULL;
+}
 
-    // Return true as we encountered no errors
+bool uring_queue_sendmsg(uring_t *ring, int clientfileDescriptor, struct msghdr *message, bool linkToNext)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return false;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = clientfileDescriptor;
+    sqe->addr = (unsigned long)message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->flags = linkToNext ? IOSQE_IO_LINK : 0;
+    sqe->user_data = 1;
     return true;
 }
 
-int compare_leaderboard_items(leaderboard_item_t *item1, leaderboard_item_t *item2)
+struct msghdr *uring_pending_message(worker_t *worker)
 {
-    // This function works similary to the strcmp function.
-    // Returns value < 0 if item1 < item2
-    // Returns value = 0 if item1 == item2
-    // Returns value > 0 if item1 > item2
-    // Determined by, in order of precedence:
-    //  - Games won (Ascending)
-    //  - Percentage of games won (Ascending)
-    //  - Alphabetical order
-    if (item1->gamesWon < item2->gamesWon)
+    struct msghdr *message = &worker->pendingMessage;
+    memset(message, 0, sizeof(struct msghdr));
+    message->msg_iov = worker->pendingSends;
+    message->msg_iovlen = worker->numPendingSends;
+    return message;
+}
+
+void uring_send_pending(int clientfileDescriptor, int threadId)
+{
+    // Submit the pending sends on their own and wait for them, without waiting for a receive to link them to
+    worker_t *worker = &workers[threadId];
+    if (worker->numPendingSends == 0)
+        return;
+
+    int numToWaitFor = uring_queue_sendmsg(worker->ring, clientfileDescriptor, uring_pending_message(worker), false) ? 1 : 0;
+    int submitResult;
+    do
     {
-        return -1;
+        submitResult = uring_submit_and_wait(worker->ring, numToWaitFor);
+    } while (submitResult < 0 && errno == EINTR);
+    worker->numPendingSends = 0;
+    if (submitResult < 0)
+    {
+        thread_printf_error(threadId, "Error sending message.");
+        return;
     }
-    else if (item1->gamesWon == item2->gamesWon)
+
+    struct io_uring_cqe completion;
+    while (numToWaitFor > 0)
     {
-        if (item1->percentageWon < item2->percentageWon)
-        {
-            return -1;
-        }
-        else if (item1->percentageWon == item2->percentageWon)
+        if (!uring_next_completion(worker->ring, &completion))
         {
-            return strcmp(item1->username, item2->username);
+            if (uring_submit_and_wait(worker->ring, numToWaitFor) < 0 && errno != EINTR)
+                return;
+            continue;
         }
+        if (completion.res < 0)
+            thread_printf_error(threadId, "Error sending message.");
+        numToWaitFor--;
     }
-
-    return 1;
 }
 
-void insert_leaderboard_item_at_correct_pos(leaderboard_item_t *startItem, leaderboard_item_t *newItem)
+void uring_flush_sends(int clientfileDescriptor, int threadId)
 {
-    leaderboard_item_t *currentItem = startItem;
-    while (currentItem->next != NULL && compare_leaderboard_items(currentItem->next, newItem) < 0)
-    {
-        currentItem = currentItem->next;
-    }
-
-    newItem->next = currentItem->next;
-    currentItem->next = newItem;
+    // Send everything that was waiting for a receive to be linked to. Used when nothing else is coming, e.g. before
+    // closing, or before carrying on without a receive. Afterwards the output's scratch space and frames are free again.
+    uring_send_pending(clientfileDescriptor, threadId);
+    output_sent(&workers[threadId].output);
 }
 
-void add_leaderboard_item(char* currentUser, bool gameWon)
+void uring_defer_sends(int clientfileDescriptor, struct iovec *segments, int numSegments, int threadId)
 {
-    leaderboard_item_t *newItem = custom_malloc(sizeof(leaderboard_item_t));
-    newItem->username = currentUser;
-    newItem->gamesWon = gameWon ? 1 : 0;
-    newItem->totalGames = 1;
-    newItem->percentageWon = get_percentage_won(newItem);
-    numLeaderboardItems++;    
+    // Don't send straight away. The segments go out linked to the next receive in a single io_uring_enter(), so the
+    // data they point at has to stay put until then. Only the iovecs are copied.
+    worker_t *worker = &workers[threadId];
+    if (worker->numPendingSends + numSegments > URING_PENDING_SENDS)
+        uring_send_pending(clientfileDescriptor, threadId);
+    memcpy(worker->pendingSends + worker->numPendingSends, segments, numSegments * sizeof(struct iovec));
+    worker->numPendingSends += numSegments;
+}
 
-    if (leaderboardItems == NULL)
+int uring_receive_client_bytes(int clientfileDescriptor, int threadId, char *buffer, int maxLength)
+{
+    // Submits any pending sends linked to a receive using one of our provided buffers, and waits for all of them.
+    // Returns the number of bytes copied into buffer, or -1/0 like recv() does.
+    worker_t *worker = &workers[threadId];
+    uring_t *ring = worker->ring;
+    int numToWaitFor = 0;
+    if (worker->numPendingSends > 0)
     {
-        // Leaderboard is empty. Make this the first item
-        newItem->next = NULL;
-        leaderboardItems = newItem;
-        return;
+        // If the send fails the linked receive gets cancelled, which we treat as an error below
+        if (!uring_queue_sendmsg(ring, clientfileDescriptor, uring_pending_message(worker), true))
+            return -1;
+        numToWaitFor++;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = clientfileDescriptor;
+    sqe->len = maxLength < URING_BUFFER_SIZE ? maxLength : URING_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = 2;
+    numToWaitFor++;
+
+    int submitResult;
+    do
+    {
+        submitResult = uring_submit_and_wait(ring, numToWaitFor);
+    } while (submitResult < 0 && errno == EINTR);
+    worker->numPendingSends = 0;
+    if (submitResult < 0)
+        return -1;
+
+    int numBytes = -1;
+    struct io_uring_cqe completion;
+    while (numToWaitFor > 0)
+    {
+        if (!uring_next_completion(ring, &completion))
+        {
+            // Not everything has completed yet (the kernel can return early), so wait for the rest
+            if (uring_submit_and_wait(ring, numToWaitFor) < 0 && errno != EINTR)
+                return -1;
+            continue;
+        }
+        numToWaitFor--;
+
+        if (completion.user_data == 1)
+        {
+            if (completion.res < 0)
+                thread_printf_error(threadId, "Error sending message.");
+        }
+        else if (completion.res >= 0 && (completion.flags & IORING_CQE_F_BUFFER))
+        {
+            unsigned short bufferId = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+            numBytes = completion.res;
+            memcpy(buffer, ring->buffers + bufferId * ring->bufferSize, numBytes);
+            uring_recycle_buffer(ring, bufferId);
+        }
+        else
+        {
+            numBytes = completion.res == 0 ? 0 : -1;
+        }
+    }
+
+    // Everything the sends pointed at has gone out
+    output_sent(&worker->output);
+    return numBytes;
+}
+#endif
+
+//--------------------------------------------------------------------------------------------
+// Traffic capture and seeded randomness related
+//--------------------------------------------------------------------------------------------
+void capture_event(unsigned long connectionNumber, trace_event_t event, unsigned long long bytesSent, char *data, int length)
+{
+    // Append one record to the capture file. See trace.h for the format.
+    trace_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.connection = connectionNumber;
+    record.event = event;
+    record.bytesSent = bytesSent;
+    record.length = length;
+
+    pthread_mutex_lock(&captureMutex);
+    record.timeUs = now_us() - captureStartUs;
+    if (fwrite(&record, sizeof(record), 1, captureFile) != 1 || (length > 0 && fwrite(data, length, 1, captureFile) != 1))
+        perror("capture file");
+    pthread_mutex_unlock(&captureMutex);
+}
+
+void open_capture_file(char *fileName)
+{
+    captureFile = fopen(fileName, "wb");
+    if (captureFile == NULL)
+    {
+        perror(fileName);
+        exit(1);
+    }
+    fwrite(TRACE_MAGIC, TRACE_MAGIC_LENGTH, 1, captureFile);
+    captureStartUs = now_us();
+}
+
+unsigned long long next_random(int threadId)
+{
+    // splitmix64, which is plenty for picking words and doesn't need any state beyond the one number
+    unsigned long long value = (workers[threadId].randomState += 0x9E3779B97F4A7C15ULL);
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+void seed_connection_random(int threadId)
+{
+    // Each connection gets its own sequence, so the words it's given don't depend on what other connections are doing
+    workers[threadId].randomState = wordSeed ^ (workers[threadId].connectionNumber * 0xD1B54A32D192ED03ULL);
+}
+
+//--------------------------------------------------------------------------------------------
+// Span tracing related
+//--------------------------------------------------------------------------------------------
+// Spans are timed with span_begin()/span_end() and collected in a buffer per thread, so recording one never takes
+// a lock. Full buffers are written to the trace file in Chrome's trace event format, which chrome://tracing and
+// Perfetto can both open. With tracing off span_begin() returns 0 and span_end() returns straight away.
+typedef struct SpanStruct
+{
+    const char *name;              // Must outlive the span, so always a string literal
+    long long startUs;
+    long long durationUs;
+    unsigned long connection;      // Which connection the thread was handling, 0 if none
+} span_t;
+
+typedef struct SpanBufferStruct
+{
+    pid_t threadId;
+    int numSpans;
+    span_t spans[SPAN_BUFFER_LENGTH];
+    struct SpanBufferStruct *next; // Every thread's buffer, so whatever's left can be written out on exit
+} span_buffer_t;
+span_buffer_t *spanBuffers = NULL;
+_Thread_local span_buffer_t *threadSpans = NULL;
+_Thread_local unsigned long threadConnection = 0;
+_Thread_local long long leaderboardLockedAtUs = 0;
+
+void open_span_trace(char *fileName)
+{
+    spanTraceFile = fopen(fileName, "w");
+    if (spanTraceFile == NULL)
+    {
+        perror(fileName);
+        exit(1);
+    }
+
+    // Starting with the process name means every event after it can start with a comma
+    fprintf(spanTraceFile, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"hangman server\"}}", getpid());
+    tracingSpans = true;
+}
+
+span_buffer_t *get_span_buffer()
+{
+    if (threadSpans != NULL)
+        return threadSpans;
+
+    threadSpans = custom_calloc(1, sizeof(span_buffer_t));
+    threadSpans->threadId = gettid();
+    pthread_mutex_lock(&spanTraceMutex);
+    threadSpans->next = spanBuffers;
+    spanBuffers = threadSpans;
+    pthread_mutex_unlock(&spanTraceMutex);
+    return threadSpans;
+}
+
+void write_spans(span_buffer_t *buffer)
+{
+    pthread_mutex_lock(&spanTraceMutex);
+    for (int i = 0; i < buffer->numSpans; i++)
+    {
+        span_t *span = &buffer->spans[i];
+        fprintf(spanTraceFile, ",\n{\"name\":\"%s\",\"cat\":\"hangman\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d",
+                span->name, span->startUs, span->durationUs, getpid(), buffer->threadId);
+        if (span->connection != 0)
+            fprintf(spanTraceFile, ",\"args\":{\"connection\":%lu}", span->connection);
+        fputc('}', spanTraceFile);
+    }
+    buffer->numSpans = 0;
+    pthread_mutex_unlock(&spanTraceMutex);
+}
+
+long long span_begin()
+{
+    return tracingSpans ? now_us() : 0;
+}
+
+void span_end(const char *name, long long startUs)
+{
+    if (startUs == 0 || !tracingSpans)
+        return;
+
+    span_buffer_t *buffer = get_span_buffer();
+    if (buffer->numSpans == SPAN_BUFFER_LENGTH)
+        write_spans(buffer);
+    span_t *span = &buffer->spans[buffer->numSpans++];
+    span->name = name;
+    span->startUs = startUs;
+    span->durationUs = now_us() - startUs;
+    span->connection = threadConnection;
+}
+
+void name_span_thread(const char *kind, int number)
+{
+    // Labels the thread in the trace viewer, e.g. "worker 3"
+    if (!tracingSpans)
+        return;
+    span_buffer_t *buffer = get_span_buffer();
+    pthread_mutex_lock(&spanTraceMutex);
+    fprintf(spanTraceFile, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+            getpid(), buffer->threadId, kind, number);
+    pthread_mutex_unlock(&spanTraceMutex);
+}
+
+void release_span_buffer()
+{
+    // Called by threads that exit before the server does, e.g. retiring workers
+    span_buffer_t *buffer = threadSpans;
+    if (buffer == NULL)
+        return;
+    write_spans(buffer);
+
+    pthread_mutex_lock(&spanTraceMutex);
+    span_buffer_t **link = &spanBuffers;
+    while (*link != buffer)
+        link = &(*link)->next;
+    *link = buffer->next;
+    pthread_mutex_unlock(&spanTraceMutex);
+    free(buffer);
+    threadSpans = NULL;
+}
+
+void close_span_trace()
+{
+    // Every other thread has stopped by now, so write out what they left behind
+    while (spanBuffers != NULL)
+    {
+        span_buffer_t *next = spanBuffers->next;
+        write_spans(spanBuffers);
+        free(spanBuffers);
+        spanBuffers = next;
+    }
+    threadSpans = NULL;
+    fprintf(spanTraceFile, "\n]\n");
+    fclose(spanTraceFile);
+
+    // Anything that still ends a span after this, e.g. during the rest of the clean up, mustn't touch the closed file
+    tracingSpans = false;
+    spanTraceFile = NULL;
+}
+
+//--------------------------------------------------------------------------------------------
+// Rate limiting related
+//--------------------------------------------------------------------------------------------
+void init_rate_limits()
+{
+    if (connectionRateLimit.perSecond <= 0 && messageRateLimit.perSecond <= 0 && maxConnectionsPerSource <= 0)
+        return;
+    rateLimitSlots = custom_calloc(RATE_LIMIT_SLOTS, sizeof(rate_limit_slot_t));
+}
+
+uint64_t rate_limit_source(struct sockaddr_storage *addressInfo)
+{
+    // IPv4 addresses are used as they are and IPv6 ones are hashed, with the top bit set so the two can't collide.
+    // Anything else, i.e. UNIX domain sockets, is local and never limited.
+    if (rateLimitSlots == NULL)
+        return 0;
+    if (addressInfo->ss_family == AF_INET)
+        return (1ULL << 32) | ((struct sockaddr_in *)addressInfo)->sin_addr.s_addr;
+    if (addressInfo->ss_family == AF_INET6)
+    {
+        unsigned char *bytes = ((struct sockaddr_in6 *)addressInfo)->sin6_addr.s6_addr;
+        uint64_t hash = 14695981039346656037ULL; // FNV-1a
+        for (int i = 0; i < 16; i++)
+            hash = (hash ^ bytes[i]) * 1099511628211ULL;
+        return hash | (1ULL << 63);
+    }
+    return 0;
+}
+
+uint64_t full_bucket(rate_limit_t *limit, uint32_t nowMs)
+{
+    return ((uint64_t)limit->burst * RATE_LIMIT_MILLI << 32) | nowMs;
+}
+
+bool rate_limit_take(_Atomic uint64_t *bucket, rate_limit_t *limit, uint32_t nowMs)
+{
+    // Top the bucket up for the time since it was last topped up, then take a token if there's one to take.
+    // perSecond tokens a second is perSecond thousandths of a token a millisecond.
+    if (limit->perSecond <= 0)
+        return true;
+    uint64_t capacity = (uint64_t)limit->burst * RATE_LIMIT_MILLI;
+    uint64_t oldBucket = atomic_load_explicit(bucket, memory_order_relaxed);
+    while (true)
+    {
+        uint64_t tokens = oldBucket >> 32;
+        uint32_t toppedUpMs = (uint32_t)oldBucket;
+        if ((int32_t)(nowMs - toppedUpMs) > 0)
+        {
+            tokens += (uint64_t)(nowMs - toppedUpMs) * limit->perSecond;
+            toppedUpMs = nowMs; // Another thread may have read the clock after us, in which case we leave its time be
+        }
+        if (tokens > capacity)
+            tokens = capacity;
+        if (tokens < RATE_LIMIT_MILLI)
+            return false;
+
+        uint64_t newBucket = ((tokens - RATE_LIMIT_MILLI) << 32) | toppedUpMs;
+        if (atomic_compare_exchange_weak_explicit(bucket, &oldBucket, newBucket, memory_order_relaxed, memory_order_relaxed))
+            return true;
+    }
+}
+
+void rate_limit_touch(rate_limit_slot_t *slot, uint32_t nowMs)
+{
+    // Only write when it's changed, so a busy address doesn't keep dirtying the line for nothing
+    if (atomic_load_explicit(&slot->lastSeenMs, memory_order_relaxed) != nowMs)
+        atomic_store_explicit(&slot->lastSeenMs, nowMs, memory_order_relaxed);
+}
+
+rate_limit_slot_t *rate_limit_find(uint64_t source, uint32_t nowMs, bool claim)
+{
+    // Look for the address in the slots it could be in, and if it isn't there and claim is set, take an empty one,
+    // or failing that the one seen least recently, preferring addresses with no connections open. Returns NULL if
+    // it isn't found, or another thread took the slot first, in which case the caller lets it through this time.
+    // Two threads claiming slots for the same address at once can leave it in two places, which just means it's
+    // limited a little less until one of them is reused.
+    int firstSlot = (int)((source * 0x9E3779B97F4A7C15ULL) >> 32) & (RATE_LIMIT_SLOTS - 1);
+    rate_limit_slot_t *emptySlot = NULL;
+    rate_limit_slot_t *oldestSlot = NULL;
+    uint64_t oldestSource = 0;
+    uint32_t oldestAgeMs = 0;
+    bool oldestHasConnections = true;
+    for (int i = 0; i < RATE_LIMIT_PROBES; i++)
+    {
+        rate_limit_slot_t *slot = &rateLimitSlots[(firstSlot + i) & (RATE_LIMIT_SLOTS - 1)];
+        uint64_t slotSource = atomic_load_explicit(&slot->source, memory_order_acquire);
+        if (slotSource == source)
+        {
+            rate_limit_touch(slot, nowMs);
+            return slot;
+        }
+        if (slotSource == 0)
+        {
+            if (emptySlot == NULL)
+                emptySlot = slot;
+            continue;
+        }
+
+        uint32_t ageMs = nowMs - atomic_load_explicit(&slot->lastSeenMs, memory_order_relaxed);
+        bool hasConnections = atomic_load_explicit(&slot->openConnections, memory_order_relaxed) > 0;
+        if (oldestSlot == NULL || (oldestHasConnections && !hasConnections) || (hasConnections == oldestHasConnections && ageMs > oldestAgeMs))
+        {
+            oldestSlot = slot;
+            oldestSource = slotSource;
+            oldestAgeMs = ageMs;
+            oldestHasConnections = hasConnections;
+        }
+    }
+    if (!claim)
+        return NULL;
+
+    rate_limit_slot_t *slot = emptySlot != NULL ? emptySlot : oldestSlot;
+    uint64_t expected = emptySlot != NULL ? 0 : oldestSource;
+    if (!atomic_compare_exchange_strong_explicit(&slot->source, &expected, source, memory_order_acq_rel, memory_order_relaxed))
+        return NULL;
+    if (expected != 0)
+        atomic_fetch_add(&rateLimitEvictions, 1);
+    atomic_store_explicit(&slot->connectionBucket, full_bucket(&connectionRateLimit, nowMs), memory_order_relaxed);
+    atomic_store_explicit(&slot->messageBucket, full_bucket(&messageRateLimit, nowMs), memory_order_relaxed);
+    atomic_store_explicit(&slot->lastSeenMs, nowMs, memory_order_relaxed);
+    atomic_store_explicit(&slot->openConnections, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->throttled, false, memory_order_relaxed);
+    return slot;
+}
+
+void rate_limit_refused(rate_limit_slot_t *slot)
+{
+    if (!atomic_exchange_explicit(&slot->throttled, true, memory_order_relaxed))
+        atomic_fetch_add(&rateLimitSourcesThrottled, 1);
+}
+
+bool rate_limit_connection(struct sockaddr_storage *addressInfo, bool refusable)
+{
+    // Called for each new connection before anything's been allocated for it. Returns false if it should be turned
+    // away. Connections handed over by an older server are only counted, as they were let in there already.
+    uint64_t source = rate_limit_source(addressInfo);
+    if (source == 0)
+        return true;
+    uint32_t nowMs = (uint32_t)now_ms();
+    rate_limit_slot_t *slot = rate_limit_find(source, nowMs, true);
+    if (slot == NULL)
+        return true;
+
+    bool allowed = !refusable || rate_limit_take(&slot->connectionBucket, &connectionRateLimit, nowMs);
+    if (allowed && maxConnectionsPerSource > 0)
+    {
+        if (atomic_fetch_add(&slot->openConnections, 1) >= maxConnectionsPerSource && refusable)
+        {
+            atomic_fetch_sub(&slot->openConnections, 1);
+            allowed = false;
+        }
+    }
+    if (!allowed)
+    {
+        atomic_fetch_add(&rateLimitConnectionsRefused, 1);
+        rate_limit_refused(slot);
+    }
+    return allowed;
+}
+
+void rate_limit_connection_finished(int threadId)
+{
+    // The worker's done with the connection, so it no longer counts towards the address's limit
+    worker_t *worker = &workers[threadId];
+    if (maxConnectionsPerSource <= 0 || worker->rateLimitSource == 0)
+        return;
+    rate_limit_slot_t *slot = rate_limit_find(worker->rateLimitSource, (uint32_t)now_ms(), false);
+    if (slot == NULL)
+        return; // Reused for another address while the connection was open, which has already lost count of it
+    int openConnections = atomic_load(&slot->openConnections);
+    while (openConnections > 0 && !atomic_compare_exchange_weak(&slot->openConnections, &openConnections, openConnections - 1));
+}
+
+bool rate_limit_message(int threadId)
+{
+    // Called for each message a client sends. Returns false if it's sending too fast.
+    worker_t *worker = &workers[threadId];
+    if (messageRateLimit.perSecond <= 0 || worker->rateLimitSource == 0)
+        return true;
+    uint32_t nowMs = (uint32_t)now_ms();
+    rate_limit_slot_t *slot = worker->rateLimit;
+    if (slot == NULL || atomic_load_explicit(&slot->source, memory_order_relaxed) != worker->rateLimitSource)
+        slot = worker->rateLimit = rate_limit_find(worker->rateLimitSource, nowMs, true);
+    else
+        rate_limit_touch(slot, nowMs);
+    if (slot == NULL || rate_limit_take(&slot->messageBucket, &messageRateLimit, nowMs))
+        return true;
+
+    atomic_fetch_add(&rateLimitMessagesRefused, 1);
+    rate_limit_refused(slot);
+    return false;
+}
+
+int count_rate_limited_sources()
+{
+    int numSources = 0;
+    for (int i = 0; i < RATE_LIMIT_SLOTS; i++)
+    {
+        if (atomic_load_explicit(&rateLimitSlots[i].source, memory_order_relaxed) != 0)
+            numSources++;
+    }
+    return numSources;
+}
+
+//--------------------------------------------------------------------------------------------
+// Sending/Receiving messages related
+//--------------------------------------------------------------------------------------------
+void send_client_message(int clientfileDescriptor, char *message, int threadId)
+{
+#ifdef HANGMAN_IO_URING
+    if (workers[threadId].ring != NULL)
+    {
+        // Messages are always string constants, so they're still there when the next receive sends them
+        struct iovec segment = {message, strlen(message)};
+        workers[threadId].bytesSentToClient += segment.iov_len;
+        uring_defer_sends(clientfileDescriptor, &segment, 1, threadId);
+        return;
+    }
+#endif
+
+    // MSG_NOSIGNAL stops a client that's disappeared from killing the whole server with SIGPIPE
+    int messageLength = strlen(message);
+    workers[threadId].bytesSentToClient += messageLength;
+    atomic_fetch_add_explicit(&ioSyscalls, 1, memory_order_relaxed);
+    int sendResult = send(clientfileDescriptor, message, messageLength, MSG_NOSIGNAL);
+    if (sendResult == -1)
+    {
+        thread_printf_error(threadId, "Error sending message.");
+    }
+}
+
+void flush_client_messages(int clientfileDescriptor, int threadId)
+{
+    // Make sure anything the backend is holding on to has actually been sent
+#ifdef HANGMAN_IO_URING
+    if (workers[threadId].ring != NULL)
+        uring_flush_sends(clientfileDescriptor, threadId);
+#endif
+}
+
+int receive_client_bytes(int clientfileDescriptor, int threadId, char *buffer, int maxLength)
+{
+    // Receive whatever the client has sent, up to maxLength bytes. Returns the number of bytes, or -1/0 like recv() does.
+    int numBytes;
+#ifdef HANGMAN_IO_URING
+    if (workers[threadId].ring != NULL)
+        numBytes = uring_receive_client_bytes(clientfileDescriptor, threadId, buffer, maxLength);
+    else
+#endif
+    {
+        // Only a handover to a newer server interrupts us on purpose, and only while we're waiting between games
+        do
+        {
+            atomic_fetch_add_explicit(&ioSyscalls, 1, memory_order_relaxed);
+            numBytes = recv(clientfileDescriptor, buffer, maxLength, 0);
+        } while (numBytes == -1 && errno == EINTR && !atomic_load(&workers[threadId].waitingBetweenGames));
+    }
+
+    // Record exactly what this receive handed us, so a replay splits the messages up the same way
+    if (captureFile != NULL && numBytes > 0)
+        capture_event(workers[threadId].connectionNumber, TRACE_RECEIVED, workers[threadId].bytesSentToClient, buffer, numBytes);
+    return numBytes;
+}
+
+char *receive_client_message(int clientfileDescriptor, int threadId)
+{
+    int numBytes = receive_client_bytes(clientfileDescriptor, threadId, workers[threadId].messageBuffer, MAX_MESSAGE_LENGTH - 1); // Leave room for the '\0'
+    if (numBytes == -1)
+    {
+        thread_printf_error(threadId, "Error receiving message.");
+        return NULL;
+    }
+    else if (numBytes == 0)
+    {
+        thread_printf_error(threadId, "Client has closed connection whilst server tried receiving message.");                
+        return NULL;
+    }
+
+    if (!rate_limit_message(threadId))
+    {
+        thread_printf_error(threadId, "Client is sending too fast.");
+        return NULL;
+    }
+
+    // Trim the message to its correct size
+    workers[threadId].messageBuffer[numBytes] = '\0';
+    return workers[threadId].messageBuffer;
+}
+
+void line_reader_begin(line_reader_t *lineReader, char *alreadyReceived)
+{
+    // Start off with whatever was received before we knew the client was using the compact protocol
+    int length = strlen(alreadyReceived);
+    memcpy(lineReader->buffer, alreadyReceived, length);
+    lineReader->start = 0;
+    lineReader->end = length;
+}
+
+bool line_reader_has_line(line_reader_t *lineReader)
+{
+    // Whether a complete line is already buffered, i.e. we can carry on without waiting on the client
+    return memchr(lineReader->buffer + lineReader->start, '\n', lineReader->end - lineReader->start) != NULL;
+}
+
+char *receive_client_line(int clientfileDescriptor, int threadId)
+{
+    // Returns the next line the client sent without its line ending, receiving more if we don't have a whole line yet
+    line_reader_t *lineReader = &workers[threadId].lineReader;
+    while (true)
+    {
+        char *lineStart = lineReader->buffer + lineReader->start;
+        char *lineEnd = memchr(lineStart, '\n', lineReader->end - lineReader->start);
+        if (lineEnd != NULL)
+        {
+#ifdef HANGMAN_IO_URING
+            // Carrying on without a receive, so sends still waiting for one go now, before the next command can
+            // change what they point at
+            if (workers[threadId].ring != NULL && workers[threadId].numPendingSends > 0)
+                uring_flush_sends(clientfileDescriptor, threadId);
+#endif
+            *lineEnd = '\0';
+            if (lineEnd > lineStart && lineEnd[-1] == '\r')
+                lineEnd[-1] = '\0';
+            lineReader->start = lineEnd + 1 - lineReader->buffer;
+            return lineStart;
+        }
+
+        // Move the partial line to the front to make room, and give up on lines that'll never fit
+        int partialLength = lineReader->end - lineReader->start;
+        if (partialLength >= MAX_LINE_LENGTH)
+        {
+            thread_printf_error(threadId, "Client sent a line that's too long.");
+            return NULL;
+        }
+        memmove(lineReader->buffer, lineStart, partialLength);
+        lineReader->start = 0;
+        lineReader->end = partialLength;
+
+        int numBytes = receive_client_bytes(clientfileDescriptor, threadId, lineReader->buffer + lineReader->end, LINE_BUFFER_LENGTH - lineReader->end);
+        if (numBytes == -1)
+        {
+            if (errno == EINTR)
+                return NULL; // Interrupted for a handover, which the caller checks errno for
+            thread_printf_error(threadId, "Error receiving message.");
+            return NULL;
+        }
+        else if (numBytes == 0)
+        {
+            thread_printf_error(threadId, "Client has closed connection whilst server tried receiving message.");
+            return NULL;
+        }
+        lineReader->end += numBytes;
+    }
+}
+
+//--------------------------------------------------------------------------------------------
+// Output buffer related
+//--------------------------------------------------------------------------------------------
+void output_sent(output_buffer_t *output)
+{
+    // Everything added so far has gone out, so the scratch space can be reused and the frames let go of
+    output->scratchUsed = 0;
+    for (int i = 0; i < output->numFrames; i++)
+        frame_release(output->frames[i]);
+    output->numFrames = 0;
+}
+
+void output_begin(output_buffer_t *output, int clientfileDescriptor, int threadId)
+{
+    output->clientfileDescriptor = clientfileDescriptor;
+    output->threadId = threadId;
+    output->numSegments = 0;
+    output->failed = false;
+    output_sent(output); // Drops anything a previous connection left behind, e.g. if it went away mid-send
+}
+
+bool output_write_segments(output_buffer_t *output, bool moreToCome)
+{
+    // Write out all the segments with as few sendmsg() calls as possible, picking up where we left off after a short write
+    struct iovec *segments = output->segments;
+    int numSegments = output->numSegments;
+    while (numSegments > 0)
+    {
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = segments;
+        message.msg_iovlen = numSegments;
+
+        atomic_fetch_add_explicit(&ioSyscalls, 1, memory_order_relaxed);
+        ssize_t numBytesSent = sendmsg(output->clientfileDescriptor, &message, MSG_NOSIGNAL | (moreToCome ? MSG_MORE : 0));
+        if (numBytesSent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            thread_printf_error(output->threadId, "Error sending message.");
+            return false;
+        }
+
+        // Skip over whatever was fully sent and trim the segment that was only partly sent
+        while (numSegments > 0 && (size_t)numBytesSent >= segments->iov_len)
+        {
+            numBytesSent -= segments->iov_len;
+            segments++;
+            numSegments--;
+        }
+        if (numSegments > 0)
+        {
+            segments->iov_base = (char *)segments->iov_base + numBytesSent;
+            segments->iov_len -= numBytesSent;
+        }
+    }
+
+    return true;
+}
+
+bool output_flush(output_buffer_t *output, bool moreToCome)
+{
+    // Send everything that's been added. Set moreToCome if another reply will follow straight away,
+    // so the kernel can hold on to this one (MSG_MORE) and put them in the same packet.
+    if (output->numSegments > 0 && !output->failed)
+    {
+        for (int i = 0; i < output->numSegments; i++)
+            workers[output->threadId].bytesSentToClient += output->segments[i].iov_len;
+#ifdef HANGMAN_IO_URING
+        if (workers[output->threadId].ring != NULL)
+        {
+            // The io_uring backend sends linked to the next receive, so the scratch space and frames
+            // are only let go of once that's happened
+            uring_defer_sends(output->clientfileDescriptor, output->segments, output->numSegments, output->threadId);
+            output->numSegments = 0;
+            return true;
+        }
+#endif
+        output->failed = !output_write_segments(output, moreToCome);
+    }
+
+    output->numSegments = 0;
+#ifdef HANGMAN_IO_URING
+    if (workers[output->threadId].ring != NULL)
+        return !output->failed;
+#endif
+    output_sent(output);
+    return !output->failed;
+}
+
+void output_add(output_buffer_t *output, char *data, size_t length)
+{
+    // Add a segment pointing at the caller's data, which must stay untouched until the next flush
+    if (length == 0)
+        return;
+
+    // If this carries straight on from the last segment (e.g. consecutive scratch values) just extend it
+    if (output->numSegments > 0)
+    {
+        struct iovec *lastSegment = &output->segments[output->numSegments - 1];
+        if ((char *)lastSegment->iov_base + lastSegment->iov_len == data)
+        {
+            lastSegment->iov_len += length;
+            return;
+        }
+    }
+
+    if (output->numSegments == MAX_OUTPUT_SEGMENTS)
+        output_flush(output, true);
+
+    output->segments[output->numSegments].iov_base = data;
+    output->segments[output->numSegments].iov_len = length;
+    output->numSegments++;
+}
+
+void output_add_string(output_buffer_t *output, char *string)
+{
+    output_add(output, string, strlen(string));
+}
+
+void output_send_now(output_buffer_t *output)
+{
+    // Make sure everything added so far has actually gone out, even on backends that would hold on to it
+    output_flush(output, true);
+    flush_client_messages(output->clientfileDescriptor, output->threadId);
+}
+
+void output_add_frame(output_buffer_t *output, frame_t *frame)
+{
+    // Add a frame without copying it. The output keeps its own reference until the frame's been sent.
+    if (output->numFrames == MAX_OUTPUT_FRAMES)
+        output_send_now(output);
+    frame_retain(frame);
+    output->frames[output->numFrames++] = frame;
+    output_add(output, frame->data, frame->length);
+}
+
+char *output_reserve_scratch(output_buffer_t *output, int length)
+{
+    // Scratch space is only reused once it's been sent, since earlier segments may still point into it
+    if (output->scratchUsed + length > OUTPUT_SCRATCH_LENGTH)
+        output_send_now(output);
+
+    char *reserved = output->scratch + output->scratchUsed;
+    output->scratchUsed += length;
+    return reserved;
+}
+
+void output_add_int(output_buffer_t *output, int value)
+{
+    char formatted[16];
+    int length = sprintf(formatted, "%d", value);
+    char *scratch = output_reserve_scratch(output, length);
+    memcpy(scratch, formatted, length);
+    output_add(output, scratch, length);
+}
+
+void output_add_unsigned_long(output_buffer_t *output, unsigned long value)
+{
+    char formatted[24];
+    int length = sprintf(formatted, "%lu", value);
+    char *scratch = output_reserve_scratch(output, length);
+    memcpy(scratch, formatted, length);
+    output_add(output, scratch, length);
+}
+
+void output_add_char(output_buffer_t *output, char character)
+{
+    char *scratch = output_reserve_scratch(output, 1);
+    *scratch = character;
+    output_add(output, scratch, 1);
+}
+
+//--------------------------------------------------------------------------------------------
+// Spectator related
+//--------------------------------------------------------------------------------------------
+frame_t *frame_create(int length)
+{
+    // The caller gets the first reference. +1 for the '\0' snprintf() wants to write.
+    frame_t *frame = custom_malloc(sizeof(frame_t) + length + 1);
+    atomic_init(&frame->refCount, 1);
+    frame->length = length;
+    return frame;
+}
+
+void frame_retain(frame_t *frame)
+{
+    atomic_fetch_add_explicit(&frame->refCount, 1, memory_order_relaxed);
+}
+
+void frame_release(frame_t *frame)
+{
+    if (atomic_fetch_sub_explicit(&frame->refCount, 1, memory_order_acq_rel) == 1)
+        free(frame);
+}
+
+void wake_spectator_thread()
+{
+    uint64_t one = 1;
+    if (spectatorWakefileDescriptor != -1 && write(spectatorWakefileDescriptor, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        perror("eventfd write");
+}
+
+void queue_spectator_frame(spectator_t *spectator, frame_t *frame)
+{
+    // Must be called with spectatorMutex locked. Every frame is a whole game state, so when a spectator falls too far
+    // behind the oldest frame it hasn't started sending is simply skipped, rather than making anyone wait.
+    if (spectator->numQueuedFrames == SPECTATOR_QUEUE_LENGTH && spectator->liveGame->deltas)
+    {
+        spectator->fellBehind = true;
+        return;
+    }
+    if (spectator->numQueuedFrames == SPECTATOR_QUEUE_LENGTH)
+    {
+        frame_release(spectator->queuedFrames[spectator->firstQueuedFrame]);
+        spectator->firstQueuedFrame = (spectator->firstQueuedFrame + 1) % SPECTATOR_QUEUE_LENGTH;
+        spectator->numQueuedFrames--;
+        atomic_fetch_add_explicit(&framesSkipped, 1, memory_order_relaxed);
+    }
+
+    frame_retain(frame);
+    int lastQueuedFrame = (spectator->firstQueuedFrame + spectator->numQueuedFrames) % SPECTATOR_QUEUE_LENGTH;
+    spectator->queuedFrames[lastQueuedFrame] = frame;
+    spectator->numQueuedFrames++;
+}
+
+live_game_t *register_live_game(char *username)
+{
+    // Every game can be watched, but nothing gets encoded for it unless somebody is
+    live_game_t *liveGame = custom_calloc(1, sizeof(live_game_t));
+    liveGame->username = username;
+    atomic_init(&liveGame->numSpectators, 0);
+
+    pthread_mutex_lock(&spectatorMutex);
+    liveGame->liveId = ++nextLiveId;
+    liveGame->next = liveGames;
+    if (liveGames != NULL)
+        liveGames->previous = liveGame;
+    liveGames = liveGame;
+    numLiveGames++;
+    pthread_mutex_unlock(&spectatorMutex);
+
+    return liveGame;
+}
+
+void unregister_live_game(live_game_t *liveGame)
+{
+    // The game's over, so its spectators get disconnected once they've been sent whatever's left in their queues
+    pthread_mutex_lock(&spectatorMutex);
+    if (liveGame->previous != NULL)
+        liveGame->previous->next = liveGame->next;
+    else
+        liveGames = liveGame->next;
+    if (liveGame->next != NULL)
+        liveGame->next->previous = liveGame->previous;
+    numLiveGames--;
+
+    bool anyWatching = liveGame->spectators != NULL;
+    for (spectator_t *spectator = liveGame->spectators; spectator != NULL; spectator = spectator->nextInGame)
+    {
+        spectator->liveGame = NULL;
+        spectator->gameOver = true;
+    }
+    pthread_mutex_unlock(&spectatorMutex);
+
+    free(liveGame);
+    if (anyWatching)
+        wake_spectator_thread();
+}
+
+void publish_frame(live_game_t *liveGame, frame_t *frame)
+{
+    // Hands the frame to every spectator of the game without copying it. Takes over the caller's reference.
+    pthread_mutex_lock(&spectatorMutex);
+    for (spectator_t *spectator = liveGame->spectators; spectator != NULL; spectator = spectator->nextInGame)
+        queue_spectator_frame(spectator, frame);
+    pthread_mutex_unlock(&spectatorMutex);
+    frame_release(frame);
+
+    atomic_fetch_add_explicit(&framesPublished, 1, memory_order_relaxed);
+    wake_spectator_thread();
+}
+
+void attach_spectator(int clientfileDescriptor, live_game_t *liveGame, frame_t *firstFrame)
+{
+    // Must be called with spectatorMutex locked. firstFrame goes out before anything else. From here on the socket is
+    // only written to without blocking, so a slow spectator can't hold anyone up. It's set up before the spectator goes
+    // on the list, since the fan-out thread may remove it (and close the socket) as soon as it's there.
+    spectator_t *spectator = custom_calloc(1, sizeof(spectator_t));
+    spectator->fileDescriptor = clientfileDescriptor;
+    spectator->liveGame = liveGame;
+    queue_spectator_frame(spectator, firstFrame);
+    if (liveGame->latestState[0] != '\0')
+    {
+        int length = snprintf(NULL, 0, REPLY_FRAME " %d %s\n", liveGame->liveId, liveGame->latestState);
+        frame_t *latestFrame = frame_create(length);
+        snprintf(latestFrame->data, length + 1, REPLY_FRAME " %d %s\n", liveGame->liveId, liveGame->latestState);
+        queue_spectator_frame(spectator, latestFrame);
+        frame_release(latestFrame);
+    }
+
+    fcntl(clientfileDescriptor, F_SETFL, fcntl(clientfileDescriptor, F_GETFL) | O_NONBLOCK);
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = spectator;
+    if (epoll_ctl(spectatorEpollfileDescriptor, EPOLL_CTL_ADD, clientfileDescriptor, &event) == -1)
+        perror("epoll_ctl");
+
+    spectator->nextInGame = liveGame->spectators;
+    liveGame->spectators = spectator;
+    atomic_fetch_add_explicit(&liveGame->numSpectators, 1, memory_order_relaxed);
+    spectator->next = spectators;
+    spectators = spectator;
+    numSpectators++;
+}
+
+bool add_spectator(int clientfileDescriptor, int liveId)
+{
+    // Hand the client's socket over to the fan-out thread to watch the given game. Returns false if there's no such game.
+    // The OK goes out through the fan-out thread too, so it can't end up behind the first frame.
+    frame_t *okFrame = frame_create(strlen(REPLY_OK) + 1);
+    sprintf(okFrame->data, REPLY_OK "\n");
+
+    pthread_mutex_lock(&spectatorMutex);
+    live_game_t *liveGame = liveGames;
+    while (liveGame != NULL && liveGame->liveId != liveId)
+        liveGame = liveGame->next;
+    if (liveGame != NULL)
+        attach_spectator(clientfileDescriptor, liveGame, okFrame);
+    pthread_mutex_unlock(&spectatorMutex);
+    frame_release(okFrame);
+
+    if (liveGame == NULL)
+        return false;
+    wake_spectator_thread();
+    return true;
+}
+
+void add_leaderboard_subscriber(int clientfileDescriptor, frame_t *firstFrame)
+{
+    // Must be called with the leaderboard read locked, so no change can slip in between firstFrame and the next delta
+    pthread_mutex_lock(&spectatorMutex);
+    attach_spectator(clientfileDescriptor, &leaderboardSubscribers, firstFrame);
+    pthread_mutex_unlock(&spectatorMutex);
+    wake_spectator_thread();
+}
+
+void remove_spectator(spectator_t *spectator)
+{
+    // Only called by the fan-out thread, which is the only one that removes spectators from the list
+    pthread_mutex_lock(&spectatorMutex);
+    spectator_t **link = &spectators;
+    while (*link != spectator)
+        link = &(*link)->next;
+    *link = spectator->next;
+    if (spectator->liveGame != NULL)
+    {
+        link = &spectator->liveGame->spectators;
+        while (*link != spectator)
+            link = &(*link)->nextInGame;
+        *link = spectator->nextInGame;
+        atomic_fetch_sub_explicit(&spectator->liveGame->numSpectators, 1, memory_order_relaxed);
+    }
+    for (int i = 0; i < spectator->numQueuedFrames; i++)
+        frame_release(spectator->queuedFrames[(spectator->firstQueuedFrame + i) % SPECTATOR_QUEUE_LENGTH]);
+    numSpectators--;
+    pthread_mutex_unlock(&spectatorMutex);
+
+    if (spectator->sendingFrame != NULL)
+        frame_release(spectator->sendingFrame);
+    epoll_ctl(spectatorEpollfileDescriptor, EPOLL_CTL_DEL, spectator->fileDescriptor, NULL);
+    close(spectator->fileDescriptor);
+    free(spectator);
+}
+
+void set_spectator_waiting_to_write(spectator_t *spectator, bool waitingToWrite)
+{
+    if (spectator->waitingToWrite == waitingToWrite)
+        return;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | (waitingToWrite ? EPOLLOUT : 0);
+    event.data.ptr = spectator;
+    epoll_ctl(spectatorEpollfileDescriptor, EPOLL_CTL_MOD, spectator->fileDescriptor, &event);
+    spectator->waitingToWrite = waitingToWrite;
+}
+
+bool service_spectator(spectator_t *spectator, long long nowMs)
+{
+    // Send the spectator as much as its socket will take right now. Returns false once it should be disconnected.
+    while (true)
+    {
+
+        if (spectator->sendingFrame == NULL)
+        {
+            pthread_mutex_lock(&spectatorMutex);
+            if (spectator->numQueuedFrames > 0)
+            {
+                spectator->sendingFrame = spectator->queuedFrames[spectator->firstQueuedFrame];
+                spectator->firstQueuedFrame = (spectator->firstQueuedFrame + 1) % SPECTATOR_QUEUE_LENGTH;
+                spectator->numQueuedFrames--;
+                spectator->bytesSent = 0;
+            }
+            bool gameOver = spectator->gameOver;
+            bool fellBehind = spectator->fellBehind;
+            pthread_mutex_unlock(&spectatorMutex);
+
+            if (fellBehind)
+            {
+                atomic_fetch_add_explicit(&spectatorsDropped, 1, memory_order_relaxed);
+                return false;
+            }
+
+            if (spectator->sendingFrame == NULL)
+            {
+                set_spectator_waiting_to_write(spectator, false);
+                return !gameOver;
+            }
+        }
+
+        frame_t *frame = spectator->sendingFrame;
+        atomic_fetch_add_explicit(&ioSyscalls, 1, memory_order_relaxed);
+        ssize_t numBytesSent = send(spectator->fileDescriptor, frame->data + spectator->bytesSent, frame->length - spectator->bytesSent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (numBytesSent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                atomic_fetch_add_explicit(&spectatorsDropped, 1, memory_order_relaxed);
+                return false;
+            }
+
+            // The socket's full. Carry on when it drains, unless it's been stuck for too long.
+            set_spectator_waiting_to_write(spectator, true);
+            if (spectator->stalledSinceMs == 0)
+                spectator->stalledSinceMs = nowMs;
+            if (nowMs - spectator->stalledSinceMs >= SPECTATOR_STALL_TIMEOUT_MS)
+            {
+                atomic_fetch_add_explicit(&spectatorsDropped, 1, memory_order_relaxed);
+                return false;
+            }
+            return true;
+        }
+
+        spectator->stalledSinceMs = 0;
+        spectator->bytesSent += numBytesSent;
+        if (spectator->bytesSent == frame->length)
+        {
+            frame_release(frame);
+            spectator->sendingFrame = NULL;
+            atomic_fetch_add_explicit(&framesSent, 1, memory_order_relaxed);
+        }
+    }
+}
+
+bool spectator_hung_up(spectator_t *spectator)
+{
+    // Spectators have nothing more to say, so anything they send is thrown away. Returns true if they've gone.
+    char discard[MAX_MESSAGE_LENGTH];
+    while (true)
+    {
+        ssize_t numBytes = recv(spectator->fileDescriptor, discard, sizeof(discard), MSG_DONTWAIT);
+        if (numBytes > 0)
+            continue;
+        return numBytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+    }
+}
+
+void spectator_fan_out_loop()
+{
+    // One thread sends every spectator its frames, so watching a game never ties up a worker or the player
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (!spectatorThreadStopping)
+    {
+        int numEvents = epoll_wait(spectatorEpollfileDescriptor, events, MAX_EPOLL_EVENTS, SPECTATOR_CHECK_INTERVAL_MS);
+        for (int i = 0; i < numEvents; i++)
+        {
+            spectator_t *spectator = events[i].data.ptr;
+            if (spectator == NULL)
+            {
+                uint64_t numWakeups;
+                if (read(spectatorWakefileDescriptor, &numWakeups, sizeof(numWakeups)) == -1 && errno != EAGAIN)
+                    perror("eventfd read");
+            }
+            else if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && spectator_hung_up(spectator))
+            {
+                remove_spectator(spectator);
+            }
+        }
+
+        // Spectators only get added at the head of the list, and we're the only ones removing them,
+        // so the list can be walked without holding the lock the whole time
+        long long nowMs = now_ms();
+        pthread_mutex_lock(&spectatorMutex);
+        spectator_t *spectator = spectators;
+        pthread_mutex_unlock(&spectatorMutex);
+        while (spectator != NULL)
+        {
+            spectator_t *nextSpectator = spectator->next;
+            if (!service_spectator(spectator, nowMs))
+                remove_spectator(spectator);
+            spectator = nextSpectator;
+        }
+    }
+}
+
+void start_spectator_fan_out()
+{
+    spectatorEpollfileDescriptor = epoll_create1(0);
+    spectatorWakefileDescriptor = eventfd(0, EFD_NONBLOCK);
+    if (spectatorEpollfileDescriptor == -1 || spectatorWakefileDescriptor == -1)
+    {
+        perror("spectator fan-out");
+        perform_clean_exit(1);
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(spectatorEpollfileDescriptor, EPOLL_CTL_ADD, spectatorWakefileDescriptor, &event);
+
+    if (pthread_create(&spectatorThread, NULL, (void *(*)(void *))spectator_fan_out_loop, NULL) != 0)
+    {
+        perror("pthread_create");
+        perform_clean_exit(1);
+    }
+    spectatorThreadRunning = true;
+}
+
+void stop_spectator_fan_out()
+{
+    // Called once the workers have stopped, so no more frames or spectators can turn up
+    if (spectatorThreadRunning)
+    {
+        spectatorThreadStopping = true;
+        wake_spectator_thread();
+        pthread_join(spectatorThread, NULL);
+        spectatorThreadRunning = false;
+    }
+
+    while (spectators != NULL)
+        remove_spectator(spectators);
+    if (spectatorEpollfileDescriptor != -1)
+        close(spectatorEpollfileDescriptor);
+    if (spectatorWakefileDescriptor != -1)
+        close(spectatorWakefileDescriptor);
+    spectatorEpollfileDescriptor = -1;
+    spectatorWakefileDescriptor = -1;
+}
+
+//--------------------------------------------------------------------------------------------
+// Leaderboard related
+//--------------------------------------------------------------------------------------------
+void read_lock()
+{
+    // Lock the read count so we don't have multiple readers accidentally screwing it up
+    long long waitStartUs = span_begin();
+	pthread_mutex_lock(&leaderboardReadMutex);
+    pthread_mutex_lock(&leaderboardReadCountMutex);
+    leaderboardReadCount++;
+    
+    // If this is the only active reader, lock the leaderboard so we can't write to it
+	if (leaderboardReadCount == 1)
+        pthread_mutex_lock(&leaderboardWriteMutex);
+        
+    // Unlock the read count so other readers can come join the fun
+	pthread_mutex_unlock(&leaderboardReadCountMutex);
+	pthread_mutex_unlock(&leaderboardReadMutex);
+    span_end("leaderboard read wait", waitStartUs);
+    leaderboardLockedAtUs = span_begin();
+}
+
+void read_unlock()
+{
+    span_end("leaderboard read hold", leaderboardLockedAtUs);
+
+    // Lock the read count as we're messing with it again
+	pthread_mutex_lock(&leaderboardReadCountMutex);
+    leaderboardReadCount--;
+    
+    // If this is the last active reader, unlock the leaderboard so it can be written to again
+	if (leaderboardReadCount == 0)
+        pthread_mutex_unlock(&leaderboardWriteMutex);
+        
+    // We're finished with the read count
+	pthread_mutex_unlock(&leaderboardReadCountMutex);
+}
+
+void write_lock()
+{
+    // Can only write if there are no readers reading and no other writers writing
+    long long waitStartUs = span_begin();
+	pthread_mutex_lock(&leaderboardReadMutex);
+	pthread_mutex_lock(&leaderboardWriteMutex);
+    span_end("leaderboard write wait", waitStartUs);
+    leaderboardLockedAtUs = span_begin();
+}
+
+void write_unlock()
+{
+    span_end("leaderboard write hold", leaderboardLockedAtUs);
+
+    // Let all other readers and writers have their fun once again
+	pthread_mutex_unlock(&leaderboardWriteMutex);
+	pthread_mutex_unlock(&leaderboardReadMutex);
+}
+
+double get_percentage_won(leaderboard_item_t *item)
+{
+    double gamesWon = (double)item->gamesWon;
+    double totalGames = (double)item->totalGames;
+    return gamesWon / totalGames;
+}
+
+bool send_leaderboard(int clientfileDescriptor, int threadId)
+{
+    output_buffer_t *output = &workers[threadId].output;
+    char* receivedMessage;
+
+    // Lock the leaderboard so no writers can write to it whilst we're reading and stuff
+    sync_shared_leaderboard();
+    read_lock();
+
+    // First send the number of items in the leaderboard
+    output_begin(output, clientfileDescriptor, threadId);
+    output_add_int(output, numLeaderboardItems);
+    output_flush(output, false);
+    receivedMessage = receive_client_message(clientfileDescriptor, threadId); // Verify that the client received the message
+    if (receivedMessage == NULL) 
+    {
+        read_unlock();
+        return false;
+    }
+
+    // Now send each item individually
+    leaderboard_item_t *item = leaderboardItems;    
+    for (int i = 0; i < numLeaderboardItems; i++)
+    {
+        // Each row points straight at the username rather than copying it
+        output_add_string(output, item->username);
+        output_add_char(output, '|');
+        output_add_int(output, item->gamesWon);
+        output_add_char(output, '|');
+        output_add_int(output, item->totalGames);
+        output_flush(output, false);
+        receivedMessage = receive_client_message(clientfileDescriptor, threadId); // Verify that the client received the message
+        if (receivedMessage == NULL) 
+        {
+            read_unlock();
+            return false;
+        }
+
+        item = item->next;
+    }
+
+    // Unlock the leaderboard
+    read_unlock();
+
+    // Indicate the server is ready to continue to the main menu
+    send_client_message(clientfileDescriptor, "Y", threadId);
+
+    // Return true as we encountered no errors
+    return true;
+}
+
+int compare_leaderboard_items(leaderboard_item_t *item1, leaderboard_item_t *item2)
+{
+    // This function works similary to the strcmp function.
+    // Returns value < 0 if item1 < item2
+    // Returns value = 0 if item1 == item2
+    // Returns value > 0 if item1 > item2
+    // Determined by, in order of precedence:
+    //  - Games won (Ascending)
+    //  - Percentage of games won (Ascending)
+    //  - Alphabetical order
+    if (item1->gamesWon < item2->gamesWon)
+    {
+        return -1;
+    }
+    else if (item1->gamesWon == item2->gamesWon)
+    {
+        if (item1->percentageWon < item2->percentageWon)
+        {
+            return -1;
+        }
+        else if (item1->percentageWon == item2->percentageWon)
+        {
+            return strcmp(item1->username, item2->username);
+        }
+    }
+
+    return 1;
+}
+
+void link_leaderboard_item(leaderboard_item_t *previousItem, leaderboard_item_t *item)
+{
+    // Put the item straight after previousItem, or at the head of the list if that's NULL
+    item->previous = previousItem;
+    item->next = previousItem != NULL ? previousItem->next : leaderboardItems;
+    if (item->next != NULL)
+        item->next->previous = item;
+    else
+        leaderboardTail = item;
+    if (previousItem != NULL)
+        previousItem->next = item;
+    else
+        leaderboardItems = item;
+}
+
+void unlink_leaderboard_item(leaderboard_item_t *item)
+{
+    if (item->previous != NULL)
+        item->previous->next = item->next;
+    else
+        leaderboardItems = item->next;
+    if (item->next != NULL)
+        item->next->previous = item->previous;
+    else
+        leaderboardTail = item->previous;
+}
+
+void move_leaderboard_item_to_correct_pos(leaderboard_item_t *item)
+{
+    // A win only ever moves an item up and a loss (a lower percentage) only down, so start where the item
+    // is and walk whichever way it needs to go
+    leaderboard_item_t *previousItem = item->previous;
+    unlink_leaderboard_item(item);
+    while (previousItem != NULL && compare_leaderboard_items(previousItem, item) > 0)
+        previousItem = previousItem->previous;
+
+    leaderboard_item_t *nextItem = previousItem != NULL ? previousItem->next : leaderboardItems;
+    while (nextItem != NULL && compare_leaderboard_items(nextItem, item) < 0)
+    {
+        previousItem = nextItem;
+        nextItem = nextItem->next;
+    }
+    link_leaderboard_item(previousItem, item);
+}
+
+leaderboard_item_t *add_leaderboard_item(char* currentUser, bool gameWon)
+{
+    leaderboard_item_t *newItem = custom_malloc(sizeof(leaderboard_item_t));
+    newItem->username = currentUser;
+    newItem->gamesWon = gameWon ? 1 : 0;
+    newItem->totalGames = 1;
+    newItem->percentageWon = get_percentage_won(newItem);
+    newItem->version = 0;
+    newItem->newerChange = NULL;
+    newItem->olderChange = NULL;
+    numLeaderboardItems++;    
+
+    // Start it off at the head of the linked list and move it up to where it belongs
+    link_leaderboard_item(NULL, newItem);
+    move_leaderboard_item_to_correct_pos(newItem);
+
+    return newItem;
+}
+
+void update_leaderboard_item(leaderboard_item_t *item, bool gameWon)
+{
+    if (gameWon)
+    {
+        item->gamesWon++;
+    }
+    item->totalGames++;
+    item->percentageWon = get_percentage_won(item);
+
+    // See if this user's position in the leaderboard needs to be updated
+    move_leaderboard_item_to_correct_pos(item);
+}
+
+bool is_in_top_leaderboard(leaderboard_item_t *item)
+{
+    // Must be called with the leaderboard locked. Only looks at the top rows, however big the leaderboard gets.
+    leaderboard_item_t *topItem = leaderboardTail;
+    for (int i = 0; i < topLeaderboardSize && topItem != NULL; i++, topItem = topItem->previous)
+    {
+        if (topItem == item)
+            return true;
+    }
+    return false;
+}
+
+int format_top_leaderboard(char *buffer, size_t bufferSize)
+{
+    // Must be called with the leaderboard locked. Writes "TOP <rows>" then a row per player, best first.
+    // Returns the length, like snprintf().
+    int numRows = numLeaderboardItems < topLeaderboardSize ? numLeaderboardItems : topLeaderboardSize;
+    int length = snprintf(buffer, bufferSize, REPLY_TOP " %d\n", numRows);
+    leaderboard_item_t *item = leaderboardTail;
+    for (int i = 0; i < numRows; i++, item = item->previous)
+    {
+        size_t remaining = (size_t)length < bufferSize ? bufferSize - length : 0;
+        length += snprintf(remaining > 0 ? buffer + length : NULL, remaining, "%s|%d|%d\n", item->username, item->gamesWon, item->totalGames);
+    }
+
+    return length;
+}
+
+void rebuild_top_leaderboard()
+{
+    // Must be called with the leaderboard write locked. Anyone still sending the old frame keeps their own reference.
+    int length = format_top_leaderboard(NULL, 0);
+    frame_t *frame = frame_create(length);
+    format_top_leaderboard(frame->data, length + 1);
+
+    if (topLeaderboard != NULL)
+        frame_release(topLeaderboard);
+    topLeaderboard = frame;
+    topLeaderboardRebuilds++;
+}
+
+void mark_leaderboard_item_changed(leaderboard_item_t *item, unsigned long version)
+{
+    // Must be called with the leaderboard write locked. Moves the leaderboard on to the given version, which is newer
+    // than any so far, and the item to the front of the changes.
+    if (item->version != 0)
+    {
+        if (item->newerChange != NULL)
+            item->newerChange->olderChange = item->olderChange;
+        else
+            newestChange = item->olderChange;
+        if (item->olderChange != NULL)
+            item->olderChange->newerChange = item->newerChange;
+    }
+
+    item->version = version;
+    leaderboardVersion = version;
+    item->newerChange = NULL;
+    item->olderChange = newestChange;
+    if (newestChange != NULL)
+        newestChange->newerChange = item;
+    newestChange = item;
+}
+
+int format_leaderboard_changes(char *buffer, size_t bufferSize, unsigned long sinceVersion)
+{
+    // Must be called with the leaderboard locked. Writes "NOTMODIFIED <version>" if nothing's changed since the given
+    // version, otherwise "DELTA <since> <version> <rows>" followed by a row for each item that has. A version from
+    // the future (e.g. from before a restart) gets everything. Returns the length, like snprintf().
+    if (sinceVersion == leaderboardVersion)
+        return snprintf(buffer, bufferSize, REPLY_NOT_MODIFIED " %lu\n", leaderboardVersion);
+    if (sinceVersion > leaderboardVersion)
+        sinceVersion = 0;
+
+    int numChanged = 0;
+    for (leaderboard_item_t *item = newestChange; item != NULL && item->version > sinceVersion; item = item->olderChange)
+        numChanged++;
+
+    int length = snprintf(buffer, bufferSize, REPLY_DELTA " %lu %lu %d\n", sinceVersion, leaderboardVersion, numChanged);
+    for (leaderboard_item_t *item = newestChange; item != NULL && item->version > sinceVersion; item = item->olderChange)
+    {
+        size_t remaining = (size_t)length < bufferSize ? bufferSize - length : 0;
+        length += snprintf(remaining > 0 ? buffer + length : NULL, remaining, "%s|%d|%d\n", item->username, item->gamesWon, item->totalGames);
+    }
+
+    return length;
+}
+
+frame_t *encode_leaderboard_changes(unsigned long sinceVersion)
+{
+    // Must be called with the leaderboard locked. Sizes the frame with a dry run first.
+    int length = format_leaderboard_changes(NULL, 0, sinceVersion);
+    frame_t *frame = frame_create(length);
+    format_leaderboard_changes(frame->data, length + 1, sinceVersion);
+    return frame;
+}
+
+//--------------------------------------------------------------------------------------------
+// Leaderboard windows related
+//--------------------------------------------------------------------------------------------
+void clear_window_bucket(leaderboard_window_t *window, window_bucket_t *bucket)
+{
+    // Must be called with windowMutex locked. Takes the bucket's results back off the window's totals.
+    for (int i = 0; i < numUsers; i++)
+    {
+        int won = atomic_exchange_explicit(&bucket->gamesWon[i], 0, memory_order_relaxed);
+        int played = atomic_exchange_explicit(&bucket->gamesPlayed[i], 0, memory_order_relaxed);
+        if (played != 0)
+        {
+            atomic_fetch_sub_explicit(&window->gamesWon[i], won, memory_order_relaxed);
+            atomic_fetch_sub_explicit(&window->gamesPlayed[i], played, memory_order_relaxed);
+            atomic_store_explicit(&window->changed, true, memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&bucket->epoch, -1, memory_order_relaxed);
+}
+
+void advance_window(leaderboard_window_t *window, long long epoch)
+{
+    // Must be called with windowMutex locked. Clears every bucket that's fallen out of the window ending at the
+    // given epoch, then hands that epoch's slot out. Writers only look at the tag once it's been set, so they
+    // never see a bucket that's half cleared.
+    if (epoch <= window->currentEpoch)
+        return;
+
+    for (int i = 0; i <= window->numBuckets; i++)
+    {
+        long long bucketEpoch = atomic_load_explicit(&window->buckets[i].epoch, memory_order_relaxed);
+        if (bucketEpoch != -1 && bucketEpoch <= epoch - window->numBuckets)
+            clear_window_bucket(window, &window->buckets[i]);
+    }
+
+    atomic_store_explicit(&window->buckets[epoch % (window->numBuckets + 1)].epoch, epoch, memory_order_release);
+    window->currentEpoch = epoch;
+    windowRotations++;
+}
+
+void record_windowed_result(int userIndex, int gamesWon, int gamesPlayed)
+{
+    // Add finished games to every window, normally just the one. That's a handful of atomic adds. Only the first
+    // result in a new bucket has to take windowMutex to rotate the ring.
+    if (userIndex < 0)
+        return;
+
+    long long nowMs = now_ms();
+    for (int i = 0; i < NUM_LEADERBOARD_WINDOWS; i++)
+    {
+        leaderboard_window_t *window = &leaderboardWindows[i];
+        long long epoch = nowMs / window->bucketMs;
+        window_bucket_t *bucket = &window->buckets[epoch % (window->numBuckets + 1)];
+        if (atomic_load_explicit(&bucket->epoch, memory_order_acquire) != epoch)
+        {
+            pthread_mutex_lock(&windowMutex);
+            advance_window(window, epoch);
+            pthread_mutex_unlock(&windowMutex);
+        }
+
+        atomic_fetch_add_explicit(&bucket->gamesWon[userIndex], gamesWon, memory_order_relaxed);
+        atomic_fetch_add_explicit(&bucket->gamesPlayed[userIndex], gamesPlayed, memory_order_relaxed);
+        atomic_fetch_add_explicit(&window->gamesWon[userIndex], gamesWon, memory_order_relaxed);
+        atomic_fetch_add_explicit(&window->gamesPlayed[userIndex], gamesPlayed, memory_order_relaxed);
+        atomic_store_explicit(&window->changed, true, memory_order_relaxed);
+    }
+}
+
+int compare_window_rows(const void *row1, const void *row2)
+{
+    // Best first, ranked the same way as the main leaderboard
+    return compare_leaderboard_items((leaderboard_item_t *)row2, (leaderboard_item_t *)row1);
+}
+
+frame_t *encode_window_summary(leaderboard_window_t *window)
+{
+    // Snapshot the window's totals and encode its top WINDOW_TOP_K as "WINDOW <name> <rows>" and a row per user.
+    // The counters may move while we read them, which only means the summary is a game or so out.
+    leaderboard_item_t *rows = custom_calloc(numUsers > 0 ? numUsers : 1, sizeof(leaderboard_item_t));
+    int numRows = 0;
+    for (int i = 0; i < numUsers; i++)
+    {
+        int played = atomic_load_explicit(&window->gamesPlayed[i], memory_order_relaxed);
+        if (played <= 0)
+            continue;
+        rows[numRows].username = users[i].username;
+        rows[numRows].gamesWon = atomic_load_explicit(&window->gamesWon[i], memory_order_relaxed);
+        rows[numRows].totalGames = played;
+        rows[numRows].percentageWon = get_percentage_won(&rows[numRows]);
+        numRows++;
+    }
+    qsort(rows, numRows, sizeof(leaderboard_item_t), compare_window_rows);
+    if (numRows > WINDOW_TOP_K)
+        numRows = WINDOW_TOP_K;
+
+    int length = snprintf(NULL, 0, REPLY_WINDOW " %s %d\n", window->name, numRows);
+    for (int i = 0; i < numRows; i++)
+        length += snprintf(NULL, 0, "%s|%d|%d\n", rows[i].username, rows[i].gamesWon, rows[i].totalGames);
+
+    frame_t *frame = frame_create(length);
+    int written = snprintf(frame->data, length + 1, REPLY_WINDOW " %s %d\n", window->name, numRows);
+    for (int i = 0; i < numRows; i++)
+        written += snprintf(frame->data + written, length + 1 - written, "%s|%d|%d\n", rows[i].username, rows[i].gamesWon, rows[i].totalGames);
+
+    free(rows);
+    return frame;
+}
+
+void refresh_leaderboard_windows()
+{
+    // Called by the pool manager on every pass. Rotates out buckets that have expired even if nobody's played
+    // since, and rebuilds the summaries of windows that have changed. Queries just send the last summary built.
+    long long nowMs = now_ms();
+    for (int i = 0; i < NUM_LEADERBOARD_WINDOWS; i++)
+    {
+        leaderboard_window_t *window = &leaderboardWindows[i];
+        pthread_mutex_lock(&windowMutex);
+        advance_window(window, nowMs / window->bucketMs);
+        pthread_mutex_unlock(&windowMutex);
+
+        if (!atomic_exchange_explicit(&window->changed, false, memory_order_relaxed))
+            continue;
+
+        frame_t *summary = encode_window_summary(window);
+        pthread_mutex_lock(&windowMutex);
+        frame_t *oldSummary = window->summary;
+        window->summary = summary;
+        windowSummariesBuilt++;
+        pthread_mutex_unlock(&windowMutex);
+        frame_release(oldSummary);
+    }
+}
+
+leaderboard_window_t *find_leaderboard_window(char *name)
+{
+    for (int i = 0; i < NUM_LEADERBOARD_WINDOWS; i++)
+    {
+        if (strcmp(leaderboardWindows[i].name, name) == 0)
+            return &leaderboardWindows[i];
+    }
+    return NULL;
+}
+
+frame_t *get_window_summary(leaderboard_window_t *window)
+{
+    // The caller gets a reference, so the summary can be replaced while it's being sent
+    pthread_mutex_lock(&windowMutex);
+    frame_t *summary = window->summary;
+    frame_retain(summary);
+    pthread_mutex_unlock(&windowMutex);
+    return summary;
+}
+
+void init_leaderboard_windows()
+{
+    // Needs the users to have been read, as the counters are per user
+    for (int i = 0; i < NUM_LEADERBOARD_WINDOWS; i++)
+    {
+        leaderboard_window_t *window = &leaderboardWindows[i];
+        window->gamesWon = custom_calloc(numUsers > 0 ? numUsers : 1, sizeof(atomic_int));
+        window->gamesPlayed = custom_calloc(numUsers > 0 ? numUsers : 1, sizeof(atomic_int));
+        for (int j = 0; j <= window->numBuckets; j++)
+        {
+            atomic_init(&window->buckets[j].epoch, -1);
+            window->buckets[j].gamesWon = custom_calloc(numUsers > 0 ? numUsers : 1, sizeof(atomic_int));
+            window->buckets[j].gamesPlayed = custom_calloc(numUsers > 0 ? numUsers : 1, sizeof(atomic_int));
+        }
+        window->currentEpoch = -1;
+        atomic_init(&window->changed, false);
+        window->summary = encode_window_summary(window);
+    }
+}
+
+void free_leaderboard_windows()
+{
+    for (int i = 0; i < NUM_LEADERBOARD_WINDOWS; i++)
+    {
+        leaderboard_window_t *window = &leaderboardWindows[i];
+        if (window->summary == NULL)
+            continue;
+        for (int j = 0; j <= window->numBuckets; j++)
+        {
+            free(window->buckets[j].gamesWon);
+            free(window->buckets[j].gamesPlayed);
+        }
+        free(window->gamesWon);
+        free(window->gamesPlayed);
+        frame_release(window->summary);
+        window->summary = NULL;
+    }
+}
+
+void publish_leaderboard_change(leaderboard_item_t *item, bool wasInTop, unsigned long version)
+{
+    // Must be called with the leaderboard write locked, once the item has its new counts and is in the right place
+    unsigned long previousVersion = leaderboardVersion;
+    mark_leaderboard_item_changed(item, version);
+
+    // The top rows only need encoding again if this user was or now is one of them
+    if (wasInTop || is_in_top_leaderboard(item))
+        rebuild_top_leaderboard();
+
+    // Push the change to any subscribers. They all share the one encoded frame.
+    if (atomic_load_explicit(&leaderboardSubscribers.numSpectators, memory_order_relaxed) > 0)
+        publish_frame(&leaderboardSubscribers, encode_leaderboard_changes(previousVersion));
+}
+
+//--------------------------------------------------------------------------------------------
+// Shared leaderboard related
+//--------------------------------------------------------------------------------------------
+void *map_shared(size_t size)
+{
+    // Anonymous and shared, so it's inherited across fork() and every process sees the same pages
+    void *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    return region;
+}
+
+void create_shared_leaderboard()
+{
+    // Needs the users to have been read, as there's a slot for each of them
+    sharedLeaderboardSize = sizeof(shared_leaderboard_t) + numUsers * sizeof(shared_player_t);
+    sharedLeaderboard = map_shared(sharedLeaderboardSize);
+    atomic_init(&sharedLeaderboard->version, 0);
+    atomic_init(&sharedLeaderboard->recoveries, 0);
+    for (int i = 0; i < numUsers; i++)
+    {
+        atomic_init(&sharedLeaderboard->players[i].gamesWon, 0);
+        atomic_init(&sharedLeaderboard->players[i].gamesPlayed, 0);
+        atomic_init(&sharedLeaderboard->players[i].version, 0);
+    }
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&sharedLeaderboard->mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+}
+
+void lock_shared_leaderboard()
+{
+    if (pthread_mutex_lock(&sharedLeaderboard->mutex) != EOWNERDEAD)
+        return;
+
+    // A worker process died holding the lock. Games are always counted before wins, so every counter still makes
+    // sense, but we can't tell whose version it didn't get to bump, so everyone's marked as changed.
+    pthread_mutex_consistent(&sharedLeaderboard->mutex);
+    atomic_fetch_add(&sharedLeaderboard->recoveries, 1);
+    unsigned long version = atomic_fetch_add(&sharedLeaderboard->version, 1) + 1;
+    for (int i = 0; i < numUsers; i++)
+        atomic_store(&sharedLeaderboard->players[i].version, version);
+    sharedLeaderboard->changes[version % SHARED_CHANGES_LENGTH] = ALL_PLAYERS_CHANGED;
+}
+
+void record_shared_result(int userIndex, bool gameWon)
+{
+    shared_player_t *player = &sharedLeaderboard->players[userIndex];
+    lock_shared_leaderboard();
+    atomic_fetch_add(&player->gamesPlayed, 1);
+    if (gameWon)
+        atomic_fetch_add(&player->gamesWon, 1);
+    unsigned long version = atomic_fetch_add(&sharedLeaderboard->version, 1) + 1;
+    atomic_store(&player->version, version);
+    sharedLeaderboard->changes[version % SHARED_CHANGES_LENGTH] = userIndex;
+    pthread_mutex_unlock(&sharedLeaderboard->mutex);
+}
+
+void set_leaderboard_counts(int userIndex, int gamesWon, int totalGames, unsigned long version)
+{
+    // Must be called with the leaderboard write locked. Brings a player's row up to the given totals, as of the given version.
+    char *username = users[userIndex].username;
+    leaderboard_item_t *item = leaderboardItems;
+    while (item != NULL && item->username != username)
+        item = item->next;
+    int previousGamesWon = item != NULL ? item->gamesWon : 0;
+    int previousTotalGames = item != NULL ? item->totalGames : 0;
+    if (gamesWon == previousGamesWon && totalGames == previousTotalGames)
+        return;
+
+    bool wasInTop = item != NULL && is_in_top_leaderboard(item);
+    if (item == NULL)
+        item = add_leaderboard_item(username, false);
+    item->gamesWon = gamesWon;
+    item->totalGames = totalGames;
+    item->percentageWon = get_percentage_won(item);
+    move_leaderboard_item_to_correct_pos(item);
+    publish_leaderboard_change(item, wasInTop, version);
+
+    // The windows only want games finished since this process started, not everything it had to catch up on
+    if (sharedLeaderboardSynced)
+        record_windowed_result(userIndex, gamesWon - previousGamesWon, totalGames - previousTotalGames);
+}
+
+int compare_shared_snapshots(const void *first, const void *second)
+{
+    // Oldest change first
+    unsigned long firstVersion = ((const shared_snapshot_t *)first)->version;
+    unsigned long secondVersion = ((const shared_snapshot_t *)second)->version;
+    return (firstVersion > secondVersion) - (firstVersion < secondVersion);
+}
+
+void snapshot_shared_player(shared_snapshot_t *snapshot, int userIndex)
+{
+    // Must be called with the shared leaderboard locked
+    shared_player_t *player = &sharedLeaderboard->players[userIndex];
+    snapshot->userIndex = userIndex;
+    snapshot->gamesWon = atomic_load(&player->gamesWon);
+    snapshot->gamesPlayed = atomic_load(&player->gamesPlayed);
+    snapshot->version = atomic_load(&player->version);
+}
+
+void sync_shared_leaderboard()
+{
+    // Catch this process's leaderboard up with results from every process. Called before anything reads the
+    // leaderboard, and costs a single atomic load when nothing's changed. The shared version is the one clients see,
+    // so it means the same thing whichever process they ask.
+    if (sharedLeaderboard == NULL || atomic_load(&sharedLeaderboard->version) == atomic_load(&sharedVersionSeen))
+        return;
+
+    write_lock();
+
+    // Copy out the changed players under the shared lock, then update our own leaderboard without it. Normally that's
+    // just the players in the recent changes, but a process that's fallen too far behind checks everyone.
+    shared_snapshot_t *changed = custom_malloc((numUsers > 0 ? numUsers : 1) * sizeof(shared_snapshot_t));
+    int numChanged = 0;
+    lock_shared_leaderboard();
+    unsigned long versionSeen = atomic_load(&sharedVersionSeen);
+    unsigned long version = atomic_load(&sharedLeaderboard->version);
+    bool checkEveryone = version - versionSeen > SHARED_CHANGES_LENGTH;
+    for (unsigned long changeVersion = versionSeen + 1; changeVersion <= version && !checkEveryone; changeVersion++)
+    {
+        // A player who's changed again since only needs picking up at their newest version
+        int userIndex = sharedLeaderboard->changes[changeVersion % SHARED_CHANGES_LENGTH];
+        if (userIndex == ALL_PLAYERS_CHANGED)
+            checkEveryone = true;
+        else if (atomic_load(&sharedLeaderboard->players[userIndex].version) == changeVersion)
+            snapshot_shared_player(&changed[numChanged++], userIndex);
+    }
+    if (checkEveryone)
+    {
+        numChanged = 0;
+        for (int i = 0; i < numUsers; i++)
+        {
+            if (atomic_load(&sharedLeaderboard->players[i].version) > versionSeen)
+                snapshot_shared_player(&changed[numChanged++], i);
+        }
+    }
+    pthread_mutex_unlock(&sharedLeaderboard->mutex);
+
+    // Changes have to be applied in order, so the newest ones stay at the front
+    if (checkEveryone)
+        qsort(changed, numChanged, sizeof(shared_snapshot_t), compare_shared_snapshots);
+    for (int i = 0; i < numChanged; i++)
+        set_leaderboard_counts(changed[i].userIndex, changed[i].gamesWon, changed[i].gamesPlayed, changed[i].version);
+    if (version > leaderboardVersion)
+        leaderboardVersion = version;
+    atomic_store(&sharedVersionSeen, version);
+    sharedLeaderboardSynced = true;
+    free(changed);
+
+    write_unlock();
+}
+
+void record_result(int userIndex, bool gameWon)
+{
+    char *currentUser = users[userIndex].username;
+
+    // With worker processes the result goes into shared memory, and this process picks it up from there like everyone else's
+    if (sharedLeaderboard != NULL)
+    {
+        record_shared_result(userIndex, gameWon);
+        sync_shared_leaderboard();
+        return;
+    }
+
+    // Lock the leaderboard as we don't want multiple threads updating it at once
+    write_lock();
+
+    // Try and find the current user in the leaderboard
+    leaderboard_item_t *item = leaderboardItems;
+    while (item != NULL && strcmp(item->username, currentUser) != 0)
+        item = item->next;
+    bool wasInTop = item != NULL && is_in_top_leaderboard(item);
+
+    // If the current user isn't already on the leaderboard, add them. Otherwise update their existing item.
+    if (item == NULL)
+    {
+        // Item doesn't exist in the leaderboard, create a new item
+        item = add_leaderboard_item(currentUser, gameWon);
+    }
+    else
+    {
+        // Item already exists, update existing item
+        update_leaderboard_item(item, gameWon);
+    }
+    publish_leaderboard_change(item, wasInTop, leaderboardVersion + 1);
+    record_windowed_result(userIndex, gameWon ? 1 : 0, 1);
+
+    // The leaderboard rows have already gone to any newer server taking over, so it needs this result too
+    forward_result(currentUser, gameWon);
+
+    // Unlock the leaderboard so other threads can do their thang
+    write_unlock();
+}
+
+void update_leaderboard(int threadId, bool gameWon)
+{
+    record_result(workers[threadId].loggedInUserIndex, gameWon);
+}
+
+//--------------------------------------------------------------------------------------------
+// Leaderboard export related
+//--------------------------------------------------------------------------------------------
+void create_board_export()
+{
+    // Needs the users to have been read, as there's a row for each of them. Made under a temporary name and renamed
+    // into place, so readers never see a file that's only half set up.
+    size_t pathLength = strlen(boardExportPath) + 5;
+    char *tempPath = custom_malloc(pathLength);
+    snprintf(tempPath, pathLength, "%s.tmp", boardExportPath);
+    boardExportSize = sizeof(board_export_header_t) + numUsers * sizeof(board_export_row_t);
+    int fileDescriptor = open(tempPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fileDescriptor == -1 || ftruncate(fileDescriptor, boardExportSize) == -1)
+    {
+        perror(tempPath);
+        exit(1);
+    }
+    void *region = mmap(NULL, boardExportSize, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, 0);
+    close(fileDescriptor);
+    if (region == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+
+    // The file starts off zeroed, which is an empty leaderboard with an even sequence
+    boardExport = region;
+    memcpy(boardExport->magic, BOARD_EXPORT_MAGIC, BOARD_EXPORT_MAGIC_LENGTH);
+    boardExport->headerSize = sizeof(board_export_header_t);
+    boardExport->rowSize = sizeof(board_export_row_t);
+    boardExport->maxRows = numUsers;
+    boardExport->serverPid = getpid();
+    boardExport->publishedAtMs = wall_clock_ms();
+    if (rename(tempPath, boardExportPath) == -1)
+    {
+        perror(boardExportPath);
+        exit(1);
+    }
+    free(tempPath);
+}
+
+uint64_t begin_board_export_write()
+{
+    // Make the sequence odd so readers know to wait. It's rounded up to even first in case a worker process died
+    // part way through the last write.
+    uint64_t sequence = (atomic_load_explicit(&boardExport->sequence, memory_order_relaxed) + 1) & ~(uint64_t)1;
+    atomic_store_explicit(&boardExport->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return sequence;
+}
+
+void end_board_export_write(uint64_t sequence)
+{
+    boardExport->publishedAtMs = wall_clock_ms();
+    atomic_store_explicit(&boardExport->sequence, sequence + 2, memory_order_release);
+    boardExportWrites++;
+}
+
+void publish_board_export()
+{
+    // Called by the pool manager on every pass. The read lock keeps writers out while we copy the rows, without
+    // holding up anyone else reading the leaderboard. Readers of the export never hold anything up.
+    long long nowMs = now_ms();
+    if (boardExport == NULL || workerProcessNumber > 0 || nowMs < nextBoardExportMs)
+        return;
+    nextBoardExportMs = nowMs + BOARD_EXPORT_INTERVAL_MS;
+
+    read_lock();
+    if (leaderboardVersion != boardExportVersion)
+    {
+        board_export_row_t *rows = (board_export_row_t *)(boardExport + 1);
+        uint64_t sequence = begin_board_export_write();
+        uint32_t numRows = 0;
+        for (leaderboard_item_t *item = leaderboardTail; item != NULL && numRows < boardExport->maxRows; item = item->previous)
+        {
+            strncpy(rows[numRows].username, item->username, BOARD_EXPORT_NAME_LENGTH - 1);
+            rows[numRows].username[BOARD_EXPORT_NAME_LENGTH - 1] = '\0';
+            rows[numRows].gamesWon = item->gamesWon;
+            rows[numRows].gamesPlayed = item->totalGames;
+            numRows++;
+        }
+        boardExport->numRows = numRows;
+        boardExport->version = leaderboardVersion;
+        end_board_export_write(sequence);
+        boardExportVersion = leaderboardVersion;
+    }
+    read_unlock();
+}
+
+void close_board_export()
+{
+    // Let readers know nothing more is coming. Only done by whoever created the export, once nobody else is writing it.
+    uint64_t sequence = begin_board_export_write();
+    boardExport->closed = 1;
+    end_board_export_write(sequence);
+}
+
+//--------------------------------------------------------------------------------------------
+// Bulk leaderboard exports related
+//--------------------------------------------------------------------------------------------
+void write_json_string(FILE *stream, char *string)
+{
+    fputc('"', stream);
+    for (char *character = string; *character != '\0'; character++)
+    {
+        if (*character == '"' || *character == '\\')
+            fprintf(stream, "\\%c", *character);
+        else if ((unsigned char)*character < ' ')
+            fprintf(stream, "\\u%04x", *character);
+        else
+            fputc(*character, stream);
+    }
+    fputc('"', stream);
+}
+
+int create_export_file()
+{
+    // An unnamed file in the temporary directory, which goes away with the last descriptor for it
+    char *directory = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    int fileDescriptor = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fileDescriptor != -1)
+        return fileDescriptor;
+
+    // Not every filesystem does O_TMPFILE
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/hangman-export-XXXXXX", directory);
+    fileDescriptor = mkostemp(path, O_CLOEXEC);
+    if (fileDescriptor != -1)
+        unlink(path);
+    return fileDescriptor;
+}
+
+export_snapshot_t *build_export_snapshot(export_format_t format)
+{
+    // Copy the rows out under the read lock, which is all writers have to wait for, then write them out with no
+    // lock held. The usernames never change, so the copy can point at them.
+    read_lock();
+    int numRows = numLeaderboardItems;
+    unsigned long version = leaderboardVersion;
+    leaderboard_item_t *rows = custom_malloc((numRows > 0 ? numRows : 1) * sizeof(leaderboard_item_t));
+    leaderboard_item_t *item = leaderboardTail;
+    for (int i = 0; i < numRows && item != NULL; i++, item = item->previous)
+        rows[i] = *item;
+    read_unlock();
+
+    int fileDescriptor = create_export_file();
+    int streamfileDescriptor = fileDescriptor != -1 ? dup(fileDescriptor) : -1;
+    FILE *stream = streamfileDescriptor != -1 ? fdopen(streamfileDescriptor, "w") : NULL;
+    if (stream == NULL)
+    {
+        perror("export file");
+        if (streamfileDescriptor != -1)
+            close(streamfileDescriptor);
+        if (fileDescriptor != -1)
+            close(fileDescriptor);
+        free(rows);
+        return NULL;
+    }
+
+    // Best first, as for BOARD TOP
+    if (format == EXPORT_CSV)
+        fprintf(stream, "username,games_won,games_played,percentage_won\n");
+    else
+        fprintf(stream, "[\n");
+    for (int i = 0; i < numRows; i++)
+    {
+        double percentageWon = rows[i].totalGames > 0 ? 100.0 * rows[i].gamesWon / rows[i].totalGames : 0.0;
+        if (format == EXPORT_CSV)
+        {
+            fprintf(stream, "%s,%d,%d,%.2f\n", rows[i].username, rows[i].gamesWon, rows[i].totalGames, percentageWon);
+            continue;
+        }
+        fprintf(stream, "{\"username\":");
+        write_json_string(stream, rows[i].username);
+        fprintf(stream, ",\"games_won\":%d,\"games_played\":%d,\"percentage_won\":%.2f}%s\n", rows[i].gamesWon, rows[i].totalGames,
+                percentageWon, i < numRows - 1 ? "," : "");
+    }
+    if (format == EXPORT_JSON)
+        fprintf(stream, "]\n");
+    bool written = fflush(stream) == 0 && !ferror(stream);
+    fclose(stream);
+    free(rows);
+    if (!written)
+    {
+        perror("export file");
+        close(fileDescriptor);
+        return NULL;
+    }
+
+    export_snapshot_t *snapshot = custom_malloc(sizeof(export_snapshot_t));
+    snapshot->fileDescriptor = fileDescriptor;
+    snapshot->size = lseek(fileDescriptor, 0, SEEK_END);
+    snapshot->version = version;
+    snapshot->numReferences = 1;
+    exportSnapshotsBuilt++;
+    return snapshot;
+}
+
+void release_export_snapshot(export_snapshot_t *snapshot)
+{
+    // Must be called with exportMutex locked
+    if (--snapshot->numReferences > 0)
+        return;
+    close(snapshot->fileDescriptor);
+    free(snapshot);
+}
+
+export_snapshot_t *get_export_snapshot(export_format_t format)
+{
+    // The latest snapshot in the format if the leaderboard hasn't changed since, otherwise a new one that replaces it.
+    // Holding exportMutex while building means everyone who asks meanwhile gets the same new one, rather than
+    // building their own. Release it with release_export_snapshot() when done.
+    sync_shared_leaderboard();
+    read_lock();
+    unsigned long version = leaderboardVersion;
+    read_unlock();
+
+    pthread_mutex_lock(&exportMutex);
+    export_snapshot_t *snapshot = exportSnapshots[format];
+    if (snapshot == NULL || snapshot->version != version)
+    {
+        export_snapshot_t *newSnapshot = build_export_snapshot(format);
+        if (newSnapshot != NULL)
+        {
+            if (snapshot != NULL)
+                release_export_snapshot(snapshot);
+            exportSnapshots[format] = snapshot = newSnapshot;
+        }
+    }
+    else
+    {
+        exportSnapshotsReused++;
+    }
+    if (snapshot != NULL)
+        snapshot->numReferences++;
+    pthread_mutex_unlock(&exportMutex);
+    return snapshot;
+}
+
+void free_export_snapshots()
+{
+    for (int i = 0; i < NUM_EXPORT_FORMATS; i++)
+    {
+        if (exportSnapshots[i] != NULL)
+            release_export_snapshot(exportSnapshots[i]);
+        exportSnapshots[i] = NULL;
+    }
+}
+
+//--------------------------------------------------------------------------------------------
+// Word statistics related
+//--------------------------------------------------------------------------------------------
+void init_word_stats()
+{
+    // Give every word the index of its category, the categories being the distinct object types in the order
+    // they first come up. Categories are found by name through their first word, so they still work once the
+    // words have been moved into shared memory.
+    wordCategories = custom_malloc(numWords * sizeof(int));
+    categoryFirstWords = custom_malloc(numWords * sizeof(int));
+    numCategories = 0;
+    for (int i = 0; i < numWords; i++)
+    {
+        int category = 0;
+        while (category < numCategories && strcmp(hangmanWords[categoryFirstWords[category]].objectType, hangmanWords[i].objectType) != 0)
+            category++;
+        if (category == numCategories)
+            categoryFirstWords[numCategories++] = i;
+        wordCategories[i] = category;
+    }
+    wordStats = custom_calloc(numWords, sizeof(word_stats_t));
+    categoryStats = custom_calloc(numCategories, sizeof(word_stats_t));
+}
+
+void add_word_stats(word_stats_t *stats, hangman_game_t *state, unsigned int *wrongLetters)
+{
+    atomic_fetch_add_explicit(&stats->plays, 1, memory_order_relaxed);
+    if (state->won)
+        atomic_fetch_add_explicit(&stats->wins, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->guessesLeft, state->numGuessesLeft, memory_order_relaxed);
+    for (int i = 0; i < NUM_LETTERS; i++)
+    {
+        if (wrongLetters[i] > 0)
+            atomic_fetch_add_explicit(&stats->wrongLetters[i], wrongLetters[i], memory_order_relaxed);
+    }
+}
+
+void record_word_stats(game_t *game)
+{
+    // Called for every game that's won or lost. Nothing's locked, so a dump taken meanwhile can be a game out
+    // between counters, which doesn't matter for tuning the words.
+    hangman_game_t *state = &game->state;
+    if (wordStats == NULL || game->wordIndex < 0 || game->wordIndex >= numWords)
+        return;
+    unsigned int wrongLetters[NUM_LETTERS] = {0};
+    for (char *letter = state->guessedLetters; *letter != '\0'; letter++)
+    {
+        if (*letter >= 'a' && *letter <= 'z' && strchr(state->hangmanWord, *letter) == NULL)
+            wrongLetters[*letter - 'a']++; // Whole word guesses are WORD_GUESS_MARKER, so don't count
+    }
+    add_word_stats(&wordStats[game->wordIndex], state, wrongLetters);
+    add_word_stats(&categoryStats[wordCategories[game->wordIndex]], state, wrongLetters);
+}
+
+void format_wrong_letters(word_stats_t *stats, char *buffer)
+{
+    // The letters most often guessed wrong, most first, as "e:12 a:7"
+    unsigned int counts[NUM_LETTERS];
+    for (int i = 0; i < NUM_LETTERS; i++)
+        counts[i] = atomic_load_explicit(&stats->wrongLetters[i], memory_order_relaxed);
+
+    int length = 0;
+    buffer[0] = '\0';
+    for (int shown = 0; shown < WORD_STATS_WRONG_LETTERS; shown++)
+    {
+        int mostWrong = 0;
+        for (int i = 1; i < NUM_LETTERS; i++)
+        {
+            if (counts[i] > counts[mostWrong])
+                mostWrong = i;
+        }
+        if (counts[mostWrong] == 0)
+            break;
+        length += sprintf(buffer + length, "%s%c:%u", shown > 0 ? " " : "", 'a' + mostWrong, counts[mostWrong]);
+        counts[mostWrong] = 0;
+    }
+}
+
+void write_word_stats_row(FILE *stream, char *kind, char *name, char *category, word_stats_t *stats)
+{
+    unsigned int plays = atomic_load_explicit(&stats->plays, memory_order_relaxed);
+    unsigned int wins = atomic_load_explicit(&stats->wins, memory_order_relaxed);
+    unsigned int guessesLeft = atomic_load_explicit(&stats->guessesLeft, memory_order_relaxed);
+    char wrongLetters[WORD_STATS_WRONG_LETTERS * 8];
+    format_wrong_letters(stats, wrongLetters);
+    fprintf(stream, "%s,%s,%s,%u,%u,%.3f,%.2f,%s\n", kind, name, category, plays, wins, plays > 0 ? (double)wins / plays : 0.0,
+            plays > 0 ? (double)guessesLeft / plays : 0.0, wrongLetters);
+}
+
+void write_word_stats_file()
+{
+    // A row per word in the order they're in the words file, then a row per category. Written to a temporary file
+    // and renamed over the old one, like the stats file.
+    if (wordStatsFileName == NULL || wordStats == NULL)
+        return;
+    char tempFileName[strlen(wordStatsFileName) + 5];
+    sprintf(tempFileName, "%s.tmp", wordStatsFileName);
+    FILE *fp = fopen(tempFileName, "w");
+    if (fp == NULL)
+    {
+        perror("word stats file");
+        return;
+    }
+    fprintf(fp, "kind,name,category,plays,wins,win_rate,avg_guesses_left,wrong_letters\n");
+    for (int i = 0; i < numWords; i++)
+        write_word_stats_row(fp, "word", hangmanWords[i].objectName, hangmanWords[i].objectType, &wordStats[i]);
+    for (int i = 0; i < numCategories; i++)
+    {
+        char *category = hangmanWords[categoryFirstWords[i]].objectType;
+        write_word_stats_row(fp, "category", category, category, &categoryStats[i]);
+    }
+    fclose(fp);
+    rename(tempFileName, wordStatsFileName);
+    wordStatsDumps++;
+}
+
+void dump_word_stats(FILE *stream)
+{
+    // The categories for the stats, the words themselves are only in the word stats file
+    int numWordsPlayed = 0;
+    for (int i = 0; i < numWords; i++)
+    {
+        if (atomic_load_explicit(&wordStats[i].plays, memory_order_relaxed) > 0)
+            numWordsPlayed++;
+    }
+    fprintf(stream, "words.count %d\n", numWords);
+    fprintf(stream, "words.played %d\n", numWordsPlayed);
+    fprintf(stream, "words.stats_dumps %lu\n", wordStatsDumps);
+    if (playerWords != NULL)
+    {
+        unsigned long numPicks = atomic_load(&wordPicks);
+        fprintf(stream, "words.picks %lu\n", numPicks);
+        fprintf(stream, "words.pick_attempts_avg %.2f\n", numPicks > 0 ? (double)atomic_load(&wordPickAttempts) / numPicks : 0.0);
+        fprintf(stream, "words.picks_unmatched %lu\n", atomic_load(&wordPicksUnmatched));
+        fprintf(stream, "words.picks_repeated %lu\n", atomic_load(&wordPicksRepeated));
+    }
+    for (int i = 0; i < numCategories; i++)
+    {
+        word_stats_t *stats = &categoryStats[i];
+        char *category = hangmanWords[categoryFirstWords[i]].objectType;
+        unsigned int plays = atomic_load_explicit(&stats->plays, memory_order_relaxed);
+        unsigned int wins = atomic_load_explicit(&stats->wins, memory_order_relaxed);
+        unsigned int guessesLeft = atomic_load_explicit(&stats->guessesLeft, memory_order_relaxed);
+        char wrongLetters[WORD_STATS_WRONG_LETTERS * 8];
+        format_wrong_letters(stats, wrongLetters);
+        fprintf(stream, "words.category.%s.plays %u\n", category, plays);
+        fprintf(stream, "words.category.%s.win_rate %.3f\n", category, plays > 0 ? (double)wins / plays : 0.0);
+        fprintf(stream, "words.category.%s.avg_guesses_left %.2f\n", category, plays > 0 ? (double)guessesLeft / plays : 0.0);
+        fprintf(stream, "words.category.%s.wrong_letters %s\n", category, wrongLetters[0] != '\0' ? wrongLetters : "-");
+    }
+}
+
+//--------------------------------------------------------------------------------------------
+// Word selection related
+//--------------------------------------------------------------------------------------------
+void init_player_words()
+{
+    // Needs the users to have been read, as there's one for each of them
+    if (freshWords || matchDifficulty)
+        playerWords = custom_calloc(numUsers, sizeof(player_words_t));
+}
+
+void seen_word_bits(int wordIndex, int *bits)
+{
+    // The SEEN_WORD_HASHES bits a word sets in a generation, from one multiplicative hash
+    uint64_t hash = (uint64_t)(wordIndex + 1) * 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < SEEN_WORD_HASHES; i++)
+        bits[i] = (hash >> (64 - 8 * (i + 1))) & (SEEN_WORD_BLOCKS * 64 - 1);
+}
+
+bool has_seen_word(player_words_t *player, int wordIndex)
+{
+    // Whether the word's in either generation. A Bloom filter can say yes when the answer's no, never the other way round.
+    int bits[SEEN_WORD_HASHES];
+    seen_word_bits(wordIndex, bits);
+    for (int generation = 0; generation < SEEN_WORD_GENERATIONS; generation++)
+    {
+        bool allSet = true;
+        for (int i = 0; i < SEEN_WORD_HASHES && allSet; i++)
+        {
+            uint64_t block = atomic_load_explicit(&player->seen[generation][bits[i] / 64], memory_order_relaxed);
+            allSet = (block >> (bits[i] % 64)) & 1;
+        }
+        if (allSet)
+            return true;
+    }
+    return false;
+}
+
+void add_seen_word(player_words_t *player, int wordIndex)
+{
+    // Words go into the current generation. Once it's had SEEN_WORD_GENERATION_SIZE words, the older generation is
+    // cleared and becomes the current one, so a word is remembered for between one and two generations' worth of games.
+    unsigned int numSeen = atomic_fetch_add_explicit(&player->numSeen, 1, memory_order_relaxed);
+    int generation = (numSeen / SEEN_WORD_GENERATION_SIZE) % SEEN_WORD_GENERATIONS;
+    if (numSeen % SEEN_WORD_GENERATION_SIZE == 0)
+    {
+        for (int i = 0; i < SEEN_WORD_BLOCKS; i++)
+            atomic_store_explicit(&player->seen[generation][i], 0, memory_order_relaxed);
+    }
+
+    int bits[SEEN_WORD_HASHES];
+    seen_word_bits(wordIndex, bits);
+    for (int i = 0; i < SEEN_WORD_HASHES; i++)
+        atomic_fetch_or_explicit(&player->seen[generation][bits[i] / 64], 1ULL << (bits[i] % 64), memory_order_relaxed);
+}
+
+bool suits_player(player_words_t *player, int wordIndex)
+{
+    // Whether the word's about as hard as the player needs. Players who win more get words that are won less, aiming
+    // for a word win rate of 1 - (player's win rate) / 2, i.e. from the easiest words down to ones won half the time.
+    // Until the word or the player has a record, anything will do.
+    unsigned int gamesPlayed = atomic_load_explicit(&player->gamesPlayed, memory_order_relaxed);
+    unsigned int wordPlays = atomic_load_explicit(&wordStats[wordIndex].plays, memory_order_relaxed);
+    if (!matchDifficulty || gamesPlayed < DIFFICULTY_MIN_GAMES || wordPlays < DIFFICULTY_MIN_GAMES)
+        return true;
+    double playerWinRate = (double)atomic_load_explicit(&player->gamesWon, memory_order_relaxed) / gamesPlayed;
+    double wordWinRate = (double)atomic_load_explicit(&wordStats[wordIndex].wins, memory_order_relaxed) / wordPlays;
+    double difference = wordWinRate - (1 - playerWinRate / 2);
+    return difference <= DIFFICULTY_TOLERANCE && difference >= -DIFFICULTY_TOLERANCE;
+}
+
+int pick_word(int threadId)
+{
+    // Try up to WORD_PICK_ATTEMPTS random words for one the player hasn't seen lately that's about as hard as they
+    // need, settling for the first one they haven't seen, or failing that the first one tried.
+    // The word's remembered as seen straight away, so it isn't picked again for a game started before this one ends.
+    int userIndex = playerWords != NULL ? workers[threadId].loggedInUserIndex : -1;
+    if (userIndex < 0)
+    {
+        unsigned long long randomNumber = seededWords ? next_random(threadId) : (unsigned long long)rand();
+        return hangman_pick_word(randomNumber, numWords);
+    }
+
+    player_words_t *player = &playerWords[userIndex];
+    int pickedWord = -1;
+    int firstWord = -1;
+    int firstUnseenWord = -1;
+    int numAttempts = 0;
+    while (pickedWord < 0 && numAttempts < WORD_PICK_ATTEMPTS)
+    {
+        unsigned long long randomNumber = seededWords ? next_random(threadId) : (unsigned long long)rand();
+        int wordIndex = hangman_pick_word(randomNumber, numWords);
+        numAttempts++;
+        if (firstWord < 0)
+            firstWord = wordIndex;
+        if (freshWords && has_seen_word(player, wordIndex))
+            continue;
+        if (suits_player(player, wordIndex))
+            pickedWord = wordIndex;
+        else if (firstUnseenWord < 0)
+            firstUnseenWord = wordIndex;
+    }
+    if (pickedWord < 0)
+    {
+        pickedWord = firstUnseenWord >= 0 ? firstUnseenWord : firstWord;
+        atomic_fetch_add_explicit(firstUnseenWord >= 0 ? &wordPicksUnmatched : &wordPicksRepeated, 1, memory_order_relaxed);
+    }
+
+    atomic_fetch_add_explicit(&wordPicks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&wordPickAttempts, numAttempts, memory_order_relaxed);
+    add_seen_word(player, pickedWord);
+    return pickedWord;
+}
+
+void record_player_result(int userIndex, game_t *game)
+{
+    // Called for every game that's won or lost. The player's record is kept here rather than looked up on the
+    // leaderboard, so picking a word never has to take the leaderboard lock.
+    if (playerWords == NULL || userIndex < 0)
+        return;
+    player_words_t *player = &playerWords[userIndex];
+    atomic_fetch_add_explicit(&player->gamesPlayed, 1, memory_order_relaxed);
+    if (game->state.won)
+        atomic_fetch_add_explicit(&player->gamesWon, 1, memory_order_relaxed);
+}
+
+//--------------------------------------------------------------------------------------------
+// Running the actual game related
+//--------------------------------------------------------------------------------------------
+user_info_t *find_user(char *username)
+{
+    // Returns the user with the given username, or NULL if there isn't one
+    for (int i = 0; i < numUsers; i++)
+    {
+        if (strcmp(users[i].username, username) == 0)
+            return &users[i];
+    }
+
+    return NULL;
+}
+
+bool is_user_valid(int clientfileDescriptor, int threadId, char *username)
+{
+    // The username prompt has already been answered, so carry on with the password
+    char* message;
+    thread_printf(threadId, "Received username: %s", username);
+
+    // Check username is in users
+    user_info_t *user = find_user(username);
+    if (user == NULL)
+        return false;
+
+    // Send message asking for password, receive message for password
+    send_client_message(clientfileDescriptor, PASSWORD_PROMPT, threadId);
+    message = receive_client_message(clientfileDescriptor, threadId);
+    if (message == NULL) return false;
+    thread_printf(threadId, "Received password");
+
+    // Check password is attributed to user
+    if (strcmp(user->password, message) == 0)
+    {
+        workers[threadId].loggedInUser = user->username;
+        workers[threadId].loggedInUserIndex = user - users;
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+char get_game_status(game_t *game)
+{
+    return hangman_game_status(&game->state);
+}
+
+void publish_game_state(game_t *game)
+{
+    // The latest state is always kept for whoever starts watching next, but a frame is only encoded
+    // for the game's spectators if there are any. Only this thread writes latestState, so it can read it unlocked.
+    live_game_t *liveGame = game->live;
+    if (liveGame == NULL)
+        return;
+
+    hangman_game_t *state = &game->state;
+    pthread_mutex_lock(&spectatorMutex);
+    snprintf(liveGame->latestState, sizeof(liveGame->latestState), "%s|%d|%s|%c", state->guessedLetters, state->numGuessesLeft, state->clientWord, get_game_status(game));
+    pthread_mutex_unlock(&spectatorMutex);
+    if (atomic_load_explicit(&liveGame->numSpectators, memory_order_relaxed) == 0)
+        return;
+
+    int length = snprintf(NULL, 0, REPLY_FRAME " %d %s\n", liveGame->liveId, liveGame->latestState);
+    frame_t *frame = frame_create(length);
+    snprintf(frame->data, length + 1, REPLY_FRAME " %d %s\n", liveGame->liveId, liveGame->latestState);
+    publish_frame(liveGame, frame);
+}
+
+void start_game(game_t *game, int threadId)
+{
+    int wordIndex = pick_word(threadId);
+    thread_printf(threadId, "Got random number %d", wordIndex);
+
+    hangman_start_game(&game->state, &hangmanWords[wordIndex]);
+    thread_printf(threadId, "Random word chosen: %s", game->state.hangmanWord);
+    thread_printf(threadId, "Number of guesses: %d", game->state.numGuessesLeft);
+    thread_printf(threadId, "Client Word: %s", game->state.clientWord);
+
+    game->active = true;
+    game->wordIndex = wordIndex;
+    game->live = register_live_game(workers[threadId].loggedInUser);
+    publish_game_state(game);
+}
+
+bool apply_guess(game_t *game, char guess)
+{
+    return hangman_guess_letter(&game->state, guess);
+}
+
+int apply_guesses(game_t *game, char *letters, char *results)
+{
+    return hangman_guess_letters(&game->state, letters, results);
+}
+
+int keep_only_letters(char *guess)
+{
+    // Squeeze out anything that isn't a letter, so a line ending or a stray space doesn't cost a guess.
+    // Returns how many letters are left.
+    int numLetters = 0;
+    for (char *c = guess; *c != '\0'; c++)
+    {
+        if (isalpha((unsigned char)*c))
+            guess[numLetters++] = tolower((unsigned char)*c);
+    }
+    guess[numLetters] = '\0';
+    return numLetters;
+}
+
+bool is_letters_guess(char *guess)
+{
+    // Trailing whitespace is stripped, then anything but letters is turned down
+    int length = strlen(guess);
+    while (length > 0 && isspace((unsigned char)guess[length - 1]))
+        guess[--length] = '\0';
+    return length > 0 && keep_only_letters(guess) == length;
+}
+
+bool apply_word_guess(game_t *game, char *word)
+{
+    return hangman_guess_word(&game->state, word);
+}
+
+void end_game(game_t *game)
+{
+    // Let anyone watching know it's over
+    if (game->live != NULL)
+        unregister_live_game(game->live);
+    game->live = NULL;
+
+    game->active = false;
+}
+
+void finish_game(game_t *game, int threadId)
+{
+    // Record a game that's been won or lost and get rid of it
+    update_leaderboard(threadId, game->state.won);
+    record_word_stats(game);
+    record_player_result(workers[threadId].loggedInUserIndex, game);
+    atomic_fetch_add_explicit(&gamesPlayed, 1, memory_order_relaxed);
+    end_game(game);
+}
+
+void output_add_game_state(output_buffer_t *output, game_t *game)
+{
+    // Guesses made thus far, number of guesses remaining, the current word, and game status, all in one message.
+    // The segments point at the strings we already have rather than formatting a copy.
+    output_add_string(output, game->state.guessedLetters);
+    output_add_char(output, '|');
+    output_add_int(output, game->state.numGuessesLeft);
+    output_add_char(output, '|');
+    output_add_string(output, game->state.clientWord);
+    output_add_char(output, '|');
+    output_add_char(output, get_game_status(game));
+}
+
+bool play_hangman(int clientfileDescriptor, int threadId)
+{
+    thread_printf(threadId, "Client '%s' playing hangman...", workers[threadId].loggedInUser);
+
+    game_t *game = &workers[threadId].games[0];
+    start_game(game, threadId);
+
+    output_buffer_t *output = &workers[threadId].output;
+    output_begin(output, clientfileDescriptor, threadId);
+    long long guessStartUs = 0;
+    while (true)
+    {
+        // Send client the state of the game. That's the end of the server's side of the guess's round trip.
+        output_add_game_state(output, game);
+        output_flush(output, false);
+        span_end("guess", guessStartUs);
+        if (get_game_status(game) != 'O')
+            break;
+
+        // Receieve guess from the client
+        char *receivedMessage = receive_client_message(clientfileDescriptor, threadId);
+        if (receivedMessage == NULL) 
+        {
+            end_game(game);
+            return false;
+        }
+
+        // Several letters in one message are applied in order, as if they'd been sent one at a time.
+        // If there aren't any the state just gets sent again.
+        guessStartUs = span_begin();
+        if (keep_only_letters(receivedMessage) == 0)
+            continue;
+        char results[MAX_MESSAGE_LENGTH];
+        apply_guesses(game, receivedMessage, results);
+        publish_game_state(game);
+    }
+
+    finish_game(game, threadId);
+    fflush(stdout);
+
+    return true;
+}
+
+bool main_menu(int clientfileDescriptor, int threadId)
+{
+    bool quitMenu = false;
+    while (!quitMenu)
+    {
+        thread_printf(threadId, "Client '%s' on main menu...", workers[threadId].loggedInUser);
+
+        // Recieve selection for user menu selection
+        char *selection = receive_client_message(clientfileDescriptor, threadId);
+        if (selection == NULL) return false;
+        thread_printf(threadId, "Received selection: %s", selection);
+
+        long long startUs = span_begin();
+        switch (selection[0])
+        {
+            case '1':
+                // play_hangman() returns false if there is an error, so we should quit the game if that's the case
+                quitMenu = !play_hangman(clientfileDescriptor, threadId);
+                span_end("play_hangman", startUs);
+                break;
+            case '2':
+                // send_leaderboard() returns false if there is an error, so we should quit the game if that's the case
+                quitMenu = !send_leaderboard(clientfileDescriptor, threadId);
+                span_end("send_leaderboard", startUs);
+                break;
+            case '3':
+                quitMenu = true;
+                break;
+            default:
+                printf("\nInvaild Selection");
+                return false;
+        }
+        span_end("menu", startUs);
+    }
+
+    // Return true as we finished successfully
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------
+// Session related
+//--------------------------------------------------------------------------------------------
+bool generate_session_token(char *token, int threadId)
+{
+    // Tokens stand in for the password when resuming, so they have to come from the kernel's CSPRNG rather than rand().
+    // The one exception is a seeded server, which is only for replaying captures and needs the same tokens every time.
+    unsigned char randomBytes[SESSION_TOKEN_LENGTH / 2];
+    size_t numBytes = 0;
+    if (seededWords)
+    {
+        for (; numBytes < sizeof(randomBytes); numBytes++)
+            randomBytes[numBytes] = next_random(threadId) & 0xFF;
+    }
+    while (numBytes < sizeof(randomBytes))
+    {
+        ssize_t result = getrandom(randomBytes + numBytes, sizeof(randomBytes) - numBytes, 0);
+        if (result == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("getrandom");
+            token[0] = '\0';
+            return false;
+        }
+        numBytes += result;
+    }
+
+    for (size_t i = 0; i < sizeof(randomBytes); i++)
+        sprintf(token + 2 * i, "%02x", randomBytes[i]);
+    return true;
+}
+
+void free_detached_session(detached_session_t *session)
+{
+    // Must be called with sessionMutex locked
+    for (int i = 0; i < session->numGames; i++)
+        end_game(&session->games[i]);
+    free(session->games);
+    session->games = NULL;
+    session->numGames = 0;
+    session->inUse = false;
+}
+
+bool is_session_expired(detached_session_t *session, long long nowMs)
+{
+    return nowMs - session->detachedAtMs >= sessionLifetimeMs;
+}
+
+void expire_detached_sessions()
+{
+    // Called by the pool manager on every pass, so sessions don't sit around long after they can no longer be resumed
+    long long nowMs = now_ms();
+    pthread_mutex_lock(&sessionMutex);
+    for (int i = 0; i < MAX_DETACHED_SESSIONS; i++)
+    {
+        if (detachedSessions[i].inUse && is_session_expired(&detachedSessions[i], nowMs))
+        {
+            free_detached_session(&detachedSessions[i]);
+            sessionsExpired++;
+        }
+    }
+    pthread_mutex_unlock(&sessionMutex);
+}
+
+detached_session_t *add_detached_session(char *token, int userIndex, game_t *games, int numGames, int nextGameId, int lastGameId)
+{
+    // Must be called with sessionMutex locked. Takes over the games.
+    // The table is bounded, so when it's full the session that's been waiting longest makes way.
+    detached_session_t *slot = NULL;
+    for (int i = 0; i < MAX_DETACHED_SESSIONS; i++)
+    {
+        detached_session_t *session = &detachedSessions[i];
+        if (!session->inUse)
+        {
+            slot = session;
+            break;
+        }
+        if (slot == NULL || session->detachedAtMs < slot->detachedAtMs)
+            slot = session;
+    }
+    if (slot->inUse)
+    {
+        free_detached_session(slot);
+        sessionsEvicted++;
+    }
+
+    slot->inUse = true;
+    slot->games = games;
+    slot->numGames = numGames;
+    strcpy(slot->token, token);
+    slot->username = users[userIndex].username;
+    slot->userIndex = userIndex;
+    slot->nextGameId = nextGameId;
+    slot->lastGameId = lastGameId;
+    slot->detachedAtMs = now_ms();
+    return slot;
+}
+
+void detach_session(worker_t *worker)
+{
+    // The client's connection dropped without it quitting, so keep its games until it comes back or the session expires
+    game_t *games = NULL;
+    int numGames = 0;
+    if (worker->numActiveGames > 0)
+    {
+        games = custom_malloc(worker->numActiveGames * sizeof(game_t));
+        for (int i = 0; i < MAX_GAMES_PER_CONNECTION; i++)
+        {
+            if (worker->games[i].active)
+            {
+                games[numGames++] = worker->games[i];
+                worker->games[i].active = false;
+            }
+        }
+        worker->numActiveGames = 0;
+    }
+
+    pthread_mutex_lock(&sessionMutex);
+    detached_session_t *session = add_detached_session(worker->sessionToken, worker->loggedInUserIndex, games, numGames, worker->nextGameId, worker->lastGameId);
+    sessionsDetached++;
+
+    // A newer server taking over from us has already had the other sessions, so it gets this one straight away
+    if (forward_detached_session(session))
+        free_detached_session(session);
+    pthread_mutex_unlock(&sessionMutex);
+
+    // The session owns the games' strings now
+    worker->sessionToken[0] = '\0';
+}
+
+bool resume_session(worker_t *worker, char *token)
+{
+    // Hand the session's user and game over to this worker. The token is used up, the client gets a new one.
+    if (token == NULL || strlen(token) != SESSION_TOKEN_LENGTH)
+        return false;
+
+    bool resumed = false;
+    long long nowMs = now_ms();
+    pthread_mutex_lock(&sessionMutex);
+    for (int i = 0; i < MAX_DETACHED_SESSIONS; i++)
+    {
+        detached_session_t *session = &detachedSessions[i];
+        if (!session->inUse || strcmp(session->token, token) != 0)
+            continue;
+
+        if (is_session_expired(session, nowMs))
+        {
+            free_detached_session(session);
+            sessionsExpired++;
+        }
+        else
+        {
+            worker->loggedInUser = session->username;
+            worker->loggedInUserIndex = session->userIndex;
+            memcpy(worker->games, session->games, session->numGames * sizeof(game_t));
+            worker->numActiveGames = session->numGames;
+            worker->nextGameId = session->nextGameId;
+            worker->lastGameId = session->lastGameId;
+            free(session->games);
+            session->games = NULL;
+            session->numGames = 0;
+            session->inUse = false;
+            sessionsResumed++;
+            resumed = true;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&sessionMutex);
+
+    return resumed;
+}
+
+//--------------------------------------------------------------------------------------------
+// Compact protocol related
+//--------------------------------------------------------------------------------------------
+bool is_compact_login(char *message)
+{
+    // Legacy usernames come from a single scanf("%s") token, so can never contain a space or a line ending
+    char *firstCommands[] = {COMMAND_LOGIN, COMMAND_RESUME, COMMAND_WATCH, COMMAND_LIVE, COMMAND_BOARD, COMMAND_SUBSCRIBE, COMMAND_EXPORT};
+    for (size_t i = 0; i < sizeof(firstCommands) / sizeof(firstCommands[0]); i++)
+    {
+        // Only look past the command once it's matched, as a shorter message ends before then
+        int commandLength = strlen(firstCommands[i]);
+        if (strncmp(message, firstCommands[i], commandLength) != 0)
+            continue;
+        char next = message[commandLength];
+        if (next == ' ' || next == '\r' || next == '\n')
+            return true;
+    }
+
+    return false;
+}
+
+void output_add_line(output_buffer_t *output, char *keyword, char *detail)
+{
+    output_add_string(output, keyword);
+    if (detail != NULL)
+    {
+        output_add_char(output, ' ');
+        output_add_string(output, detail);
+    }
+    output_add_char(output, '\n');
+}
+
+void output_add_leaderboard(output_buffer_t *output, int threadId)
+{
+    // The whole leaderboard in one reply, no acknowledgements per row like the legacy protocol needs.
+    // Rows point straight at the usernames, and the read lock is only held while the reply is being built.
+    sync_shared_leaderboard();
+    read_lock();
+    output_add_string(output, REPLY_BOARD " ");
+    output_add_int(output, numLeaderboardItems);
+    output_add_char(output, ' ');
+    output_add_unsigned_long(output, leaderboardVersion);
+    output_add_char(output, '\n');
+    for (leaderboard_item_t *item = leaderboardItems; item != NULL; item = item->next)
+    {
+        output_add_string(output, item->username);
+        output_add_char(output, '|');
+        output_add_int(output, item->gamesWon);
+        output_add_char(output, '|');
+        output_add_int(output, item->totalGames);
+        output_add_char(output, '\n');
+    }
+
+    // The usernames never change or get freed, but the counts live in the scratch space, so flush before anyone can update them
+    output_flush(output, line_reader_has_line(&workers[threadId].lineReader));
+    read_unlock();
+}
+
+void output_add_state_line(output_buffer_t *output, game_t *game)
+{
+    output_add_string(output, REPLY_STATE " ");
+    output_add_int(output, game->gameId);
+    output_add_char(output, ' ');
+    output_add_game_state(output, game);
+    output_add_char(output, '\n');
+}
+
+game_t *find_game(worker_t *worker, int gameId)
+{
+    // Only games still being played count, finished ones are just waiting for their final state to go out
+    for (int i = 0; i < MAX_GAMES_PER_CONNECTION; i++)
+    {
+        game_t *game = &worker->games[i];
+        if (game->active && game->gameId == gameId && get_game_status(game) == 'O')
+            return game;
+    }
+
+    return NULL;
+}
+
+game_t *add_game(worker_t *worker, int threadId)
+{
+    for (int i = 0; i < MAX_GAMES_PER_CONNECTION; i++)
+    {
+        game_t *game = &worker->games[i];
+        if (!game->active)
+        {
+            start_game(game, threadId);
+            game->gameId = ++worker->nextGameId;
+            worker->lastGameId = game->gameId;
+            worker->numActiveGames++;
+            return game;
+        }
+    }
+
+    return NULL;
+}
+
+void reap_finished_games(worker_t *worker, int threadId)
+{
+    // Called once replies have been flushed, since the final states point at the games' strings
+    for (int i = 0; i < MAX_GAMES_PER_CONNECTION && worker->numFinishedGames > 0; i++)
+    {
+        game_t *game = &worker->games[i];
+        if (game->active && get_game_status(game) != 'O')
+        {
+            finish_game(game, threadId);
+            worker->numActiveGames--;
+            worker->numFinishedGames--;
+        }
+    }
+}
+
+void end_all_games(worker_t *worker)
+{
+    for (int i = 0; i < MAX_GAMES_PER_CONNECTION; i++)
+    {
+        if (worker->games[i].active)
+            end_game(&worker->games[i]);
+    }
+    worker->numActiveGames = 0;
+    worker->numFinishedGames = 0;
+}
+
+void run_play_command(char *argument, int threadId)
+{
+    // "PLAY [count]" starts one or more games at once, each with its own ID
+    worker_t *worker = &workers[threadId];
+    output_buffer_t *output = &worker->output;
+    int numToStart = argument != NULL ? atoi(argument) : 1;
+    if (numToStart <= 0)
+    {
+        output_add_line(output, REPLY_ERROR, "bad game count");
+        return;
+    }
+    if (worker->numActiveGames + numToStart > MAX_GAMES_PER_CONNECTION)
+    {
+        output_add_line(output, REPLY_ERROR, "too many games");
+        return;
+    }
+
+    thread_printf(threadId, "Client '%s' playing %d game(s) of hangman...", worker->loggedInUser, numToStart);
+    for (int i = 0; i < numToStart; i++)
+        output_add_state_line(output, add_game(worker, threadId));
+}
+
+game_t *find_game_argument(char **argument, int threadId)
+{
+    // Commands that act on a game take an optional game ID first, or go to the game started most recently.
+    // Moves argument past the ID, and replies with ERR if there's no such game.
+    worker_t *worker = &workers[threadId];
+    int gameId = worker->lastGameId;
+    char *rest = *argument != NULL ? strchr(*argument, ' ') : NULL;
+    if (rest != NULL && strspn(*argument, "0123456789") == (size_t)(rest - *argument))
+    {
+        gameId = atoi(*argument);
+        *argument = rest + 1;
+    }
+    if (*argument == NULL || (*argument)[0] == '\0')
+    {
+        output_add_line(&worker->output, REPLY_ERROR, "missing guess");
+        return NULL;
+    }
+
+    game_t *game = find_game(worker, gameId);
+    if (game == NULL)
+        output_add_line(&worker->output, REPLY_ERROR, "no such game in progress");
+    return game;
+}
+
+void add_game_result(game_t *game, char *results, int threadId)
+{
+    // Per-letter results go just before the state they led to, so both arrive together
+    worker_t *worker = &workers[threadId];
+    output_buffer_t *output = &worker->output;
+    if (results != NULL)
+    {
+        output_add_string(output, REPLY_RESULTS " ");
+        output_add_int(output, game->gameId);
+        output_add_char(output, ' ');
+        output_add_string(output, results);
+        output_add_char(output, '\n');
+    }
+    output_add_state_line(output, game);
+    publish_game_state(game);
+    if (get_game_status(game) != 'O')
+        worker->numFinishedGames++;
+}
+
+void run_guess_command(char *argument, int threadId)
+{
+    // "GUESS [game ID] <letters>". More than one letter are applied in order and get a RESULTS line back.
+    game_t *game = find_game_argument(&argument, threadId);
+    if (game == NULL)
+        return;
+
+    if (!is_letters_guess(argument))
+    {
+        output_add_line(&workers[threadId].output, REPLY_ERROR, "guesses must be letters");
+        return;
+    }
+
+    int numLetters = strlen(argument);
+    if (numLetters == 1)
+    {
+        apply_guess(game, argument[0]);
+        add_game_result(game, NULL, threadId);
+        return;
+    }
+    if (numLetters > MAX_NUM_GUESSES)
+    {
+        output_add_line(&workers[threadId].output, REPLY_ERROR, "too many letters");
+        return;
+    }
+
+    char *results = output_reserve_scratch(&workers[threadId].output, numLetters + 1);
+    apply_guesses(game, argument, results);
+    add_game_result(game, results, threadId);
+}
+
+void run_word_command(char *argument, int threadId)
+{
+    // "WORD [game ID] <object type> <object name>" guesses the whole thing at once
+    game_t *game = find_game_argument(&argument, threadId);
+    if (game == NULL)
+        return;
+
+    bool correct = apply_word_guess(game, argument);
+    add_game_result(game, correct ? "+" : "-", threadId);
+}
+
+void run_board_command(char *argument, int threadId)
+{
+    // "BOARD" sends the whole leaderboard, "BOARD SINCE <version>" only the rows that have changed since then,
+    // "BOARD TOP" the best few players, and "BOARD <window>" the best of a time window
+    output_buffer_t *output = &workers[threadId].output;
+    if (argument == NULL)
+    {
+        output_add_leaderboard(output, threadId);
+        return;
+    }
+    sync_shared_leaderboard();
+
+    // "BOARD TOP" sends the pre-encoded top of the leaderboard
+    if (strcmp(argument, BOARD_TOP) == 0)
+    {
+        read_lock();
+        frame_t *top = topLeaderboard;
+        frame_retain(top);
+        read_unlock();
+        output_add_frame(output, top);
+        output_flush(output, line_reader_has_line(&workers[threadId].lineReader));
+        frame_release(top);
+        return;
+    }
+
+    // "BOARD HOUR" etc. send the pre-built summary of that window
+    leaderboard_window_t *window = find_leaderboard_window(argument);
+    if (window != NULL)
+    {
+        frame_t *summary = get_window_summary(window);
+        output_add_frame(output, summary);
+        output_flush(output, line_reader_has_line(&workers[threadId].lineReader));
+        frame_release(summary);
+        return;
+    }
+
+    if (strncmp(argument, BOARD_SINCE " ", strlen(BOARD_SINCE) + 1) != 0)
+    {
+        output_add_line(output, REPLY_ERROR, "bad board request");
+        return;
+    }
+
+    read_lock();
+    frame_t *changes = encode_leaderboard_changes(strtoul(argument + strlen(BOARD_SINCE) + 1, NULL, 10));
+    read_unlock();
+    output_add_frame(output, changes);
+    output_flush(output, line_reader_has_line(&workers[threadId].lineReader));
+    frame_release(changes);
+}
+
+bool run_export_command(char *argument, int threadId)
+{
+    // "EXPORT CSV|JSON" sends a header with the size, then the snapshot straight from its file with sendfile(), so
+    // a big leaderboard costs the worker nothing per row. Returns false if the connection's failed.
+    worker_t *worker = &workers[threadId];
+    output_buffer_t *output = &worker->output;
+    export_format_t format;
+    if (argument != NULL && strcasecmp(argument, "CSV") == 0)
+        format = EXPORT_CSV;
+    else if (argument != NULL && strcasecmp(argument, "JSON") == 0)
+        format = EXPORT_JSON;
+    else
+    {
+        output_add_line(output, REPLY_ERROR, "bad export format");
+        return true;
+    }
+
+    export_snapshot_t *snapshot = get_export_snapshot(format);
+    if (snapshot == NULL)
+    {
+        output_add_line(output, REPLY_ERROR, "export failed");
+        return true;
+    }
+
+    // Everything before the file has to be out first, including the header
+    char header[MAX_LINE_LENGTH];
+    snprintf(header, sizeof(header), REPLY_EXPORT " %s %lu %lld\n", exportFormatNames[format], snapshot->version, (long long)snapshot->size);
+    output_add_string(output, header);
+    bool sent = output_flush(output, true);
+    flush_client_messages(output->clientfileDescriptor, threadId);
+
+    off_t offset = 0;
+    while (sent && offset < snapshot->size)
+    {
+        atomic_fetch_add_explicit(&ioSyscalls, 1, memory_order_relaxed);
+        ssize_t numBytes = sendfile(output->clientfileDescriptor, snapshot->fileDescriptor, &offset, snapshot->size - offset);
+        if (numBytes == -1 && errno == EINTR)
+            continue;
+        if (numBytes <= 0)
+        {
+            thread_printf_error(threadId, "Error sending export.");
+            sent = false;
+        }
+    }
+    worker->bytesSentToClient += offset;
+    atomic_fetch_add(&exportBytesSent, offset);
+
+    pthread_mutex_lock(&exportMutex);
+    exportsServed++;
+    release_export_snapshot(snapshot);
+    pthread_mutex_unlock(&exportMutex);
+    output->failed = !sent;
+    return sent;
+}
+
+void subscribe_to_leaderboard(int clientfileDescriptor, char *argument, int threadId)
+{
+    // "SUBSCRIBE [version]" sends what's changed since the version (everything by default), then pushes each change
+    // as it happens. The connection belongs to the fan-out thread from then on.
+    sync_shared_leaderboard();
+    read_lock();
+    frame_t *changes = encode_leaderboard_changes(argument != NULL ? strtoul(argument, NULL, 10) : 0);
+    add_leaderboard_subscriber(clientfileDescriptor, changes);
+    read_unlock();
+    frame_release(changes);
+
+    thread_printf(threadId, "Client subscribed to the leaderboard");
+    workers[threadId].connectionHandedOff = true;
+}
+
+bool run_compact_command(char *command, int threadId)
+{
+    // Carry out one command, adding its reply to the worker's output buffer. Returns false if the session should end.
+    worker_t *worker = &workers[threadId];
+    output_buffer_t *output = &worker->output;
+    thread_printf(threadId, "Received command: %s", command);
+
+    char *argument = strchr(command, ' ');
+    if (argument != NULL)
+        *argument++ = '\0';
+
+    // Each command is a span named after it. GUESS and WORD are the server's side of a guess round trip.
+    long long startUs = span_begin();
+    if (strcmp(command, COMMAND_PLAY) == 0)
+    {
+        run_play_command(argument, threadId);
+        span_end(COMMAND_PLAY, startUs);
+    }
+    else if (strcmp(command, COMMAND_GUESS) == 0)
+    {
+        run_guess_command(argument, threadId);
+        span_end(COMMAND_GUESS, startUs);
+    }
+    else if (strcmp(command, COMMAND_WORD) == 0)
+    {
+        run_word_command(argument, threadId);
+        span_end(COMMAND_WORD, startUs);
+    }
+    else if (strcmp(command, COMMAND_BOARD) == 0)
+    {
+        run_board_command(argument, threadId);
+        span_end(COMMAND_BOARD, startUs);
+    }
+    else if (strcmp(command, COMMAND_EXPORT) == 0)
+    {
+        bool sent = run_export_command(argument, threadId);
+        span_end(COMMAND_EXPORT, startUs);
+        return sent;
+    }
+    else if (strcmp(command, COMMAND_QUIT) == 0)
+    {
+        output_add_line(output, REPLY_BYE, NULL);
+        return false;
+    }
+    else
+    {
+        output_add_line(output, REPLY_ERROR, "unknown command");
+    }
+
+    return true;
+}
+
+void output_add_live_games(output_buffer_t *output)
+{
+    // Rows point straight at the usernames, which never change, so the lock isn't needed for the flush
+    pthread_mutex_lock(&spectatorMutex);
+    output_add_string(output, REPLY_LIVE " ");
+    output_add_int(output, numLiveGames);
+    output_add_char(output, '\n');
+    for (live_game_t *liveGame = liveGames; liveGame != NULL; liveGame = liveGame->next)
+    {
+        output_add_int(output, liveGame->liveId);
+        output_add_char(output, '|');
+        output_add_string(output, liveGame->username);
+        output_add_char(output, '\n');
+    }
+    pthread_mutex_unlock(&spectatorMutex);
+}
+
+bool handle_spectator_session(int clientfileDescriptor, int threadId, char *line)
+{
+    // Spectators don't log in. They can list the games being played, then pick one to WATCH, at which point
+    // their connection is handed over to the fan-out thread.
+    worker_t *worker = &workers[threadId];
+    output_buffer_t *output = &worker->output;
+    while (line != NULL)
+    {
+        thread_printf(threadId, "Received spectator command: %s", line);
+        char *command = line;
+        char *argument = strchr(line, ' ');
+        if (argument != NULL)
+            *argument++ = '\0';
+
+        // Make sure everything we've said so far is out before the fan-out thread might start writing
+        bool handingOff = strcmp(command, COMMAND_WATCH) == 0 || strcmp(command, COMMAND_SUBSCRIBE) == 0;
+        if (handingOff)
+        {
+            if (!output_flush(output, false))
+                return false;
+            flush_client_messages(clientfileDescriptor, threadId);
+        }
+
+        if (strcmp(command, COMMAND_LIVE) == 0)
+        {
+            output_add_live_games(output);
+        }
+        else if (strcmp(command, COMMAND_BOARD) == 0)
+        {
+            run_board_command(argument, threadId);
+        }
+        else if (strcmp(command, COMMAND_EXPORT) == 0)
+        {
+            if (!run_export_command(argument, threadId))
+                return false;
+        }
+        else if (strcmp(command, COMMAND_SUBSCRIBE) == 0)
+        {
+            subscribe_to_leaderboard(clientfileDescriptor, argument, threadId);
+            return true;
+        }
+        else if (strcmp(command, COMMAND_WATCH) == 0)
+        {
+            if (argument != NULL && add_spectator(clientfileDescriptor, atoi(argument)))
+            {
+                thread_printf(threadId, "Client is now watching game %s", argument);
+                worker->connectionHandedOff = true;
+                return true;
+            }
+            output_add_line(output, REPLY_ERROR, "no such game");
+        }
+        else if (strcmp(command, COMMAND_QUIT) == 0)
+        {
+            output_add_line(output, REPLY_BYE, NULL);
+            output_flush(output, false);
+            return true;
+        }
+        else
+        {
+            output_add_line(output, REPLY_ERROR, "log in first");
+        }
+
+        if (!output_flush(output, line_reader_has_line(&worker->lineReader)))
+            return false;
+        line = receive_client_line(clientfileDescriptor, threadId);
+    }
+
+    return false;
+}
+
+bool run_compact_session(int clientfileDescriptor, int threadId, char *firstAction)
+{
+    // Handle a logged in client's commands until it quits or goes away. Returns whether it quit properly.
+    worker_t *worker = &workers[threadId];
+    output_buffer_t *output = &worker->output;
+    char *line;
+
+    // The first action saves the client a round trip, e.g. so the first game state comes back with the login
+    bool keepGoing = true;
+    if (firstAction != NULL)
+        keepGoing = run_compact_command(firstAction, threadId);
+
+    while (keepGoing)
+    {
+        // Hold the reply back (MSG_MORE) if there are more commands already waiting, so the replies go out together.
+        // Every game's guesses are handled in the order they arrive, so many games interleave over the one connection.
+        if (!output_flush(output, line_reader_has_line(&worker->lineReader)))
+            break;
+        reap_finished_games(worker, threadId);
+
+        // A newer server taking over from us gets the connection as soon as it's between games. Waiting on the
+        // client's next command is the one place the handover can interrupt, so it doesn't have to wait for it.
+        bool betweenGames = worker->numActiveGames == 0 && !line_reader_has_line(&worker->lineReader);
+        if (betweenGames && hand_off_connection(clientfileDescriptor, threadId))
+            return true;
+        atomic_store(&worker->waitingBetweenGames, betweenGames && handoffPath != NULL);
+        errno = 0;
+        line = receive_client_line(clientfileDescriptor, threadId);
+        bool interrupted = line == NULL && errno == EINTR && atomic_load(&worker->waitingBetweenGames);
+        atomic_store(&worker->waitingBetweenGames, false);
+        if (interrupted)
+            continue;
+        if (line == NULL)
+            break;
+        if (!rate_limit_message(threadId))
+        {
+            // The session's kept like any other dropped connection, so the client can resume once it's slowed down
+            output_add_line(output, REPLY_ERROR, "too many requests");
+            thread_printf_error(threadId, "Client is sending too fast.");
+            break;
+        }
+        keepGoing = run_compact_command(line, threadId);
+    }
+    output_flush(output, false);
+    reap_finished_games(worker, threadId);
+
+    // If the connection dropped rather than the client quitting, hold on to the session so the client can resume it
+    if (keepGoing && worker->sessionToken[0] != '\0')
+        detach_session(worker);
+    else
+        end_all_games(worker);
+
+    return !keepGoing;
+}
+
+bool handle_compact_session(int clientfileDescriptor, int threadId, char *loginMessage)
+{
+    // The client sent "LOGIN <username> <password> [action]" without waiting for the prompt, and may have sent
+    // more commands straight after it. Reply to everything in as few writes as possible.
+    worker_t *worker = &workers[threadId];
+    output_buffer_t *output = &worker->output;
+    line_reader_begin(&worker->lineReader, loginMessage);
+    output_begin(output, clientfileDescriptor, threadId);
+    worker->numActiveGames = 0;
+    worker->numFinishedGames = 0;
+    worker->nextGameId = 0;
+    worker->lastGameId = 0;
+
+    char *line = receive_client_line(clientfileDescriptor, threadId);
+    if (line == NULL)
+        return false;
+    if (strncmp(line, COMMAND_LOGIN " ", strlen(COMMAND_LOGIN) + 1) != 0 && strncmp(line, COMMAND_RESUME " ", strlen(COMMAND_RESUME) + 1) != 0)
+        return handle_spectator_session(clientfileDescriptor, threadId, line);
+
+    // Either log in with a username and password, or pick up a dropped session with its token
+    char *command = strtok(line, " ");
+    char *firstAction = NULL;
+    worker->sessionToken[0] = '\0';
+    if (strcmp(command, COMMAND_RESUME) == 0)
+    {
+        long long startUs = span_begin();
+        bool resumed = resume_session(worker, strtok(NULL, " "));
+        span_end("resume", startUs);
+        if (!resumed)
+        {
+            output_add_line(output, REPLY_ERROR, "session expired");
+            output_flush(output, false);
+            return false;
+        }
+        thread_printf(threadId, "User '%s' resumed their session", worker->loggedInUser);
+    }
+    else
+    {
+        long long startUs = span_begin();
+        char *username = strtok(NULL, " ");
+        char *password = strtok(NULL, " ");
+        firstAction = strtok(NULL, "");
+        user_info_t *user = username != NULL ? find_user(username) : NULL;
+        bool authenticated = user != NULL && password != NULL && strcmp(user->password, password) == 0;
+        span_end("authenticate", startUs);
+        if (!authenticated)
+        {
+            output_add_line(output, REPLY_ERROR, "login failed");
+            output_flush(output, false);
+            return false;
+        }
+        worker->loggedInUser = user->username;
+        worker->loggedInUserIndex = user - users;
+        thread_printf(threadId, "User '%s' successfully authenticated", worker->loggedInUser);
+    }
+
+    // Without a token the client can still play, it just can't resume
+    generate_session_token(worker->sessionToken, threadId);
+    output_add_line(output, REPLY_OK, worker->sessionToken[0] != '\0' ? worker->sessionToken : NULL);
+    for (int i = 0; i < MAX_GAMES_PER_CONNECTION; i++)
+    {
+        if (worker->games[i].active)
+            output_add_state_line(output, &worker->games[i]);
+    }
+
+    return run_compact_session(clientfileDescriptor, threadId, firstAction);
+}
+
+bool handle_adopted_session(int clientfileDescriptor, int threadId)
+{
+    // An older server handed the connection over between games, so carry on from the client's next command as if
+    // nothing had happened. The client keeps its session token.
+    worker_t *worker = &workers[threadId];
+    adopted_session_t *session = worker->adopted;
+    worker->adopted = NULL;
+    output_begin(&worker->output, clientfileDescriptor, threadId);
+    memcpy(worker->lineReader.buffer, session->unread, session->numUnread);
+    worker->lineReader.start = 0;
+    worker->lineReader.end = session->numUnread;
+    worker->numActiveGames = 0;
+    worker->numFinishedGames = 0;
+    worker->nextGameId = session->nextGameId;
+    worker->lastGameId = session->lastGameId;
+    worker->loggedInUser = session->username;
+    worker->loggedInUserIndex = session->userIndex;
+    strcpy(worker->sessionToken, session->token);
+    free(session);
+    thread_printf(threadId, "User '%s' was handed over by the older server", worker->loggedInUser);
+
+    return run_compact_session(clientfileDescriptor, threadId, NULL);
+}
+
+//--------------------------------------------------------------------------------------------
+// Handling requests related
+//--------------------------------------------------------------------------------------------
+void classify_request(request_t *request, long long nowMs)
+{
+    // Peek at whatever the client has already sent without waiting for more. Compact clients send their first
+    // command straight away, legacy clients wait for the prompt so they'll have sent nothing and count as logins.
+    // A compact client's first message can easily arrive after we've accepted it though, so until CLASSIFY_GRACE_MS
+    // has passed an empty peek is only a guess and the request gets looked at again.
+    char peeked[MAX_LINE_LENGTH];
+    atomic_fetch_add_explicit(&ioSyscalls, 1, memory_order_relaxed);
+    ssize_t numBytes = recv(request->fileDescriptor, peeked, sizeof(peeked) - 1, MSG_PEEK | MSG_DONTWAIT);
+    request->requestClass = REQUEST_LOGIN;
+    request->classified = numBytes != 0 && (numBytes > 0 || errno != EAGAIN || nowMs - request->enqueuedAtMs >= CLASSIFY_GRACE_MS);
+    if (numBytes <= 0)
+        return;
+    peeked[numBytes] = '\0';
+    if (!is_compact_login(peeked))
+        return;
+
+    if (strncmp(peeked, COMMAND_RESUME, strlen(COMMAND_RESUME)) == 0)
+    {
+        request->requestClass = REQUEST_IN_GAME;
+        return;
+    }
+    if (strncmp(peeked, COMMAND_LOGIN, strlen(COMMAND_LOGIN)) != 0)
+    {
+        request->requestClass = REQUEST_EXPORT;
+        return;
+    }
+
+    // "LOGIN <username> <password> <action>" has a menu action riding along with it
+    int numSpaces = 0;
+    for (char *c = peeked; *c != '\0' && *c != '\r' && *c != '\n'; c++)
+        numSpaces += *c == ' ' ? 1 : 0;
+    if (numSpaces >= 3)
+        request->requestClass = REQUEST_MENU;
+}
+
+void enqueue_request(request_t *request)
+{
+    // Must be called with requestMutex locked. Keeps each class in the order its requests arrived.
+    request_queue_t *queue = &requestQueues[request->requestClass];
+    request_t *previousRequest = NULL;
+    request_t *nextRequest = queue->head;
+    if (queue->tail != NULL && queue->tail->enqueuedAtMs <= request->enqueuedAtMs)
+    {
+        previousRequest = queue->tail;
+        nextRequest = NULL;
+    }
+    while (nextRequest != NULL && nextRequest->enqueuedAtMs <= request->enqueuedAtMs)
+    {
+        previousRequest = nextRequest;
+        nextRequest = nextRequest->next;
+    }
+
+    request->next = nextRequest;
+    if (previousRequest != NULL)
+        previousRequest->next = request;
+    else
+        queue->head = request;
+    if (nextRequest == NULL)
+        queue->tail = request;
+    queue->length++;
+}
+
+void reclassify_requests(long long nowMs)
+{
+    // Must be called with requestMutex locked. Anything that was only guessed to be a login gets another look,
+    // as its first message may have arrived since. Only worth doing when there's more than one request to choose from.
+    // Each peek is a syscall with the lock held, so only the oldest few get looked at, as they'll be taken soonest.
+    request_queue_t *loginQueue = &requestQueues[REQUEST_LOGIN];
+    request_t *previousRequest = NULL;
+    request_t *request = loginQueue->head;
+    int numPeeks = 0;
+    while (request != NULL && numPeeks < RECLASSIFY_PEEKS)
+    {
+        request_t *nextRequest = request->next;
+        if (!request->classified)
+        {
+            classify_request(request, nowMs);
+            numPeeks++;
+        }
+        if (request->requestClass == REQUEST_LOGIN)
+        {
+            previousRequest = request;
+            request = nextRequest;
+            continue;
+        }
+
+        // Move it to the queue it belongs in
+        if (previousRequest != NULL)
+            previousRequest->next = nextRequest;
+        else
+            loginQueue->head = nextRequest;
+        if (nextRequest == NULL)
+            loginQueue->tail = previousRequest;
+        loginQueue->length--;
+        enqueue_request(request);
+        request = nextRequest;
+    }
+}
+
+long long oldest_request_enqueued_at_ms()
+{
+    // Must be called with requestMutex locked and at least one request queued
+    long long oldestMs = LLONG_MAX;
+    for (int i = 0; i < NUM_REQUEST_CLASSES; i++)
+    {
+        if (requestQueues[i].head != NULL && requestQueues[i].head->enqueuedAtMs < oldestMs)
+            oldestMs = requestQueues[i].head->enqueuedAtMs;
+    }
+    return oldestMs;
+}
+
+void queue_request(request_t *request, pthread_mutex_t *p_mutex, pthread_cond_t *p_cond_var)
+{
+    // Lock the mutex, to assure exclusive access to the linked lists of requests
+    pthread_mutex_lock(p_mutex);
+
+    // Add new request to the end of its class's list, and increase total number of pending requests by one
+    enqueue_request(request);
+    numRequests++;
+
+    // If there aren't enough idle workers to take everything that's queued, let the pool manager know so it can
+    // decide whether to grow the pool once the request has waited long enough
+    if (numRequests > pool.numIdle)
+        pthread_cond_signal(&poolManagerCond);
+
+    // Unlock mutex
+    pthread_mutex_unlock(p_mutex);
+
+    // Signal the condition variable - there's a new request to handle
+    pthread_cond_signal(p_cond_var);
+}
+
+request_t *create_request(int fileDescriptor, struct sockaddr_storage addressInfo, socklen_t addressSize)
+{
+    // Create new request
+    request_t *request = (request_t *)custom_malloc(sizeof(request_t));
+
+    // Setup request
+    request->fileDescriptor = fileDescriptor;
+    request->addressInfo = addressInfo;
+    request->addressSize = addressSize;
+    request->enqueuedAtMs = now_ms();
+    request->connectionNumber = atomic_fetch_add(&connectionsAccepted, 1) + 1;
+    request->adopted = NULL;
+    if (captureFile != NULL)
+        capture_event(request->connectionNumber, TRACE_OPENED, 0, NULL, 0);
+    return request;
+}
+
+void add_request(int fileDescriptor, struct sockaddr_storage addressInfo, socklen_t addressSize, pthread_mutex_t *p_mutex, pthread_cond_t *p_cond_var)
+{
+    // Classified here, as that decides which queue it waits in. The peek doesn't wait (MSG_DONTWAIT), so a slow
+    // client costs the accepting thread one syscall rather than holding it up.
+    request_t *request = create_request(fileDescriptor, addressInfo, addressSize);
+    classify_request(request, request->enqueuedAtMs);
+    queue_request(request, p_mutex, p_cond_var);
+}
+
+request_t *get_request(pthread_mutex_t *p_mutex)
+{
+    // lock the mutex, to assure exclusive access to the list
+    pthread_mutex_lock(p_mutex);
+
+    request_t *request;
+    if (numRequests > 0)
+    {
+        // Take the head of whichever class is most urgent once its wait is taken into account.
+        // Between equally urgent heads the one that's waited longest goes first.
+        long long nowMs = now_ms();
+        if (numRequests > 1)
+            reclassify_requests(nowMs);
+        int chosenClass = -1;
+        long long chosenUrgency = 0;
+        for (int i = 0; i < NUM_REQUEST_CLASSES; i++)
+        {
+            request_t *head = requestQueues[i].head;
+            if (head == NULL)
+                continue;
+            long long urgency = i - (nowMs - head->enqueuedAtMs) / priorityAgingMs;
+            if (chosenClass == -1 || urgency < chosenUrgency ||
+                (urgency == chosenUrgency && head->enqueuedAtMs < requestQueues[chosenClass].head->enqueuedAtMs))
+            {
+                chosenClass = i;
+                chosenUrgency = urgency;
+            }
+        }
+        for (int i = 0; i < chosenClass; i++)
+        {
+            if (requestQueues[i].head != NULL)
+            {
+                requestsAged++;
+                break;
+            }
+        }
+
+        request_queue_t *queue = &requestQueues[chosenClass];
+        request = queue->head;
+        queue->head = request->next;
+        if (queue->head == NULL)
+        {
+            // This was the last request on the list
+            queue->tail = NULL;
+        }
+        // decrease the total number of pending requests
+        queue->length--;
+        numRequests--;
+
+        // Keep track of how long requests are sitting in the queue, as that's what drives the pool growing
+        long long queueWaitMs = nowMs - request->enqueuedAtMs;
+        pool.queueWaitEwmaMs = pool.requestsHandled == 0 ? queueWaitMs : 0.9 * pool.queueWaitEwmaMs + 0.1 * queueWaitMs;
+        if (queueWaitMs > pool.maxQueueWaitMs)
+            pool.maxQueueWaitMs = queueWaitMs;
+        pool.requestsHandled++;
+        queue->waitEwmaMs = queue->handled == 0 ? queueWaitMs : 0.9 * queue->waitEwmaMs + 0.1 * queueWaitMs;
+        if (queueWaitMs > queue->maxWaitMs)
+            queue->maxWaitMs = queueWaitMs;
+        queue->handled++;
+    }
+    else
+    {
+        // requests list is empty
+        request = NULL;
+    }
+
+    // Unlock mutex and return the request to the caller.
+    pthread_mutex_unlock(p_mutex);
+    return request;
+}
+
+void handle_request(int clientfileDescriptor, int threadId)
+{
+    // Connections handed over by an older server are already logged in
+    if (workers[threadId].adopted != NULL)
+    {
+        if (!handle_adopted_session(clientfileDescriptor, threadId))
+            thread_printf_error(threadId, "Compact session ended early");
+        return;
+    }
+
+    // Send message asking for username, receive message for username.
+    // A compact client will already have sent its login line instead of waiting for the prompt.
+    send_client_message(clientfileDescriptor, LOGIN_PROMPT, threadId);
+    char *message = receive_client_message(clientfileDescriptor, threadId);
+    if (message == NULL)
+        return;
+
+    if (is_compact_login(message))
+    {
+        if (!handle_compact_session(clientfileDescriptor, threadId, message))
+            thread_printf_error(threadId, "Compact session ended early");
+        return;
+    }
+
+    // Authenticate user. For legacy clients this includes waiting for them to send their password.
+    long long startUs = span_begin();
+    bool authenticated = is_user_valid(clientfileDescriptor, threadId, message);
+    span_end("authenticate", startUs);
+    if (!authenticated)
+    {
+        thread_printf_error(threadId, "User failed to validate");
+        send_client_message(clientfileDescriptor, "false", threadId);
+        return;
+    }
+
+    // Notify the client they've logged in successfully
+    send_client_message(clientfileDescriptor, "true", threadId);
+    thread_printf(threadId, "User '%s' successfully authenticated", workers[threadId].loggedInUser);
+
+    if (!main_menu(clientfileDescriptor, threadId))
+    {
+        thread_printf_error(threadId, "Error playing hangman");
+        return;
+    }
+}
+
+//--------------------------------------------------------------------------------------------
+// Worker pool related
+//--------------------------------------------------------------------------------------------
+void set_worker_state(worker_t *worker, worker_state_t newState)
+{
+    // Must be called with requestMutex locked. Keeps the pool's counts in line with each worker's state.
+    if (worker->state == WORKER_IDLE) pool.numIdle--;
+    if (worker->state == WORKER_BUSY) pool.numBusy--;
+    if (newState == WORKER_IDLE)
+    {
+        pool.numIdle++;
+        worker->idleSinceMs = now_ms();
+    }
+    if (newState == WORKER_BUSY) pool.numBusy++;
+
+    worker->state = newState;
+    pool.transitions[newState]++;
+}
+
+void handle_requests_loop(void *data)
+{
+    int threadId = *((int *)data);
+    worker_t *worker = &workers[threadId];
+    thread_printf(threadId, "CREATED");
+
+    name_span_thread("worker", threadId);
+#ifdef HANGMAN_IO_URING
+    worker->ring = ioBackend == IO_BACKEND_URING ? create_worker_ring(threadId) : NULL;
+    worker->numPendingSends = 0;
+#endif
+
+    // Lock the mutex, to access the requests list exclusively.
+    pthread_mutex_lock(&requestMutex);
+    set_worker_state(worker, WORKER_IDLE);
+
+    // Keep checking to see if a request is pending, and handle it if so, until we're told to stop or we retire
+    bool retiring = false;
+    while (!pool.shuttingDown && !retiring)
+    {
+        // Check if a request is pending
+        if (numRequests > 0)
+        {
+            // If we get a request - handle it and free it
+            request_t *request = get_request(&requestMutex);
+            if (request)
+            {
+                set_worker_state(worker, WORKER_BUSY);
+                
+                // The only thing we really need is the file descriptor, so get that and free the memory allocated for the request
+                int clientfileDescriptor = request->fileDescriptor;
+                worker->clientConnection = clientfileDescriptor;
+                worker->connectionNumber = request->connectionNumber;
+                threadConnection = request->connectionNumber;
+                worker->bytesSentToClient = 0;
+                worker->adopted = request->adopted;
+                worker->rateLimitSource = rate_limit_source(&request->addressInfo);
+                worker->rateLimit = NULL;
+                if (seededWords)
+                    seed_connection_random(threadId);
+                char clientAddress[MAX_ADDRESS_LENGTH];
+                format_client_address(&request->addressInfo, clientAddress);
+                free(request);
+
+                // Unlock mutex so other threads would be able to handle other requests waiting in the queue paralelly.
+                pthread_mutex_unlock(&requestMutex);
+
+                // Deal with the client
+                thread_printf(threadId, "STARTED handling request for %s", clientAddress);
+                handle_request(clientfileDescriptor, threadId);
+                flush_client_messages(clientfileDescriptor, threadId);
+                if (captureFile != NULL && !worker->connectionHandedOff)
+                    capture_event(worker->connectionNumber, TRACE_CLOSED, worker->bytesSentToClient, NULL, 0);
+                thread_printf(threadId, "Finished handling request for %s", clientAddress);
+
+                // Lock the mutex again, we want to check the numRequests variable to see if there are any requests
+                pthread_mutex_lock(&requestMutex);
+                if (!worker->connectionHandedOff)
+                    close(clientfileDescriptor);
+                rate_limit_connection_finished(threadId);
+                worker->connectionHandedOff = false;
+                worker->clientConnection = NO_CONNECTION;
+                threadConnection = 0;
+                worker->loggedInUser = NULL;
+                worker->loggedInUserIndex = -1;
+                set_worker_state(worker, WORKER_IDLE);
+            }
+        }
+        else
+        {
+            // Wait for a request to arrive. Note the mutex will be unlocked here, thus allowing other threads access
+            // to the requests list.
+            // Passing requestMutex to this function means that after we return from pthread_cond_timedwait, the mutex
+            // is locked again, so we don't need to lock it ourselves.
+            // We only wait until our idle time is up, at which point we retire if the pool has more workers than it needs.
+            // A worker whose time is already up was still needed, so it waits another idle timeout before checking again.
+            long long nowMs = now_ms();
+            long long deadlineMs = worker->idleSinceMs + pool.idleTimeoutMs;
+            if (deadlineMs <= nowMs)
+                deadlineMs = nowMs + pool.idleTimeoutMs;
+            struct timespec deadline = deadline_at_ms(deadlineMs);
+            int waitResult = pthread_cond_timedwait(&gotRequestThreadCond, &requestMutex, &deadline);
+            if (waitResult == ETIMEDOUT && numRequests == 0 && pool.numLive > pool.minWorkers)
+                retiring = true;
+        }
+    }
+
+    // Let the pool manager know we're done so it can join us and reuse our slot
+    if (retiring)
+    {
+        pool.retired++;
+        pool.shrinkEvents++;
+    }
+    pool.numLive--;
+    set_worker_state(worker, WORKER_EXITED);
+    pthread_cond_signal(&poolManagerCond);
+    pthread_mutex_unlock(&requestMutex);
+
+#ifdef HANGMAN_IO_URING
+    destroy_worker_ring(worker);
+#endif
+    release_span_buffer();
+    thread_printf(threadId, retiring ? "RETIRED after being idle" : "EXITED");
+}
+
+bool spawn_worker()
+{
+    // Must be called with requestMutex locked. Finds a free slot and starts a worker thread in it.
+    for (int i = 0; i < pool.maxWorkers; i++)
+    {
+        worker_t *worker = &workers[i];
+        if (worker->state != WORKER_UNUSED)
+            continue;
+
+        worker->threadId = i;
+        worker->clientConnection = NO_CONNECTION;
+        worker->loggedInUser = NULL;
+        worker->loggedInUserIndex = -1;
+        set_worker_state(worker, WORKER_STARTING);
+        if (pthread_create(&worker->thread, NULL, (void *(*)(void *))handle_requests_loop, (void *)&worker->threadId) != 0)
+        {
+            perror("pthread_create");
+            worker->state = WORKER_UNUSED;
+            return false;
+        }
+
+        pool.numLive++;
+        pool.spawned++;
+        if (pool.numLive > pool.peakLive)
+            pool.peakLive = pool.numLive;
+        return true;
+    }
+
+    return false;
+}
+
+void join_exited_workers()
+{
+    // Must be called with requestMutex locked. Exited workers have already unlocked the mutex for the last time,
+    // so joining them here can't deadlock.
+    for (int i = 0; i < pool.maxWorkers; i++)
+    {
+        if (workers[i].state == WORKER_EXITED)
+        {
+            pthread_join(workers[i].thread, NULL);
+            workers[i].state = WORKER_UNUSED;
+        }
+    }
+}
+
+void dump_stats(FILE *stream)
+{
+    // Write out every metric we keep as "name value" lines, which is easy to read and easy to scrape
+    pthread_mutex_lock(&requestMutex);
+    fprintf(stream, "pool.workers.min %d\n", pool.minWorkers);
+    fprintf(stream, "pool.workers.max %d\n", pool.maxWorkers);
+    fprintf(stream, "pool.workers.live %d\n", pool.numLive);
+    fprintf(stream, "pool.workers.idle %d\n", pool.numIdle);
+    fprintf(stream, "pool.workers.busy %d\n", pool.numBusy);
+    fprintf(stream, "pool.workers.peak %d\n", pool.peakLive);
+    fprintf(stream, "pool.workers.spawned %lu\n", pool.spawned);
+    fprintf(stream, "pool.workers.retired %lu\n", pool.retired);
+    fprintf(stream, "pool.events.grow %lu\n", pool.growEvents);
+    fprintf(stream, "pool.events.shrink %lu\n", pool.shrinkEvents);
+    fprintf(stream, "pool.transitions.starting %lu\n", pool.transitions[WORKER_STARTING]);
+    fprintf(stream, "pool.transitions.idle %lu\n", pool.transitions[WORKER_IDLE]);
+    fprintf(stream, "pool.transitions.busy %lu\n", pool.transitions[WORKER_BUSY]);
+    fprintf(stream, "pool.transitions.exited %lu\n", pool.transitions[WORKER_EXITED]);
+    fprintf(stream, "queue.length %d\n", numRequests);
+    fprintf(stream, "queue.requests_handled %lu\n", pool.requestsHandled);
+    fprintf(stream, "queue.wait_ms.ewma %.3f\n", pool.queueWaitEwmaMs);
+    fprintf(stream, "queue.wait_ms.max %lld\n", pool.maxQueueWaitMs);
+    fprintf(stream, "queue.aged %lu\n", requestsAged);
+    for (int i = 0; i < NUM_REQUEST_CLASSES; i++)
+    {
+        fprintf(stream, "queue.%s.length %d\n", requestClassNames[i], requestQueues[i].length);
+        fprintf(stream, "queue.%s.handled %lu\n", requestClassNames[i], requestQueues[i].handled);
+        fprintf(stream, "queue.%s.wait_ms.ewma %.3f\n", requestClassNames[i], requestQueues[i].waitEwmaMs);
+        fprintf(stream, "queue.%s.wait_ms.max %lld\n", requestClassNames[i], requestQueues[i].maxWaitMs);
+    }
+    pthread_mutex_unlock(&requestMutex);
+
+    unsigned long numSyscalls = atomic_load(&ioSyscalls);
+    unsigned long numGames = atomic_load(&gamesPlayed);
+    fprintf(stream, "io.backend %s\n", ioBackendNames[ioBackend]);
+    fprintf(stream, "io.syscalls %lu\n", numSyscalls);
+    fprintf(stream, "games.played %lu\n", numGames);
+    fprintf(stream, "io.syscalls_per_game %.2f\n", numGames == 0 ? 0.0 : (double)numSyscalls / numGames);
+
+    pthread_mutex_lock(&sessionMutex);
+    int numDetached = 0;
+    for (int i = 0; i < MAX_DETACHED_SESSIONS; i++)
+        numDetached += detachedSessions[i].inUse ? 1 : 0;
+    fprintf(stream, "sessions.waiting %d\n", numDetached);
+    fprintf(stream, "sessions.detached %lu\n", sessionsDetached);
+    fprintf(stream, "sessions.resumed %lu\n", sessionsResumed);
+    fprintf(stream, "sessions.expired %lu\n", sessionsExpired);
+    fprintf(stream, "sessions.evicted %lu\n", sessionsEvicted);
+    pthread_mutex_unlock(&sessionMutex);
+
+    pthread_mutex_lock(&spectatorMutex);
+    fprintf(stream, "spectators.live_games %d\n", numLiveGames);
+    fprintf(stream, "spectators.watching %lu\n", numSpectators);
+    pthread_mutex_unlock(&spectatorMutex);
+    fprintf(stream, "spectators.frames_published %lu\n", atomic_load(&framesPublished));
+    fprintf(stream, "spectators.frames_sent %lu\n", atomic_load(&framesSent));
+    fprintf(stream, "spectators.frames_skipped %lu\n", atomic_load(&framesSkipped));
+    fprintf(stream, "spectators.dropped %lu\n", atomic_load(&spectatorsDropped));
+
+    sync_shared_leaderboard();
+    read_lock();
+    fprintf(stream, "leaderboard.players %d\n", numLeaderboardItems);
+    fprintf(stream, "leaderboard.top_rebuilds %lu\n", topLeaderboardRebuilds);
+    read_unlock();
+    if (sharedLeaderboard != NULL)
+    {
+        fprintf(stream, "prefork.process %d\n", workerProcessNumber);
+        fprintf(stream, "leaderboard.shared_version %lu\n", atomic_load(&sharedLeaderboard->version));
+        fprintf(stream, "leaderboard.shared_recoveries %lu\n", atomic_load(&sharedLeaderboard->recoveries));
+    }
+    if (boardExport != NULL && workerProcessNumber <= 0)
+        fprintf(stream, "leaderboard.export_writes %lu\n", boardExportWrites);
+    pthread_mutex_lock(&exportMutex);
+    fprintf(stream, "exports.served %lu\n", exportsServed);
+    fprintf(stream, "exports.snapshots_built %lu\n", exportSnapshotsBuilt);
+    fprintf(stream, "exports.snapshots_reused %lu\n", exportSnapshotsReused);
+    pthread_mutex_unlock(&exportMutex);
+    fprintf(stream, "exports.bytes_sent %lu\n", atomic_load(&exportBytesSent));
+    if (rateLimitSlots != NULL)
+    {
+        fprintf(stream, "ratelimit.sources %d\n", count_rate_limited_sources());
+        fprintf(stream, "ratelimit.sources_throttled %lu\n", atomic_load(&rateLimitSourcesThrottled));
+        fprintf(stream, "ratelimit.connections_refused %lu\n", atomic_load(&rateLimitConnectionsRefused));
+        fprintf(stream, "ratelimit.messages_refused %lu\n", atomic_load(&rateLimitMessagesRefused));
+        fprintf(stream, "ratelimit.evictions %lu\n", atomic_load(&rateLimitEvictions));
+    }
+    if (handoffPath != NULL)
+    {
+        fprintf(stream, "handoff.state %d\n", atomic_load(&handoffState));
+        fprintf(stream, "handoff.players_adopted %lu\n", atomic_load(&handoffPlayersAdopted));
+        fprintf(stream, "handoff.sessions_adopted %lu\n", atomic_load(&handoffSessionsAdopted));
+        fprintf(stream, "handoff.connections_adopted %lu\n", atomic_load(&handoffConnectionsAdopted));
+        fprintf(stream, "handoff.sessions_sent %lu\n", atomic_load(&handoffSessionsSent));
+        fprintf(stream, "handoff.results_forwarded %lu\n", atomic_load(&handoffResultsForwarded));
+        fprintf(stream, "handoff.connections_sent %lu\n", atomic_load(&handoffConnectionsSent));
+    }
+    pthread_mutex_lock(&windowMutex);
+    fprintf(stream, "leaderboard.window_rotations %lu\n", windowRotations);
+    fprintf(stream, "leaderboard.window_summaries %lu\n", windowSummariesBuilt);
+    pthread_mutex_unlock(&windowMutex);
+    dump_word_stats(stream);
+    fflush(stream);
+}
+
+void write_stats_file()
+{
+    // Write to a temporary file and rename it over the old one, so anything reading the stats never sees half a file
+    char tempFileName[strlen(statsFileName) + 5];
+    sprintf(tempFileName, "%s.tmp", statsFileName);
+    FILE *fp = fopen(tempFileName, "w");
+    if (fp == NULL)
+    {
+        perror("stats file");
+        return;
+    }
+    dump_stats(fp);
+    fclose(fp);
+    rename(tempFileName, statsFileName);
+}
+
+void pool_manager_loop()
+{
+    long long nextStatsMs = now_ms() + statsIntervalMs;
+
+    pthread_mutex_lock(&requestMutex);
+
+    // Make sure we start with at least the minimum number of workers
+    while (pool.numLive < pool.minWorkers && spawn_worker());
+
+    while (!pool.shuttingDown)
+    {
+        join_exited_workers();
+        expire_detached_sessions();
+        pthread_mutex_unlock(&requestMutex);
+        sync_shared_leaderboard();
+        refresh_leaderboard_windows();
+        publish_board_export();
+        pthread_mutex_lock(&requestMutex);
+
+        // Grow the pool if the oldest request has been waiting too long and nobody is free to take it.
+        // Spawn enough workers for everything that's queued (up to the maximum) so a burst is absorbed in one go.
+        long long nowMs = now_ms();
+        long long nextWakeMs = nowMs + (boardExport != NULL ? BOARD_EXPORT_INTERVAL_MS : POOL_MANAGER_INTERVAL_MS);
+        if (numRequests > pool.numIdle && pool.numLive < pool.maxWorkers)
+        {
+            long long growAtMs = oldest_request_enqueued_at_ms() + pool.growWaitMs;
+            if (nowMs >= growAtMs)
+            {
+                int numToSpawn = numRequests - pool.numIdle;
+                bool grew = false;
+                while (numToSpawn-- > 0 && pool.numLive < pool.maxWorkers && spawn_worker())
+                    grew = true;
+                if (grew)
+                    pool.growEvents++;
+            }
+            else if (growAtMs < nextWakeMs)
+            {
+                nextWakeMs = growAtMs;
+            }
+        }
+
+        // Dump the stats if they've been asked for or it's time to refresh the stats file
+        if (statsRequested || ((statsFileName != NULL || wordStatsFileName != NULL) && nowMs >= nextStatsMs))
+        {
+            pthread_mutex_unlock(&requestMutex);
+            if (statsRequested)
+            {
+                statsRequested = 0;
+                dump_stats(stdout);
+            }
+            if (statsFileName != NULL && nowMs >= nextStatsMs)
+                write_stats_file();
+            if (wordStatsFileName != NULL && workerProcessNumber <= 0 && nowMs >= nextStatsMs)
+                write_word_stats_file();
+            if (nowMs >= nextStatsMs)
+                nextStatsMs = nowMs + statsIntervalMs;
+            pthread_mutex_lock(&requestMutex);
+        }
+
+        struct timespec deadline = deadline_at_ms(nextWakeMs);
+        pthread_cond_timedwait(&poolManagerCond, &requestMutex, &deadline);
     }
 
-    // Find where to insert this item into the leaderboard.
-    if (leaderboardItems == NULL || compare_leaderboard_items(leaderboardItems, newItem) >= 0)
+    pthread_mutex_unlock(&requestMutex);
+}
+
+void start_worker_pool()
+{
+    workers = custom_calloc(pool.maxWorkers, sizeof(worker_t));
+    for (int i = 0; i < pool.maxWorkers; i++)
     {
-        // The newItem is less than all the current items, or there are no current items, so make it the new head of the linked list
-        newItem->next = leaderboardItems;
-        leaderboardItems = newItem;
+        workers[i].state = WORKER_UNUSED;
+        workers[i].clientConnection = NO_CONNECTION;
     }
-    else
+
+    // Both condition variables are waited on with timeouts, so have them use the monotonic clock like now_ms() does
+    pthread_condattr_t condAttributes;
+    pthread_condattr_init(&condAttributes);
+    pthread_condattr_setclock(&condAttributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&gotRequestThreadCond, &condAttributes);
+    pthread_cond_init(&poolManagerCond, &condAttributes);
+    pthread_condattr_destroy(&condAttributes);
+
+    // The manager creates the initial workers and then looks after growing the pool
+    if (pthread_create(&pool.managerThread, NULL, (void *(*)(void *))pool_manager_loop, NULL) != 0)
     {
-        // Search for where to insert this new item, starting at the head of the linked list
-        insert_leaderboard_item_at_correct_pos(leaderboardItems, newItem);
+        perror("pthread_create");
+        exit(1);
     }
+    pool.managerRunning = true;
 }
 
-void update_leaderboard_item(leaderboard_item_t *previousItem, leaderboard_item_t *item, bool gameWon)
+//--------------------------------------------------------------------------------------------
+// Handing over to a newer server related
+//--------------------------------------------------------------------------------------------
+// The servers talk over a SOCK_SEQPACKET UNIX socket, one message to a packet. Each message is a line of text,
+// sometimes followed by more:
+//
+//   PLAYER <username> <games won> <games played>                  A row of the leaderboard
+//   SESSION <token> <username> <age ms> <next game ID> <last game ID> <games>
+//                                                                 A detached session, followed by a line per game:
+//   GAME <game ID> <word index> <guesses made> <guesses left> <won>|<guessed letters>|<client word>|<word>
+//   LISTENERS <count>                                             Comes with the listening sockets, TCP first
+//   RESULT <username> <1 won or 0 lost>                           A game that finished after the rows were sent
+//   CONNECTION <token or -> <username> <next game ID> <last game ID> <unread bytes>
+//                                                                 Comes with a compact client's socket, followed by
+//                                                                 whatever it sent that hadn't been handled yet
+//   DONE                                                          Nothing else is coming
+//
+// The rows and sessions come first so the newer server has them before it starts accepting, then the listeners,
+// then results, sessions and connections as the older server's clients finish their games.
+bool is_handing_off()
 {
-    if (gameWon)
+    int state = atomic_load(&handoffState);
+    return state == HANDOFF_SENDING || state == HANDOFF_DRAINING;
+}
+
+bool send_handoff_message(char *message, int length, int *fileDescriptors, int numFileDescriptors)
+{
+    // Must be called with handoffMutex locked. Any sockets sent along with the message are duplicated into the
+    // newer server, so our own copies still need closing.
+    struct iovec segment = {message, length};
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &segment;
+    header.msg_iovlen = 1;
+    char control[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+    if (numFileDescriptors > 0)
     {
-        item->gamesWon++;
+        memset(control, 0, sizeof(control));
+        header.msg_control = control;
+        header.msg_controllen = CMSG_SPACE(numFileDescriptors * sizeof(int));
+        struct cmsghdr *controlMessage = CMSG_FIRSTHDR(&header);
+        controlMessage->cmsg_level = SOL_SOCKET;
+        controlMessage->cmsg_type = SCM_RIGHTS;
+        controlMessage->cmsg_len = CMSG_LEN(numFileDescriptors * sizeof(int));
+        memcpy(CMSG_DATA(controlMessage), fileDescriptors, numFileDescriptors * sizeof(int));
     }
-    item->totalGames++;
-    item->percentageWon = get_percentage_won(item);
 
-    // See if this user's position in the leaderboard needs to be updated.
-    // If nextItem is NULL, this user is already at the top
-    if (item->next != NULL && compare_leaderboard_items(item, item->next) > 0)
+    while (sendmsg(handoffOutboundfileDescriptor, &header, MSG_NOSIGNAL) == -1)
     {
-        // This item is greater than the next item. Have the previousItem point to the nextItem,
-        // then find where the current item is meant to be moved up to.
-        if (previousItem == NULL)
+        if (errno != EINTR)
         {
-            leaderboardItems = item->next;
-            previousItem = leaderboardItems;
+            perror("handoff");
+            return false;
         }
-        else
+    }
+    return true;
+}
+
+int receive_handoff_message(char *message, int *fileDescriptors, int *numFileDescriptors)
+{
+    // Returns the length of the message, which is '\0' terminated, 0 once the older server's gone or -1 on an error
+    struct iovec segment = {message, HANDOFF_MESSAGE_LENGTH - 1};
+    char control[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &segment;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+
+    ssize_t length;
+    do
+    {
+        length = recvmsg(handoffInboundfileDescriptor, &header, MSG_CMSG_CLOEXEC);
+    } while (length == -1 && errno == EINTR);
+    if (length <= 0)
+        return length;
+
+    *numFileDescriptors = 0;
+    for (struct cmsghdr *controlMessage = CMSG_FIRSTHDR(&header); controlMessage != NULL; controlMessage = CMSG_NXTHDR(&header, controlMessage))
+    {
+        if (controlMessage->cmsg_level != SOL_SOCKET || controlMessage->cmsg_type != SCM_RIGHTS)
+            continue;
+        int numReceived = (controlMessage->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fileDescriptors, CMSG_DATA(controlMessage), numReceived * sizeof(int));
+        *numFileDescriptors = numReceived;
+    }
+    message[length] = '\0';
+    return length;
+}
+
+int append_handoff_game(char *message, int length, game_t *game)
+{
+    hangman_game_t *state = &game->state;
+    int remaining = length < HANDOFF_MESSAGE_LENGTH ? HANDOFF_MESSAGE_LENGTH - length : 0;
+    return length + snprintf(message + length, remaining, "GAME %d %d %d %d %d|%s|%s|%s\n", game->gameId, game->wordIndex,
+                             state->numGuessesMade, state->numGuessesLeft, state->won, state->guessedLetters, state->clientWord, state->hangmanWord);
+}
+
+bool send_detached_session(detached_session_t *session)
+{
+    // Must be called with sessionMutex and handoffMutex locked
+    char *message = custom_malloc(HANDOFF_MESSAGE_LENGTH);
+    int length = snprintf(message, HANDOFF_MESSAGE_LENGTH, "SESSION %s %s %lld %d %d %d\n", session->token, session->username,
+                          now_ms() - session->detachedAtMs, session->nextGameId, session->lastGameId, session->numGames);
+    for (int i = 0; i < session->numGames; i++)
+        length = append_handoff_game(message, length, &session->games[i]);
+    bool sent = length < HANDOFF_MESSAGE_LENGTH && send_handoff_message(message, length, NULL, 0);
+    if (sent)
+        atomic_fetch_add(&handoffSessionsSent, 1);
+    free(message);
+    return sent;
+}
+
+bool forward_detached_session(detached_session_t *session)
+{
+    // Must be called with sessionMutex locked. Returns true if the session's gone to a newer server that's taking
+    // over from us, in which case it's finished with here.
+    if (!is_handing_off())
+        return false;
+    pthread_mutex_lock(&handoffMutex);
+    bool sent = is_handing_off() && send_detached_session(session);
+    pthread_mutex_unlock(&handoffMutex);
+    return sent;
+}
+
+bool forward_result(char *username, bool gameWon)
+{
+    // Must be called with the leaderboard write locked
+    if (!is_handing_off())
+        return false;
+    char message[MAX_LINE_LENGTH];
+    int length = snprintf(message, sizeof(message), "RESULT %s %d", username, gameWon ? 1 : 0);
+    pthread_mutex_lock(&handoffMutex);
+    bool sent = is_handing_off() && send_handoff_message(message, length, NULL, 0);
+    if (sent)
+        atomic_fetch_add(&handoffResultsForwarded, 1);
+    pthread_mutex_unlock(&handoffMutex);
+    return sent;
+}
+
+bool hand_off_connection(int clientfileDescriptor, int threadId)
+{
+    // Must be between games. Sends the client's socket to the newer server, along with its session and whatever it's
+    // sent that we haven't handled. Returns false if there's nobody to hand it to, in which case we carry on with it.
+    worker_t *worker = &workers[threadId];
+    if (atomic_load(&handoffState) != HANDOFF_DRAINING)
+        return false;
+#ifdef HANGMAN_IO_URING
+    if (worker->ring != NULL)
+        return false; // A receive might still be in flight on the socket, so it stays here
+#endif
+
+    line_reader_t *lineReader = &worker->lineReader;
+    int numUnread = lineReader->end - lineReader->start;
+    char message[MAX_LINE_LENGTH + LINE_BUFFER_LENGTH];
+    int length = snprintf(message, MAX_LINE_LENGTH, "CONNECTION %s %s %d %d %d\n", worker->sessionToken[0] != '\0' ? worker->sessionToken : "-",
+                          worker->loggedInUser, worker->nextGameId, worker->lastGameId, numUnread);
+    memcpy(message + length, lineReader->buffer + lineReader->start, numUnread);
+    length += numUnread;
+
+    pthread_mutex_lock(&handoffMutex);
+    bool sent = atomic_load(&handoffState) == HANDOFF_DRAINING && send_handoff_message(message, length, &clientfileDescriptor, 1);
+    if (sent)
+        atomic_fetch_add(&handoffConnectionsSent, 1);
+    pthread_mutex_unlock(&handoffMutex);
+    if (!sent)
+        return false;
+
+    thread_printf(threadId, "Handed '%s' over to the newer server", worker->loggedInUser);
+    worker->sessionToken[0] = '\0';
+    return true;
+}
+
+void hand_off_to_newer_server(int newerServerfileDescriptor)
+{
+    printf("Handing over to a newer server...\n");
+    handoffOutboundfileDescriptor = newerServerfileDescriptor;
+
+    // The leaderboard first. From the moment it's gone, results and detached sessions are forwarded as they happen.
+    char message[MAX_LINE_LENGTH];
+    bool sent = true;
+    write_lock();
+    pthread_mutex_lock(&handoffMutex);
+    for (leaderboard_item_t *item = leaderboardItems; item != NULL && sent; item = item->next)
+    {
+        int length = snprintf(message, sizeof(message), "PLAYER %s %d %d", item->username, item->gamesWon, item->totalGames);
+        sent = send_handoff_message(message, length, NULL, 0);
+    }
+    atomic_store(&handoffState, HANDOFF_SENDING);
+    pthread_mutex_unlock(&handoffMutex);
+    write_unlock();
+
+    pthread_mutex_lock(&sessionMutex);
+    for (int i = 0; i < MAX_DETACHED_SESSIONS && sent; i++)
+    {
+        if (!detachedSessions[i].inUse)
+            continue;
+        pthread_mutex_lock(&handoffMutex);
+        sent = send_detached_session(&detachedSessions[i]);
+        pthread_mutex_unlock(&handoffMutex);
+        if (sent)
+            free_detached_session(&detachedSessions[i]);
+    }
+    pthread_mutex_unlock(&sessionMutex);
+
+    // Then the listeners, after which the newer server's accepting and we can stop
+    pthread_mutex_lock(&handoffMutex);
+    if (sent)
+    {
+        int length = snprintf(message, sizeof(message), "LISTENERS %d", numListeners);
+        sent = send_handoff_message(message, length, listenerfileDescriptors, numListeners);
+    }
+    if (!sent)
+    {
+        fprintf(stderr, "Couldn't hand over to the newer server, carrying on\n");
+        atomic_store(&handoffState, HANDOFF_NONE);
+        close(handoffOutboundfileDescriptor);
+        handoffOutboundfileDescriptor = -1;
+        pthread_mutex_unlock(&handoffMutex);
+        return;
+    }
+    atomic_store(&handoffState, HANDOFF_DRAINING);
+    pthread_mutex_unlock(&handoffMutex);
+    unixSocketPath = NULL; // The newer server removes the socket file when it's done with it
+    serverClosing = 1;
+
+    // Wait for everyone to finish, up to the deadline. Compact clients go over as soon as they're between games, and
+    // the ones waiting on their next command get interrupted so they don't have to send it first. The main thread
+    // gets interrupted too, until it's out of accept().
+    long long deadlineMs = now_ms() + drainTimeoutMs;
+    while (now_ms() < deadlineMs)
+    {
+        if (atomic_load(&acceptingConnections))
+            pthread_kill(mainThread, SIGUSR2);
+        pthread_mutex_lock(&requestMutex);
+        bool drained = numRequests == 0 && pool.numBusy == 0;
+        for (int i = 0; i < pool.maxWorkers && !drained; i++)
         {
-            previousItem->next = item->next;
+            if (workers[i].state == WORKER_BUSY && atomic_load(&workers[i].waitingBetweenGames))
+                pthread_kill(workers[i].thread, SIGUSR2);
         }
+        pthread_mutex_unlock(&requestMutex);
+        if (drained)
+            break;
+        usleep(HANDOFF_CHECK_INTERVAL_MS * 1000);
+    }
+}
 
-        item->next = NULL;
+void finish_handoff()
+{
+    // Called once the worker pool's stopped, so the sessions of any clients still playing when the drain timed out
+    // have been detached and sent on too
+    if (atomic_load(&handoffState) != HANDOFF_DRAINING)
+        return;
+    pthread_mutex_lock(&handoffMutex);
+    send_handoff_message("DONE", 4, NULL, 0);
+    atomic_store(&handoffState, HANDOFF_DONE);
+    close(handoffOutboundfileDescriptor);
+    handoffOutboundfileDescriptor = -1;
+    pthread_mutex_unlock(&handoffMutex);
+    printf("Handed over %lu connections and %lu sessions\n", atomic_load(&handoffConnectionsSent), atomic_load(&handoffSessionsSent));
+}
 
-        // Search for where to insert this new item, starting at the previousItem
-        insert_leaderboard_item_at_correct_pos(previousItem, item);
-    }
+bool parse_handoff_game(char *line, game_t *game)
+{
+    // Reads a GAME line back into a game. The word comes with it, so it doesn't matter if our words are different.
+    hangman_game_t *state = &game->state;
+    int won;
+    if (sscanf(line, "GAME %d %d %d %d %d|", &game->gameId, &game->wordIndex, &state->numGuessesMade, &state->numGuessesLeft, &won) != 5)
+        return false;
+    char *guessedLetters = strchr(line, '|');
+    char *clientWord = guessedLetters != NULL ? strchr(guessedLetters + 1, '|') : NULL;
+    char *hangmanWord = clientWord != NULL ? strchr(clientWord + 1, '|') : NULL;
+    if (hangmanWord == NULL || clientWord - guessedLetters - 1 > MAX_NUM_GUESSES || hangmanWord - clientWord - 1 > MAX_WORD_LENGTH
+        || strlen(hangmanWord + 1) > MAX_WORD_LENGTH)
+        return false;
+    *clientWord = '\0';
+    *hangmanWord = '\0';
+    strcpy(state->guessedLetters, guessedLetters + 1);
+    strcpy(state->clientWord, clientWord + 1);
+    strcpy(state->hangmanWord, hangmanWord + 1);
+    state->wordLength = strlen(state->hangmanWord);
+    state->won = won != 0;
+    if (game->wordIndex < 0 || game->wordIndex >= numWords)
+        game->wordIndex = 0;
+    game->active = true;
+    game->live = NULL;
+    return true;
 }
 
-void update_leaderboard(int threadId, bool gameWon)
+void adopt_player(char *username, char *gamesWon, char *gamesPlayed)
 {
-    // Lock the leaderboard as we don't want multiple threads updating it at once
+    user_info_t *user = username != NULL ? find_user(username) : NULL;
+    if (user == NULL || gamesPlayed == NULL)
+        return;
     write_lock();
+    set_leaderboard_counts(user - users, atoi(gamesWon), atoi(gamesPlayed), leaderboardVersion + 1);
+    write_unlock();
+    atomic_fetch_add(&handoffPlayersAdopted, 1);
+}
 
-    // Try and find the current user in the leaderboard
-    char *currentUser = loggedInUsers[threadId];
-    bool itemFound = false;
-    leaderboard_item_t *previousItem = NULL;
-    leaderboard_item_t *item = leaderboardItems;
-    while (item != NULL && !itemFound)
+void adopt_session(char *header, char *gameLines)
+{
+    char token[SESSION_TOKEN_LENGTH + 1];
+    char username[MAX_LINE_LENGTH];
+    long long ageMs;
+    int nextGameId, lastGameId, numGames;
+    if (sscanf(header, "SESSION %32s %1023s %lld %d %d %d", token, username, &ageMs, &nextGameId, &lastGameId, &numGames) != 6
+        || numGames < 0 || numGames > MAX_GAMES_PER_CONNECTION)
+        return;
+    user_info_t *user = find_user(username);
+    if (user == NULL)
+        return;
+
+    game_t *games = numGames > 0 ? custom_malloc(numGames * sizeof(game_t)) : NULL;
+    char *nextLine = gameLines;
+    for (int i = 0; i < numGames; i++)
+    {
+        char *line = strsep(&nextLine, "\n");
+        if (line == NULL || !parse_handoff_game(line, &games[i]))
+        {
+            free(games);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&sessionMutex);
+    detached_session_t *session = add_detached_session(token, user - users, games, numGames, nextGameId, lastGameId);
+    session->detachedAtMs -= ageMs;
+    pthread_mutex_unlock(&sessionMutex);
+    atomic_fetch_add(&handoffSessionsAdopted, 1);
+}
+
+void adopt_connection(char *header, char *unread, int numUnread, int clientfileDescriptor)
+{
+    adopted_session_t *session = custom_malloc(sizeof(adopted_session_t));
+    char username[MAX_LINE_LENGTH];
+    int numExpected;
+    user_info_t *user = NULL;
+    if (sscanf(header, "CONNECTION %32s %1023s %d %d %d", session->token, username, &session->nextGameId, &session->lastGameId, &numExpected) == 5)
+        user = find_user(username);
+    if (user == NULL || numExpected != numUnread || numUnread > LINE_BUFFER_LENGTH)
+    {
+        free(session);
+        close(clientfileDescriptor);
+        return;
+    }
+    if (strcmp(session->token, "-") == 0)
+        session->token[0] = '\0';
+    session->username = user->username;
+    session->userIndex = user - users;
+    session->numUnread = numUnread;
+    memcpy(session->unread, unread, numUnread);
+
+    // Straight to the front of the queue, as the client's already been waiting on the handover
+    struct sockaddr_storage addressInfo;
+    socklen_t addressSize = sizeof(addressInfo);
+    memset(&addressInfo, 0, sizeof(addressInfo));
+    getpeername(clientfileDescriptor, (struct sockaddr *)&addressInfo, &addressSize);
+    rate_limit_connection(&addressInfo, false);
+    request_t *request = create_request(clientfileDescriptor, addressInfo, addressSize);
+    request->adopted = session;
+    request->requestClass = REQUEST_IN_GAME;
+    request->classified = true;
+    queue_request(request, &requestMutex, &gotRequestThreadCond);
+    atomic_fetch_add(&handoffConnectionsAdopted, 1);
+}
+
+bool receive_handoff(bool untilListeners)
+{
+    // Handle what the older server sends until it's sent its listeners, or until it's finished with us.
+    // Returns false if it went away before then.
+    char *message = custom_malloc(HANDOFF_MESSAGE_LENGTH);
+    bool finished = false;
+    while (!finished)
     {
-        if (strcmp(item->username, currentUser) == 0)
-            itemFound = true;
+        int fileDescriptors[MAX_LISTENERS];
+        int numFileDescriptors = 0;
+        int length = receive_handoff_message(message, fileDescriptors, &numFileDescriptors);
+        if (length <= 0)
+            break;
+
+        // Anything after the first line goes with it
+        char *body = strchr(message, '\n');
+        if (body != NULL)
+            *body++ = '\0';
         else
+            body = message + length;
+        int bodyLength = message + length - body;
+
+        if (strncmp(message, "PLAYER ", 7) == 0)
+        {
+            strtok(message, " ");
+            char *username = strtok(NULL, " ");
+            char *gamesWon = strtok(NULL, " ");
+            adopt_player(username, gamesWon, strtok(NULL, " "));
+        }
+        else if (strncmp(message, "RESULT ", 7) == 0)
+        {
+            strtok(message, " ");
+            user_info_t *user = find_user(strtok(NULL, " "));
+            char *gameWon = strtok(NULL, " ");
+            if (user != NULL && gameWon != NULL)
+                record_result(user - users, atoi(gameWon) != 0);
+        }
+        else if (strncmp(message, "SESSION ", 8) == 0)
+        {
+            adopt_session(message, body);
+        }
+        else if (strncmp(message, "CONNECTION ", 11) == 0 && numFileDescriptors == 1)
+        {
+            adopt_connection(message, body, bodyLength, fileDescriptors[0]);
+            numFileDescriptors = 0;
+        }
+        else if (strncmp(message, "LISTENERS ", 10) == 0 && numFileDescriptors > 0)
+        {
+            memcpy(listenerfileDescriptors, fileDescriptors, numFileDescriptors * sizeof(int));
+            numListeners = numFileDescriptors;
+            serverfileDescriptor = listenerfileDescriptors[0];
+            numFileDescriptors = 0;
+            finished = untilListeners;
+        }
+        else if (strcmp(message, "DONE") == 0)
         {
-            previousItem = item;
-            item = item->next;
+            finished = true;
         }
+
+        // Anything that came with a message we didn't want
+        for (int i = 0; i < numFileDescriptors; i++)
+            close(fileDescriptors[i]);
     }
+    free(message);
+    return finished;
+}
 
-    // If the current user isn't already on the leaderboard, add them. Otherwise update their existing item.
-    if (item == NULL)
+bool take_over_from_older_server()
+{
+    // Called from main() instead of creating the listeners. Returns false if there's no server at handoffPath to
+    // take over from. Otherwise it's handed over the listeners, along with the leaderboard and detached sessions.
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, handoffPath, sizeof(address.sun_path) - 1);
+    int fileDescriptor = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fileDescriptor == -1 || connect(fileDescriptor, (struct sockaddr *)&address, sizeof(address)) == -1)
     {
-        // Item doesn't exist in the leaderboard, create a new item
-        add_leaderboard_item(currentUser, gameWon);
+        if (fileDescriptor != -1)
+            close(fileDescriptor);
+        return false;
     }
-    else
+
+    printf("Taking over from the server at %s...\n", handoffPath);
+    struct timeval timeout = {HANDOFF_TIMEOUT_MS / 1000, 0};
+    setsockopt(fileDescriptor, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    handoffInboundfileDescriptor = fileDescriptor;
+    if (!receive_handoff(true))
     {
-        // Item already exists, update existing item
-        update_leaderboard_item(previousItem, item, gameWon);
+        fprintf(stderr, "The server at %s didn't hand over its listeners\n", handoffPath);
+        exit(1);
     }
 
-    // Unlock the leaderboard so other threads can do their thang
-    write_unlock();
+    // The rest comes in as the older server's clients finish, however long that takes
+    struct timeval noTimeout = {0, 0};
+    setsockopt(fileDescriptor, SOL_SOCKET, SO_RCVTIMEO, &noTimeout, sizeof(noTimeout));
+    printf("Took over %lu players and %lu sessions\n", atomic_load(&handoffPlayersAdopted), atomic_load(&handoffSessionsAdopted));
+    return true;
+}
+
+int create_handoff_listener()
+{
+    // Anything still at the path is from a server that's either gone or finished handing over to us
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, handoffPath, sizeof(address.sun_path) - 1);
+    unlink(handoffPath);
+
+    int listenerfileDescriptor = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listenerfileDescriptor == -1 || bind(listenerfileDescriptor, (struct sockaddr *)&address, sizeof(address)) == -1
+        || listen(listenerfileDescriptor, 1) == -1)
+    {
+        perror(handoffPath);
+        if (listenerfileDescriptor != -1)
+            close(listenerfileDescriptor);
+        return -1;
+    }
+    return listenerfileDescriptor;
+}
+
+void handoff_loop()
+{
+    // First take in everything the server we took over from has left to send, then wait for a newer server to take
+    // over from us. Polls rather than blocking so it notices the server closing.
+    if (handoffInboundfileDescriptor != -1)
+    {
+        receive_handoff(false);
+        pthread_mutex_lock(&handoffMutex);
+        close(handoffInboundfileDescriptor);
+        handoffInboundfileDescriptor = -1;
+        pthread_mutex_unlock(&handoffMutex);
+        printf("The older server has finished handing over, %lu connections came with it\n", atomic_load(&handoffConnectionsAdopted));
+    }
+
+    if (serverClosing)
+        return;
+    int listenerfileDescriptor = create_handoff_listener();
+    if (listenerfileDescriptor == -1)
+        return;
+    handoffListenerfileDescriptor = listenerfileDescriptor;
+
+    struct pollfd pollfileDescriptor = {listenerfileDescriptor, POLLIN, 0};
+    while (!serverClosing)
+    {
+        if (poll(&pollfileDescriptor, 1, HANDOFF_CHECK_INTERVAL_MS) <= 0)
+            continue;
+        int newerServerfileDescriptor = accept4(listenerfileDescriptor, NULL, NULL, SOCK_CLOEXEC);
+        if (newerServerfileDescriptor == -1)
+            continue;
+        hand_off_to_newer_server(newerServerfileDescriptor);
+        if (atomic_load(&handoffState) != HANDOFF_NONE)
+            return;
+    }
+}
+
+void start_handoff_thread()
+{
+    if (handoffPath == NULL)
+        return;
+    if (pthread_create(&handoffThread, NULL, (void *(*)(void *))handoff_loop, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(1);
+    }
+    handoffThreadRunning = true;
+}
+
+void stop_handoff_thread()
+{
+    // Once serverClosing is set the thread stops waiting for a newer server by itself, but it could still be taking
+    // things in from an older one
+    if (!handoffThreadRunning || pthread_equal(handoffThread, pthread_self()))
+        return;
+    pthread_mutex_lock(&handoffMutex);
+    if (handoffInboundfileDescriptor != -1)
+        shutdown(handoffInboundfileDescriptor, SHUT_RDWR);
+    pthread_mutex_unlock(&handoffMutex);
+    pthread_join(handoffThread, NULL);
+    handoffThreadRunning = false;
 }
 
 //--------------------------------------------------------------------------------------------
-// Running the actual game related
+// Accepting connections related
 //--------------------------------------------------------------------------------------------
-bool is_user_valid(int clientfileDescriptor, int threadId)
+void accept_new_connection(int clientfileDescriptor, struct sockaddr_storage clientaddressInfo, socklen_t clientaddressSize)
 {
-    char* message;
+    // Turn away addresses that are connecting too often, or have too many connections open already, before anything's
+    // been allocated for them. They're told why if their socket has room for it, but nothing waits on that.
+    if (!rate_limit_connection(&clientaddressInfo, true))
+    {
+        char *reply = REPLY_ERROR " too many connections\n";
+        send(clientfileDescriptor, reply, strlen(reply), MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(clientfileDescriptor);
+        return;
+    }
 
-    // Send message asking for username, receive message for username
-    send_client_message(clientfileDescriptor, "\nPlease enter your username: ", threadId);
-    message = receive_client_message(clientfileDescriptor, threadId);
-    if (message == NULL) return false;
-    thread_printf(threadId, "Received username: %s", message);
+    // Do whatever with the connection
+    if (!quietMode)
+    {
+        char clientAddress[MAX_ADDRESS_LENGTH];
+        format_client_address(&clientaddressInfo, clientAddress);
+        printf("server: got connection from %s\n", clientAddress);
+    }
+    add_request(clientfileDescriptor, clientaddressInfo, clientaddressSize, &requestMutex, &gotRequestThreadCond);
+}
 
-    // Check username is in users
-    for (int i = 0; i < numUsers; i++)
+bool accept_from_listener(int listenerfileDescriptor)
+{
+    // Accept one connection from the given listener. Returns false if there wasn't one to accept.
+    struct sockaddr_storage clientaddressInfo;                     // Client's address info
+    socklen_t clientaddressSize = sizeof(struct sockaddr_storage); // Need to initialise this to be the size of the struct for clientaddressInfo
+    atomic_fetch_add_explicit(&ioSyscalls, 1, memory_order_relaxed);
+    int clientfileDescriptor = accept4(listenerfileDescriptor, (struct sockaddr *)&clientaddressInfo, &clientaddressSize, SOCK_CLOEXEC);
+    if (clientfileDescriptor == -1)
+    {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("accept");
+        return false;
+    }
+
+    accept_new_connection(clientfileDescriptor, clientaddressInfo, clientaddressSize);
+    return true;
+}
+
+void accept_connections_blocking()
+{
+    // Loop handling client connections until we're asked to close.
+    // With just the one listener we can sit in accept(), otherwise poll() tells us which one to accept from.
+    struct pollfd pollfileDescriptors[MAX_LISTENERS];
+    for (int i = 0; i < numListeners; i++)
+    {
+        pollfileDescriptors[i].fd = listenerfileDescriptors[i];
+        pollfileDescriptors[i].events = POLLIN;
+    }
+
+    while (!serverClosing)
+    {
+        if (numListeners == 1)
+        {
+            accept_from_listener(listenerfileDescriptors[0]);
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&ioSyscalls, 1, memory_order_relaxed);
+        if (poll(pollfileDescriptors, numListeners, -1) == -1)
+        {
+            if (errno != EINTR)
+                perror("poll");
+            continue;
+        }
+        for (int i = 0; i < numListeners; i++)
+        {
+            if (pollfileDescriptors[i].revents & POLLIN)
+                accept_from_listener(listenerfileDescriptors[i]);
+        }
+    }
+}
+
+#ifdef HANGMAN_IO_URING
+bool uring_queue_multishot_accept(uring_t *ring, int listenerIndex)
+{
+    // One SQE keeps producing a completion per accepted connection until the kernel tells us it's stopped
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+        return false;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenerfileDescriptors[listenerIndex];
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = listenerIndex;
+    return true;
+}
+
+bool accept_connections_uring()
+{
+    // Returns false if io_uring isn't usable here, so the caller can fall back
+    uring_t ring;
+    if (!uring_init(&ring, URING_ACCEPT_ENTRIES))
+        return false;
+
+    for (int i = 0; i < numListeners; i++)
+        uring_queue_multishot_accept(&ring, i);
+    while (!serverClosing)
     {
-        user_info_t user = users[i];
-        if (strcmp(user.username, message) == 0)
+        if (uring_submit_and_wait(&ring, 1) < 0)
         {
-            // Send message asking for password, receive message for password
-            send_client_message(clientfileDescriptor, "Please enter your password: ", threadId);
-            message = receive_client_message(clientfileDescriptor, threadId);
-            if (message == NULL) return false;
-            thread_printf(threadId, "Received password");
+            if (errno != EINTR)
+                perror("io_uring_enter");
+            continue;
+        }
 
-            // Check password is attributed to user
-            if (strcmp(user.password, message) == 0)
+        struct io_uring_cqe completion;
+        while (uring_next_completion(&ring, &completion))
+        {
+            if (completion.res >= 0)
             {
-                loggedInUsers[threadId] = user.username;
-                return true;
+                // Multishot accept can't fill in a separate address per connection, so ask for it afterwards
+                struct sockaddr_storage clientaddressInfo;
+                socklen_t clientaddressSize = sizeof(struct sockaddr_storage);
+                memset(&clientaddressInfo, 0, sizeof(clientaddressInfo));
+                atomic_fetch_add_explicit(&ioSyscalls, 1, memory_order_relaxed);
+                getpeername(completion.res, (struct sockaddr *)&clientaddressInfo, &clientaddressSize);
+                accept_new_connection(completion.res, clientaddressInfo, clientaddressSize);
             }
-            else
+            else if (completion.res == -EINVAL)
             {
+                // The kernel doesn't know about multishot accept
+                uring_free(&ring);
                 return false;
             }
+            else
+            {
+                fprintf(stderr, "accept: %s\n", strerror(-completion.res));
+            }
+
+            if (!(completion.flags & IORING_CQE_F_MORE))
+                uring_queue_multishot_accept(&ring, completion.user_data);
         }
     }
 
-    return false;
+    uring_free(&ring);
+    return true;
+}
+
+bool io_uring_available()
+{
+    // Check we can make a ring and register a provided buffer ring, which means the kernel is new enough for everything we use
+    uring_t ring;
+    if (!uring_init(&ring, URING_WORKER_ENTRIES))
+        return false;
+    bool buffersRegistered = uring_setup_buffers(&ring, URING_NUM_BUFFERS, URING_BUFFER_SIZE);
+    uring_free(&ring);
+    return buffersRegistered;
+}
+#endif
+
+void accept_connections()
+{
+    switch (ioBackend)
+    {
+        case IO_BACKEND_URING:
+#ifdef HANGMAN_IO_URING
+            if (accept_connections_uring())
+                break;
+            fprintf(stderr, "io_uring accept isn't supported, falling back to blocking accept()\n");
+#endif
+            accept_connections_blocking();
+            break;
+        default:
+            accept_connections_blocking();
+            break;
+    }
+}
+
+//--------------------------------------------------------------------------------------------
+// Setting up listening sockets related
+//--------------------------------------------------------------------------------------------
+int create_tcp_listener(int port)
+{
+    // Generate a socket for the server
+    int listenerfileDescriptor = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenerfileDescriptor == -1)
+    {
+        perror("socket");
+        exit(1);
+    }
+
+    // Let us rebind straight away after a restart instead of waiting for old connections to leave TIME_WAIT
+    int reuseAddress = 1;
+    setsockopt(listenerfileDescriptor, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress));
+
+    // Generate the end point (my address info)
+    struct sockaddr_in serveraddressInfo;
+    memset(&serveraddressInfo, 0, sizeof(serveraddressInfo));
+    serveraddressInfo.sin_family = AF_INET;         // host byte order
+    serveraddressInfo.sin_port = htons(port);       // short, network byte order
+    serveraddressInfo.sin_addr.s_addr = INADDR_ANY; // auto-fill with my IP
+
+    // Bind the socket to the end point
+    int bindResult = bind(listenerfileDescriptor, (struct sockaddr *)&serveraddressInfo, sizeof(struct sockaddr));
+    if (bindResult == -1)
+    {
+        perror("bind");
+        exit(1);
+    }
+
+    // Start listening on the created socket
+    int listenResult = listen(listenerfileDescriptor, LISTEN_BACKLOG);
+    if (listenResult == -1)
+    {
+        perror("listen");
+        exit(1);
+    }
+
+    return listenerfileDescriptor;
 }
 
-bool play_hangman(int clientfileDescriptor, int threadId)
+void remove_stale_unix_socket(struct sockaddr_un *address)
 {
-    thread_printf(threadId, "Client '%s' playing hangman...", loggedInUsers[threadId]);
-
-    // Generate a random number for selecting the hangman words
-    int randomNumber = rand() % numWords;
-    thread_printf(threadId, "Got random number %d", randomNumber);
-
-    hangman_word_t hangmanWordItem = hangmanWords[randomNumber];
-    char *objectType = hangmanWordItem.objectType;
-    char *objectName = hangmanWordItem.objectName;
-    int hangmanWordLength = strlen(objectType) + 1 + strlen(objectName); // +1 for the space
-
-    // Combine to get a single string with both objectType and objectName separated by a space
-    char *hangmanWord = custom_calloc(hangmanWordLength + 1, sizeof(char));
-    hangmanWordsInUse[threadId] = hangmanWord; // Save it to ensure if the thread gets cancelled we can free this memory properly
-    strcpy(hangmanWord, objectType);
-    strcat(hangmanWord, " ");
-    strcat(hangmanWord, objectName);
-    hangmanWord[hangmanWordLength] = '\0';
-    thread_printf(threadId, "Random word chosen: %s", hangmanWord);
-
-    // Determine whether the number of guesses is 26 or the number of characters in both words plus nine
-    int numGuesses;    
-    if ((hangmanWordLength + 9) > MAX_NUM_GUESSES)
-        numGuesses = MAX_NUM_GUESSES;
-    else
-        numGuesses = (strlen(hangmanWord) + 9);
-
-    thread_printf(threadId, "Number of guesses: %d", numGuesses);
-
-    // Create the initial version of the hangman word to be sent to the client comprised of underscores and a single space
-    char *clientWord = custom_calloc(hangmanWordLength + 1, sizeof(char));
-    clientWordsInUse[threadId] = clientWord; // Save it to ensure if the thread gets cancelled we can free this memory properly
-    for (int i = 0; i < hangmanWordLength; i++)
+    // Only a socket file left behind by a server that didn't exit cleanly gets removed. Anything else at the path,
+    // or a socket another server is still listening on, is left alone and we give up.
+    char *path = address->sun_path;
+    struct stat pathInfo;
+    if (lstat(path, &pathInfo) == -1)
+        return;
+    if (!S_ISSOCK(pathInfo.st_mode))
     {
-        clientWord[i] = '_';
+        fprintf(stderr, "%s already exists and isn't a socket\n", path);
+        exit(1);
     }
-    clientWord[strlen(objectType)] = ' ';
-    clientWord[hangmanWordLength] = '\0';
-    thread_printf(threadId, "Client Word: %s", clientWord);
 
-    int i = 0;
-    char guessedLetters[MAX_NUM_GUESSES] = {' '};   
-    char messageToSend[MAX_MESSAGE_LENGTH];    
-    bool gameWon = false;
-    bool gameOver = false; 
-    while (!gameOver)
+    int probefileDescriptor = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probefileDescriptor == -1)
     {
-        // Send client guesses made thus far, number of guesses remaining, the current word, and game status
-        // Join them all in one message for simplicity
-        char gameStatusIndicator = 'O'; // Ongoing
-        if (gameWon) 
-        {
-            gameOver = true;
-            gameStatusIndicator = 'W'; // Won
-        }
-        else if (numGuesses == 0)
-        {
-            gameOver = true;
-            gameStatusIndicator = 'L'; // Lost
-        }
-        sprintf(messageToSend, "%s|%d|%s|%c", guessedLetters, numGuesses, clientWord, gameStatusIndicator);
-        send_client_message(clientfileDescriptor, messageToSend, threadId);
-
-        if (gameStatusIndicator == 'O')
-        {
-            // Receieve guess from the client
-            char *receivedMessage = receive_client_message(clientfileDescriptor, threadId);
-            if (receivedMessage == NULL) 
-            {
-                // Free dynamically allocated memory
-                free(hangmanWord);
-                free(clientWord);
-                return false;
-            }
-
-            char guess = receivedMessage[0];
-            guessedLetters[i] = guess;
-            guessedLetters[i + 1] = '\0';
-            numGuesses--;
-
-            // Update the clientWord and check if they've won the game
-            gameWon = true;
-            for (int j = 0; j < hangmanWordLength; j++)
-            {
-                // Check if the current character in the array is the same as the guess character
-                if (hangmanWord[j] == guess)
-                {
-                    // Change the client hangman word to have the guessed character in the same position as the original word
-                    clientWord[j] = guess;
-                } 
-                else if (clientWord[j] == '_')
-                {
-                    // Make the winning boolean false if there is still any underscores found in the client word
-                    gameWon = false;
-                }
-            }
-
-            i++;
-        }
+        perror("socket");
+        exit(1);
     }
-
-    update_leaderboard(threadId, gameWon);
-
-    // Free dynamically allocated memory
-    fflush(stdout);
-    free(hangmanWord);
-    free(clientWord);
-
-    return true;
+    int connectResult = connect(probefileDescriptor, (struct sockaddr *)address, sizeof(*address));
+    int connectError = errno;
+    close(probefileDescriptor);
+    if (connectResult == 0)
+    {
+        fprintf(stderr, "Another server is already listening on %s\n", path);
+        exit(1);
+    }
+    if (connectError != ECONNREFUSED)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(connectError));
+        exit(1);
+    }
+    unlink(path);
 }
 
-bool main_menu(int clientfileDescriptor, int threadId)
+int create_unix_listener(char *path)
 {
-    bool quitMenu = false;
-    while (!quitMenu)
+    // Bots and gateways on the same host can connect through here and skip the TCP loopback overhead.
+    // Connections from it go through exactly the same request queue and session handling as TCP ones.
+    struct sockaddr_un serveraddressInfo;
+    memset(&serveraddressInfo, 0, sizeof(serveraddressInfo));
+    serveraddressInfo.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(serveraddressInfo.sun_path))
     {
-        thread_printf(threadId, "Client '%s' on main menu...", loggedInUsers[threadId]);
+        fprintf(stderr, "UNIX socket path is too long (%s)\n", path);
+        exit(1);
+    }
+    strcpy(serveraddressInfo.sun_path, path);
 
-        // Recieve selection for user menu selection
-        char *selection = receive_client_message(clientfileDescriptor, threadId);
-        if (selection == NULL) return false;
-        thread_printf(threadId, "Received selection: %s", selection);
+    int listenerfileDescriptor = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenerfileDescriptor == -1)
+    {
+        perror("socket");
+        exit(1);
+    }
 
-        switch (selection[0])
-        {
-            case '1':
-                // play_hangman() returns false if there is an error, so we should quit the game if that's the case
-                quitMenu = !play_hangman(clientfileDescriptor, threadId);
-                break;
-            case '2':
-                // send_leaderboard() returns false if there is an error, so we should quit the game if that's the case
-                quitMenu = !send_leaderboard(clientfileDescriptor, threadId);
-                break;
-            case '3':
-                quitMenu = true;
-                break;
-            default:
-                printf("\nInvaild Selection");
-                return false;
-        }
+    remove_stale_unix_socket(&serveraddressInfo);
+    if (bind(listenerfileDescriptor, (struct sockaddr *)&serveraddressInfo, sizeof(serveraddressInfo)) == -1)
+    {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(listenerfileDescriptor, LISTEN_BACKLOG) == -1)
+    {
+        perror("listen");
+        exit(1);
     }
 
-    // Return true as we finished successfully
-    return true;
+    return listenerfileDescriptor;
 }
 
 //--------------------------------------------------------------------------------------------
-// Handling requests related
+// Worker processes related
 //--------------------------------------------------------------------------------------------
-void add_request(int fileDescriptor, struct sockaddr_in addressInfo, socklen_t addressSize, pthread_mutex_t *p_mutex, pthread_cond_t *p_cond_var)
+char *copy_to_shared_tables(char **cursor, char *string)
 {
-    // Create new request
-    request_t *request = (request_t *)custom_malloc(sizeof(request_t));
-
-    // Setup request
-    request->fileDescriptor = fileDescriptor;
-    request->addressInfo = addressInfo;
-    request->addressSize = addressSize;
-    request->next = NULL;
+    char *copy = *cursor;
+    strcpy(copy, string);
+    *cursor += strlen(string) + 1;
+    return copy;
+}
 
-    // Lock the mutex, to assure exclusive access to the linked list of requests
-    pthread_mutex_lock(p_mutex);
+void share_read_only_tables()
+{
+    // Copy the words and users into one mapping that every worker process shares, then make it read only so a stray
+    // write crashes the process that made it rather than quietly changing what everyone else sees
+    sharedTablesSize = numWords * sizeof(hangman_word_t) + numUsers * sizeof(user_info_t);
+    for (int i = 0; i < numWords; i++)
+        sharedTablesSize += strlen(hangmanWords[i].objectName) + strlen(hangmanWords[i].objectType) + 2;
+    for (int i = 0; i < numUsers; i++)
+        sharedTablesSize += strlen(users[i].username) + strlen(users[i].password) + 2;
+    char *tables = map_shared(sharedTablesSize);
 
-    // Add new request to the end of the list, updating list pointers as required
-    if (numRequests == 0)
+    hangman_word_t *sharedWords = (hangman_word_t *)tables;
+    user_info_t *sharedUsers = (user_info_t *)(sharedWords + numWords);
+    char *cursor = (char *)(sharedUsers + numUsers);
+    for (int i = 0; i < numWords; i++)
     {
-        // Special case - list is empty
-        requests = request;
-        lastRequest = request;
+        sharedWords[i].objectName = copy_to_shared_tables(&cursor, hangmanWords[i].objectName);
+        sharedWords[i].objectType = copy_to_shared_tables(&cursor, hangmanWords[i].objectType);
     }
-    else
+    for (int i = 0; i < numUsers; i++)
     {
-        lastRequest->next = request;
-        lastRequest = request;
+        sharedUsers[i].username = copy_to_shared_tables(&cursor, users[i].username);
+        sharedUsers[i].password = copy_to_shared_tables(&cursor, users[i].password);
+        free(users[i].username);
+        free(users[i].password);
     }
+    hangman_free_words(hangmanWords, numWords);
+    free(users);
 
-    // Increase total number of pending requests by one.
-    numRequests++;
+    if (mprotect(tables, sharedTablesSize, PROT_READ) == -1)
+        perror("mprotect");
+    sharedTables = tables;
+    hangmanWords = sharedWords;
+    users = sharedUsers;
+}
 
-    // Unlock mutex
-    pthread_mutex_unlock(p_mutex);
+void share_rate_limits()
+{
+    // So an address is limited across every worker process, rather than by each of them separately. The slots are
+    // only ever touched with atomics, which work just as well between processes.
+    if (rateLimitSlots == NULL)
+        return;
+    rate_limit_slot_t *slots = map_shared(RATE_LIMIT_SLOTS * sizeof(rate_limit_slot_t));
+    free(rateLimitSlots);
+    rateLimitSlots = slots;
+    rateLimitSlotsShared = true;
+}
 
-    // Signal the condition variable - there's a new request to handle
-    pthread_cond_signal(p_cond_var);
+void share_word_stats()
+{
+    // So every worker process's games go into the same counts, and the first one writes them all out
+    word_stats_t *sharedWordStats = map_shared((numWords + numCategories) * sizeof(word_stats_t));
+    free(wordStats);
+    free(categoryStats);
+    wordStats = sharedWordStats;
+    categoryStats = sharedWordStats + numWords;
+    wordStatsShared = true;
 }
 
-request_t *get_request(pthread_mutex_t *p_mutex)
+void share_player_words()
 {
-    // lock the mutex, to assure exclusive access to the list
-    pthread_mutex_lock(p_mutex);
+    // So a player's filter follows them whichever worker process they connect to
+    if (playerWords == NULL)
+        return;
+    player_words_t *sharedPlayerWords = map_shared(numUsers * sizeof(player_words_t));
+    free(playerWords);
+    playerWords = sharedPlayerWords;
+    playerWordsShared = true;
+}
 
-    request_t *request;
-    if (numRequests > 0)
+void serve_connections();
+
+pid_t spawn_worker_process(int processNumber)
+{
+    fflush(stdout); // Or the worker process prints whatever we had buffered all over again
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1)
     {
-        request = requests;
-        requests = request->next;
-        if (requests == NULL)
-        {
-            // This was the last request on the list
-            lastRequest = NULL;
-        }
-        // decrease the total number of pending requests
-        numRequests--;
+        perror("fork");
+        return -1;
     }
-    else
+    if (pid > 0)
     {
-        // requests list is empty
-        request = NULL;
+        workerProcessStartedAtMs[processNumber] = now_ms();
+        return pid;
     }
 
-    // Unlock mutex and return the request to the caller.
-    pthread_mutex_unlock(p_mutex);
-    return request;
+    // From here on it's a server like any other, just sharing the listening sockets and the leaderboard.
+    // Take the server down with the supervisor if it goes, rather than carry on with nobody restarting us.
+    prctl(PR_SET_PDEATHSIG, SIGINT);
+    workerProcessNumber = processNumber;
+    free(workerProcesses);
+    free(workerProcessStartedAtMs);
+    workerProcesses = NULL;
+    workerProcessStartedAtMs = NULL;
+    unixSocketPath = NULL; // The supervisor removes the socket file once everyone's finished with it
+    srand(time(NULL) ^ getpid());
+    if (statsFileName != NULL)
+    {
+        char *processStatsFileName = custom_malloc(strlen(statsFileName) + 12);
+        sprintf(processStatsFileName, "%s.%d", statsFileName, processNumber);
+        statsFileName = processStatsFileName;
+    }
+    serve_connections();
+    exit(0);
 }
 
-void handle_request(int clientfileDescriptor, int threadId)
+void stop_worker_processes()
 {
-    // Authenticate user
-    if (!is_user_valid(clientfileDescriptor, threadId))
+    printf("Stopping worker processes...\n");
+    for (int i = 0; i < numWorkerProcesses; i++)
     {
-        thread_printf_error(threadId, "User failed to validate");
-        send_client_message(clientfileDescriptor, "false", threadId);
-        return;
+        if (workerProcesses[i] > 0)
+            kill(workerProcesses[i], SIGINT);
     }
-
-    // Notify the client they've logged in successfully
-    send_client_message(clientfileDescriptor, "true", threadId);
-    thread_printf(threadId, "User '%s' successfully authenticated", loggedInUsers[threadId]);
-
-    if (!main_menu(clientfileDescriptor, threadId))
+    for (int i = 0; i < numWorkerProcesses; i++)
     {
-        thread_printf_error(threadId, "Error playing hangman");
-        return;
+        if (workerProcesses[i] > 0)
+            waitpid(workerProcesses[i], NULL, 0);
     }
 }
 
-void handle_requests_loop(void *data)
+void run_supervisor()
 {
-    int threadId = *((int *)data);
-    thread_printf(threadId, "CREATED");
-
-    // Lock the mutex, to access the requests list exclusively.
-    pthread_mutex_lock(&requestMutex);
-
-    // Infinite loop where we continuously check to see if a request is pending, and handle it if so
-    while (1)
+    // Start the worker processes and restart any that die, until we're asked to close. The leaderboard lives in
+    // shared memory that belongs to us, so a restarted worker process just catches up with it.
+    workerProcesses = custom_calloc(numWorkerProcesses, sizeof(pid_t));
+    workerProcessStartedAtMs = custom_calloc(numWorkerProcesses, sizeof(long long));
+    for (int i = 0; i < numWorkerProcesses; i++)
+        workerProcesses[i] = spawn_worker_process(i);
+    printf("Supervising %d worker processes\n", numWorkerProcesses);
+
+    while (!serverClosing)
     {
-        // Check if a request is pending
-        if (numRequests > 0)
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1)
         {
-            // If we get a request - handle it and free it
-            request_t *request = get_request(&requestMutex);
-            if (request)
+            // Pass a stats request on to the worker processes, as they're the ones with the stats
+            if (statsRequested)
             {
-                // Unlock mutex so other threads would be able to handle other requests waiting in the queue paralelly.
-                pthread_mutex_unlock(&requestMutex);
-
-                // The only thing we really need is the file descriptor, so get that and free the memory allocated for the request
-                int clientfileDescriptor = request->fileDescriptor;
-                clientConnections[threadId] = clientfileDescriptor;
-                free(request);
-
-                // Deal with the client
-                thread_printf(threadId, "STARTED handling request for %s", inet_ntoa(request->addressInfo.sin_addr));
-                handle_request(clientfileDescriptor, threadId);
-                
-                thread_printf(threadId, "Finished handling request for %s", inet_ntoa(request->addressInfo.sin_addr));
-                close(clientfileDescriptor);
-                clientConnections[threadId] = NO_CONNECTION;                
-                loggedInUsers[threadId] = NULL;
-
-                // Lock the mutex again, we want to check the numRequests variable to see if there are any requests
-                pthread_mutex_lock(&requestMutex);
+                statsRequested = 0;
+                for (int i = 0; i < numWorkerProcesses; i++)
+                {
+                    if (workerProcesses[i] > 0)
+                        kill(workerProcesses[i], SIGUSR1);
+                }
             }
+            if (errno == ECHILD)
+                sleep(1); // None running, e.g. fork() keeps failing
+            continue;
         }
-        else
+
+        for (int i = 0; i < numWorkerProcesses; i++)
         {
-            // Wait for a request to arrive. Note the mutex will be unlocked here, thus allowing other threads access
-            // to the requests list.
-            // Passing requestMutex to this function means that after we return from pthread_cond_wait, the mutex
-            // is locked again, so we don't need to lock it ourselves
-            pthread_cond_wait(&gotRequestThreadCond, &requestMutex);
+            if (workerProcesses[i] != pid)
+                continue;
+            workerProcesses[i] = 0;
+            if (serverClosing)
+                break;
+
+            if (WIFSIGNALED(status))
+                fprintf(stderr, "Worker process %d (pid %d) was killed by signal %d, restarting it\n", i, pid, WTERMSIG(status));
+            else
+                fprintf(stderr, "Worker process %d (pid %d) exited with status %d, restarting it\n", i, pid, WEXITSTATUS(status));
+            if (now_ms() - workerProcessStartedAtMs[i] < MIN_PROCESS_LIFETIME_MS)
+                sleep(1); // Don't spin if it dies as soon as it starts
+            workerProcessRestarts++;
+            workerProcesses[i] = spawn_worker_process(i);
+            break;
         }
     }
+
+    printf("\n\nClosing Program...\n");
+    stop_worker_processes();
+    close_sockets();
+    printf("prefork.processes %d\n", numWorkerProcesses);
+    printf("prefork.restarts %lu\n", workerProcessRestarts);
+    printf("leaderboard.shared_version %lu\n", atomic_load(&sharedLeaderboard->version));
+    printf("leaderboard.shared_recoveries %lu\n", atomic_load(&sharedLeaderboard->recoveries));
+    if (boardExport != NULL)
+        close_board_export();
+    free_memory();
+    free(workerProcesses);
+    free(workerProcessStartedAtMs);
+    exit(0);
 }
 
 //--------------------------------------------------------------------------------------------
 // main
 //--------------------------------------------------------------------------------------------
+void print_usage()
+{
+    fprintf(stderr, "usage: Server [options] [port]\n");
+    fprintf(stderr, "  -w <num>   minimum number of worker threads (default %d)\n", DEFAULT_MIN_WORKERS);
+    fprintf(stderr, "  -W <num>   maximum number of worker threads (default %d)\n", DEFAULT_MAX_WORKERS);
+    fprintf(stderr, "  -i <ms>    how long a surplus worker can be idle before it retires (default %d)\n", DEFAULT_IDLE_TIMEOUT_MS);
+    fprintf(stderr, "  -g <ms>    how long a request can be queued before the pool grows (default %d)\n", DEFAULT_GROW_WAIT_MS);
+    fprintf(stderr, "  -a <ms>    how long a queued connection waits to be treated as one class more urgent (default %d)\n", DEFAULT_PRIORITY_AGING_MS);
+    fprintf(stderr, "  -s <file>  periodically write stats to this file\n");
+    fprintf(stderr, "  -S <ms>    how often to write the stats file (default %d)\n", DEFAULT_STATS_INTERVAL_MS);
+    fprintf(stderr, "  -o <file>  periodically write how each word and category has played to this file, as CSV\n");
+    fprintf(stderr, "  -F         pick words purely at random, rather than avoiding the ones each player's seen lately\n");
+    fprintf(stderr, "  -d         pick words about as hard as each player needs, going by how often they and the word win\n");
+    fprintf(stderr, "  -R <ms>    how long a dropped compact client can resume its session (default %d)\n", DEFAULT_SESSION_LIFETIME_MS);
+    fprintf(stderr, "  -t <num>   rows in the top of the leaderboard sent for BOARD TOP (default %d)\n", DEFAULT_TOP_LEADERBOARD_SIZE);
+    fprintf(stderr, "  -c <file>  capture everything clients send to this file, for replay\n");
+    fprintf(stderr, "  -r <seed>  pick words from this seed so replays of a capture are repeatable\n");
+    fprintf(stderr, "  -T <file>  write a Chrome trace of where the time goes to this file\n");
+    fprintf(stderr, "  -u <path>  also listen on a UNIX domain socket at this path\n");
+    fprintf(stderr, "  -P <num>   run this many worker processes sharing the leaderboard, restarting any that crash\n");
+    fprintf(stderr, "  -x <file>  keep the leaderboard in this file for local readers like boardview, e.g. /dev/shm/hangman.board\n");
+    fprintf(stderr, "  -H <path>  take over from the server handing off at this UNIX socket path if there is one, then hand off there in turn\n");
+    fprintf(stderr, "  -D <ms>    how long to wait for clients to finish their games after handing off (default %d)\n", DEFAULT_DRAIN_TIMEOUT_MS);
+    fprintf(stderr, "  -L <rate>[/<burst>]  most new connections a second from one address, with bursts of up to burst (default rate)\n");
+    fprintf(stderr, "  -M <rate>[/<burst>]  most messages a second from one address, a client that sends more is disconnected\n");
+    fprintf(stderr, "  -l <num>   most connections one address can have open at once\n");
+    fprintf(stderr, "  -b <name>  socket I/O backend: blocking or uring (default blocking)\n");
+    fprintf(stderr, "  -q         quiet, don't log every message\n");
+}
+
+int parse_positive_option(char *value)
+{
+    int result = atoi(value);
+    if (result <= 0)
+    {
+        print_usage();
+        exit(1);
+    }
+    return result;
+}
+
+void parse_rate_limit_option(char *value, rate_limit_t *limit)
+{
+    // <rate>[/<burst>], where the burst defaults to a second's worth
+    char *burst = strchr(value, '/');
+    limit->perSecond = parse_positive_option(value);
+    limit->burst = burst != NULL ? parse_positive_option(burst + 1) : limit->perSecond;
+    if (limit->burst > UINT32_MAX / RATE_LIMIT_MILLI)
+    {
+        print_usage();
+        exit(1);
+    }
+}
+
 int main(int argc, char **argv)
 {
+    // Read in any options
+    int option;
+    while ((option = getopt(argc, argv, "w:W:i:g:a:s:S:R:t:c:r:T:b:qu:P:x:H:D:L:M:l:o:Fd")) != -1)
+    {
+        switch (option)
+        {
+            case 'w': pool.minWorkers = parse_positive_option(optarg); break;
+            case 'W': pool.maxWorkers = parse_positive_option(optarg); break;
+            case 'i': pool.idleTimeoutMs = parse_positive_option(optarg); break;
+            case 'g': pool.growWaitMs = parse_positive_option(optarg); break;
+            case 'a': priorityAgingMs = parse_positive_option(optarg); break;
+            case 's': statsFileName = optarg; break;
+            case 'S': statsIntervalMs = parse_positive_option(optarg); break;
+            case 'o': wordStatsFileName = optarg; break;
+            case 'F': freshWords = false; break;
+            case 'd': matchDifficulty = true; break;
+            case 'R': sessionLifetimeMs = parse_positive_option(optarg); break;
+            case 't': topLeaderboardSize = parse_positive_option(optarg); break;
+            case 'c': open_capture_file(optarg); break;
+            case 'r':
+                seededWords = true;
+                wordSeed = strtoull(optarg, NULL, 0);
+                break;
+            case 'T': open_span_trace(optarg); break;
+            case 'q': quietMode = true; break;
+            case 'u': unixSocketPath = optarg; break;
+            case 'P': numWorkerProcesses = parse_positive_option(optarg); break;
+            case 'x': boardExportPath = optarg; break;
+            case 'H': handoffPath = optarg; break;
+            case 'D': drainTimeoutMs = parse_positive_option(optarg); break;
+            case 'L': parse_rate_limit_option(optarg, &connectionRateLimit); break;
+            case 'M': parse_rate_limit_option(optarg, &messageRateLimit); break;
+            case 'l': maxConnectionsPerSource = parse_positive_option(optarg); break;
+            case 'b':
+                if (strcmp(optarg, "blocking") == 0) ioBackend = IO_BACKEND_BLOCKING;
+                else if (strcmp(optarg, "uring") == 0) ioBackend = IO_BACKEND_URING;
+                else
+                {
+                    print_usage();
+                    exit(1);
+                }
+                break;
+            default:
+                print_usage();
+                exit(1);
+        }
+    }
+
     // Check they're running the program correctly
-    if (argc > 2)
+    if (argc - optind > 1 || pool.minWorkers > pool.maxWorkers)
+    {
+        print_usage();
+        exit(1);
+    }
+    if (numWorkerProcesses > 0 && (captureFile != NULL || tracingSpans))
+    {
+        fprintf(stderr, "Capturing and tracing need everything in the one process, so can't be used with -P\n");
+        exit(1);
+    }
+    if (seededWords)
     {
-        fprintf(stderr, "usage: Server port\n");
+        // Which word a player gets would depend on everything else that's been played, which a replay can't repeat
+        freshWords = false;
+        matchDifficulty = false;
+    }
+    if (numWorkerProcesses > 0 && handoffPath != NULL)
+    {
+        fprintf(stderr, "Handing off between servers can't be used with -P, restart the worker processes one at a time instead\n");
         exit(1);
     }
 
     int port = DEFAULT_PORT;
-    if (argc == 2)
+    if (argc - optind == 1)
     {
         // Get port number from command line arguments
-        port = atoi(argv[1]);
+        port = atoi(argv[optind]);
         if (port <= 0)
         {
             fprintf(stderr, "Please specify a valid port number\n");
@@ -1027,74 +6684,89 @@ int main(int argc, char **argv)
         }
     }
 
+    // Fall back to the blocking path if this build or this kernel can't do io_uring
+    if (ioBackend == IO_BACKEND_URING)
+    {
+#ifdef HANGMAN_IO_URING
+        if (!io_uring_available())
+        {
+            fprintf(stderr, "io_uring isn't available on this system, falling back to blocking sockets\n");
+            ioBackend = IO_BACKEND_BLOCKING;
+        }
+#else
+        fprintf(stderr, "Server was built without io_uring support, falling back to blocking sockets\n");
+        ioBackend = IO_BACKEND_BLOCKING;
+#endif
+    }
+
     // Seed the random number generator
     srand(time(NULL));
 
-    // Set exit_handler() to trigger when a SIGINT signal is received (i.e. when Ctrl+C is pressed)
-    if (signal(SIGINT, exit_handler) == SIG_ERR)
+    // Set exit_handler() to trigger when a SIGINT signal is received (i.e. when Ctrl+C is pressed), SIGUSR1 for stats,
+    // or SIGUSR2 to interrupt a thread while handing off.
+    // We deliberately don't ask for SA_RESTART so that accept() gets interrupted and we can shut down from main().
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = exit_handler;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGINT, &action, NULL) == -1 || sigaction(SIGUSR1, &action, NULL) == -1 || sigaction(SIGUSR2, &action, NULL) == -1)
         printf("\nCan't catch SIGINT\n");
 
     // Read and store the words we'll be using for Hangman, as well as the info of the Users that are allowed to connect
     read_hangman_words();
+    init_word_stats();
     read_users();
-
-    // Generate a socket for the server
-    serverfileDescriptor = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverfileDescriptor == -1)
-    {
-        perror("socket");
-        exit(1);
-    }
-
-    // Generate the end point (my address info)
-    struct sockaddr_in serveraddressInfo;
-    serveraddressInfo.sin_family = AF_INET;         // host byte order
-    serveraddressInfo.sin_port = htons(port);       // short, network byte order
-    serveraddressInfo.sin_addr.s_addr = INADDR_ANY; // auto-fill with my IP
-
-    // Bind the socket to the end point
-    int bindResult = bind(serverfileDescriptor, (struct sockaddr *)&serveraddressInfo, sizeof(struct sockaddr));
-    if (bindResult == -1)
-    {
-        perror("bind");
-        exit(1);
-    }
-
-    // Start listening on the created socket
-    int listenResult = listen(serverfileDescriptor, MAX_USERS);
-    if (listenResult == -1)
+    init_player_words();
+    init_leaderboard_windows();
+    rebuild_top_leaderboard();
+    init_rate_limits();
+    if (boardExportPath != NULL)
+        create_board_export();
+
+    // Set up the sockets we'll be listening on, unless there's a server to take them over from
+    if (handoffPath == NULL || !take_over_from_older_server())
     {
-        perror("listen");
-        exit(1);
+        serverfileDescriptor = create_tcp_listener(port);
+        listenerfileDescriptors[numListeners++] = serverfileDescriptor;
+        if (unixSocketPath != NULL)
+            listenerfileDescriptors[numListeners++] = create_unix_listener(unixSocketPath);
     }
 
-    // Create threads to handle incoming client requests
-    int threadIds[MAX_USERS];
-    for (int i = 0; i < MAX_USERS; i++)
+    if (numWorkerProcesses > 0)
     {
-        threadIds[i] = i;
-        clientConnections[i] = NO_CONNECTION;
-        pthread_create(&threads[i], NULL, (void *(*)(void *))handle_requests_loop, (void *)&threadIds[i]);
+        share_read_only_tables();
+        share_rate_limits();
+        share_word_stats();
+        share_player_words();
+        create_shared_leaderboard();
+        run_supervisor();
     }
+    serve_connections();
+    return 0;
+}
 
-    // Infinite loop to handle client connections
-    while (1)
-    {
-        struct sockaddr_in clientaddressInfo;                     // Client's address info
-        socklen_t clientaddressSize = sizeof(struct sockaddr_in); // Need to initialise this to be the size of the struct for clientaddressInfo
-
-        // Accept any incoming connection
-        int clientfileDescriptor = accept(serverfileDescriptor, (struct sockaddr *)&clientaddressInfo, &clientaddressSize);
-        if (clientfileDescriptor == -1)
-        {
-            perror("accept");
-            continue;
-        }
-
-        // Do whatever with the connection
-        printf("server: got connection from %s\n", inet_ntoa(clientaddressInfo.sin_addr));
-        add_request(clientfileDescriptor, clientaddressInfo, clientaddressSize, &requestMutex, &gotRequestThreadCond);
-    }
+void serve_connections()
+{
+    // Create the pool of threads to handle incoming client requests.
+    // Block our signals while doing so, as the pool's threads inherit the mask and we want them delivered to main()
+    sigset_t signalsToBlock, previousSignals;
+    sigemptyset(&signalsToBlock);
+    sigaddset(&signalsToBlock, SIGINT);
+    sigaddset(&signalsToBlock, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signalsToBlock, &previousSignals);
+    start_spectator_fan_out();
+    start_worker_pool();
+    mainThread = pthread_self();
+    atomic_store(&acceptingConnections, true);
+    sigaddset(&signalsToBlock, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signalsToBlock, NULL);
+    start_handoff_thread();
+    pthread_sigmask(SIG_SETMASK, &previousSignals, NULL);
+
+    // Handle client connections until we're asked to close, or a newer server takes over.
+    // perform_clean_exit() waits for our clients to finish first if it has.
+    accept_connections();
+    atomic_store(&acceptingConnections, false);
 
-    return 0;
+    perform_clean_exit(0);
 }
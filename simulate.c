@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "solver.h"
+
+//--------------------------------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------------------------------
+#define DEFAULT_GAMES 1000000
+#define DEFAULT_WORDS_FILE "hangman_text.txt"
+#define FREQUENCY_ORDER "etaoinshrdlucmfwypvbgkjqxz" // Rough English letter frequency
+
+//--------------------------------------------------------------------------------------------
+// Global variables
+//--------------------------------------------------------------------------------------------
+long long numGames = DEFAULT_GAMES;
+int numThreads = 0;                       // Defaults to one per core
+unsigned long long seed = 0;
+char *wordsFileName = DEFAULT_WORDS_FILE;
+hangman_word_t *words;
+int numWords;
+hangman_solver_t *solver;                 // Only built if the strategy needs it
+int numHardestWords = 0;
+
+// Define a struct to hold what a strategy can keep between guesses, one per thread
+typedef struct PlayerStruct
+{
+    unsigned long long randomState;
+    solver_scratch_t *scratch;
+} player_t;
+
+// Define a struct to describe a way of playing. Strategies only get to see what a player would, i.e. the
+// guessed letters and the client word, and return the next letter to guess.
+typedef struct StrategyStruct
+{
+    const char *name;
+    const char *description;
+    bool usesSolver;
+    char (*next_guess)(hangman_game_t *game, player_t *player);
+} strategy_t;
+
+// Define a struct to hold what each thread measured
+typedef struct SimulationResultStruct
+{
+    pthread_t thread;
+    int threadNumber;
+    long long numGames;
+    long long gamesWon;
+    long long guessesMade;
+    long long *gamesPerWord; // Indexed like words
+    long long *winsPerWord;
+} simulation_result_t;
+
+//--------------------------------------------------------------------------------------------
+// Time related
+//--------------------------------------------------------------------------------------------
+long long now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+//--------------------------------------------------------------------------------------------
+// Custom calloc function to ensure we handle errors properly
+//--------------------------------------------------------------------------------------------
+void *custom_calloc(size_t numItems, size_t size)
+{
+    void *allocatedPointer = calloc(numItems, size);
+    if (allocatedPointer == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory\n");
+        exit(1);
+    }
+    return allocatedPointer;
+}
+
+//--------------------------------------------------------------------------------------------
+// Strategies related
+//--------------------------------------------------------------------------------------------
+unsigned long long next_random(unsigned long long *randomState)
+{
+    // splitmix64, the same as the server uses for seeded words
+    unsigned long long value = (*randomState += 0x9E3779B97F4A7C15ULL);
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+unsigned int guessed_letter_mask(hangman_game_t *game)
+{
+    // Bit n is set if the nth letter of the alphabet has been guessed
+    unsigned int mask = 0;
+    for (int i = 0; i < game->numGuessesMade; i++)
+    {
+        char letter = game->guessedLetters[i];
+        if (letter >= 'a' && letter <= 'z')
+            mask |= 1u << (letter - 'a');
+    }
+    return mask;
+}
+
+char next_in_order(hangman_game_t *game, const char *order)
+{
+    unsigned int guessed = guessed_letter_mask(game);
+    for (const char *letter = order; *letter != '\0'; letter++)
+    {
+        if (!(guessed & (1u << (*letter - 'a'))))
+            return *letter;
+    }
+    return 'a';
+}
+
+char guess_by_frequency(hangman_game_t *game, player_t *player)
+{
+    (void)player;
+    return next_in_order(game, FREQUENCY_ORDER);
+}
+
+char guess_alphabetically(hangman_game_t *game, player_t *player)
+{
+    (void)player;
+    return next_in_order(game, "abcdefghijklmnopqrstuvwxyz");
+}
+
+char guess_randomly(hangman_game_t *game, player_t *player)
+{
+    // Any letter that hasn't been guessed yet, each as likely as the next
+    unsigned int guessed = guessed_letter_mask(game);
+    int numLeft = 26 - __builtin_popcount(guessed);
+    if (numLeft == 0)
+        return 'a';
+    int pick = next_random(&player->randomState) % numLeft;
+    for (int i = 0; i < 26; i++)
+    {
+        if (!(guessed & (1u << i)) && pick-- == 0)
+            return 'a' + i;
+    }
+    return 'a';
+}
+
+char guess_most_common_candidate_letter(hangman_game_t *game, player_t *player)
+{
+    // Knows the dictionary, so only considers the words that could still be the answer
+    hangman_solver_filter(solver, player->scratch, game->clientWord, game->guessedLetters);
+    return hangman_solver_next_guess(player->scratch, SOLVER_FREQUENCY);
+}
+
+char guess_most_informative_letter(hangman_game_t *game, player_t *player)
+{
+    hangman_solver_filter(solver, player->scratch, game->clientWord, game->guessedLetters);
+    return hangman_solver_next_guess(player->scratch, SOLVER_ENTROPY);
+}
+
+strategy_t strategies[] = {
+    {"frequency", "letters in order of how common they are in English", false, guess_by_frequency},
+    {"alphabet", "a to z", false, guess_alphabetically},
+    {"random", "any letter not guessed yet", false, guess_randomly},
+    {"solver", "the letter in the most words that still fit", true, guess_most_common_candidate_letter},
+    {"entropy", "the letter that best splits up the words that still fit", true, guess_most_informative_letter},
+};
+#define NUM_STRATEGIES (int)(sizeof(strategies) / sizeof(strategies[0]))
+strategy_t *strategy = &strategies[0];
+
+//--------------------------------------------------------------------------------------------
+// Simulating related
+//--------------------------------------------------------------------------------------------
+void *run_simulation(void *data)
+{
+    // Each thread plays its share of the games with its own random sequence and counters, so nothing is shared
+    simulation_result_t *result = (simulation_result_t *)data;
+    player_t player = {0};
+    player.randomState = seed ^ ((unsigned long long)(result->threadNumber + 1) * 0xD1B54A32D192ED03ULL);
+    if (strategy->usesSolver)
+    {
+        player.scratch = hangman_solver_scratch_create(solver);
+        if (player.scratch == NULL)
+        {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(1);
+        }
+    }
+
+    hangman_game_t game;
+    for (long long i = 0; i < result->numGames; i++)
+    {
+        int wordIndex = hangman_pick_word(next_random(&player.randomState), numWords);
+        hangman_start_game(&game, &words[wordIndex]);
+        while (hangman_game_status(&game) == 'O')
+            hangman_guess_letter(&game, strategy->next_guess(&game, &player));
+
+        result->gamesPerWord[wordIndex]++;
+        result->guessesMade += game.numGuessesMade;
+        if (game.won)
+        {
+            result->winsPerWord[wordIndex]++;
+            result->gamesWon++;
+        }
+    }
+
+    hangman_solver_scratch_free(player.scratch);
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------------
+// Reporting related
+//--------------------------------------------------------------------------------------------
+void report_results(simulation_result_t *results, double elapsedSeconds)
+{
+    long long totalWon = 0;
+    long long totalGuesses = 0;
+    long long *gamesPerWord = custom_calloc(numWords, sizeof(long long));
+    long long *winsPerWord = custom_calloc(numWords, sizeof(long long));
+    for (int i = 0; i < numThreads; i++)
+    {
+        totalWon += results[i].gamesWon;
+        totalGuesses += results[i].guessesMade;
+        for (int j = 0; j < numWords; j++)
+        {
+            gamesPerWord[j] += results[i].gamesPerWord[j];
+            winsPerWord[j] += results[i].winsPerWord[j];
+        }
+    }
+
+    printf("strategy %s\n", strategy->name);
+    printf("threads %d\n", numThreads);
+    printf("words %d\n", numWords);
+    printf("games %lld\n", numGames);
+    printf("seconds %.3f\n", elapsedSeconds);
+    printf("games_per_second %.0f\n", elapsedSeconds > 0 ? numGames / elapsedSeconds : 0.0);
+    printf("games_won %lld\n", totalWon);
+    printf("win_rate %.4f\n", (double)totalWon / numGames);
+    printf("guesses_per_game %.2f\n", (double)totalGuesses / numGames);
+    printf("us_per_guess %.3f\n", totalGuesses > 0 ? elapsedSeconds * 1000000 * numThreads / totalGuesses : 0.0);
+
+    // Win rates by category, in the order each category first appears in the dictionary
+    bool *reported = custom_calloc(numWords, sizeof(bool));
+    for (int i = 0; i < numWords; i++)
+    {
+        if (reported[i])
+            continue;
+        long long categoryGames = 0;
+        long long categoryWins = 0;
+        for (int j = i; j < numWords; j++)
+        {
+            if (strcmp(words[j].objectType, words[i].objectType) == 0)
+            {
+                categoryGames += gamesPerWord[j];
+                categoryWins += winsPerWord[j];
+                reported[j] = true;
+            }
+        }
+        printf("category.%s.games %lld\n", words[i].objectType, categoryGames);
+        printf("category.%s.win_rate %.4f\n", words[i].objectType, categoryGames > 0 ? (double)categoryWins / categoryGames : 0.0);
+    }
+
+    // The words this strategy does worst on, for ranking words by difficulty
+    int *order = custom_calloc(numWords, sizeof(int));
+    for (int i = 0; i < numWords; i++)
+        order[i] = i;
+    for (int i = 0; i < numHardestWords && i < numWords; i++)
+    {
+        // Only a handful are ever asked for, so a partial selection sort will do
+        int hardest = i;
+        for (int j = i + 1; j < numWords; j++)
+        {
+            double hardestRate = gamesPerWord[order[hardest]] > 0 ? (double)winsPerWord[order[hardest]] / gamesPerWord[order[hardest]] : 2;
+            double rate = gamesPerWord[order[j]] > 0 ? (double)winsPerWord[order[j]] / gamesPerWord[order[j]] : 2;
+            if (rate < hardestRate)
+                hardest = j;
+        }
+        int swap = order[i];
+        order[i] = order[hardest];
+        order[hardest] = swap;
+        int word = order[i];
+        printf("hardest.%s,%s.win_rate %.4f\n", words[word].objectName, words[word].objectType,
+               gamesPerWord[word] > 0 ? (double)winsPerWord[word] / gamesPerWord[word] : 0.0);
+    }
+
+    free(order);
+    free(reported);
+    free(gamesPerWord);
+    free(winsPerWord);
+}
+
+//--------------------------------------------------------------------------------------------
+// main
+//--------------------------------------------------------------------------------------------
+void print_usage()
+{
+    fprintf(stderr, "usage: simulate [options]\n");
+    fprintf(stderr, "  -n <num>   games to play (default %d)\n", DEFAULT_GAMES);
+    fprintf(stderr, "  -j <num>   threads to play them on (default one per core)\n");
+    fprintf(stderr, "  -r <seed>  seed for picking words, so runs can be repeated (default the time)\n");
+    fprintf(stderr, "  -f <file>  dictionary to play with (default %s)\n", DEFAULT_WORDS_FILE);
+    fprintf(stderr, "  -H <num>   also list the words with the lowest win rates\n");
+    fprintf(stderr, "  -s <name>  how to guess (default %s):\n", strategies[0].name);
+    for (int i = 0; i < NUM_STRATEGIES; i++)
+        fprintf(stderr, "               %-10s %s\n", strategies[i].name, strategies[i].description);
+}
+
+int main(int argc, char **argv)
+{
+    seed = (unsigned long long)time(NULL);
+    int option;
+    while ((option = getopt(argc, argv, "n:j:r:f:s:H:")) != -1)
+    {
+        switch (option)
+        {
+            case 'n': numGames = atoll(optarg); break;
+            case 'j': numThreads = atoi(optarg); break;
+            case 'r': seed = strtoull(optarg, NULL, 0); break;
+            case 'f': wordsFileName = optarg; break;
+            case 'H': numHardestWords = atoi(optarg); break;
+            case 's':
+                strategy = NULL;
+                for (int i = 0; i < NUM_STRATEGIES; i++)
+                {
+                    if (strcmp(optarg, strategies[i].name) == 0)
+                        strategy = &strategies[i];
+                }
+                break;
+            default:
+                print_usage();
+                exit(1);
+        }
+    }
+    if (numThreads == 0)
+        numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc != optind || strategy == NULL || numGames <= 0 || numThreads <= 0)
+    {
+        print_usage();
+        exit(1);
+    }
+
+    words = hangman_read_words(wordsFileName, &numWords);
+    if (words == NULL || numWords == 0)
+        exit(2);
+    if (strategy->usesSolver)
+    {
+        solver = hangman_solver_create(words, numWords);
+        if (solver == NULL)
+        {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(1);
+        }
+    }
+
+    // Share the games out as evenly as we can
+    simulation_result_t *results = custom_calloc(numThreads, sizeof(simulation_result_t));
+    for (int i = 0; i < numThreads; i++)
+    {
+        results[i].threadNumber = i;
+        results[i].numGames = numGames / numThreads + (i < numGames % numThreads ? 1 : 0);
+        results[i].gamesPerWord = custom_calloc(numWords, sizeof(long long));
+        results[i].winsPerWord = custom_calloc(numWords, sizeof(long long));
+    }
+
+    long long startUs = now_us();
+    for (int i = 0; i < numThreads; i++)
+    {
+        if (pthread_create(&results[i].thread, NULL, run_simulation, &results[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < numThreads; i++)
+        pthread_join(results[i].thread, NULL);
+    double elapsedSeconds = (now_us() - startUs) / 1000000.0;
+
+    report_results(results, elapsedSeconds);
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        free(results[i].gamesPerWord);
+        free(results[i].winsPerWord);
+    }
+    free(results);
+    hangman_solver_free(solver);
+    hangman_free_words(words, numWords);
+    return 0;
+}
@@ -0,0 +1,464 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "solver.h"
+
+#define FREQUENCY_ORDER "etaoinshrdlucmfwypvbgkjqxz" // Rough English letter frequency, for breaking ties
+
+//--------------------------------------------------------------------------------------------
+// Building the solver related
+//--------------------------------------------------------------------------------------------
+typedef struct SolverEntryStruct
+{
+    hangman_word_t *word;
+    int wordLength;
+    int spacePosition;
+} solver_entry_t;
+
+int letter_index(char letter)
+{
+    // 0 to 25 for lowercase letters, -1 for anything else
+    return letter >= 'a' && letter <= 'z' ? letter - 'a' : -1;
+}
+
+int compare_solver_entries(const void *first, const void *second)
+{
+    const solver_entry_t *a = first;
+    const solver_entry_t *b = second;
+    if (a->wordLength != b->wordLength)
+        return a->wordLength - b->wordLength;
+    if (a->spacePosition != b->spacePosition)
+        return a->spacePosition - b->spacePosition;
+    int categoryOrder = strcmp(a->word->objectType, b->word->objectType);
+    if (categoryOrder != 0)
+        return categoryOrder;
+    return a->word < b->word ? -1 : a->word > b->word; // Keep dictionary order so the layout doesn't depend on qsort
+}
+
+uint64_t *position_bits(solver_partition_t *partition, int position, int letter)
+{
+    return partition->positionBits + ((size_t)position * SOLVER_LETTERS + letter) * partition->numBlocks;
+}
+
+uint64_t *contains_bits(solver_partition_t *partition, int letter)
+{
+    return partition->containsBits + (size_t)letter * partition->numBlocks;
+}
+
+bool build_partition(solver_partition_t *partition, solver_entry_t *entries, int numEntries)
+{
+    partition->wordLength = entries[0].wordLength;
+    partition->spacePosition = entries[0].spacePosition;
+    partition->numWords = numEntries;
+    partition->numBlocks = (numEntries + 64 * SOLVER_CHUNK_BLOCKS - 1) / (64 * SOLVER_CHUNK_BLOCKS) * SOLVER_CHUNK_BLOCKS;
+    partition->text = malloc((size_t)numEntries * partition->wordLength);
+    partition->categories = malloc(numEntries * sizeof(char *));
+    partition->containsBits = calloc((size_t)SOLVER_LETTERS * partition->numBlocks, sizeof(uint64_t));
+    partition->positionBits = calloc((size_t)partition->wordLength * SOLVER_LETTERS * partition->numBlocks, sizeof(uint64_t));
+    if (partition->text == NULL || partition->categories == NULL || partition->containsBits == NULL || partition->positionBits == NULL)
+        return false;
+
+    for (int i = 0; i < numEntries; i++)
+    {
+        // Laid out the same way the engine plays it, objectType then a space then objectName
+        char *text = partition->text + (size_t)i * partition->wordLength;
+        hangman_word_t *word = entries[i].word;
+        memcpy(text, word->objectType, entries[i].spacePosition);
+        text[entries[i].spacePosition] = ' ';
+        memcpy(text + entries[i].spacePosition + 1, word->objectName, partition->wordLength - entries[i].spacePosition - 1);
+        partition->categories[i] = word->objectType;
+
+        uint64_t bit = 1ULL << (i % 64);
+        for (int position = 0; position < partition->wordLength; position++)
+        {
+            int letter = letter_index(text[position]);
+            if (letter < 0)
+                continue;
+            position_bits(partition, position, letter)[i / 64] |= bit;
+            contains_bits(partition, letter)[i / 64] |= bit;
+        }
+    }
+    for (int letter = 0; letter < SOLVER_LETTERS; letter++)
+    {
+        for (int block = 0; block < partition->numBlocks; block++)
+            partition->letterTotals[letter] += __builtin_popcountll(contains_bits(partition, letter)[block]);
+    }
+    return true;
+}
+
+void hangman_solver_free(hangman_solver_t *solver)
+{
+    if (solver == NULL)
+        return;
+    for (int i = 0; i < solver->numPartitions; i++)
+    {
+        free(solver->partitions[i].text);
+        free(solver->partitions[i].categories);
+        free(solver->partitions[i].containsBits);
+        free(solver->partitions[i].positionBits);
+    }
+    free(solver->partitions);
+    free(solver);
+}
+
+hangman_solver_t *hangman_solver_create(hangman_word_t *words, int numWords)
+{
+    hangman_solver_t *solver = calloc(1, sizeof(hangman_solver_t));
+    solver_entry_t *entries = malloc((numWords > 0 ? numWords : 1) * sizeof(solver_entry_t));
+    if (solver == NULL || entries == NULL)
+    {
+        free(solver);
+        free(entries);
+        return NULL;
+    }
+    solver->numWords = numWords;
+
+    for (int i = 0; i < numWords; i++)
+    {
+        entries[i].word = &words[i];
+        entries[i].spacePosition = strlen(words[i].objectType);
+        entries[i].wordLength = entries[i].spacePosition + 1 + strlen(words[i].objectName);
+    }
+    qsort(entries, numWords, sizeof(solver_entry_t), compare_solver_entries);
+
+    for (int i = 0; i < numWords; i++)
+    {
+        if (i == 0 || entries[i].wordLength != entries[i - 1].wordLength || entries[i].spacePosition != entries[i - 1].spacePosition)
+            solver->numPartitions++;
+    }
+    solver->partitions = calloc(solver->numPartitions > 0 ? solver->numPartitions : 1, sizeof(solver_partition_t));
+    if (solver->partitions == NULL)
+    {
+        solver->numPartitions = 0;
+        hangman_solver_free(solver);
+        free(entries);
+        return NULL;
+    }
+
+    int partitionStart = 0;
+    int partitionNumber = 0;
+    bool built = true;
+    for (int i = 1; i <= numWords && built; i++)
+    {
+        if (i < numWords && entries[i].wordLength == entries[partitionStart].wordLength && entries[i].spacePosition == entries[partitionStart].spacePosition)
+            continue;
+        solver_partition_t *partition = &solver->partitions[partitionNumber++];
+        built = build_partition(partition, entries + partitionStart, i - partitionStart);
+        if (partition->numBlocks > solver->maxBlocks)
+            solver->maxBlocks = partition->numBlocks;
+        partitionStart = i;
+    }
+
+    free(entries);
+    if (!built)
+    {
+        hangman_solver_free(solver);
+        return NULL;
+    }
+    return solver;
+}
+
+void hangman_solver_scratch_free(solver_scratch_t *scratch)
+{
+    if (scratch == NULL)
+        return;
+    free(scratch->candidates);
+    free(scratch->activeChunks);
+    free(scratch->slotStamps);
+    free(scratch->slotPatterns);
+    free(scratch->slotLetters);
+    free(scratch->slotCounts);
+    free(scratch->usedSlots);
+    free(scratch);
+}
+
+solver_scratch_t *hangman_solver_scratch_create(hangman_solver_t *solver)
+{
+    solver_scratch_t *scratch = calloc(1, sizeof(solver_scratch_t));
+    if (scratch == NULL)
+        return NULL;
+    scratch->candidates = malloc((solver->maxBlocks > 0 ? solver->maxBlocks : 1) * sizeof(uint64_t));
+    scratch->activeChunks = malloc((solver->maxBlocks / SOLVER_CHUNK_BLOCKS + 1) * sizeof(int));
+    scratch->slotStamps = calloc(SOLVER_PATTERN_SLOTS, sizeof(uint32_t));
+    scratch->slotPatterns = malloc(SOLVER_PATTERN_SLOTS * sizeof(uint64_t));
+    scratch->slotLetters = malloc(SOLVER_PATTERN_SLOTS * sizeof(uint8_t));
+    scratch->slotCounts = malloc(SOLVER_PATTERN_SLOTS * sizeof(int));
+    scratch->usedSlots = malloc(SOLVER_PATTERN_SLOTS * sizeof(int));
+    if (scratch->candidates == NULL || scratch->activeChunks == NULL || scratch->slotStamps == NULL || scratch->slotPatterns == NULL || scratch->slotLetters == NULL ||
+        scratch->slotCounts == NULL || scratch->usedSlots == NULL)
+    {
+        hangman_solver_scratch_free(scratch);
+        return NULL;
+    }
+    return scratch;
+}
+
+//--------------------------------------------------------------------------------------------
+// Filtering related
+//--------------------------------------------------------------------------------------------
+int count_bits(uint64_t bits)
+{
+    // Without -mpopcnt, __builtin_popcountll is a library call, which was half the time spent solving
+    bits = bits - ((bits >> 1) & 0x5555555555555555ULL);
+    bits = (bits & 0x3333333333333333ULL) + ((bits >> 2) & 0x3333333333333333ULL);
+    bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (bits * 0x0101010101010101ULL) >> 56;
+}
+
+solver_partition_t *find_partition(hangman_solver_t *solver, int wordLength, int spacePosition)
+{
+    int low = 0;
+    int high = solver->numPartitions - 1;
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        solver_partition_t *partition = &solver->partitions[middle];
+        int order = partition->wordLength != wordLength ? partition->wordLength - wordLength : partition->spacePosition - spacePosition;
+        if (order == 0)
+            return partition;
+        if (order < 0)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    return NULL;
+}
+
+int hangman_solver_filter(hangman_solver_t *solver, solver_scratch_t *scratch, const char *clientWord, const char *guessedLetters)
+{
+    int guessed[SOLVER_LETTERS];
+    int numGuessed = 0;
+    scratch->guessedMask = 0;
+    for (const char *letter = guessedLetters; *letter != '\0'; letter++)
+    {
+        int index = letter_index(*letter);
+        if (index >= 0 && !(scratch->guessedMask & (1u << index)))
+        {
+            scratch->guessedMask |= 1u << index;
+            guessed[numGuessed++] = index;
+        }
+    }
+    memset(scratch->letterCounts, 0, sizeof(scratch->letterCounts));
+    scratch->numCandidates = 0;
+    scratch->numActiveChunks = 0;
+
+    int wordLength = strlen(clientWord);
+    const char *space = strchr(clientWord, ' ');
+    scratch->partition = space != NULL ? find_partition(solver, wordLength, space - clientWord) : NULL;
+    solver_partition_t *partition = scratch->partition;
+    if (partition == NULL)
+        return 0;
+
+    // Revealed letters have to be where they are, and guessed letters can't be under an underscore as they'd have
+    // been revealed too. Revealed letters rule out the most words, so they go first.
+    const uint64_t *rows[MAX_WORD_LENGTH * SOLVER_LETTERS];
+    int numRevealedRows = 0;
+    int numRows = 0;
+    for (int position = 0; position < wordLength; position++)
+    {
+        int letter = letter_index(clientWord[position]);
+        if (position != partition->spacePosition && letter >= 0)
+            rows[numRows++] = position_bits(partition, position, letter);
+    }
+    numRevealedRows = numRows;
+    for (int position = 0; position < wordLength; position++)
+    {
+        if (position != partition->spacePosition && clientWord[position] == '_')
+        {
+            for (int i = 0; i < numGuessed; i++)
+                rows[numRows++] = position_bits(partition, position, guessed[i]);
+        }
+    }
+
+    // A chunk at a time, so the inner loops can be vectorised but a chunk's dropped as soon as nothing in it fits
+    uint64_t *candidates = scratch->candidates;
+    for (int chunk = 0; chunk < partition->numBlocks; chunk += SOLVER_CHUNK_BLOCKS)
+    {
+        uint64_t bits[SOLVER_CHUNK_BLOCKS];
+        uint64_t any = 0;
+        for (int i = 0; i < SOLVER_CHUNK_BLOCKS; i++)
+        {
+            int firstWord = (chunk + i) * 64;
+            bits[i] = firstWord + 64 <= partition->numWords ? ~0ULL : firstWord < partition->numWords ? (1ULL << (partition->numWords - firstWord)) - 1 : 0;
+        }
+        for (int row = 0; row < numRows; row++)
+        {
+            const uint64_t *rowBits = rows[row] + chunk;
+            any = 0;
+            if (row < numRevealedRows)
+            {
+                for (int i = 0; i < SOLVER_CHUNK_BLOCKS; i++)
+                    any |= bits[i] &= rowBits[i];
+            }
+            else
+            {
+                for (int i = 0; i < SOLVER_CHUNK_BLOCKS; i++)
+                    any |= bits[i] &= ~rowBits[i];
+            }
+            if (any == 0)
+                break;
+        }
+        if (numRows > 0 && any == 0)
+            continue;
+
+        memcpy(candidates + chunk, bits, sizeof(bits));
+        scratch->activeChunks[scratch->numActiveChunks++] = chunk;
+        for (int i = 0; i < SOLVER_CHUNK_BLOCKS; i++)
+            scratch->numCandidates += count_bits(bits[i]);
+    }
+
+    for (int letter = 0; letter < SOLVER_LETTERS; letter++)
+    {
+        if (scratch->guessedMask & (1u << letter))
+            continue;
+        if (numRows == 0)
+        {
+            // Nothing's been ruled out, which is every game's first guess
+            scratch->letterCounts[letter] = partition->letterTotals[letter];
+            continue;
+        }
+        const uint64_t *letterBits = contains_bits(partition, letter);
+        int count = 0;
+        for (int i = 0; i < scratch->numActiveChunks; i++)
+        {
+            int chunk = scratch->activeChunks[i];
+            for (int j = 0; j < SOLVER_CHUNK_BLOCKS; j++)
+                count += count_bits(candidates[chunk + j] & letterBits[chunk + j]);
+        }
+        scratch->letterCounts[letter] = count;
+    }
+    return scratch->numCandidates;
+}
+
+const char *hangman_solver_category(solver_scratch_t *scratch)
+{
+    // Words are sorted by category within a partition, so it's enough to check the first and last candidates
+    if (scratch->numCandidates == 0)
+        return NULL;
+    int first = -1;
+    int last = -1;
+    for (int i = 0; i < scratch->numActiveChunks; i++)
+    {
+        for (int block = scratch->activeChunks[i]; block < scratch->activeChunks[i] + SOLVER_CHUNK_BLOCKS; block++)
+        {
+            if (scratch->candidates[block] == 0)
+                continue;
+            if (first < 0)
+                first = block * 64 + __builtin_ctzll(scratch->candidates[block]);
+            last = block * 64 + 63 - __builtin_clzll(scratch->candidates[block]);
+        }
+    }
+    const char **categories = scratch->partition->categories;
+    return strcmp(categories[first], categories[last]) == 0 ? categories[first] : NULL;
+}
+
+//--------------------------------------------------------------------------------------------
+// Picking a letter related
+//--------------------------------------------------------------------------------------------
+double outcome_entropy(int count, int numCandidates)
+{
+    if (count == 0)
+        return 0;
+    double probability = (double)count / numCandidates;
+    return -probability * log2(probability);
+}
+
+void count_patterns(solver_scratch_t *scratch, double *entropies)
+{
+    // Adds up, for every letter, how the candidates split by the positions it shows up in. Positions past 63 share
+    // bits with earlier ones, which only matters for words far longer than anything in the dictionary.
+    solver_partition_t *partition = scratch->partition;
+    if (++scratch->stamp == 0)
+    {
+        memset(scratch->slotStamps, 0, SOLVER_PATTERN_SLOTS * sizeof(uint32_t));
+        scratch->stamp = 1;
+    }
+    int numUsed = 0;
+    for (int i = 0; i < scratch->numActiveChunks * SOLVER_CHUNK_BLOCKS; i++)
+    {
+        int block = scratch->activeChunks[i / SOLVER_CHUNK_BLOCKS] + i % SOLVER_CHUNK_BLOCKS;
+        for (uint64_t bits = scratch->candidates[block]; bits != 0; bits &= bits - 1)
+        {
+            const char *text = partition->text + (size_t)(block * 64 + __builtin_ctzll(bits)) * partition->wordLength;
+            uint64_t patterns[SOLVER_LETTERS];
+            uint32_t present = 0;
+            for (int position = 0; position < partition->wordLength; position++)
+            {
+                int letter = letter_index(text[position]);
+                if (letter < 0 || (scratch->guessedMask & (1u << letter)))
+                    continue;
+                if (!(present & (1u << letter)))
+                    patterns[letter] = 0;
+                present |= 1u << letter;
+                patterns[letter] |= 1ULL << (position % 64);
+            }
+
+            for (; present != 0; present &= present - 1)
+            {
+                int letter = __builtin_ctz(present);
+                uint64_t hash = (patterns[letter] * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)letter * 0xC2B2AE3D27D4EB4FULL);
+                int slot = (hash >> 40) & (SOLVER_PATTERN_SLOTS - 1);
+                while (scratch->slotStamps[slot] == scratch->stamp &&
+                       (scratch->slotLetters[slot] != letter || scratch->slotPatterns[slot] != patterns[letter]))
+                    slot = (slot + 1) & (SOLVER_PATTERN_SLOTS - 1);
+                if (scratch->slotStamps[slot] != scratch->stamp)
+                {
+                    scratch->slotStamps[slot] = scratch->stamp;
+                    scratch->slotLetters[slot] = letter;
+                    scratch->slotPatterns[slot] = patterns[letter];
+                    scratch->slotCounts[slot] = 0;
+                    scratch->usedSlots[numUsed++] = slot;
+                }
+                scratch->slotCounts[slot]++;
+            }
+        }
+    }
+
+    for (int letter = 0; letter < SOLVER_LETTERS; letter++)
+        entropies[letter] = outcome_entropy(scratch->numCandidates - scratch->letterCounts[letter], scratch->numCandidates);
+    for (int i = 0; i < numUsed; i++)
+    {
+        int slot = scratch->usedSlots[i];
+        entropies[scratch->slotLetters[slot]] += outcome_entropy(scratch->slotCounts[slot], scratch->numCandidates);
+    }
+}
+
+char hangman_solver_next_guess(solver_scratch_t *scratch, solver_method_t method)
+{
+    double scores[SOLVER_LETTERS];
+    if (method == SOLVER_ENTROPY && scratch->numCandidates <= SOLVER_ENTROPY_CANDIDATES && scratch->numCandidates > 0)
+    {
+        count_patterns(scratch, scores);
+    }
+    else
+    {
+        for (int letter = 0; letter < SOLVER_LETTERS; letter++)
+        {
+            if (method == SOLVER_ENTROPY)
+                scores[letter] = outcome_entropy(scratch->letterCounts[letter], scratch->numCandidates) +
+                                 outcome_entropy(scratch->numCandidates - scratch->letterCounts[letter], scratch->numCandidates);
+            else
+                scores[letter] = scratch->letterCounts[letter];
+        }
+    }
+
+    // Only letters that are in at least one candidate are worth a guess. Ties, and having no candidates at all,
+    // fall back to how common letters are in English.
+    char bestGuess = '\0';
+    double bestScore = -1;
+    for (const char *letter = FREQUENCY_ORDER; *letter != '\0'; letter++)
+    {
+        int index = *letter - 'a';
+        if (scratch->guessedMask & (1u << index))
+            continue;
+        if (bestGuess == '\0')
+            bestGuess = *letter;
+        if (scratch->letterCounts[index] > 0 && scores[index] > bestScore)
+        {
+            bestGuess = *letter;
+            bestScore = scores[index];
+        }
+    }
+    return bestGuess;
+}
@@ -0,0 +1,87 @@
+#ifndef HANGMAN_SOLVER_H
+#define HANGMAN_SOLVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "engine.h"
+
+//--------------------------------------------------------------------------------------------
+// Working out which words are still possible, and what to guess next
+//--------------------------------------------------------------------------------------------
+// Words are split into partitions of the same length with the space in the same place, i.e. words that look the
+// same before anything's been guessed, and sorted by category within each one. Each partition keeps a bitset per
+// position and letter of which of its words have that letter there, so finding the words that still match a
+// client word is a run of ANDs over 64 bit blocks, a few blocks at a time so the compiler can vectorise them.
+//
+// The solver is read only once built, so threads can share one as long as they each have their own scratch.
+#define SOLVER_LETTERS 26
+#define SOLVER_CHUNK_BLOCKS 4            // Blocks filtered together, 256 words or one AVX2 register per letter
+#define SOLVER_ENTROPY_CANDIDATES 1024   // Above this many candidates, entropy only looks at whether a letter's in a word or not
+#define SOLVER_PATTERN_SLOTS 65536       // Enough for every letter of every word at the limit above, at least twice over
+
+typedef enum
+{
+    SOLVER_FREQUENCY, // The letter in the most candidates
+    SOLVER_ENTROPY    // The letter that best splits up the candidates by where it shows up
+} solver_method_t;
+
+typedef struct SolverPartitionStruct
+{
+    int wordLength;
+    int spacePosition;
+    int numWords;
+    int numBlocks;                         // 64 words to a block, rounded up to whole chunks
+    char *text;                            // numWords * wordLength, without terminators
+    const char **categories;               // Each word's objectType
+    uint64_t *containsBits;                // [letter][block]: words with the letter anywhere
+    uint64_t *positionBits;                // [position][letter][block]: words with the letter at that position
+    int letterTotals[SOLVER_LETTERS];      // How many words have each letter, for when nothing's been guessed
+} solver_partition_t;
+
+typedef struct HangmanSolverStruct
+{
+    solver_partition_t *partitions;        // Sorted by wordLength then spacePosition
+    int numPartitions;
+    int maxBlocks;
+    int numWords;
+} hangman_solver_t;
+
+// Everything one player writes to while solving
+typedef struct SolverScratchStruct
+{
+    solver_partition_t *partition;         // Where the candidates are, NULL if nothing matched
+    uint64_t *candidates;                  // [block], only valid in the active chunks
+    int *activeChunks;                     // First block of each chunk with any candidates in it
+    int numActiveChunks;
+    int numCandidates;
+    uint32_t guessedMask;
+    int letterCounts[SOLVER_LETTERS];      // How many candidates have each letter not guessed yet
+
+    // Pattern counting for entropy
+    uint32_t stamp;
+    uint32_t *slotStamps;
+    uint64_t *slotPatterns;
+    uint8_t *slotLetters;
+    int *slotCounts;
+    int *usedSlots;
+} solver_scratch_t;
+
+// Returns NULL if out of memory. The words need to outlive the solver, as the categories aren't copied.
+hangman_solver_t *hangman_solver_create(hangman_word_t *words, int numWords);
+void hangman_solver_free(hangman_solver_t *solver);
+solver_scratch_t *hangman_solver_scratch_create(hangman_solver_t *solver);
+void hangman_solver_scratch_free(solver_scratch_t *scratch);
+
+// Finds the words that match what the player can see, i.e. the client word and the guessed letters. Anything that
+// isn't a lowercase letter in guessedLetters is skipped over. Returns the number of candidates.
+int hangman_solver_filter(hangman_solver_t *solver, solver_scratch_t *scratch, const char *clientWord, const char *guessedLetters);
+
+// Picks the next letter from the last filter's candidates, or the most common letter not guessed yet if there
+// aren't any. Returns '\0' once every letter's been guessed.
+char hangman_solver_next_guess(solver_scratch_t *scratch, solver_method_t method);
+
+// The category all the candidates are in, or NULL if there's more than one
+const char *hangman_solver_category(solver_scratch_t *scratch);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef HANGMAN_TRACE_H
+#define HANGMAN_TRACE_H
+
+#include <stdint.h>
+
+//--------------------------------------------------------------------------------------------
+// Traffic captures, written by the server (-c) and read back by replay
+//--------------------------------------------------------------------------------------------
+// A capture starts with TRACE_MAGIC, followed by one trace_record_t per event. TRACE_RECEIVED records are
+// followed by the length bytes the server received, exactly as one receive handed them over.
+// Everything is in the capturing machine's byte order, as traces are meant to be replayed on the same kind of machine.
+//
+// bytesSent is how much the server had sent that connection when the event happened. Replaying a message once
+// at least that much has come back keeps every connection's conversation in the same order it was captured in,
+// however fast the replay runs.
+#define TRACE_MAGIC "HANGTRC1"
+#define TRACE_MAGIC_LENGTH 8
+
+typedef enum
+{
+    TRACE_OPENED,   // Connection accepted
+    TRACE_RECEIVED, // Bytes received from the client
+    TRACE_CLOSED    // Server finished with the connection. Connections handed to spectator mode never get one.
+} trace_event_t;
+
+typedef struct TraceRecordStruct
+{
+    uint64_t timeUs;     // Since the capture started
+    uint64_t bytesSent;
+    uint32_t connection; // Connections are numbered in the order they were accepted
+    uint16_t event;
+    uint16_t reserved;
+    uint32_t length;     // Bytes of data following the record
+    uint32_t padding;
+} trace_record_t;
+
+#endif